@@ -14,6 +14,7 @@
 
 #include "log.h"
 #include "server.h"
+#include "shm.h"
 #include "tpaf_version.h"
 #include "util.h"
 
@@ -21,6 +22,60 @@
 #define DEFAULT_LOG_FACILITY LOG_DAEMON
 #define DEFAULT_LOG_FLAGS LOG_USE_SYSLOG
 
+#define DEFAULT_OUT_SOFT_LIMIT (4 * 1024 * 1024)
+#define DEFAULT_OUT_HARD_LIMIT (64 * 1024 * 1024)
+#define DEFAULT_DOMAIN_OUT_SOFT_LIMIT (256 * 1024 * 1024)
+#define DEFAULT_DOMAIN_OUT_HARD_LIMIT ((size_t)1024 * 1024 * 1024)
+#define DEFAULT_SLOW_POLICY proto_conn_slow_policy_disconnect
+#define DEFAULT_IO_THREADS 0
+#define MAX_IO_THREADS 256
+#define DEFAULT_SHARDS 0
+#define MAX_SHARDS 256
+#define DEFAULT_QUERY_THREADS 0
+#define MAX_QUERY_THREADS 256
+#define DEFAULT_STATE_INTERVAL 60
+#define MAX_SHM_SLOTS (16 * 1024 * 1024)
+
+static const char *slow_policy_to_str(enum proto_conn_slow_policy policy)
+{
+    switch (policy) {
+    case proto_conn_slow_policy_disconnect:
+	return "disconnect";
+    case proto_conn_slow_policy_resync:
+	return "resync";
+    default:
+	ut_assert(0);
+	return NULL;
+    }
+}
+
+static int str_to_slow_policy(const char *policy_s,
+			      enum proto_conn_slow_policy *policy)
+{
+    if (strcmp(policy_s, "disconnect") == 0)
+	*policy = proto_conn_slow_policy_disconnect;
+    else if (strcmp(policy_s, "resync") == 0)
+	*policy = proto_conn_slow_policy_resync;
+    else
+	return -1;
+
+    return 0;
+}
+
+static int str_to_journal_sync(const char *sync_s, enum journal_sync *sync)
+{
+    if (strcmp(sync_s, "none") == 0)
+	*sync = journal_sync_none;
+    else if (strcmp(sync_s, "batch") == 0)
+	*sync = journal_sync_batch;
+    else if (strcmp(sync_s, "periodic") == 0)
+	*sync = journal_sync_periodic;
+    else
+	return -1;
+
+    return 0;
+}
+
 static void usage(const char *name)
 {
     printf("%s [options] [<domain-addr> ...]\n", name);
@@ -33,6 +88,104 @@ static void usage(const char *name)
 	   "\"%s\".\n", log_level_to_str(DEFAULT_LOG_LEVEL));
     printf("  -v             Print version information.\n");
     printf("  -h             Print this text.\n");
+    printf("  --out-soft-limit <bytes>\n");
+    printf("                 Per-connection output queue size at which a "
+	   "client is\n"
+	   "                 considered a slow consumer. Default is %d.\n",
+	   DEFAULT_OUT_SOFT_LIMIT);
+    printf("  --out-hard-limit <bytes>\n");
+    printf("                 Per-connection output queue size at which the "
+	   "slow-\n"
+	   "                 consumer policy is applied. Default is %d.\n",
+	   DEFAULT_OUT_HARD_LIMIT);
+    printf("  --domain-out-soft-limit <bytes>\n");
+    printf("                 Per-domain output queue size at which a "
+	   "warning is\n"
+	   "                 logged. Default is %d.\n",
+	   DEFAULT_DOMAIN_OUT_SOFT_LIMIT);
+    printf("  --domain-out-hard-limit <bytes>\n");
+    printf("                 Per-domain output queue size at which the "
+	   "slow-consumer\n"
+	   "                 policy is applied to slow consumers. Default is "
+	   "%zd.\n", DEFAULT_DOMAIN_OUT_HARD_LIMIT);
+    printf("  --slow-policy <policy>\n");
+    printf("                 Set slow-consumer policy to \"disconnect\" or "
+	   "\"resync\".\n"
+	   "                 Default is \"%s\".\n",
+	   slow_policy_to_str(DEFAULT_SLOW_POLICY));
+    printf("  --io-threads <num>\n");
+    printf("                 Number of per-domain threads doing socket I/O "
+	   "and request\n"
+	   "                 decoding. With zero, this work is done by the "
+	   "domain thread.\n"
+	   "                 Default is %d.\n", DEFAULT_IO_THREADS);
+    printf("  --shards <num>\n");
+    printf("                 Number of per-domain threads among which the "
+	   "services are\n"
+	   "                 partitioned. With zero, the services are kept "
+	   "by the domain\n"
+	   "                 thread. Default is %d.\n", DEFAULT_SHARDS);
+    printf("  --query-threads <num>\n");
+    printf("                 Number of per-domain threads answering "
+	   "listing requests\n"
+	   "                 from snapshots of the domain's state. With "
+	   "zero, listings are\n"
+	   "                 done by the domain thread. Default is %d.\n",
+	   DEFAULT_QUERY_THREADS);
+    printf("  --state-dir <dir>\n");
+    printf("                 Directory in which the domains' services are "
+	   "saved, and from\n"
+	   "                 which they are restored, as orphans, at "
+	   "startup. Default is\n"
+	   "                 to not save any state.\n");
+    printf("  --state-interval <s>\n");
+    printf("                 Seconds between saves of the domains' "
+	   "services. Default is\n"
+	   "                 %d.\n", DEFAULT_STATE_INTERVAL);
+    printf("  --journal <sync>\n");
+    printf("                 Journal every service change in the state "
+	   "directory, with\n"
+	   "                 the \"none\", \"batch\" or \"periodic\" fsync "
+	   "policy. Default is to\n"
+	   "                 not keep a journal.\n");
+    printf("  --replicate-to [<domain-addr>=]<addr>\n");
+    printf("                 Replicate a domain's services to a standby "
+	   "tpafd at the\n"
+	   "                 XCM address.\n");
+    printf("  --standby [<domain-addr>=]<addr>\n");
+    printf("                 Accept replication of a domain's services on "
+	   "the XCM\n"
+	   "                 address, until promoted by SIGUSR2.\n");
+    printf("  --upstream [<domain-addr>=]<addr>\n");
+    printf("                 Serve a domain as a proxy of the tpafd at "
+	   "the XCM address,\n"
+	   "                 mirroring its services and forwarding "
+	   "publications to it.\n");
+    printf("  --export [<domain-addr>=]<addr>\n");
+    printf("                 Export a domain's services to federation "
+	   "peers connecting to\n"
+	   "                 the XCM address.\n");
+    printf("  --import [<domain-addr>=]<addrs>\n");
+    printf("                 Import services into a domain from the "
+	   "federation peers at\n"
+	   "                 the whitespace-separated XCM addresses.\n");
+    printf("  --import-filter [<domain-addr>=]<filter>\n");
+    printf("                 Import only services matching the filter. "
+	   "Default is to\n"
+	   "                 import all services.\n");
+    printf("  --shm [<domain-addr>=]<name>\n");
+    printf("                 Publish a read-only copy of a domain's "
+	   "services in the POSIX\n"
+	   "                 shared memory segment.\n");
+    printf("  --shm-slots <n>\n");
+    printf("                 Make room for <n> services in each shared "
+	   "memory segment.\n"
+	   "                 Default is %d.\n", SHM_DEFAULT_SLOTS);
+    printf("\nThe per-domain options may be given once per domain. When "
+	   "more than one domain\n"
+	   "is served, their values must be prefixed by the address of the "
+	   "domain they\n"
+	   "apply to.\n");
 }
 
 static void die(const char *fmt, ...)
@@ -55,6 +208,162 @@ static void signal_cb(evutil_socket_t fd, short event, void *arg)
     event_base_loopbreak(event_base);
 }
 
+struct server_set
+{
+    struct server **servers;
+    int num_servers;
+};
+
+static void stats_cb(evutil_socket_t fd, short event, void *arg)
+{
+    struct server_set *set = arg;
+
+    int i;
+    for (i = 0; i < set->num_servers; i++)
+	server_log_stats(set->servers[i]);
+}
+
+static void promote_cb(evutil_socket_t fd, short event, void *arg)
+{
+    struct server_set *set = arg;
+
+    int i;
+    for (i = 0; i < set->num_servers; i++)
+	server_promote(set->servers[i]);
+}
+
+static void add_addr(const char ***addrs, size_t *num_addrs, const char *addr)
+{
+    *addrs = ut_realloc(*addrs, sizeof(const char *) * (*num_addrs + 1));
+    (*addrs)[(*num_addrs)++] = addr;
+}
+
+/* Returns the per-domain option values, indexed as the domains, with
+   NULL for domains without a value. A value applies to the domain
+   whose address it's prefixed by, followed by '='. Unprefixed values
+   are only allowed when there is a single domain. */
+static const char **key_by_domain(const char *opt_name, const char **values,
+				  size_t num_values, char **domain_addrs,
+				  size_t num_domains)
+{
+    const char **keyed = ut_calloc(sizeof(const char *) * num_domains);
+    size_t i;
+
+    for (i = 0; i < num_values; i++) {
+	const char *value = values[i];
+	size_t domain_idx = num_domains;
+	size_t d;
+
+	for (d = 0; d < num_domains; d++) {
+	    size_t addr_len = strlen(domain_addrs[d]);
+
+	    if (strncmp(value, domain_addrs[d], addr_len) == 0 &&
+		value[addr_len] == '=') {
+		domain_idx = d;
+		value += addr_len + 1;
+		break;
+	    }
+	}
+
+	if (domain_idx == num_domains) {
+	    if (num_domains > 1) {
+		fprintf(stderr, "Value \"%s\" of option --%s is not prefixed "
+			"by the address of a domain.\n", values[i], opt_name);
+		exit(EXIT_FAILURE);
+	    }
+	    domain_idx = 0;
+	}
+
+	if (keyed[domain_idx] != NULL) {
+	    fprintf(stderr, "Option --%s given more than once for domain "
+		    "\"%s\".\n", opt_name, domain_addrs[domain_idx]);
+	    exit(EXIT_FAILURE);
+	}
+
+	keyed[domain_idx] = value;
+    }
+
+    return keyed;
+}
+
+/* Accepts a non-negative integer with an optional k, M or G suffix */
+static size_t parse_size(const char *opt_name, const char *size_s)
+{
+    char *end;
+    unsigned long long size = strtoull(size_s, &end, 10);
+
+    if (end == size_s || size_s[0] == '-')
+	goto err;
+
+    switch (*end) {
+    case 'k':
+	size *= 1024;
+	end++;
+	break;
+    case 'M':
+	size *= 1024 * 1024;
+	end++;
+	break;
+    case 'G':
+	size *= 1024 * 1024 * 1024;
+	end++;
+	break;
+    }
+
+    if (*end != '\0')
+	goto err;
+
+    return size;
+
+err:
+    fprintf(stderr, "Invalid %s size \"%s\".\n", opt_name, size_s);
+    exit(EXIT_FAILURE);
+}
+
+static size_t parse_threads(const char *threads_name, const char *num_s,
+			    unsigned long max)
+{
+    char *end;
+    unsigned long num = strtoul(num_s, &end, 10);
+
+    if (end == num_s || num_s[0] == '-' || *end != '\0' || num > max) {
+	fprintf(stderr, "Invalid number of %s \"%s\". Valid values are 0 "
+		"to %lu.\n", threads_name, num_s, max);
+	exit(EXIT_FAILURE);
+    }
+
+    return num;
+}
+
+static double parse_interval(const char *interval_name,
+			     const char *interval_s)
+{
+    char *end;
+    double interval = strtod(interval_s, &end);
+
+    if (end == interval_s || *end != '\0' || !(interval > 0)) {
+	fprintf(stderr, "Invalid %s \"%s\".\n", interval_name, interval_s);
+	exit(EXIT_FAILURE);
+    }
+
+    return interval;
+}
+
+static size_t parse_slots(const char *num_s)
+{
+    char *end;
+    unsigned long num = strtoul(num_s, &end, 10);
+
+    if (end == num_s || num_s[0] == '-' || *end != '\0' || num < 2 ||
+	num > MAX_SHM_SLOTS) {
+	fprintf(stderr, "Invalid number of shared memory slots \"%s\". "
+		"Valid values are 2 to %d.\n", num_s, MAX_SHM_SLOTS);
+	exit(EXIT_FAILURE);
+    }
+
+    return num;
+}
+
 static char *get_prg_name(const char *prg_path)
 {
     const char *prg_name = strrchr(prg_path, '/');
@@ -93,9 +402,85 @@ int main(int argc, char **argv)
     int log_facility = DEFAULT_LOG_FACILITY;
     int log_filter = DEFAULT_LOG_LEVEL;
     unsigned log_flags = DEFAULT_LOG_FLAGS;
+    struct server_conf conf = {
+	.conn_conf = {
+	    .soft_out_limit = DEFAULT_OUT_SOFT_LIMIT,
+	    .hard_out_limit = DEFAULT_OUT_HARD_LIMIT,
+	    .slow_policy = DEFAULT_SLOW_POLICY
+	},
+	.domain_soft_out_limit = DEFAULT_DOMAIN_OUT_SOFT_LIMIT,
+	.domain_hard_out_limit = DEFAULT_DOMAIN_OUT_HARD_LIMIT,
+	.num_io_threads = DEFAULT_IO_THREADS,
+	.num_shards = DEFAULT_SHARDS,
+	.num_query_threads = DEFAULT_QUERY_THREADS,
+	.state_interval = DEFAULT_STATE_INTERVAL,
+	.shm_slots = SHM_DEFAULT_SLOTS
+    };
+
+    enum {
+	opt_out_soft_limit = 256,
+	opt_out_hard_limit,
+	opt_domain_out_soft_limit,
+	opt_domain_out_hard_limit,
+	opt_slow_policy,
+	opt_io_threads,
+	opt_shards,
+	opt_query_threads,
+	opt_state_dir,
+	opt_state_interval,
+	opt_journal,
+	opt_replicate_to,
+	opt_standby,
+	opt_upstream,
+	opt_export,
+	opt_import,
+	opt_import_filter,
+	opt_shm,
+	opt_shm_slots
+    };
+
+    static const struct option long_opts[] = {
+	{ "out-soft-limit", required_argument, NULL, opt_out_soft_limit },
+	{ "out-hard-limit", required_argument, NULL, opt_out_hard_limit },
+	{ "domain-out-soft-limit", required_argument, NULL,
+	  opt_domain_out_soft_limit },
+	{ "domain-out-hard-limit", required_argument, NULL,
+	  opt_domain_out_hard_limit },
+	{ "slow-policy", required_argument, NULL, opt_slow_policy },
+	{ "io-threads", required_argument, NULL, opt_io_threads },
+	{ "shards", required_argument, NULL, opt_shards },
+	{ "query-threads", required_argument, NULL, opt_query_threads },
+	{ "state-dir", required_argument, NULL, opt_state_dir },
+	{ "state-interval", required_argument, NULL, opt_state_interval },
+	{ "journal", required_argument, NULL, opt_journal },
+	{ "replicate-to", required_argument, NULL, opt_replicate_to },
+	{ "standby", required_argument, NULL, opt_standby },
+	{ "upstream", required_argument, NULL, opt_upstream },
+	{ "export", required_argument, NULL, opt_export },
+	{ "import", required_argument, NULL, opt_import },
+	{ "import-filter", required_argument, NULL, opt_import_filter },
+	{ "shm", required_argument, NULL, opt_shm },
+	{ "shm-slots", required_argument, NULL, opt_shm_slots },
+	{ NULL, 0, NULL, 0 }
+    };
+
+    const char **replicate_to = NULL;
+    size_t num_replicate_to = 0;
+    const char **standby_addrs = NULL;
+    size_t num_standby_addrs = 0;
+    const char **upstream_addrs = NULL;
+    size_t num_upstream_addrs = 0;
+    const char **export_addrs = NULL;
+    size_t num_export_addrs = 0;
+    const char **import_from = NULL;
+    size_t num_import_from = 0;
+    const char **import_filters = NULL;
+    size_t num_import_filters = 0;
+    const char **shm_names = NULL;
+    size_t num_shm_names = 0;
 
     int c;
-    while ((c = getopt(argc, argv, "sny:l:vh")) != -1)
+    while ((c = getopt_long(argc, argv, "sny:l:vh", long_opts, NULL)) != -1)
 	switch (c) {
 	case 's':
 	    log_flags |= LOG_USE_STDERR;
@@ -121,6 +506,79 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	    }
 	    break;
+	case opt_out_soft_limit:
+	    conf.conn_conf.soft_out_limit =
+		parse_size("output queue soft limit", optarg);
+	    break;
+	case opt_out_hard_limit:
+	    conf.conn_conf.hard_out_limit =
+		parse_size("output queue hard limit", optarg);
+	    break;
+	case opt_domain_out_soft_limit:
+	    conf.domain_soft_out_limit =
+		parse_size("domain output queue soft limit", optarg);
+	    break;
+	case opt_domain_out_hard_limit:
+	    conf.domain_hard_out_limit =
+		parse_size("domain output queue hard limit", optarg);
+	    break;
+	case opt_slow_policy:
+	    if (str_to_slow_policy(optarg,
+				   &conf.conn_conf.slow_policy) < 0) {
+		fprintf(stderr, "Unknown slow-consumer policy \"%s\".\n",
+			optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    break;
+	case opt_io_threads:
+	    conf.num_io_threads =
+		parse_threads("I/O threads", optarg, MAX_IO_THREADS);
+	    break;
+	case opt_shards:
+	    conf.num_shards = parse_threads("shards", optarg, MAX_SHARDS);
+	    break;
+	case opt_query_threads:
+	    conf.num_query_threads =
+		parse_threads("query threads", optarg, MAX_QUERY_THREADS);
+	    break;
+	case opt_state_dir:
+	    conf.state_dir = optarg;
+	    break;
+	case opt_state_interval:
+	    conf.state_interval = parse_interval("state interval", optarg);
+	    break;
+	case opt_journal:
+	    if (str_to_journal_sync(optarg, &conf.journal_sync) < 0) {
+		fprintf(stderr, "Unknown journal sync policy \"%s\".\n",
+			optarg);
+		exit(EXIT_FAILURE);
+	    }
+	    conf.journal = true;
+	    break;
+	case opt_replicate_to:
+	    add_addr(&replicate_to, &num_replicate_to, optarg);
+	    break;
+	case opt_standby:
+	    add_addr(&standby_addrs, &num_standby_addrs, optarg);
+	    break;
+	case opt_upstream:
+	    add_addr(&upstream_addrs, &num_upstream_addrs, optarg);
+	    break;
+	case opt_export:
+	    add_addr(&export_addrs, &num_export_addrs, optarg);
+	    break;
+	case opt_import:
+	    add_addr(&import_from, &num_import_from, optarg);
+	    break;
+	case opt_import_filter:
+	    add_addr(&import_filters, &num_import_filters, optarg);
+	    break;
+	case opt_shm:
+	    add_addr(&shm_names, &num_shm_names, optarg);
+	    break;
+	case opt_shm_slots:
+	    conf.shm_slots = parse_slots(optarg);
+	    break;
 	case 'v':
 	    printf("%s\n", TPAF_VERSION);
 	    exit(EXIT_SUCCESS);
@@ -140,12 +598,51 @@ int main(int argc, char **argv)
 
     ut_free(prg_name);
 
+    if (conf.journal && conf.state_dir == NULL) {
+	fprintf(stderr, "A journal requires a state directory.\n");
+	exit(EXIT_FAILURE);
+    }
+
     int num_servers = argc - optind;
     if (num_servers == 0) {
 	usage(argv[0]);
 	exit(EXIT_FAILURE);
     }
 
+    char **domain_addrs = &argv[optind];
+
+    const char **domain_replicate_to =
+	key_by_domain("replicate-to", replicate_to, num_replicate_to,
+		      domain_addrs, num_servers);
+    const char **domain_standby_addrs =
+	key_by_domain("standby", standby_addrs, num_standby_addrs,
+		      domain_addrs, num_servers);
+    const char **domain_upstream_addrs =
+	key_by_domain("upstream", upstream_addrs, num_upstream_addrs,
+		      domain_addrs, num_servers);
+    const char **domain_export_addrs =
+	key_by_domain("export", export_addrs, num_export_addrs,
+		      domain_addrs, num_servers);
+    const char **domain_import_from =
+	key_by_domain("import", import_from, num_import_from,
+		      domain_addrs, num_servers);
+    const char **domain_import_filters =
+	key_by_domain("import-filter", import_filters, num_import_filters,
+		      domain_addrs, num_servers);
+    const char **domain_shm_names =
+	key_by_domain("shm", shm_names, num_shm_names, domain_addrs,
+		      num_servers);
+
+    int i;
+
+    for (i = 0; i < num_servers; i++)
+	if (domain_import_filters[i] != NULL &&
+	    domain_import_from[i] == NULL) {
+	    fprintf(stderr, "Import filter given for domain \"%s\", which "
+		    "doesn't import.\n", domain_addrs[i]);
+	    exit(EXIT_FAILURE);
+	}
+
     struct event_base *event_base = event_base_new();
 
     if (event_base == NULL)
@@ -165,14 +662,41 @@ int main(int argc, char **argv)
 
     struct server *servers[num_servers];
 
-    log_info("tpafd version %s started.", TPAF_VERSION);
+    struct server_set server_set = {
+	.servers = servers,
+	.num_servers = num_servers
+    };
 
-    int i;
+    struct event sigusr1_event;
+    evsignal_assign(&sigusr1_event, event_base, SIGUSR1, stats_cb,
+		    &server_set);
+    evsignal_add(&sigusr1_event, NULL);
+
+    struct event sigusr2_event;
+    evsignal_assign(&sigusr2_event, event_base, SIGUSR2, promote_cb,
+		    &server_set);
+    evsignal_add(&sigusr2_event, NULL);
+
+    log_info("tpafd version %s started.", TPAF_VERSION);
 
     for (i = 0; i < num_servers; i++) {
 	const char *server_addr = argv[optind + i];
 
-	servers[i] = server_create(NULL, server_addr, event_base);
+	/* Domains are served by different threads, and their log
+	   messages may be interleaved. */
+	const char *name = num_servers > 1 ? server_addr : NULL;
+
+	struct server_conf domain_conf = conf;
+
+	domain_conf.replicate_to = domain_replicate_to[i];
+	domain_conf.standby_addr = domain_standby_addrs[i];
+	domain_conf.upstream_addr = domain_upstream_addrs[i];
+	domain_conf.export_addr = domain_export_addrs[i];
+	domain_conf.import_from = domain_import_from[i];
+	domain_conf.import_filter = domain_import_filters[i];
+	domain_conf.shm_name = domain_shm_names[i];
+
+	servers[i] = server_create(name, server_addr, &domain_conf);
 
 	if (servers[i] == NULL)
 	    die("Unable to create server bound to \"%s\"", server_addr);
@@ -184,11 +708,28 @@ int main(int argc, char **argv)
 	if (server_start(servers[i]) < 0)
 	    die("Unable to start server bound to \"%s\"", server_addr);
     }
+
+    /* The main thread only handles signals */
     event_base_dispatch(event_base);
 
     for (i = 0; i < num_servers; i++)
 	server_destroy(servers[i]);
 
+    ut_free(replicate_to);
+    ut_free(standby_addrs);
+    ut_free(upstream_addrs);
+    ut_free(export_addrs);
+    ut_free(import_from);
+    ut_free(import_filters);
+    ut_free(shm_names);
+    ut_free(domain_replicate_to);
+    ut_free(domain_standby_addrs);
+    ut_free(domain_upstream_addrs);
+    ut_free(domain_export_addrs);
+    ut_free(domain_import_from);
+    ut_free(domain_import_filters);
+    ut_free(domain_shm_names);
+
     event_base_free(event_base);
 
     log_deinit();
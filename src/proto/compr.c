@@ -0,0 +1,173 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <stdatomic.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "util.h"
+
+#include "compr.h"
+
+/* Updated by the thread doing the work, and read by the thread
+   logging statistics */
+struct counters
+{
+    atomic_uint_fast64_t plain_bytes;
+    atomic_uint_fast64_t compressed_bytes;
+    atomic_uint_fast64_t cpu_ns;
+};
+
+struct deflater
+{
+    z_stream zs;
+    struct counters counters;
+};
+
+struct inflater
+{
+    z_stream zs;
+    struct counters counters;
+};
+
+static uint64_t cpu_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void counters_init(struct counters *counters)
+{
+    atomic_init(&counters->plain_bytes, 0);
+    atomic_init(&counters->compressed_bytes, 0);
+    atomic_init(&counters->cpu_ns, 0);
+}
+
+static void counters_add(struct counters *counters, size_t plain_bytes,
+			 size_t compressed_bytes, uint64_t start)
+{
+    atomic_fetch_add(&counters->plain_bytes, plain_bytes);
+    atomic_fetch_add(&counters->compressed_bytes, compressed_bytes);
+    atomic_fetch_add(&counters->cpu_ns, cpu_ns() - start);
+}
+
+static void counters_get(struct counters *counters,
+			 struct compr_stats *stats)
+{
+    *stats = (struct compr_stats) {
+	.plain_bytes = atomic_load(&counters->plain_bytes),
+	.compressed_bytes = atomic_load(&counters->compressed_bytes),
+	.cpu_time = atomic_load(&counters->cpu_ns) / 1e9
+    };
+}
+
+struct deflater *deflater_create(void)
+{
+    struct deflater *deflater = ut_calloc(sizeof(struct deflater));
+
+    if (deflateInit(&deflater->zs, Z_DEFAULT_COMPRESSION) != Z_OK)
+	ut_mem_exhausted();
+
+    counters_init(&deflater->counters);
+
+    return deflater;
+}
+
+void deflater_destroy(struct deflater *deflater)
+{
+    if (deflater != NULL) {
+	deflateEnd(&deflater->zs);
+	ut_free(deflater);
+    }
+}
+
+/* Room for the sync flush marker, and the block headers */
+#define FLUSH_OVERHEAD 16
+
+struct msg *deflater_compress(struct deflater *deflater, const void *data,
+			      size_t len)
+{
+    uint64_t start = cpu_ns();
+    size_t capacity = deflateBound(&deflater->zs, len) + FLUSH_OVERHEAD;
+    void *out = ut_malloc(capacity);
+
+    deflater->zs.next_in = (Bytef *)data;
+    deflater->zs.avail_in = len;
+    deflater->zs.next_out = out;
+    deflater->zs.avail_out = capacity;
+
+    int rc = deflate(&deflater->zs, Z_SYNC_FLUSH);
+
+    if (rc != Z_OK || deflater->zs.avail_in > 0 ||
+	deflater->zs.avail_out == 0) {
+	ut_free(out);
+	return NULL;
+    }
+
+    size_t out_len = capacity - deflater->zs.avail_out;
+
+    counters_add(&deflater->counters, len, out_len, start);
+
+    return msg_create_prealloc(out, out_len);
+}
+
+void deflater_get_stats(struct deflater *deflater,
+			struct compr_stats *stats)
+{
+    counters_get(&deflater->counters, stats);
+}
+
+struct inflater *inflater_create(void)
+{
+    struct inflater *inflater = ut_calloc(sizeof(struct inflater));
+
+    if (inflateInit(&inflater->zs) != Z_OK)
+	ut_mem_exhausted();
+
+    counters_init(&inflater->counters);
+
+    return inflater;
+}
+
+void inflater_destroy(struct inflater *inflater)
+{
+    if (inflater != NULL) {
+	inflateEnd(&inflater->zs);
+	ut_free(inflater);
+    }
+}
+
+int inflater_decompress(struct inflater *inflater, const void *data,
+			size_t len, void *buf, size_t capacity)
+{
+    uint64_t start = cpu_ns();
+
+    inflater->zs.next_in = (Bytef *)data;
+    inflater->zs.avail_in = len;
+    inflater->zs.next_out = buf;
+    inflater->zs.avail_out = capacity;
+
+    int rc = inflate(&inflater->zs, Z_SYNC_FLUSH);
+
+    /* A full output buffer may mean the message was cut short */
+    if ((rc != Z_OK && rc != Z_BUF_ERROR) || inflater->zs.avail_in > 0 ||
+	inflater->zs.avail_out == 0)
+	return -1;
+
+    size_t out_len = capacity - inflater->zs.avail_out;
+
+    counters_add(&inflater->counters, out_len, len, start);
+
+    return out_len;
+}
+
+void inflater_get_stats(struct inflater *inflater,
+			struct compr_stats *stats)
+{
+    counters_get(&inflater->counters, stats);
+}
@@ -0,0 +1,56 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef COMPR_H
+#define COMPR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msg.h"
+
+/* Per-message deflate compression of a connection's messages, in one
+   direction. Every message is sync flushed, so that it may be
+   decompressed in full on arrival, while the compression history
+   carries over to the next message. Hence, the messages must be
+   decompressed in the order they were compressed, and every message
+   compressed must be sent. */
+
+struct compr_stats
+{
+    /* bytes before compression, or after decompression */
+    uint64_t plain_bytes;
+    uint64_t compressed_bytes;
+    /* thread CPU time spent (de)compressing, in seconds */
+    double cpu_time;
+};
+
+struct deflater;
+
+struct deflater *deflater_create(void);
+void deflater_destroy(struct deflater *deflater);
+
+/* Returns NULL on failure, which leaves the deflater unusable */
+struct msg *deflater_compress(struct deflater *deflater, const void *data,
+			      size_t len);
+
+/* The statistics may be retrieved from any thread */
+void deflater_get_stats(struct deflater *deflater,
+			struct compr_stats *stats);
+
+struct inflater;
+
+struct inflater *inflater_create(void);
+void inflater_destroy(struct inflater *inflater);
+
+/* Returns the length of the decompressed message, or -1 if the
+   data is invalid or doesn't fit into 'capacity' bytes. */
+int inflater_decompress(struct inflater *inflater, const void *data,
+			size_t len, void *buf, size_t capacity);
+
+void inflater_get_stats(struct inflater *inflater,
+			struct compr_stats *stats);
+
+#endif
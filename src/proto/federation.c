@@ -0,0 +1,912 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <xcm.h>
+#include <zlib.h>
+
+#include "filter.h"
+#include "pmap.h"
+#include "srec.h"
+#include "util.h"
+
+#include "federation.h"
+
+#define MAX_MSG 65535
+#define RECONNECT_INTERVAL 1.0
+
+/* Service records, in bytes, deflated into a single message. Small
+   enough for the deflated data to always fit, even if it doesn't
+   compress at all. */
+#define MAX_BATCH 60000
+
+/* Output queued, in bytes, at which the exporter gives up on a peer,
+   which then has to reconnect, and start over. */
+#define MAX_QUEUED (64 * 1024 * 1024)
+
+/* The importer sends an import message, carrying the filter (if
+   any), after which the exporter sends records messages, with a
+   synced message marking the end of the initial copy. */
+enum msg_type {
+    msg_type_import = 1,
+    msg_type_records = 2,
+    msg_type_synced = 3
+};
+
+struct msg_header
+{
+    uint32_t type;
+    /* the length of the records, before compression */
+    uint32_t records_len;
+};
+
+struct out_msg
+{
+    char *data;
+    size_t len;
+    TAILQ_ENTRY(out_msg) entry;
+};
+
+TAILQ_HEAD(out_msg_queue, out_msg);
+
+/* A peer importing services. Also the client id of the subscription
+   kept on its behalf. */
+struct export_conn
+{
+    struct fed_export *export;
+    int64_t client_id;
+    int64_t sub_id;
+    bool importing;
+
+    struct xcm_socket *sock;
+    struct event sock_event;
+    char *remote_addr;
+
+    struct srec_buf batch;
+    bool synced;
+    struct event flush_event;
+
+    z_stream zs;
+    struct out_msg_queue out;
+    size_t out_bytes;
+};
+
+PMAP_GEN_WRAPPER(export_conn_map, struct export_conn_map, int64_t,
+		 struct export_conn, static __attribute__((unused)))
+
+struct fed_export
+{
+    struct event_base *event_base;
+    struct shards *shards;
+
+    struct xcm_socket *server_sock;
+    struct event accept_event;
+
+    struct export_conn_map *conns;
+
+    const struct log_ctx *log_ctx;
+};
+
+static void free_out_msgs(struct out_msg_queue *out)
+{
+    struct out_msg *out_msg;
+
+    while ((out_msg = TAILQ_FIRST(out)) != NULL) {
+	TAILQ_REMOVE(out, out_msg, entry);
+	ut_free(out_msg->data);
+	ut_free(out_msg);
+    }
+}
+
+static void export_conn_destroy(struct export_conn *conn)
+{
+    struct fed_export *export = conn->export;
+
+    export_conn_map_del(export->conns, conn->client_id);
+
+    event_del(&conn->sock_event);
+    event_del(&conn->flush_event);
+
+    /* Drops any listing in progress */
+    shards_cancel(export->shards, conn);
+
+    if (conn->importing)
+	shards_client_disconnect(export->shards, conn->client_id);
+
+    xcm_close(conn->sock);
+
+    free_out_msgs(&conn->out);
+    deflateEnd(&conn->zs);
+    srec_buf_deinit(&conn->batch);
+
+    ut_free(conn->remote_addr);
+    ut_free(conn);
+}
+
+static void queue_msg(struct export_conn *conn, char *data, size_t len)
+{
+    struct out_msg *out_msg = ut_malloc(sizeof(struct out_msg));
+
+    out_msg->data = data;
+    out_msg->len = len;
+
+    TAILQ_INSERT_TAIL(&conn->out, out_msg, entry);
+    conn->out_bytes += len;
+}
+
+static int queue_records(struct export_conn *conn, const char *records,
+			 size_t len)
+{
+    char *msg = ut_malloc(MAX_MSG);
+    struct msg_header header = {
+	.type = msg_type_records,
+	.records_len = len
+    };
+
+    memcpy(msg, &header, sizeof(header));
+
+    conn->zs.next_in = (Bytef *)records;
+    conn->zs.avail_in = len;
+    conn->zs.next_out = (Bytef *)msg + sizeof(header);
+    conn->zs.avail_out = MAX_MSG - sizeof(header);
+
+    /* A sync flush lets the peer inflate the message in full, while
+       the compression history carries over to the next message */
+    int rc = deflate(&conn->zs, Z_SYNC_FLUSH);
+
+    if (rc != Z_OK || conn->zs.avail_in > 0 || conn->zs.avail_out == 0) {
+	log_error_c(conn->export->log_ctx, "Error compressing service "
+		    "records.");
+	ut_free(msg);
+	return -1;
+    }
+
+    queue_msg(conn, msg, MAX_MSG - conn->zs.avail_out);
+
+    return 0;
+}
+
+/* Packs the batched records into as few messages as possible. */
+static int flush_batch(struct export_conn *conn)
+{
+    const char *data = conn->batch.data;
+    size_t start = 0;
+    size_t offset = 0;
+
+    while (offset < conn->batch.len) {
+	size_t rec_len = srec_len(data + offset);
+
+	if (rec_len > MAX_BATCH) {
+	    log_warn_c(conn->export->log_ctx, "Service record of %zd bytes "
+		       "is too large to be exported.", rec_len);
+	    if (offset > start &&
+		queue_records(conn, data + start, offset - start) < 0)
+		return -1;
+	    offset += rec_len;
+	    start = offset;
+	    continue;
+	}
+
+	if (offset + rec_len - start > MAX_BATCH) {
+	    if (queue_records(conn, data + start, offset - start) < 0)
+		return -1;
+	    start = offset;
+	}
+
+	offset += rec_len;
+    }
+
+    if (offset > start &&
+	queue_records(conn, data + start, offset - start) < 0)
+	return -1;
+
+    conn->batch.len = 0;
+
+    return 0;
+}
+
+static void queue_synced(struct export_conn *conn)
+{
+    struct msg_header header = {
+	.type = msg_type_synced
+    };
+
+    queue_msg(conn, ut_memdup(&header, sizeof(header)), sizeof(header));
+}
+
+static int try_send(struct export_conn *conn)
+{
+    struct out_msg *out_msg;
+
+    while ((out_msg = TAILQ_FIRST(&conn->out)) != NULL) {
+	if (xcm_send(conn->sock, out_msg->data, out_msg->len) < 0) {
+	    if (errno == EAGAIN)
+		return 0;
+
+	    log_info_c(conn->export->log_ctx, "Error sending to federation "
+		       "peer \"%s\": %s.", conn->remote_addr, strerror(errno));
+	    return -1;
+	}
+
+	TAILQ_REMOVE(&conn->out, out_msg, entry);
+	conn->out_bytes -= out_msg->len;
+	ut_free(out_msg->data);
+	ut_free(out_msg);
+    }
+
+    return 0;
+}
+
+static void update(struct export_conn *conn)
+{
+    int condition = XCM_SO_RECEIVABLE;
+
+    if (!TAILQ_EMPTY(&conn->out))
+	condition |= XCM_SO_SENDABLE;
+
+    xcm_await(conn->sock, condition);
+}
+
+static void flush_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct export_conn *conn = cb_data;
+
+    if (flush_batch(conn) < 0) {
+	export_conn_destroy(conn);
+	return;
+    }
+
+    if (conn->synced) {
+	queue_synced(conn);
+	conn->synced = false;
+    }
+
+    if (try_send(conn) < 0) {
+	export_conn_destroy(conn);
+	return;
+    }
+
+    if (conn->out_bytes > MAX_QUEUED) {
+	log_warn_c(conn->export->log_ctx, "Federation peer \"%s\" is "
+		   "falling behind. Disconnecting.", conn->remote_addr);
+	export_conn_destroy(conn);
+	return;
+    }
+
+    update(conn);
+}
+
+static void schedule_flush(struct export_conn *conn)
+{
+    event_active(&conn->flush_event, 0, 0);
+}
+
+static void match_cb(struct sub *sub, const struct service *service,
+		     enum sub_match_type match_type, void *cb_data)
+{
+    struct export_conn *conn = cb_data;
+
+    /* Services imported from elsewhere are not passed on */
+    if (service_is_mirrored(service))
+	return;
+
+    if (match_type == sub_match_type_disappeared)
+	srec_add_removed(&conn->batch, ut_ftime(), service_get_id(service));
+    else
+	srec_add_service(&conn->batch, ut_ftime(), service);
+
+    schedule_flush(conn);
+}
+
+/* The listing is made only after the subscription is activated, so
+   its completion means the peer has been notified of every service
+   matching at the time. */
+static void listing_cb(int64_t op_id, const struct service *service,
+		       void *cb_data)
+{
+    struct export_conn *conn = cb_data;
+
+    if (service == NULL) {
+	conn->synced = true;
+	schedule_flush(conn);
+    }
+}
+
+static int handle_import(struct export_conn *conn, const char *msg,
+			 size_t len)
+{
+    struct fed_export *export = conn->export;
+    char *filter_s = len > 0 ? ut_asprintf("%.*s", (int)len, msg) : NULL;
+    struct filter *filter = NULL;
+
+    if (filter_s != NULL) {
+	filter = filter_parse(filter_s);
+
+	if (filter == NULL) {
+	    log_warn_c(export->log_ctx, "Federation peer \"%s\" supplied "
+		       "invalid filter \"%s\".", conn->remote_addr, filter_s);
+	    ut_free(filter_s);
+	    return -1;
+	}
+    }
+
+    int rc = shards_client_connect(export->shards, conn->client_id,
+				   conn->remote_addr);
+    ut_assert(rc == 0);
+
+    conn->importing = true;
+
+    rc = shards_create_sub(export->shards, conn->client_id, conn->sub_id,
+			   filter_s, match_cb, conn);
+    ut_assert(rc == 0);
+
+    shards_activate_sub(export->shards, conn->client_id, conn->sub_id);
+
+    shards_foreach_service(export->shards, filter, 0, listing_cb, conn);
+
+    log_info_c(export->log_ctx, "Exporting services%s%s to federation "
+	       "peer \"%s\".", filter_s != NULL ? " matching " : "",
+	       filter_s != NULL ? filter_s : "", conn->remote_addr);
+
+    filter_destroy(filter);
+    ut_free(filter_s);
+
+    return 0;
+}
+
+static int try_receive(struct export_conn *conn)
+{
+    for (;;) {
+	char msg[MAX_MSG];
+	int rc = xcm_receive(conn->sock, msg, sizeof(msg));
+
+	if (rc < 0 && errno == EAGAIN)
+	    return 0;
+
+	if (rc <= 0) {
+	    log_info_c(conn->export->log_ctx, "Federation peer \"%s\" "
+		       "disconnected.", conn->remote_addr);
+	    return -1;
+	}
+
+	struct msg_header header;
+
+	if ((size_t)rc < sizeof(header))
+	    goto malformed;
+
+	memcpy(&header, msg, sizeof(header));
+
+	if (header.type != msg_type_import || conn->importing)
+	    goto malformed;
+
+	if (handle_import(conn, msg + sizeof(header),
+			  rc - sizeof(header)) < 0)
+	    return -1;
+    }
+
+malformed:
+    log_warn_c(conn->export->log_ctx, "Received malformed message from "
+	       "federation peer \"%s\".", conn->remote_addr);
+    return -1;
+}
+
+static void export_conn_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct export_conn *conn = cb_data;
+
+    if (try_send(conn) < 0 || try_receive(conn) < 0) {
+	export_conn_destroy(conn);
+	return;
+    }
+
+    update(conn);
+}
+
+static void export_accept_cb(evutil_socket_t fd, short events,
+			     void *cb_data)
+{
+    struct fed_export *export = cb_data;
+
+    struct xcm_socket *sock = xcm_accept(export->server_sock);
+
+    if (sock == NULL)
+	return;
+
+    if (xcm_set_blocking(sock, false) < 0 ||
+	xcm_await(sock, XCM_SO_RECEIVABLE) < 0) {
+	log_error_c(export->log_ctx, "Unable to configure federation "
+		    "connection: %s.", strerror(errno));
+	xcm_close(sock);
+	return;
+    }
+
+    struct export_conn *conn = ut_malloc(sizeof(struct export_conn));
+
+    *conn = (struct export_conn) {
+	.export = export,
+	.client_id = ut_rand_id(),
+	.sub_id = ut_rand_id(),
+	.sock = sock,
+	.remote_addr = ut_strdup(xcm_remote_addr(sock))
+    };
+
+    if (deflateInit(&conn->zs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+	log_error_c(export->log_ctx, "Unable to initialize compression.");
+	xcm_close(sock);
+	ut_free(conn->remote_addr);
+	ut_free(conn);
+	return;
+    }
+
+    srec_buf_init(&conn->batch);
+    TAILQ_INIT(&conn->out);
+
+    event_assign(&conn->sock_event, export->event_base, xcm_fd(sock),
+		 EV_READ|EV_PERSIST, export_conn_cb, conn);
+    event_add(&conn->sock_event, NULL);
+
+    event_assign(&conn->flush_event, export->event_base, -1, 0, flush_cb,
+		 conn);
+
+    export_conn_map_add(export->conns, conn->client_id, conn);
+
+    log_info_c(export->log_ctx, "Accepted federation connection from "
+	       "\"%s\".", conn->remote_addr);
+}
+
+struct fed_export *fed_export_create(struct event_base *event_base,
+				     struct shards *shards,
+				     const char *addr,
+				     const struct log_ctx *log_ctx)
+{
+    struct xcm_socket *server_sock = xcm_server(addr);
+
+    if (server_sock == NULL) {
+	log_error_c(log_ctx, "Error creating federation server socket "
+		    "\"%s\": %s", addr, strerror(errno));
+	return NULL;
+    }
+
+    struct fed_export *export = ut_malloc(sizeof(struct fed_export));
+
+    *export = (struct fed_export) {
+	.event_base = event_base,
+	.shards = shards,
+	.server_sock = server_sock,
+	.conns = export_conn_map_create(),
+	.log_ctx = log_ctx
+    };
+
+    event_assign(&export->accept_event, event_base, -1, 0, export_accept_cb,
+		 export);
+
+    return export;
+}
+
+struct collect_conns_param
+{
+    struct export_conn **conns;
+    size_t num_conns;
+};
+
+static bool collect_conn_cb(int64_t client_id, struct export_conn *conn,
+			    void *cb_data)
+{
+    struct collect_conns_param *param = cb_data;
+
+    param->conns[param->num_conns++] = conn;
+
+    return true;
+}
+
+void fed_export_destroy(struct fed_export *export)
+{
+    if (export != NULL) {
+	/* can't modify 'conns' while iterating */
+	struct collect_conns_param param = {
+	    .conns = ut_malloc(sizeof(struct export_conn *) *
+			       (export_conn_map_size(export->conns) + 1))
+	};
+
+	export_conn_map_foreach(export->conns, collect_conn_cb, &param);
+
+	size_t i;
+	for (i = 0; i < param.num_conns; i++)
+	    export_conn_destroy(param.conns[i]);
+
+	ut_free(param.conns);
+	export_conn_map_destroy(export->conns);
+
+	event_del(&export->accept_event);
+	xcm_close(export->server_sock);
+
+	ut_free(export);
+    }
+}
+
+int fed_export_start(struct fed_export *export)
+{
+    if (xcm_set_blocking(export->server_sock, false) < 0 ||
+	xcm_await(export->server_sock, XCM_SO_ACCEPTABLE) < 0) {
+	log_error_c(export->log_ctx, "Unable to configure federation "
+		    "server socket: %s.", strerror(errno));
+	return -1;
+    }
+
+    event_assign(&export->accept_event, export->event_base,
+		 xcm_fd(export->server_sock), EV_READ|EV_PERSIST,
+		 export_accept_cb, export);
+    event_add(&export->accept_event, NULL);
+
+    return 0;
+}
+
+/* The import connection epoch in which a service was last seen */
+struct imported
+{
+    uint64_t epoch;
+};
+
+PMAP_GEN_WRAPPER(imported_map, struct imported_map, int64_t, struct imported,
+		 static __attribute__((unused)))
+
+struct fed_import
+{
+    struct event_base *event_base;
+    struct shards *shards;
+    char *peer_addr;
+    char *filter_s;
+
+    struct xcm_socket *sock;
+    struct event sock_event;
+    bool request_sent;
+    z_stream zs;
+
+    struct event reconnect_event;
+    bool failing;
+    uint64_t epoch;
+    struct imported_map *imported;
+
+    const struct log_ctx *log_ctx;
+};
+
+static void schedule_reconnect(struct fed_import *import)
+{
+    struct timeval tv;
+    ut_f_to_timeval(RECONNECT_INTERVAL, &tv);
+
+    event_add(&import->reconnect_event, &tv);
+}
+
+static void close_sock(struct fed_import *import)
+{
+    if (import->sock != NULL) {
+	event_del(&import->sock_event);
+	xcm_close(import->sock);
+	import->sock = NULL;
+	inflateEnd(&import->zs);
+    }
+}
+
+static void import_lost(struct fed_import *import)
+{
+    close_sock(import);
+
+    if (!import->failing)
+	log_info_c(import->log_ctx, "Lost connection to federation peer "
+		   "\"%s\". Keeping %zd imported services.",
+		   import->peer_addr, imported_map_size(import->imported));
+
+    import->failing = true;
+
+    schedule_reconnect(import);
+}
+
+static void import_service(struct fed_import *import, const struct srec *rec)
+{
+    shards_mirror(import->shards, rec->client_id, rec->service_id,
+		  rec->generation, rec->props, rec->ttl, rec->orphan_since);
+
+    struct imported *imported =
+	imported_map_get(import->imported, rec->service_id);
+
+    if (imported == NULL) {
+	imported = ut_malloc(sizeof(struct imported));
+	imported_map_add(import->imported, rec->service_id, imported);
+    }
+
+    imported->epoch = import->epoch;
+}
+
+static void import_remove(struct fed_import *import, int64_t service_id)
+{
+    struct imported *imported = imported_map_get(import->imported, service_id);
+
+    if (imported == NULL)
+	return;
+
+    shards_mirror_remove(import->shards, service_id);
+
+    imported_map_del(import->imported, service_id);
+    ut_free(imported);
+}
+
+struct sweep_param
+{
+    struct fed_import *import;
+    int64_t *stale_ids;
+    size_t num_stale;
+};
+
+static bool find_stale_cb(int64_t service_id, struct imported *imported,
+			  void *cb_data)
+{
+    struct sweep_param *param = cb_data;
+
+    if (imported->epoch != param->import->epoch)
+	param->stale_ids[param->num_stale++] = service_id;
+
+    return true;
+}
+
+/* Removes services which went away while the peer was disconnected,
+   i.e., those not part of the new connection's initial copy. */
+static void sweep(struct fed_import *import)
+{
+    struct sweep_param param = {
+	.import = import,
+	.stale_ids = ut_malloc(sizeof(int64_t) *
+			       (imported_map_size(import->imported) + 1))
+    };
+
+    imported_map_foreach(import->imported, find_stale_cb, &param);
+
+    size_t i;
+    for (i = 0; i < param.num_stale; i++)
+	import_remove(import, param.stale_ids[i]);
+
+    log_info_c(import->log_ctx, "Imported %zd services from federation "
+	       "peer \"%s\". Removed %zd services no longer there.",
+	       imported_map_size(import->imported), import->peer_addr,
+	       param.num_stale);
+
+    ut_free(param.stale_ids);
+}
+
+static int process_records(struct fed_import *import,
+			   const struct msg_header *header,
+			   const char *data, size_t len)
+{
+    if (header->records_len > MAX_BATCH)
+	return -1;
+
+    char records[MAX_BATCH];
+
+    import->zs.next_in = (Bytef *)data;
+    import->zs.avail_in = len;
+    import->zs.next_out = (Bytef *)records;
+    import->zs.avail_out = header->records_len;
+
+    int rc = inflate(&import->zs, Z_SYNC_FLUSH);
+
+    if ((rc != Z_OK && rc != Z_BUF_ERROR) || import->zs.avail_in > 0 ||
+	import->zs.avail_out > 0)
+	return -1;
+
+    size_t offset = 0;
+
+    while (offset < header->records_len) {
+	struct srec rec;
+	ssize_t rec_len = srec_parse(records + offset,
+				     header->records_len - offset, &rec);
+
+	if (rec_len < 0)
+	    return -1;
+
+	if (rec.type == srec_type_service) {
+	    import_service(import, &rec);
+	    props_destroy(rec.props);
+	} else
+	    import_remove(import, rec.service_id);
+
+	offset += rec_len;
+    }
+
+    return 0;
+}
+
+static int process_msg(struct fed_import *import, const char *msg,
+		       size_t len)
+{
+    struct msg_header header;
+
+    if (len < sizeof(header))
+	return -1;
+
+    memcpy(&header, msg, sizeof(header));
+
+    switch (header.type) {
+    case msg_type_records:
+	return process_records(import, &header, msg + sizeof(header),
+			       len - sizeof(header));
+    case msg_type_synced:
+	sweep(import);
+	return 0;
+    default:
+	return -1;
+    }
+}
+
+static int send_request(struct fed_import *import)
+{
+    size_t filter_len = import->filter_s != NULL ?
+	strlen(import->filter_s) : 0;
+    size_t len = sizeof(struct msg_header) + filter_len;
+    char msg[len];
+    struct msg_header header = {
+	.type = msg_type_import
+    };
+
+    memcpy(msg, &header, sizeof(header));
+    if (filter_len > 0)
+	memcpy(msg + sizeof(header), import->filter_s, filter_len);
+
+    if (xcm_send(import->sock, msg, len) < 0)
+	return errno == EAGAIN ? 0 : -1;
+
+    import->request_sent = true;
+    import->failing = false;
+
+    log_info_c(import->log_ctx, "Importing services from federation peer "
+	       "\"%s\".", import->peer_addr);
+
+    return 0;
+}
+
+static void import_sock_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct fed_import *import = cb_data;
+
+    if (!import->request_sent) {
+	if (send_request(import) < 0) {
+	    log_info_c(import->log_ctx, "Error sending to federation peer "
+		       "\"%s\": %s.", import->peer_addr, strerror(errno));
+	    import_lost(import);
+	    return;
+	}
+
+	if (!import->request_sent) {
+	    xcm_await(import->sock, XCM_SO_SENDABLE);
+	    return;
+	}
+
+	xcm_await(import->sock, XCM_SO_RECEIVABLE);
+    }
+
+    for (;;) {
+	char msg[MAX_MSG];
+	int rc = xcm_receive(import->sock, msg, sizeof(msg));
+
+	if (rc < 0 && errno == EAGAIN)
+	    return;
+
+	if (rc <= 0) {
+	    import_lost(import);
+	    return;
+	}
+
+	if (process_msg(import, msg, rc) < 0) {
+	    log_error_c(import->log_ctx, "Received malformed message from "
+			"federation peer \"%s\". Reconnecting.",
+			import->peer_addr);
+	    import_lost(import);
+	    return;
+	}
+    }
+}
+
+static void import_connect(struct fed_import *import)
+{
+    import->sock = xcm_connect(import->peer_addr, XCM_NONBLOCK);
+
+    if (import->sock == NULL) {
+	if (!import->failing)
+	    log_info_c(import->log_ctx, "Unable to connect to federation "
+		       "peer \"%s\": %s. Retrying.", import->peer_addr,
+		       strerror(errno));
+	import->failing = true;
+	schedule_reconnect(import);
+	return;
+    }
+
+    import->zs = (z_stream) { };
+
+    if (inflateInit(&import->zs) != Z_OK)
+	ut_mem_exhausted();
+
+    import->epoch++;
+    import->request_sent = false;
+
+    event_assign(&import->sock_event, import->event_base,
+		 xcm_fd(import->sock), EV_READ|EV_PERSIST, import_sock_cb,
+		 import);
+    event_add(&import->sock_event, NULL);
+
+    xcm_await(import->sock, XCM_SO_SENDABLE);
+}
+
+static void reconnect_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct fed_import *import = cb_data;
+
+    import_connect(import);
+}
+
+struct fed_import *fed_import_create(struct event_base *event_base,
+				     struct shards *shards,
+				     const char *peer_addr,
+				     const char *filter_s,
+				     const struct log_ctx *log_ctx)
+{
+    if (filter_s != NULL) {
+	struct filter *filter = filter_parse(filter_s);
+
+	if (filter == NULL) {
+	    log_error_c(log_ctx, "Invalid federation import filter "
+			"\"%s\".", filter_s);
+	    return NULL;
+	}
+
+	filter_destroy(filter);
+    }
+
+    struct fed_import *import = ut_malloc(sizeof(struct fed_import));
+
+    *import = (struct fed_import) {
+	.event_base = event_base,
+	.shards = shards,
+	.peer_addr = ut_strdup(peer_addr),
+	.filter_s = ut_strdup_non_null(filter_s),
+	.imported = imported_map_create(),
+	.log_ctx = log_ctx
+    };
+
+    event_assign(&import->reconnect_event, event_base, -1, 0,
+		 reconnect_cb, import);
+
+    return import;
+}
+
+static bool free_imported_cb(int64_t service_id, struct imported *imported,
+			     void *cb_data)
+{
+    ut_free(imported);
+
+    return true;
+}
+
+void fed_import_destroy(struct fed_import *import)
+{
+    if (import != NULL) {
+	close_sock(import);
+	event_del(&import->reconnect_event);
+
+	imported_map_foreach(import->imported, free_imported_cb, NULL);
+	imported_map_destroy(import->imported);
+
+	ut_free(import->filter_s);
+	ut_free(import->peer_addr);
+	ut_free(import);
+    }
+}
+
+int fed_import_start(struct fed_import *import)
+{
+    import_connect(import);
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <event.h>
+
+#include "log.h"
+#include "shards.h"
+
+/* Exchange of services between the domains of peer servers.
+
+   An importing server connects to the exporting server, and asks for
+   the services matching a filter. The exporter keeps an ordinary
+   subscription on the importer's behalf, under a client id of its
+   own, and streams a copy of the matching services, followed by
+   every change to them, as service records. Records are batched per
+   event loop iteration, and deflated into XCM messages, with one
+   compression stream per connection. Both servers must share byte
+   order.
+
+   Imported services keep their client id, generation and orphan
+   state, and are mirrored into the importer's shards, where they are
+   visible to local clients, but may not be published or unpublished
+   by them. Only services of the exporter's own clients are exported,
+   so peers may import from each other without services looping. */
+
+struct fed_export;
+
+struct fed_export *fed_export_create(struct event_base *event_base,
+				     struct shards *shards,
+				     const char *addr,
+				     const struct log_ctx *log_ctx);
+/* Must be called before the shards are destroyed. */
+void fed_export_destroy(struct fed_export *export);
+
+int fed_export_start(struct fed_export *export);
+
+struct fed_import;
+
+/* A NULL 'filter_s' imports all of the peer's services. */
+struct fed_import *fed_import_create(struct event_base *event_base,
+				     struct shards *shards,
+				     const char *peer_addr,
+				     const char *filter_s,
+				     const struct log_ctx *log_ctx);
+void fed_import_destroy(struct fed_import *import);
+
+int fed_import_start(struct fed_import *import);
+
+#endif
@@ -0,0 +1,797 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+#include "compr.h"
+#include "pring.h"
+#include "proto_ta.h"
+#include "util.h"
+
+#include "io_pool.h"
+
+/* Connection output is held in the core's output queues, where it's
+   subject to coalescing and the output limits. Only a small number
+   of messages are handed over to the I/O thread at a time. */
+#define IN_RING_CAPACITY 32
+#define OUT_RING_CAPACITY 64
+
+/* An io_conn's status while the connection is usable. Otherwise,
+   the status is zero if the peer closed the connection, or an errno
+   value, as per xcm_receive(). */
+#define STATUS_OPEN (-1)
+
+PRING_GEN_WRAPPER_DEF(in_ring, struct in_ring, json_t,
+		      static __attribute__((unused)))
+PRING_GEN_WRAPPER_DEF(out_ring, struct out_ring, struct msg,
+		      static __attribute__((unused)))
+
+enum io_side { io_side_core, io_side_worker };
+
+/* Connections with work for one side, in the form of a lock-free
+   stack, taken as a whole by the consumer. A pipe is used to wake up
+   the consuming thread's event loop. */
+struct mailbox
+{
+    enum io_side side;
+    _Atomic(struct io_conn *) head;
+    int fds[2];
+    struct event event;
+};
+
+TAILQ_HEAD(io_conn_list, io_conn);
+
+struct io_worker
+{
+    struct event_base *event_base;
+    struct mailbox mailbox;
+    atomic_bool stop;
+    pthread_t thread;
+
+    /* owned by the worker thread */
+    struct io_conn_list conns;
+};
+
+struct io_pool
+{
+    struct mailbox mailbox;
+    struct io_worker *workers;
+    size_t num_workers;
+    size_t next_worker;
+    bool running;
+    struct log_ctx *log_ctx;
+};
+
+struct io_conn
+{
+    struct io_pool *pool;
+    struct io_worker *worker;
+    char *remote_addr;
+    struct log_ctx *log_ctx;
+    io_conn_cb ready_cb;
+    void *cb_data;
+
+    /* One reference each for the core and the worker, and one per
+       mailbox the connection is in. */
+    atomic_int refs;
+
+    struct in_ring *in_ring;
+    struct out_ring *out_ring;
+
+    /* set once the binary encoding is enabled */
+    _Atomic(struct proto_dict *) dict;
+    /* set once compression is enabled, and then used only by the
+       worker */
+    _Atomic(struct inflater *) inflater;
+
+    atomic_int status;
+    atomic_bool closing;
+
+    /* Set by a consumer finding its ring empty, or by a producer
+       finding its ring full, to have the other side notify it when
+       that changes. */
+    atomic_bool in_idle;
+    atomic_bool in_blocked;
+    atomic_bool out_idle;
+    atomic_bool out_blocked;
+
+    struct io_conn *next[2];
+    atomic_bool queued[2];
+
+    /* owned by the core thread */
+    bool core_closed;
+
+    /* owned by the worker thread */
+    struct xcm_socket *sock;
+    struct event sock_event;
+    bool attached;
+    int condition;
+    TAILQ_ENTRY(io_conn) entry;
+};
+
+static void conn_ref(struct io_conn *conn)
+{
+    atomic_fetch_add(&conn->refs, 1);
+}
+
+static void conn_unref(struct io_conn *conn)
+{
+    if (atomic_fetch_sub(&conn->refs, 1) > 1)
+	return;
+
+    json_t *req;
+    while ((req = in_ring_pop(conn->in_ring)) != NULL)
+	json_decref(req);
+    in_ring_destroy(conn->in_ring);
+
+    struct msg *msg;
+    while ((msg = out_ring_pop(conn->out_ring)) != NULL)
+	msg_destroy(msg);
+    out_ring_destroy(conn->out_ring);
+
+    proto_dict_dec_ref(atomic_load(&conn->dict));
+    inflater_destroy(atomic_load(&conn->inflater));
+
+    log_ctx_destroy(conn->log_ctx);
+    ut_free(conn->remote_addr);
+    ut_free(conn);
+}
+
+static int mailbox_init(struct mailbox *mailbox, enum io_side side,
+			struct event_base *event_base,
+			event_callback_fn cb, void *cb_data)
+{
+    mailbox->side = side;
+    atomic_init(&mailbox->head, NULL);
+
+    if (pipe2(mailbox->fds, O_CLOEXEC|O_NONBLOCK) < 0)
+	return -1;
+
+    event_assign(&mailbox->event, event_base, mailbox->fds[0],
+		 EV_READ|EV_PERSIST, cb, cb_data);
+    event_add(&mailbox->event, NULL);
+
+    return 0;
+}
+
+static void mailbox_deinit(struct mailbox *mailbox)
+{
+    event_del(&mailbox->event);
+    close(mailbox->fds[0]);
+    close(mailbox->fds[1]);
+}
+
+static void mailbox_post(struct mailbox *mailbox, struct io_conn *conn)
+{
+    enum io_side side = mailbox->side;
+
+    if (atomic_exchange(&conn->queued[side], true))
+	return;
+
+    conn_ref(conn);
+
+    struct io_conn *head = atomic_load(&mailbox->head);
+
+    do {
+	conn->next[side] = head;
+    } while (!atomic_compare_exchange_weak(&mailbox->head, &head, conn));
+
+    if (head == NULL) {
+	char c = 0;
+	ssize_t rc;
+
+	/* A full pipe already is a pending wakeup */
+	do {
+	    rc = write(mailbox->fds[1], &c, 1);
+	} while (rc < 0 && errno == EINTR);
+    }
+}
+
+/* Returns the posted connections, oldest first. */
+static struct io_conn *mailbox_take(struct mailbox *mailbox)
+{
+    char buf[64];
+
+    while (read(mailbox->fds[0], buf, sizeof(buf)) > 0)
+	;
+
+    struct io_conn *conn = atomic_exchange(&mailbox->head, NULL);
+    struct io_conn *reversed = NULL;
+
+    while (conn != NULL) {
+	struct io_conn *next = conn->next[mailbox->side];
+	conn->next[mailbox->side] = reversed;
+	reversed = conn;
+	conn = next;
+    }
+
+    return reversed;
+}
+
+static void notify_core(struct io_conn *conn)
+{
+    mailbox_post(&conn->pool->mailbox, conn);
+}
+
+static void notify_worker(struct io_conn *conn)
+{
+    mailbox_post(&conn->worker->mailbox, conn);
+}
+
+/* Wakes up the other side, in case it's waiting for the ring
+   condition signaled by 'flag'. */
+static void signal_flag(struct io_conn *conn, atomic_bool *flag,
+			void (*notify)(struct io_conn *))
+{
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_load_explicit(flag, memory_order_relaxed) &&
+	atomic_exchange(flag, false))
+	notify(conn);
+}
+
+static void set_flag(atomic_bool *flag)
+{
+    atomic_store(flag, true);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void set_status(struct io_conn *conn, int status)
+{
+    atomic_store(&conn->status, status);
+    notify_core(conn);
+}
+
+static bool is_open(struct io_conn *conn)
+{
+    return atomic_load(&conn->status) == STATUS_OPEN;
+}
+
+static void worker_detach(struct io_conn *conn)
+{
+    if (!conn->attached)
+	return;
+
+    if (conn->condition >= 0) {
+	TAILQ_REMOVE(&conn->worker->conns, conn, entry);
+	event_del(&conn->sock_event);
+    }
+
+    xcm_close(conn->sock);
+    conn->sock = NULL;
+    conn->attached = false;
+
+    conn_unref(conn);
+}
+
+/* 'data' must have room for a NUL terminator */
+static json_t *decode_req(struct io_conn *conn, char *data, size_t len)
+{
+    struct proto_dict *dict = atomic_load(&conn->dict);
+
+    if (dict != NULL && proto_bin_is_bin(data, len)) {
+	log_debug_c(conn->log_ctx, "Received %zd-byte binary message.", len);
+
+	return proto_req_bin_to_json(data, len, dict, conn->log_ctx);
+    }
+
+    /* NUL terminate */
+    data[len] = '\0';
+    log_debug_c(conn->log_ctx, "Received message: %s", data);
+
+    json_error_t json_err;
+    json_t *req = json_loadb(data, len, 0, &json_err);
+
+    if (req == NULL)
+	log_debug_c(conn->log_ctx, "Error parsing request message "
+		    "JSON at (%d, %d): %s.", json_err.line,
+		    json_err.column, json_err.text);
+
+    return req;
+}
+
+static void worker_receive(struct io_conn *conn)
+{
+    char buf[65536];
+    char plain[65536];
+    bool received = false;
+
+    while (is_open(conn)) {
+	if (in_ring_len(conn->in_ring) == IN_RING_CAPACITY) {
+	    set_flag(&conn->in_blocked);
+
+	    if (in_ring_len(conn->in_ring) == IN_RING_CAPACITY)
+		break;
+	}
+
+	int rc = xcm_receive(conn->sock, buf, sizeof(buf) - 1);
+
+	if (rc > 0) {
+	    struct inflater *inflater = atomic_load(&conn->inflater);
+	    char *data = buf;
+	    int len = rc;
+
+	    if (inflater != NULL) {
+		data = plain;
+		len = inflater_decompress(inflater, buf, rc, plain,
+					  sizeof(plain) - 1);
+
+		if (len < 0) {
+		    log_debug_c(conn->log_ctx, "Error decompressing "
+				"%d-byte message.", rc);
+		    set_status(conn, EBADMSG);
+		    break;
+		}
+	    }
+
+	    json_t *req = decode_req(conn, data, len);
+
+	    if (req == NULL) {
+		set_status(conn, EBADMSG);
+		break;
+	    }
+
+	    in_ring_push(conn->in_ring, req);
+	    received = true;
+	} else if (rc == 0)
+	    set_status(conn, 0);
+	else if (errno != EAGAIN)
+	    set_status(conn, errno);
+	else
+	    break;
+    }
+
+    if (received)
+	signal_flag(conn, &conn->in_idle, notify_core);
+}
+
+/* JSON messages are logged in full */
+static bool is_text(const void *data, size_t len)
+{
+    return len > 0 && ((const char *)data)[0] == '{';
+}
+
+static void worker_send(struct io_conn *conn)
+{
+    bool sent = false;
+
+    for (;;) {
+	struct msg *msg = out_ring_peek(conn->out_ring);
+
+	if (msg == NULL) {
+	    set_flag(&conn->out_idle);
+
+	    msg = out_ring_peek(conn->out_ring);
+
+	    if (msg == NULL)
+		break;
+	}
+
+	/* Output to a failed connection is discarded */
+	if (is_open(conn)) {
+	    const void *data = msg_data(msg);
+	    size_t len = msg_len(msg);
+
+	    int rc = xcm_send(conn->sock, data, len);
+
+	    if (rc < 0 && errno == EAGAIN)
+		break;
+	    else if (rc < 0)
+		set_status(conn, errno);
+	    else if (!is_text(data, len))
+		log_debug_c(conn->log_ctx, "Sent %zd-byte binary or "
+			    "compressed message.", len);
+	    else if (log_is_debug_enabled()) {
+		/* NUL terminate */
+		char sdata[len + 1];
+		memcpy(sdata, data, len);
+		sdata[len] = '\0';
+
+		log_debug_c(conn->log_ctx, "Sent message: %s", sdata);
+	    }
+	}
+
+	out_ring_pop(conn->out_ring);
+	msg_destroy(msg);
+	sent = true;
+    }
+
+    if (sent)
+	signal_flag(conn, &conn->out_blocked, notify_core);
+}
+
+static void worker_await(struct io_conn *conn)
+{
+    int condition = 0;
+
+    if (is_open(conn)) {
+	if (out_ring_len(conn->out_ring) > 0)
+	    condition |= XCM_SO_SENDABLE;
+	if (in_ring_len(conn->in_ring) < IN_RING_CAPACITY)
+	    condition |= XCM_SO_RECEIVABLE;
+    }
+
+    if (condition != conn->condition) {
+	xcm_await(conn->sock, condition);
+	conn->condition = condition;
+    }
+}
+
+static void worker_process(struct io_conn *conn)
+{
+    worker_send(conn);
+    worker_receive(conn);
+    worker_await(conn);
+}
+
+static void sock_cb(int fd, short ev, void *cb_data)
+{
+    worker_process(cb_data);
+}
+
+static void worker_attach(struct io_worker *worker, struct io_conn *conn)
+{
+    TAILQ_INSERT_TAIL(&worker->conns, conn, entry);
+
+    event_assign(&conn->sock_event, worker->event_base,
+		 xcm_fd(conn->sock), EV_READ|EV_PERSIST, sock_cb, conn);
+    event_add(&conn->sock_event, NULL);
+
+    conn->condition = 0;
+}
+
+static void worker_mailbox_cb(int fd, short ev, void *cb_data)
+{
+    struct io_worker *worker = cb_data;
+
+    struct io_conn *conn = mailbox_take(&worker->mailbox);
+
+    while (conn != NULL) {
+	struct io_conn *next = conn->next[io_side_worker];
+
+	atomic_store(&conn->queued[io_side_worker], false);
+
+	if (atomic_load(&conn->closing))
+	    worker_detach(conn);
+	else if (conn->attached) {
+	    if (conn->condition < 0)
+		worker_attach(worker, conn);
+	    worker_process(conn);
+	}
+
+	conn_unref(conn);
+
+	conn = next;
+    }
+
+    if (atomic_load(&worker->stop))
+	event_base_loopbreak(worker->event_base);
+}
+
+static void *worker_run(void *arg)
+{
+    struct io_worker *worker = arg;
+
+    event_base_dispatch(worker->event_base);
+
+    return NULL;
+}
+
+static void core_mailbox_cb(int fd, short ev, void *cb_data)
+{
+    struct io_pool *pool = cb_data;
+
+    struct io_conn *conn = mailbox_take(&pool->mailbox);
+
+    while (conn != NULL) {
+	struct io_conn *next = conn->next[io_side_core];
+
+	atomic_store(&conn->queued[io_side_core], false);
+
+	if (!conn->core_closed)
+	    conn->ready_cb(conn->cb_data);
+
+	conn_unref(conn);
+
+	conn = next;
+    }
+}
+
+static int worker_init(struct io_worker *worker)
+{
+    worker->event_base = event_base_new();
+
+    if (worker->event_base == NULL)
+	return -1;
+
+    if (mailbox_init(&worker->mailbox, io_side_worker, worker->event_base,
+		     worker_mailbox_cb, worker) < 0) {
+	event_base_free(worker->event_base);
+	return -1;
+    }
+
+    atomic_init(&worker->stop, false);
+    TAILQ_INIT(&worker->conns);
+
+    return 0;
+}
+
+static void worker_deinit(struct io_worker *worker)
+{
+    struct io_conn *conn;
+
+    /* The core thread may still hold references to these */
+    while ((conn = TAILQ_FIRST(&worker->conns)) != NULL)
+	worker_detach(conn);
+
+    mailbox_deinit(&worker->mailbox);
+
+    event_base_free(worker->event_base);
+}
+
+struct io_pool *io_pool_create(struct event_base *event_base,
+			       size_t num_threads,
+			       const struct log_ctx *log_ctx)
+{
+    struct io_pool *pool = ut_calloc(sizeof(struct io_pool));
+
+    pool->log_ctx = log_ctx_create(log_ctx);
+
+    if (mailbox_init(&pool->mailbox, io_side_core, event_base,
+		     core_mailbox_cb, pool) < 0) {
+	log_error_c(pool->log_ctx, "Error creating I/O notification pipe: "
+		    "%s.", strerror(errno));
+	goto err_free;
+    }
+
+    pool->workers = ut_calloc(sizeof(struct io_worker) * num_threads);
+
+    for (; pool->num_workers < num_threads; pool->num_workers++)
+	if (worker_init(&pool->workers[pool->num_workers]) < 0) {
+	    log_error_c(pool->log_ctx, "Error creating I/O thread event "
+			"loop: %s.", strerror(errno));
+	    goto err_deinit;
+	}
+
+    return pool;
+
+err_deinit:
+    while (pool->num_workers > 0)
+	worker_deinit(&pool->workers[--pool->num_workers]);
+    ut_free(pool->workers);
+    mailbox_deinit(&pool->mailbox);
+err_free:
+    log_ctx_destroy(pool->log_ctx);
+    ut_free(pool);
+    return NULL;
+}
+
+static void stop_workers(struct io_pool *pool, size_t num)
+{
+    size_t i;
+
+    for (i = 0; i < num; i++) {
+	struct io_worker *worker = &pool->workers[i];
+
+	atomic_store(&worker->stop, true);
+
+	char c = 0;
+	ssize_t rc;
+	do {
+	    rc = write(worker->mailbox.fds[1], &c, 1);
+	} while (rc < 0 && errno == EINTR);
+
+	pthread_join(worker->thread, NULL);
+    }
+}
+
+void io_pool_destroy(struct io_pool *pool)
+{
+    if (pool != NULL) {
+	if (pool->running)
+	    stop_workers(pool, pool->num_workers);
+
+	size_t i;
+	for (i = 0; i < pool->num_workers; i++) {
+	    struct io_worker *worker = &pool->workers[i];
+	    struct io_conn *conn = mailbox_take(&worker->mailbox);
+
+	    /* Includes connections not yet seen by the I/O thread */
+	    while (conn != NULL) {
+		struct io_conn *next = conn->next[io_side_worker];
+		worker_detach(conn);
+		conn_unref(conn);
+		conn = next;
+	    }
+
+	    worker_deinit(worker);
+	}
+
+	struct io_conn *conn = mailbox_take(&pool->mailbox);
+
+	while (conn != NULL) {
+	    struct io_conn *next = conn->next[io_side_core];
+	    conn_unref(conn);
+	    conn = next;
+	}
+
+	mailbox_deinit(&pool->mailbox);
+
+	ut_free(pool->workers);
+	log_ctx_destroy(pool->log_ctx);
+	ut_free(pool);
+    }
+}
+
+int io_pool_start(struct io_pool *pool)
+{
+    ut_assert(!pool->running);
+
+    /* Signals are left to the main thread */
+    sigset_t all;
+    sigset_t orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &orig);
+
+    size_t i;
+    int rc = 0;
+
+    for (i = 0; i < pool->num_workers; i++) {
+	rc = pthread_create(&pool->workers[i].thread, NULL, worker_run,
+			    &pool->workers[i]);
+	if (rc != 0)
+	    break;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    if (rc != 0) {
+	log_error_c(pool->log_ctx, "Unable to create I/O thread: %s.",
+		    strerror(rc));
+	stop_workers(pool, i);
+	return -1;
+    }
+
+    pool->running = true;
+
+    log_debug_c(pool->log_ctx, "Started %zd I/O threads.", pool->num_workers);
+
+    return 0;
+}
+
+struct io_conn *io_conn_create(struct io_pool *pool,
+			       struct xcm_socket *sock,
+			       io_conn_cb ready_cb, void *cb_data)
+{
+    struct io_conn *conn = ut_calloc(sizeof(struct io_conn));
+
+    conn->pool = pool;
+    conn->worker = &pool->workers[pool->next_worker];
+    pool->next_worker = (pool->next_worker + 1) % pool->num_workers;
+
+    conn->remote_addr = ut_strdup_non_null(xcm_remote_addr(sock));
+    /* The I/O thread can't share the core's connection log context,
+       which changes, and may go away first. */
+    conn->log_ctx = log_ctx_create_prefix(pool->log_ctx, "<conn: %s> ",
+					  conn->remote_addr);
+    conn->ready_cb = ready_cb;
+    conn->cb_data = cb_data;
+
+    atomic_init(&conn->refs, 2);
+
+    conn->in_ring = in_ring_create(IN_RING_CAPACITY);
+    conn->out_ring = out_ring_create(OUT_RING_CAPACITY);
+
+    atomic_init(&conn->dict, NULL);
+    atomic_init(&conn->inflater, NULL);
+    atomic_init(&conn->status, STATUS_OPEN);
+    atomic_init(&conn->closing, false);
+    atomic_init(&conn->in_idle, true);
+    atomic_init(&conn->in_blocked, false);
+    atomic_init(&conn->out_idle, true);
+    atomic_init(&conn->out_blocked, false);
+    atomic_init(&conn->queued[io_side_core], false);
+    atomic_init(&conn->queued[io_side_worker], false);
+
+    conn->sock = sock;
+    conn->attached = true;
+    /* not yet attached to the worker's event loop */
+    conn->condition = -1;
+
+    /* The I/O thread takes over the socket when it sees the
+       connection in its mailbox. */
+    notify_worker(conn);
+
+    return conn;
+}
+
+void io_conn_close(struct io_conn *conn)
+{
+    if (conn != NULL) {
+	conn->core_closed = true;
+
+	atomic_store(&conn->closing, true);
+
+	notify_worker(conn);
+
+	conn_unref(conn);
+    }
+}
+
+int io_conn_receive(struct io_conn *conn, json_t **req)
+{
+    /* Requests are queued before the status changes */
+    int status = atomic_load(&conn->status);
+
+    json_t *msg = in_ring_pop(conn->in_ring);
+
+    if (msg == NULL && status == STATUS_OPEN) {
+	set_flag(&conn->in_idle);
+	msg = in_ring_pop(conn->in_ring);
+    }
+
+    if (msg != NULL) {
+	signal_flag(conn, &conn->in_blocked, notify_worker);
+	*req = msg;
+	return 1;
+    }
+
+    if (status == 0)
+	return 0;
+
+    errno = status == STATUS_OPEN ? EAGAIN : status;
+    return -1;
+}
+
+void io_conn_set_inflater(struct io_conn *conn, struct inflater *inflater)
+{
+    atomic_store(&conn->inflater, inflater);
+}
+
+void io_conn_set_dict(struct io_conn *conn, struct proto_dict *dict)
+{
+    proto_dict_inc_ref(dict);
+
+    atomic_store(&conn->dict, dict);
+}
+
+bool io_conn_has_input(struct io_conn *conn)
+{
+    return in_ring_len(conn->in_ring) > 0 || !is_open(conn);
+}
+
+int io_conn_send(struct io_conn *conn, struct msg *msg)
+{
+    int status = atomic_load(&conn->status);
+
+    if (status != STATUS_OPEN) {
+	errno = status > 0 ? status : EPIPE;
+	return -1;
+    }
+
+    if (!out_ring_push(conn->out_ring, msg)) {
+	set_flag(&conn->out_blocked);
+
+	if (!out_ring_push(conn->out_ring, msg)) {
+	    errno = EAGAIN;
+	    return -1;
+	}
+    }
+
+    signal_flag(conn, &conn->out_idle, notify_worker);
+
+    return 0;
+}
+
+const char *io_conn_remote_addr(struct io_conn *conn)
+{
+    return conn->remote_addr;
+}
@@ -0,0 +1,68 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <event.h>
+#include <jansson.h>
+#include <xcm.h>
+
+#include "log.h"
+#include "compr.h"
+#include "msg.h"
+#include "proto_bin.h"
+
+/* A pool of I/O threads, doing XCM socket I/O and request decoding
+   on behalf of a domain's (single-threaded) core.
+
+   Each connection is served by one of the pool's threads, which is
+   the sole user of the connection's XCM socket. Decoded requests
+   and encoded messages are passed between the core and the I/O
+   thread over lock-free rings. All functions below are to be called
+   from the core thread. */
+struct io_pool;
+struct io_conn;
+
+struct io_pool *io_pool_create(struct event_base *event_base,
+			       size_t num_threads,
+			       const struct log_ctx *log_ctx);
+void io_pool_destroy(struct io_pool *pool);
+
+int io_pool_start(struct io_pool *pool);
+
+/* Called (from the core thread) when the connection has become
+   receivable or sendable, or has failed. */
+typedef void (*io_conn_cb)(void *cb_data);
+
+/* Takes ownership of the socket. */
+struct io_conn *io_conn_create(struct io_pool *pool,
+			       struct xcm_socket *sock,
+			       io_conn_cb ready_cb, void *cb_data);
+void io_conn_close(struct io_conn *conn);
+
+/* Semantics as per xcm_receive(), except a decoded request message,
+   owned by the caller, is returned. */
+int io_conn_receive(struct io_conn *conn, json_t **req);
+
+/* Enables the decoding of binary requests, using the dictionary
+   'dict'. May be called at most once. */
+void io_conn_set_dict(struct io_conn *conn, struct proto_dict *dict);
+
+/* Makes the I/O thread decompress all requests received from now
+   on, and hands over the ownership of the inflater. May be called at
+   most once. */
+void io_conn_set_inflater(struct io_conn *conn, struct inflater *inflater);
+
+/* True if io_conn_receive() would not fail with EAGAIN. */
+bool io_conn_has_input(struct io_conn *conn);
+
+/* Semantics as per xcm_send(). On success, the connection takes
+   ownership of the message. */
+int io_conn_send(struct io_conn *conn, struct msg *msg);
+
+const char *io_conn_remote_addr(struct io_conn *conn);
+
+#endif
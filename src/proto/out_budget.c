@@ -0,0 +1,85 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "log.h"
+#include "util.h"
+
+#include "out_budget.h"
+
+struct out_budget
+{
+    size_t soft_limit;
+    size_t hard_limit;
+    size_t used;
+
+    struct log_ctx *log_ctx;
+};
+
+struct out_budget *out_budget_create(const struct log_ctx *log_ctx,
+				     size_t soft_limit, size_t hard_limit)
+{
+    struct out_budget *budget = ut_malloc(sizeof(struct out_budget));
+
+    *budget = (struct out_budget) {
+	.soft_limit = soft_limit,
+	.hard_limit = hard_limit,
+	.log_ctx = log_ctx_create(log_ctx)
+    };
+
+    return budget;
+}
+
+void out_budget_destroy(struct out_budget *budget)
+{
+    if (budget != NULL) {
+	log_ctx_destroy(budget->log_ctx);
+	ut_free(budget);
+    }
+}
+
+static bool exceeds(size_t used, size_t limit)
+{
+    return limit > 0 && used > limit;
+}
+
+void out_budget_add(struct out_budget *budget, size_t bytes)
+{
+    bool was_exceeded = out_budget_is_soft_exceeded(budget);
+
+    budget->used += bytes;
+
+    if (!was_exceeded && out_budget_is_soft_exceeded(budget))
+	log_warn_c(budget->log_ctx, "Output queues hold %zd bytes, which "
+		   "exceeds the domain soft limit of %zd bytes.",
+		   budget->used, budget->soft_limit);
+}
+
+void out_budget_sub(struct out_budget *budget, size_t bytes)
+{
+    ut_assert(budget->used >= bytes);
+
+    bool was_exceeded = out_budget_is_soft_exceeded(budget);
+
+    budget->used -= bytes;
+
+    if (was_exceeded && !out_budget_is_soft_exceeded(budget))
+	log_info_c(budget->log_ctx, "Output queues are back below the "
+		   "domain soft limit.");
+}
+
+size_t out_budget_used(const struct out_budget *budget)
+{
+    return budget->used;
+}
+
+bool out_budget_is_soft_exceeded(const struct out_budget *budget)
+{
+    return exceeds(budget->used, budget->soft_limit);
+}
+
+bool out_budget_is_hard_exceeded(const struct out_budget *budget)
+{
+    return exceeds(budget->used, budget->hard_limit);
+}
@@ -0,0 +1,30 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef OUT_BUDGET_H
+#define OUT_BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct log_ctx;
+
+/* Keeps track of the amount of memory held by a domain's protocol
+   connection output queues. A limit of zero means no limit. */
+struct out_budget;
+
+struct out_budget *out_budget_create(const struct log_ctx *log_ctx,
+				     size_t soft_limit, size_t hard_limit);
+void out_budget_destroy(struct out_budget *budget);
+
+void out_budget_add(struct out_budget *budget, size_t bytes);
+void out_budget_sub(struct out_budget *budget, size_t bytes);
+
+size_t out_budget_used(const struct out_budget *budget);
+
+bool out_budget_is_soft_exceeded(const struct out_budget *budget);
+bool out_budget_is_hard_exceeded(const struct out_budget *budget);
+
+#endif
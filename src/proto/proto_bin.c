@@ -0,0 +1,372 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#include "proto_bin.h"
+
+bool proto_bin_is_bin(const void *data, size_t len)
+{
+    return len > 0 && ((const uint8_t *)data)[0] == PROTO_BIN_MAGIC;
+}
+
+struct dict_entry
+{
+    const char *name;
+    uint32_t idx;
+};
+
+struct proto_dict
+{
+    char **names;
+    size_t num_names;
+    /* in name order, for lookups */
+    struct dict_entry *sorted;
+    atomic_int ref_cnt;
+};
+
+static int cmp_entry(const void *a, const void *b)
+{
+    const struct dict_entry *entry_a = a;
+    const struct dict_entry *entry_b = b;
+
+    return strcmp(entry_a->name, entry_b->name);
+}
+
+struct proto_dict *proto_dict_create(const char **names, size_t num_names)
+{
+    struct proto_dict *dict = ut_malloc(sizeof(struct proto_dict));
+
+    *dict = (struct proto_dict) {
+	.names = ut_malloc(sizeof(char *) * (num_names + 1)),
+	.num_names = num_names,
+	.sorted = ut_malloc(sizeof(struct dict_entry) * (num_names + 1))
+    };
+
+    atomic_init(&dict->ref_cnt, 1);
+
+    size_t i;
+    for (i = 0; i < num_names; i++) {
+	dict->names[i] = ut_strdup(names[i]);
+	dict->sorted[i] = (struct dict_entry) {
+	    .name = dict->names[i],
+	    .idx = i
+	};
+    }
+
+    qsort(dict->sorted, num_names, sizeof(struct dict_entry), cmp_entry);
+
+    return dict;
+}
+
+void proto_dict_inc_ref(struct proto_dict *dict)
+{
+    atomic_fetch_add(&dict->ref_cnt, 1);
+}
+
+void proto_dict_dec_ref(struct proto_dict *dict)
+{
+    if (dict == NULL || atomic_fetch_sub(&dict->ref_cnt, 1) > 1)
+	return;
+
+    size_t i;
+    for (i = 0; i < dict->num_names; i++)
+	ut_free(dict->names[i]);
+
+    ut_free(dict->names);
+    ut_free(dict->sorted);
+    ut_free(dict);
+}
+
+const char *proto_dict_name(const struct proto_dict *dict, uint32_t idx)
+{
+    if (dict == NULL || idx >= dict->num_names)
+	return NULL;
+
+    return dict->names[idx];
+}
+
+/* Returns -1 if the name isn't in the dictionary. Of duplicate
+   names, any one is used. */
+static int64_t dict_lookup(const struct proto_dict *dict, const char *name)
+{
+    struct dict_entry key = {
+	.name = name
+    };
+    const struct dict_entry *entry =
+	bsearch(&key, dict->sorted, dict->num_names,
+		sizeof(struct dict_entry), cmp_entry);
+
+    return entry != NULL ? (int64_t)entry->idx : -1;
+}
+
+#define INITIAL_CAPACITY 256
+
+void proto_bin_writer_init(struct proto_bin_writer *writer)
+{
+    *writer = (struct proto_bin_writer) {
+	.data = ut_malloc(INITIAL_CAPACITY),
+	.capacity = INITIAL_CAPACITY
+    };
+}
+
+struct msg *proto_bin_writer_morph(struct proto_bin_writer *writer)
+{
+    struct msg *msg = msg_create_prealloc(writer->data, writer->len);
+
+    writer->data = NULL;
+
+    return msg;
+}
+
+static void write_bytes(struct proto_bin_writer *writer, const void *data,
+			size_t len)
+{
+    if (writer->len + len > writer->capacity) {
+	while (writer->len + len > writer->capacity)
+	    writer->capacity *= 2;
+	writer->data = ut_realloc(writer->data, writer->capacity);
+    }
+
+    memcpy(writer->data + writer->len, data, len);
+    writer->len += len;
+}
+
+void proto_bin_write_u8(struct proto_bin_writer *writer, uint8_t value)
+{
+    write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_le(struct proto_bin_writer *writer, uint64_t value,
+		     size_t len)
+{
+    uint8_t bytes[sizeof(uint64_t)];
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	bytes[i] = (value >> (8 * i)) & 0xff;
+
+    write_bytes(writer, bytes, len);
+}
+
+void proto_bin_write_u32(struct proto_bin_writer *writer, uint32_t value)
+{
+    write_le(writer, value, sizeof(uint32_t));
+}
+
+void proto_bin_write_i64(struct proto_bin_writer *writer, int64_t value)
+{
+    write_le(writer, (uint64_t)value, sizeof(uint64_t));
+}
+
+void proto_bin_write_f64(struct proto_bin_writer *writer, double value)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+
+    write_le(writer, bits, sizeof(uint64_t));
+}
+
+void proto_bin_write_str(struct proto_bin_writer *writer, const char *str,
+			 size_t len)
+{
+    proto_bin_write_u32(writer, len);
+    write_bytes(writer, str, len);
+}
+
+struct props_param
+{
+    struct proto_bin_writer *writer;
+    const struct proto_dict *dict;
+};
+
+static bool write_prop(const char *prop_name, const struct pvalue *prop_value,
+		       void *user)
+{
+    struct props_param *param = user;
+    int64_t idx = param->dict != NULL ?
+	dict_lookup(param->dict, prop_name) : -1;
+
+    if (idx >= 0)
+	proto_bin_write_u32(param->writer, PROTO_BIN_DICT_REF | idx);
+    else
+	proto_bin_write_str(param->writer, prop_name, strlen(prop_name));
+
+    if (pvalue_is_int64(prop_value)) {
+	proto_bin_write_u8(param->writer, PROTO_BIN_INT64);
+	proto_bin_write_i64(param->writer, pvalue_int64(prop_value));
+    } else {
+	const char *str = pvalue_str(prop_value);
+
+	proto_bin_write_u8(param->writer, PROTO_BIN_STR);
+	proto_bin_write_str(param->writer, str, strlen(str));
+    }
+
+    return true;
+}
+
+void proto_bin_write_props(struct proto_bin_writer *writer,
+			   const struct proto_dict *dict,
+			   const struct props *props)
+{
+    struct props_param param = {
+	.writer = writer,
+	.dict = dict
+    };
+
+    proto_bin_write_u32(writer, props_num_values(props));
+
+    props_foreach(props, write_prop, &param);
+}
+
+void proto_bin_reader_init(struct proto_bin_reader *reader, const void *data,
+			   size_t len)
+{
+    *reader = (struct proto_bin_reader) {
+	.data = data,
+	.len = len
+    };
+}
+
+bool proto_bin_reader_at_end(const struct proto_bin_reader *reader)
+{
+    return reader->offset == reader->len;
+}
+
+static const uint8_t *read_bytes(struct proto_bin_reader *reader, size_t len)
+{
+    if (len > reader->len - reader->offset)
+	return NULL;
+
+    const uint8_t *bytes = reader->data + reader->offset;
+
+    reader->offset += len;
+
+    return bytes;
+}
+
+static int read_le(struct proto_bin_reader *reader, uint64_t *value,
+		   size_t len)
+{
+    const uint8_t *bytes = read_bytes(reader, len);
+
+    if (bytes == NULL)
+	return -1;
+
+    uint64_t v = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	v |= (uint64_t)bytes[i] << (8 * i);
+
+    *value = v;
+
+    return 0;
+}
+
+int proto_bin_read_u8(struct proto_bin_reader *reader, uint8_t *value)
+{
+    const uint8_t *bytes = read_bytes(reader, sizeof(uint8_t));
+
+    if (bytes == NULL)
+	return -1;
+
+    *value = bytes[0];
+
+    return 0;
+}
+
+int proto_bin_read_u32(struct proto_bin_reader *reader, uint32_t *value)
+{
+    uint64_t v;
+
+    if (read_le(reader, &v, sizeof(uint32_t)) < 0)
+	return -1;
+
+    *value = v;
+
+    return 0;
+}
+
+int proto_bin_read_i64(struct proto_bin_reader *reader, int64_t *value)
+{
+    uint64_t v;
+
+    if (read_le(reader, &v, sizeof(uint64_t)) < 0)
+	return -1;
+
+    *value = (int64_t)v;
+
+    return 0;
+}
+
+int proto_bin_read_f64(struct proto_bin_reader *reader, double *value)
+{
+    uint64_t bits;
+
+    if (read_le(reader, &bits, sizeof(uint64_t)) < 0)
+	return -1;
+
+    memcpy(value, &bits, sizeof(bits));
+
+    return 0;
+}
+
+int proto_bin_read_str(struct proto_bin_reader *reader, const char **str,
+		       size_t *len)
+{
+    uint32_t str_len;
+
+    if (proto_bin_read_u32(reader, &str_len) < 0)
+	return -1;
+
+    const uint8_t *bytes = read_bytes(reader, str_len);
+
+    if (bytes == NULL)
+	return -1;
+
+    *str = (const char *)bytes;
+    *len = str_len;
+
+    return 0;
+}
+
+int proto_bin_read_name(struct proto_bin_reader *reader,
+			const struct proto_dict *dict, const char **name,
+			size_t *len)
+{
+    uint32_t prefix;
+
+    if (proto_bin_read_u32(reader, &prefix) < 0)
+	return -1;
+
+    if (prefix & PROTO_BIN_DICT_REF) {
+	const char *dict_name =
+	    proto_dict_name(dict, prefix & ~PROTO_BIN_DICT_REF);
+
+	if (dict_name == NULL)
+	    return -1;
+
+	*name = dict_name;
+	*len = strlen(dict_name);
+
+	return 0;
+    }
+
+    const uint8_t *bytes = read_bytes(reader, prefix);
+
+    if (bytes == NULL)
+	return -1;
+
+    *name = (const char *)bytes;
+    *len = prefix;
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef PROTO_BIN_H
+#define PROTO_BIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "msg.h"
+#include "props.h"
+
+/* A compact binary encoding of the Pathfinder protocol messages,
+   which a client may switch to in the hello handshake.
+
+   message  := MAGIC u8:msg-type u8:cmd i64:ta-id field*
+   field    := u8:tag value
+   envelope := MAGIC u8:ENVELOPE (u32:len message)*
+
+   The message type is one of request (0), accept (1), notify (2),
+   complete (3) and fail (4). The command is the index of the
+   transaction type in the protocol's table of types. The tag is the
+   index of the field among the fields of the message type in
+   question, followed by its optional fields.
+
+   Integers are in little-endian byte order, and numbers are IEEE 754
+   doubles. Strings, and array fields (in JSON), are prefixed by a u32
+   length. Properties are encoded as a u32 number of values, each
+   consisting of a name and a u8 type followed by an i64 (type 0) or
+   a string (type 1). A name is a u32 length followed by the name
+   itself, or, with the most significant bit set, an index into the
+   connection's dictionary of property names. */
+
+#define PROTO_BIN_MAGIC 0xb2
+#define PROTO_BIN_ENVELOPE 5
+
+#define PROTO_BIN_INT64 0
+#define PROTO_BIN_STR 1
+
+#define PROTO_BIN_DICT_REF (UINT32_C(1) << 31)
+
+/* JSON messages never start with the magic byte */
+bool proto_bin_is_bin(const void *data, size_t len);
+
+/* An immutable property name dictionary, shared by the threads
+   encoding and decoding a connection's messages */
+struct proto_dict;
+
+struct proto_dict *proto_dict_create(const char **names, size_t num_names);
+void proto_dict_inc_ref(struct proto_dict *dict);
+void proto_dict_dec_ref(struct proto_dict *dict);
+
+/* Returns NULL if there's no such index */
+const char *proto_dict_name(const struct proto_dict *dict, uint32_t idx);
+
+struct proto_bin_writer
+{
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+};
+
+void proto_bin_writer_init(struct proto_bin_writer *writer);
+/* Turns the written data into a message */
+struct msg *proto_bin_writer_morph(struct proto_bin_writer *writer);
+
+void proto_bin_write_u8(struct proto_bin_writer *writer, uint8_t value);
+void proto_bin_write_u32(struct proto_bin_writer *writer, uint32_t value);
+void proto_bin_write_i64(struct proto_bin_writer *writer, int64_t value);
+void proto_bin_write_f64(struct proto_bin_writer *writer, double value);
+void proto_bin_write_str(struct proto_bin_writer *writer, const char *str,
+			 size_t len);
+/* 'dict' may be NULL */
+void proto_bin_write_props(struct proto_bin_writer *writer,
+			   const struct proto_dict *dict,
+			   const struct props *props);
+
+struct proto_bin_reader
+{
+    const uint8_t *data;
+    size_t len;
+    size_t offset;
+};
+
+void proto_bin_reader_init(struct proto_bin_reader *reader, const void *data,
+			   size_t len);
+bool proto_bin_reader_at_end(const struct proto_bin_reader *reader);
+
+/* The read functions return -1 if the data is truncated. */
+int proto_bin_read_u8(struct proto_bin_reader *reader, uint8_t *value);
+int proto_bin_read_u32(struct proto_bin_reader *reader, uint32_t *value);
+int proto_bin_read_i64(struct proto_bin_reader *reader, int64_t *value);
+int proto_bin_read_f64(struct proto_bin_reader *reader, double *value);
+/* The string is not NUL-terminated, and remains owned by the
+   reader's data. */
+int proto_bin_read_str(struct proto_bin_reader *reader, const char **str,
+		       size_t *len);
+/* Returns -1 also if the name refers to a non-existent dictionary
+   entry. 'dict' may be NULL. */
+int proto_bin_read_name(struct proto_bin_reader *reader,
+			const struct proto_dict *dict, const char **name,
+			size_t *len);
+
+#endif
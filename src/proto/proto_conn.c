@@ -4,8 +4,11 @@
  */
 
 #include <string.h>
+#include <sys/queue.h>
 
 #include "client.h"
+#include "compr.h"
+#include "io_pool.h"
 #include "log.h"
 #include "msg.h"
 #include "pqueue.h"
@@ -15,18 +18,121 @@
 
 #include "proto_conn.h"
 
-PQUEUE_GEN_WRAPPER_DEF(msg_queue, struct msg_queue, struct msg,
+/* Notifications of several subscriptions of a session, caused by the
+   same service change, which are sent as one message */
+struct notify_group
+{
+    int64_t service_id;
+    /* a copy of the state notified, or NULL if the service
+       disappeared for all subscriptions */
+    struct service *service;
+    int64_t session_id;
+    struct proto_group_match *matches;
+    size_t num_matches;
+    /* the message doesn't yet cover all matches */
+    bool stale;
+};
+
+/* Tells the service states notifications carry apart. All
+   "disappeared" notifications of a service are alike, since they
+   carry no state. */
+struct group_key
+{
+    int64_t service_id;
+    bool disappeared;
+    int64_t generation;
+    int64_t client_id;
+    bool orphan;
+    double orphan_since;
+};
+
+struct out_msg
+{
+    /* NULL if the message has been dropped while queued */
+    struct msg *msg;
+    /* The subscription a notification belongs to, or -1 */
+    int64_t sub_id;
+    int64_t service_id;
+    enum sub_match_type match_type;
+    /* queued before compression was enabled */
+    bool plain;
+    /* for a group notification, its matches */
+    struct notify_group *group;
+};
+
+PQUEUE_GEN_WRAPPER_DEF(out_queue, struct out_queue, struct out_msg,
 		       static __attribute__((unused)))
 
+/* The most recent not-yet-sent notification, per service id, for a
+   particular subscription */
+PMAP_GEN_WRAPPER_DEF(pending_map, struct pending_map, int64_t,
+		     struct out_msg, static __attribute__((unused)))
+
+/* Pending notifications, per subscription id */
+PMAP_GEN_WRAPPER_DEF(sub_pending_map, struct sub_pending_map, int64_t,
+		     struct pending_map, static __attribute__((unused)))
+
 PMAP_GEN_WRAPPER_DEF(proto_ta_map, struct proto_ta_map, int64_t,
 		     struct proto_ta, static __attribute__((unused)))
 
+/* A subscription whose client is kept informed of the change
+   sequence number it's up to date with, so it may later resume the
+   subscription from there. */
+struct resumable
+{
+    /* markers are issued by the syncs started after this one */
+    int64_t sync_after;
+    int64_t synced_seq;
+};
+
+/* An operation of a batch request, awaiting its result */
+struct batch_op
+{
+    struct batch *batch;
+    size_t idx;
+};
+
+PMAP_GEN_WRAPPER_DEF(batch_op_map, struct batch_op_map, int64_t,
+		     struct batch_op, static __attribute__((unused)))
+
+PMAP_GEN_WRAPPER_DEF(resumable_map, struct resumable_map, int64_t,
+		     struct resumable, static __attribute__((unused)))
+
+TAILQ_HEAD(conn_queue, proto_conn);
+
+/* A connection's multiplexed sessions, per session id */
+PMAP_GEN_WRAPPER_DEF(session_map, struct session_map, int64_t,
+		     struct proto_conn, static __attribute__((unused)))
+
+struct proto_sched
+{
+    struct event_base *event_base;
+    struct out_budget *budget;
+    struct event run_event;
+    /* connections with work to do, in round-robin order */
+    struct conn_queue runnable;
+    size_t num_runnable;
+    bool running;
+};
+
+/* With multiplexing, every client session but the connection's
+   primary one is a proto_conn of its own, sharing the socket, the
+   output queues and the scheduling of the primary session's
+   'transport'. The fields marked "transport" are only used by the
+   primary session. */
 struct proto_conn
 {
+    /* With I/O threads, the socket is owned by 'io' (transport) */
     struct xcm_socket *sock;
     struct event sock_event;
-    struct sd *sd;
+    struct io_conn *io;
+    struct shards *shards;
+    struct query_pool *query_pool;
+    struct upstream *upstream;
     struct event_base *event_base;
+    struct proto_conn_conf conf;
+    struct out_budget *budget;
+    struct proto_sched *sched;
     struct log_ctx *log_ctx;
     proto_conn_cb handshake_cb;
     proto_conn_cb term_cb;
@@ -36,43 +142,513 @@ struct proto_conn
 
     int64_t client_id;
 
+    /* For a multiplexed session, the primary session, and NULL
+       otherwise */
+    struct proto_conn *transport;
+    int64_t session_id;
+    /* the session was closed by its client */
+    bool closed;
+    /* the multiplexed sessions (transport) */
+    struct session_map *sessions;
+
+    /* the protocol extensions enabled, as per 'ext_names' */
+    unsigned extensions;
+    /* with the binary encoding enabled, the client's property name
+       dictionary (possibly empty) */
+    struct proto_dict *dict;
+
+    /* with compression enabled, the (de)compression contexts of the
+       connection (transport). With I/O threads, the inflater is
+       owned, and used, by 'io'. */
+    struct deflater *deflater;
+    struct inflater *inflater;
+    /* a message compressed, but not yet sent */
+    struct msg *deflated;
+
     struct proto_ta_map *sub_tas;
 
-    struct msg_queue *out_queue;
+    /* Transactions awaiting an sd result, per operation id */
+    struct proto_ta_map *pending_tas;
+    int64_t next_op_id;
+
+    /* Batch operations awaiting an sd result, per operation id */
+    struct batch_op_map *batch_ops;
+
+    /* Listings being run by the query pool */
+    size_t num_queries;
+
+    /* Replies to requests, which are kept from waiting behind the
+       (potentially very long) notification streams (transport) */
+    struct out_queue *high_queue;
+    /* Messages of multi-response transactions */
+    struct out_queue *bulk_queue;
+    /* With subscription groups, the notification at the tail of the
+       bulk lane, if later notifications of the same session and
+       service state may join it */
+    struct out_msg *group_tail;
+    struct proto_conn *group_session;
+    struct group_key group_key;
+    /* Number of high-lane messages sent in a row, with bulk-lane
+       messages waiting */
+    unsigned high_streak;
+    size_t out_bytes;
+
+    struct sub_pending_map *pending_notifications;
+
+    struct resumable_map *resumables;
+    /* the number of syncs started, and the change sequence number
+       the latest one is waiting for */
+    int64_t num_syncs;
+    int64_t sync_seq;
+    bool syncing;
+    /* a sync was requested while another was in progress */
+    bool sync_again;
+    struct event sync_timer;
+
+    /* above the soft output limit */
+    bool slow;
+    /* above the hard output limit, with the slow-consumer policy
+       not yet applied */
+    bool overloaded;
+    struct event overload_event;
+
+    /* the currently awaited XCM socket condition */
+    int condition;
+    struct event flush_event;
+
+    bool runnable;
+    TAILQ_ENTRY(proto_conn) runnable_entry;
+    /* may have more requests to read */
+    bool receive_pending;
+    /* deficit round-robin send allowance, in bytes */
+    size_t deficit;
 
     bool term;
 };
 
+/* The protocol extensions supported, in the order of their bits in
+   the connection's 'extensions' */
+static const char *ext_names[] = {
+    PROTO_EXT_BATCH,
+    PROTO_EXT_ENVELOPE,
+    PROTO_EXT_DELTA,
+    PROTO_EXT_BINARY,
+    PROTO_EXT_DEFLATE,
+    PROTO_EXT_MUX,
+    PROTO_EXT_GROUP
+};
+
+#define EXT_BATCH (1U << 0)
+#define EXT_ENVELOPE (1U << 1)
+#define EXT_DELTA (1U << 2)
+#define EXT_BINARY (1U << 3)
+#define EXT_DEFLATE (1U << 4)
+#define EXT_MUX (1U << 5)
+#define EXT_GROUP (1U << 6)
+
 static bool has_finished_handshake(struct proto_conn *conn)
 {
     return conn->client_id >= 0;
 }
 
-#define MAX_SEND_BATCH 64
-#define MAX_RECEIVE_BATCH 4
+static struct proto_conn *transport_of(struct proto_conn *conn)
+{
+    return conn->transport != NULL ? conn->transport : conn;
+}
+
+/* Work allowed per scheduler run, across all of a domain's
+   connections. The per-connection share adapts to the number of
+   connections with work to do. */
+#define SCHED_RECEIVE_BUDGET 256
+#define SCHED_SEND_BUDGET (1024 * 1024)
+
+/* Amount of queued output across the domain beyond which requests
+   are processed one per connection and run. */
+#define SCHED_MAX_BACKLOG (256 * 1024)
+
+#define MIN_RECEIVE_BATCH 1
+#define MAX_RECEIVE_BATCH 32
+
+#define MIN_SEND_QUANTUM (16 * 1024)
+
 #define SOFT_OUT_WIRE_LIMIT 128
 
-static void await_update(struct proto_conn *conn)
+/* Bulk messages are guaranteed at least one in this many slots */
+#define MAX_HIGH_STREAK 16
+
+/* For clients having enabled envelopes, consecutive bulk-lane
+   messages are sent packed into envelopes of at most this size */
+#define MAX_ENVELOPE_SIZE 65535
+
+#define ENVELOPE_HEAD \
+    "{\"" PROTO_FIELD_MSG_TYPE "\":\"" PROTO_MSG_TYPE_ENVELOPE "\",\"" \
+    PROTO_FIELD_MESSAGES "\":["
+#define ENVELOPE_TAIL "]}"
+
+/* the magic and message type bytes */
+#define BIN_ENVELOPE_HEAD_LEN 2
+
+#define MAX_DICT_NAMES 4096
+
+/* Multiplexed sessions per connection, besides the primary one */
+#define MAX_SESSIONS 1024
+
+/* Interval between change sequence markers, for resumable
+   subscriptions, while services change */
+#define SYNC_INTERVAL 1.0
+
+static size_t out_len(struct proto_conn *conn)
+{
+    return out_queue_len(conn->high_queue) +
+	out_queue_len(conn->bulk_queue) + (conn->deflated != NULL ? 1 : 0);
+}
+
+/* Only replies count toward the wire limit, since notification
+   backlogs are bounded by the output limits, and shouldn't stop
+   the client's requests from being served. */
+static bool may_receive(struct proto_conn *conn)
+{
+    return out_queue_len(conn->high_queue) < SOFT_OUT_WIRE_LIMIT &&
+	!conn->slow;
+}
+
+static void sched_add(struct proto_sched *sched, struct proto_conn *conn);
+
+static void set_condition(struct proto_conn *conn)
 {
     int condition = 0;
 
     if (!conn->term) {
-	if (msg_queue_len(conn->out_queue) > 0)
+	if (out_len(conn) > 0)
 	    condition |= XCM_SO_SENDABLE;
 
 	/* Let client consume responses before accepting more work */
-	if (msg_queue_len(conn->out_queue) < SOFT_OUT_WIRE_LIMIT)
+	if (may_receive(conn))
 	    condition |= XCM_SO_RECEIVABLE;
     }
 
-    xcm_await(conn->sock, condition);
+    if (conn->io != NULL) {
+	/* Requests held back by the I/O thread are not signaled
+	   again, once the connection is ready to receive them. */
+	if ((condition & XCM_SO_RECEIVABLE) && io_conn_has_input(conn->io))
+	    sched_add(conn->sched, conn);
+	return;
+    }
+
+    if (condition != conn->condition) {
+	xcm_await(conn->sock, condition);
+	conn->condition = condition;
+    }
+}
+
+/* The XCM socket condition is updated at most once per event loop
+   iteration, regardless of how many messages are queued. */
+static void await_update(struct proto_conn *conn)
+{
+    event_active(&conn->flush_event, 0, 0);
+}
+
+static bool exceeds(size_t bytes, size_t limit)
+{
+    return limit > 0 && bytes > limit;
 }
 
-static void queue_response(struct proto_conn *conn, struct msg *msg)
+static void check_out_limits(struct proto_conn *conn)
 {
-    msg_queue_push(conn->out_queue, msg);
+    if (!conn->slow && exceeds(conn->out_bytes, conn->conf.soft_out_limit)) {
+	log_warn_c(conn->log_ctx, "Slow consumer: %zd messages (%zd bytes) "
+		   "queued for transmission.", out_len(conn),
+		   conn->out_bytes);
+	conn->slow = true;
+    }
+
+    if (conn->overloaded)
+	return;
+
+    bool conn_hard = exceeds(conn->out_bytes, conn->conf.hard_out_limit);
+    /* When the domain as a whole runs out of budget, the
+       connections already identified as slow are the ones to go. */
+    bool domain_hard = conn->slow && out_budget_is_hard_exceeded(conn->budget);
+
+    if (conn_hard || domain_hard) {
+	log_warn_c(conn->log_ctx, "Output queue of %zd bytes exceeds the "
+		   "%s hard limit.", conn->out_bytes,
+		   conn_hard ? "connection" : "domain");
+	conn->overloaded = true;
+	/* The policy can't be applied here, since this function may be
+	   called deep inside the sd module. */
+	event_active(&conn->overload_event, 0, 0);
+    }
+}
+
+static void account_queued(struct proto_conn *conn, struct msg *msg)
+{
+    size_t len = msg_len(msg);
+
+    conn->out_bytes += len;
+    out_budget_add(conn->budget, len);
+
+    check_out_limits(conn);
+}
+
+static void account_dequeued(struct proto_conn *conn, size_t len)
+{
+    conn->out_bytes -= len;
+    out_budget_sub(conn->budget, len);
+
+    if (conn->slow && !exceeds(conn->out_bytes, conn->conf.soft_out_limit)) {
+	log_info_c(conn->log_ctx, "Consumer caught up with output queue.");
+	conn->slow = false;
+    }
+}
+
+static void finish_group(struct proto_conn *conn);
+
+static struct out_msg *queue_msg(struct proto_conn *conn,
+				 struct out_queue *queue, struct msg *msg,
+				 int64_t sub_id)
+{
+    /* Nothing may join a group notification queued behind */
+    if (queue == conn->bulk_queue) {
+	finish_group(conn);
+	conn->group_tail = NULL;
+    }
+
+    struct out_msg *out_msg = ut_malloc(sizeof(struct out_msg));
+
+    *out_msg = (struct out_msg) {
+	.msg = msg,
+	.sub_id = sub_id,
+	.service_id = -1,
+	.plain = conn->deflater == NULL
+    };
+
+    out_queue_push(queue, out_msg);
+
+    account_queued(conn, msg);
 
     await_update(conn);
+
+    return out_msg;
+}
+
+static struct out_msg *get_pending(struct proto_conn *conn, int64_t sub_id,
+				   int64_t service_id)
+{
+    struct pending_map *pending =
+	sub_pending_map_get(conn->pending_notifications, sub_id);
+
+    if (pending == NULL)
+	return NULL;
+
+    return pending_map_get(pending, service_id);
+}
+
+static void index_pending(struct proto_conn *conn, struct out_msg *out_msg)
+{
+    struct pending_map *pending =
+	sub_pending_map_get(conn->pending_notifications, out_msg->sub_id);
+
+    if (pending == NULL) {
+	pending = pending_map_create();
+	sub_pending_map_add(conn->pending_notifications, out_msg->sub_id,
+			    pending);
+    } else if (pending_map_has_key(pending, out_msg->service_id))
+	pending_map_del(pending, out_msg->service_id);
+
+    pending_map_add(pending, out_msg->service_id, out_msg);
+}
+
+static void unindex_pending(struct proto_conn *conn, struct out_msg *out_msg)
+{
+    struct pending_map *pending =
+	sub_pending_map_get(conn->pending_notifications, out_msg->sub_id);
+
+    /* Only the most recent notification is indexed, and a
+       subscription's index is removed when it's terminated */
+    if (pending == NULL ||
+	pending_map_get(pending, out_msg->service_id) != out_msg)
+	return;
+
+    pending_map_del(pending, out_msg->service_id);
+
+    if (pending_map_size(pending) == 0) {
+	sub_pending_map_del(conn->pending_notifications, out_msg->sub_id);
+	pending_map_destroy(pending);
+    }
+}
+
+static void unindex_sub(struct proto_conn *conn, int64_t sub_id)
+{
+    struct pending_map *pending =
+	sub_pending_map_get(conn->pending_notifications, sub_id);
+
+    if (pending != NULL) {
+	sub_pending_map_del(conn->pending_notifications, sub_id);
+	pending_map_destroy(pending);
+    }
+}
+
+static bool destroy_pending_map(int64_t sub_id, struct pending_map *pending,
+				void *cb_data)
+{
+    pending_map_destroy(pending);
+    return true;
+}
+
+static void unindex_all(struct proto_conn *conn)
+{
+    sub_pending_map_foreach(conn->pending_notifications, destroy_pending_map,
+			    NULL);
+    sub_pending_map_clear(conn->pending_notifications);
+}
+
+static void replace_msg(struct proto_conn *conn, struct out_msg *out_msg,
+			struct msg *msg)
+{
+    size_t old_len = msg_len(out_msg->msg);
+
+    conn->out_bytes -= old_len;
+    out_budget_sub(conn->budget, old_len);
+
+    msg_destroy(out_msg->msg);
+    out_msg->msg = msg;
+
+    account_queued(conn, msg);
+}
+
+static void drop_msg(struct proto_conn *conn, struct out_msg *out_msg)
+{
+    if (out_msg == conn->group_tail)
+	conn->group_tail = NULL;
+
+    account_dequeued(conn, msg_len(out_msg->msg));
+    msg_destroy(out_msg->msg);
+    out_msg->msg = NULL;
+}
+
+/* For single-response transactions, and for multi-response
+   transactions failed before being accepted. */
+static void queue_response(struct proto_conn *conn, struct msg *msg)
+{
+    struct proto_conn *transport = transport_of(conn);
+
+    queue_msg(transport, transport->high_queue, msg, -1);
+}
+
+/* For messages of a multi-response transaction, from its accept
+   message onwards. Placing all of them in the same lane keeps them in
+   order. */
+static void queue_bulk(struct proto_conn *conn, struct msg *msg)
+{
+    struct proto_conn *transport = transport_of(conn);
+
+    queue_msg(transport, transport->bulk_queue, msg, -1);
+}
+
+/* Unknown extensions are ignored */
+static unsigned parse_exts(const char *names)
+{
+    char *copy = ut_strdup(names);
+    char *saveptr = NULL;
+    unsigned extensions = 0;
+    char *name;
+
+    for (name = strtok_r(copy, " \t\n", &saveptr); name != NULL;
+	 name = strtok_r(NULL, " \t\n", &saveptr)) {
+	size_t i;
+	for (i = 0; i < UT_ARRAY_LEN(ext_names); i++)
+	    if (strcmp(name, ext_names[i]) == 0)
+		extensions |= 1U << i;
+    }
+
+    ut_free(copy);
+
+    return extensions;
+}
+
+/* Returns NULL if no extension is enabled */
+static const char *ext_str(unsigned extensions, char *buf, size_t capacity)
+{
+    size_t i;
+
+    buf[0] = '\0';
+
+    for (i = 0; i < UT_ARRAY_LEN(ext_names); i++)
+	if (extensions & (1U << i))
+	    ut_aprintf(buf, capacity, "%s%s", buf[0] != '\0' ? " " : "",
+		       ext_names[i]);
+
+    return buf[0] != '\0' ? buf : NULL;
+}
+
+/* Returns NULL if the names are invalid */
+static struct proto_dict *create_dict(struct proto_conn *conn,
+				      json_t *names)
+{
+    size_t num_names = json_array_size(names);
+
+    if (num_names > MAX_DICT_NAMES) {
+	log_info_c(conn->log_ctx, "Binary encoding not enabled, with %zd "
+		   "property names exceeding the limit of %d.", num_names,
+		   MAX_DICT_NAMES);
+	return NULL;
+    }
+
+    const char *name_strs[num_names + 1];
+    size_t i;
+
+    for (i = 0; i < num_names; i++) {
+	name_strs[i] = json_string_value(json_array_get(names, i));
+
+	if (name_strs[i] == NULL) {
+	    log_info_c(conn->log_ctx, "Binary encoding not enabled, with "
+		       "invalid property names.");
+	    return NULL;
+	}
+    }
+
+    return proto_dict_create(name_strs, num_names);
+}
+
+static void enable_compression(struct proto_conn *conn)
+{
+    conn->deflater = deflater_create();
+    conn->inflater = inflater_create();
+
+    if (conn->io != NULL)
+	io_conn_set_inflater(conn->io, conn->inflater);
+}
+
+static void select_exts(struct proto_conn *conn, const char *requested_exts,
+			json_t *property_names)
+{
+    if (requested_exts != NULL)
+	conn->extensions = parse_exts(requested_exts);
+
+    if (conn->extensions & EXT_BINARY) {
+	conn->dict = create_dict(conn, property_names);
+
+	if (conn->dict == NULL)
+	    conn->extensions &= ~EXT_BINARY;
+    }
+
+    /* Session ids are carried as JSON fields */
+    if ((conn->extensions & EXT_MUX) && (conn->extensions & EXT_BINARY)) {
+	log_info_c(conn->log_ctx, "Multiplexing not enabled, since it "
+		   "can't be combined with the binary encoding.");
+	conn->extensions &= ~EXT_MUX;
+    }
+
+    if (conn->extensions & EXT_MUX)
+	conn->sessions = session_map_create();
+
+    /* Group notifications only exist in JSON */
+    if ((conn->extensions & EXT_GROUP) && (conn->extensions & EXT_BINARY)) {
+	log_info_c(conn->log_ctx, "Subscription groups not enabled, since "
+		   "they can't be combined with the binary encoding.");
+	conn->extensions &= ~EXT_GROUP;
+    }
 }
 
 static void handle_hello(struct proto_conn *conn, struct proto_ta *ta)
@@ -81,7 +657,12 @@ static void handle_hello(struct proto_conn *conn, struct proto_ta *ta)
     const int64_t *min_version = proto_ta_get_req_field_uint63_value(ta, 1);
     const int64_t *max_version = proto_ta_get_req_field_uint63_value(ta, 2);
 
+    const char *requested_exts =
+	proto_ta_get_opt_req_field_str_value(ta, 0);
+    json_t *property_names = proto_ta_get_opt_req_field_array_value(ta, 1);
+
     struct msg *response;
+    char exts[256];
 
     if (has_finished_handshake(conn)) {
 	if (conn->client_id != *client_id) {
@@ -91,7 +672,9 @@ static void handle_hello(struct proto_conn *conn, struct proto_ta *ta)
 	    log_debug_c(conn->log_ctx, "Received hello from client with "
 			"handshake procedure already successfully completed.");
 	    int64_t previously_agreed_version = PROTO_VERSION;
-	    response = proto_ta_complete(ta, &previously_agreed_version);
+	    response = proto_ta_complete(ta, &previously_agreed_version,
+					 ext_str(conn->extensions, exts,
+						 sizeof(exts)));
 	}
 
 	goto respond;
@@ -108,9 +691,9 @@ static void handle_hello(struct proto_conn *conn, struct proto_ta *ta)
 	goto respond;
     }
 
-    const char *remote_addr = xcm_remote_addr(conn->sock);
+    const char *remote_addr = proto_conn_remote_addr(conn);
 
-    int rc = sd_client_connect(conn->sd, *client_id, remote_addr);
+    int rc = shards_client_connect(conn->shards, *client_id, remote_addr);
 
     if (rc == SD_ERR_CLIENT_ALREADY_EXISTS) {
 	log_info_c(conn->log_ctx, "Client %"PRIx64" already exists.",
@@ -127,19 +710,38 @@ static void handle_hello(struct proto_conn *conn, struct proto_ta *ta)
     /* all error codes should be handled explicitly */
     ut_assert(rc == 0);
 
-    log_ctx_set_prefix(conn->log_ctx, "<client: %"PRIx64"> ", *client_id);
+    if (conn->transport != NULL)
+	log_ctx_set_prefix(conn->log_ctx, "<session: %"PRId64", client: "
+			   "%"PRIx64"> ", conn->session_id, *client_id);
+    else
+	log_ctx_set_prefix(conn->log_ctx, "<client: %"PRIx64"> ", *client_id);
 
     log_info_c(conn->log_ctx, "Connected using protocol version %"PRId64".",
 	       PROTO_VERSION);
 
     int64_t selected_version = PROTO_VERSION;
 
-    conn->handshake_cb(conn, conn->cb_data);
+    /* A multiplexed session has the extensions of its connection */
+    if (conn->transport == NULL) {
+	select_exts(conn, requested_exts, property_names);
+
+	conn->handshake_cb(conn, conn->cb_data);
+    }
+
+    const char *selected_exts = ext_str(conn->extensions, exts, sizeof(exts));
 
-    response = proto_ta_complete(ta, &selected_version);
+    response = proto_ta_complete(ta, &selected_version, selected_exts);
 
 respond:
     queue_response(conn, response);
+
+    /* The hello reply itself is in JSON, and not compressed */
+    if (conn->dict != NULL && conn->io != NULL)
+	io_conn_set_dict(conn->io, conn->dict);
+
+    if ((conn->extensions & EXT_DEFLATE) && conn->transport == NULL &&
+	conn->deflater == NULL)
+	enable_compression(conn);
 }
 
 static void handle_no_hello(struct proto_conn *conn, struct proto_ta *ta)
@@ -153,105 +755,557 @@ static void handle_no_hello(struct proto_conn *conn, struct proto_ta *ta)
     queue_response(conn, response);
 }
 
-static void notify_sub_match(struct sub *sub, const struct service *service,
-			     enum sub_match_type match_type, void *cb_data)
+static bool add_prop_name(const char *prop_name,
+			  const struct pvalue *prop_value, void *user)
 {
-    struct proto_conn *conn = cb_data;
-    struct proto_ta *sub_ta =
-	proto_ta_map_get(conn->sub_tas, sub_get_sub_id(sub));
+    json_t *names = user;
+    size_t i;
 
-    int64_t service_id = service_get_id(service);
+    /* Multi-valued properties are only listed once */
+    for (i = 0; i < json_array_size(names); i++)
+	if (strcmp(json_string_value(json_array_get(names, i)),
+		   prop_name) == 0)
+	    return true;
 
-    struct msg *response;
+    json_array_append_new(names, json_string(prop_name));
+
+    return true;
+}
+
+/* With 'delta', a "modified" notification only carries the
+   properties changed by the service's most recent change, if known,
+   rather than all of them. */
+static struct msg *create_notification(struct proto_ta *sub_ta,
+					const struct service *service,
+					enum sub_match_type match_type,
+					bool delta)
+{
+    int64_t service_id = service_get_id(service);
 
     if (match_type == sub_match_type_disappeared)
-	response = proto_ta_notify(sub_ta, &match_type, &service_id,
-				   NULL, NULL, NULL, NULL, NULL);
-    else {
-	int64_t generation = service_get_generation(service);
-	const struct props *props = service_get_props(service);
-	int64_t ttl = service_get_ttl(service);
-	int64_t client_id = service_get_client_id(service);
-
-	double orphan_since_value;
-	const double *orphan_since = NULL;
-
-	if (service_is_orphan(service)) {
-	    orphan_since_value = service_get_orphan_since(service);
-	    orphan_since = &orphan_since_value;
-	}
+	return proto_ta_notify(sub_ta, &match_type, &service_id,
+			       NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+			       NULL);
 
-	response =
-	    proto_ta_notify(sub_ta, &match_type, &service_id, &generation,
-			    props, &ttl, &client_id, orphan_since);
+    int64_t generation = service_get_generation(service);
+    const struct props *props = service_get_props(service);
+    int64_t ttl = service_get_ttl(service);
+    int64_t client_id = service_get_client_id(service);
+
+    double orphan_since_value;
+    const double *orphan_since = NULL;
+
+    if (service_is_orphan(service)) {
+	orphan_since_value = service_get_orphan_since(service);
+	orphan_since = &orphan_since_value;
     }
 
-    queue_response(conn, response);
-}
+    const struct props *changed;
+    const struct props *removed;
 
-static void handle_subscribe(struct proto_conn *conn, struct proto_ta *ta)
-{
-    const int64_t *sub_id = proto_ta_get_req_field_uint63_value(ta, 0);
-    const char *filter_s = proto_ta_get_opt_req_field_str_value(ta, 0);
+    if (!delta || match_type != sub_match_type_modified ||
+	!service_get_props_delta(service, &changed, &removed))
+	return proto_ta_notify(sub_ta, &match_type, &service_id,
+			       &generation, props, &ttl, &client_id,
+			       orphan_since, NULL, NULL, NULL);
 
-    int rc = sd_create_sub(conn->sd, conn->client_id, *sub_id, filter_s,
-			   notify_sub_match, conn);
+    json_t *removed_names = NULL;
 
-    switch (rc) {
-    case SD_ERR_SUB_ALREADY_EXISTS: {
-	log_info_c(conn->log_ctx, "Subscription %"PRIx64" already exists.",
-		   *sub_id);
-	struct msg *response =
-	    proto_ta_fail(ta, PROTO_FAIL_REASON_SUBSCRIPTION_ID_EXISTS);
-	queue_response(conn, response);
-	return;
-    }
-    case SD_ERR_INVALID_FILTER: {
-	log_info_c(conn->log_ctx, "Received subscription request with invalid "
-		   "filter \"%s\".", filter_s);
-	struct msg *response =
-	    proto_ta_fail(ta, PROTO_FAIL_REASON_INVALID_FILTER_SYNTAX);
-	queue_response(conn, response);
-	return;
-    }
+    if (props_num_values(removed) > 0) {
+	removed_names = json_array();
+	props_foreach(removed, add_prop_name, removed_names);
     }
 
-    ut_assert(rc == 0);
+    struct msg *msg =
+	proto_ta_notify(sub_ta, &match_type, &service_id, &generation, NULL,
+			&ttl, &client_id, orphan_since, NULL, changed,
+			removed_names);
 
-    if (filter_s != NULL)
-	log_debug_c(conn->log_ctx, "Installed subscription %"PRIx64" with "
-		    "filter \"%s\".", *sub_id, filter_s);
-    else
-	log_debug_c(conn->log_ctx, "Installed subscription %"PRIx64".",
-		    *sub_id);
+    json_decref(removed_names);
 
-    proto_ta_map_add(conn->sub_tas, *sub_id, ta);
+    return msg;
+}
 
-    struct msg *response = proto_ta_accept(ta);
+enum coalesce_action {
+    coalesce_action_none,
+    coalesce_action_replace,
+    coalesce_action_cancel
+};
 
-    queue_response(conn, response);
+/* Determine how a new notification may be merged with a queued, but
+   not yet sent, notification for the same subscription and
+   service. */
+static enum coalesce_action coalesce(enum sub_match_type pending_type,
+				     enum sub_match_type new_type,
+				     enum sub_match_type *merged_type)
+{
+    switch (pending_type) {
+    case sub_match_type_appeared:
+	if (new_type == sub_match_type_modified) {
+	    /* The client has yet to see the service */
+	    *merged_type = sub_match_type_appeared;
+	    return coalesce_action_replace;
+	} else if (new_type == sub_match_type_disappeared)
+	    return coalesce_action_cancel;
+	break;
+    case sub_match_type_modified:
+	if (new_type == sub_match_type_modified ||
+	    new_type == sub_match_type_disappeared) {
+	    *merged_type = new_type;
+	    return coalesce_action_replace;
+	}
+	break;
+    case sub_match_type_disappeared:
+	/* The client has a copy of the service, which must be removed
+	   before the service reappears. */
+	break;
+    }
 
-    sd_activate_sub(conn->sd, conn->client_id, *sub_id);
+    return coalesce_action_none;
 }
 
-static void handle_unsubscribe(struct proto_conn *conn,
-			       struct proto_ta *unsub_ta)
+static void group_key_init(struct group_key *key,
+			   const struct service *service,
+			   enum sub_match_type match_type)
 {
-    const int64_t *sub_id = proto_ta_get_req_field_uint63_value(unsub_ta, 0);
+    *key = (struct group_key) {
+	.service_id = service_get_id(service),
+	.disappeared = match_type == sub_match_type_disappeared
+    };
 
-    int rc = sd_unsubscribe(conn->sd, conn->client_id, *sub_id);
+    if (key->disappeared)
+	return;
 
-    struct msg *unsub_response;
-    struct msg *sub_response = NULL;
+    key->generation = service_get_generation(service);
+    key->client_id = service_get_client_id(service);
+    key->orphan = service_is_orphan(service);
 
-    switch (rc) {
-    case SD_ERR_NO_SUCH_SUB:
-	log_info_c(conn->log_ctx, "Attempt to unsubscribe to non-existing "
-		   "subscription %"PRIx64".", *sub_id);
-	unsub_response = proto_ta_fail(unsub_ta,
-			       PROTO_FAIL_REASON_NON_EXISTENT_SUBSCRIPTION_ID);
-	break;
-    case SD_ERR_PERM_DENIED:
+    if (key->orphan)
+	key->orphan_since = service_get_orphan_since(service);
+}
+
+static bool group_key_equal(const struct group_key *key_a,
+			    const struct group_key *key_b)
+{
+    return key_a->service_id == key_b->service_id &&
+	key_a->disappeared == key_b->disappeared &&
+	key_a->generation == key_b->generation &&
+	key_a->client_id == key_b->client_id &&
+	key_a->orphan == key_b->orphan &&
+	key_a->orphan_since == key_b->orphan_since;
+}
+
+static void group_destroy(struct notify_group *group)
+{
+    if (group != NULL) {
+	if (group->service != NULL)
+	    service_dec_ref(group->service);
+	ut_free(group->matches);
+	ut_free(group);
+    }
+}
+
+static void free_out_msg(struct out_msg *out_msg)
+{
+    group_destroy(out_msg->group);
+    ut_free(out_msg);
+}
+
+static void group_add(struct notify_group *group, struct proto_ta *sub_ta,
+		      int64_t sub_id, enum sub_match_type match_type)
+{
+    group->matches = ut_realloc(group->matches,
+				sizeof(struct proto_group_match) *
+				(group->num_matches + 1));
+    group->matches[group->num_matches] = (struct proto_group_match) {
+	.ta_id = sub_ta->ta_id,
+	.sub_id = sub_id,
+	.match_type = match_type
+    };
+    group->num_matches++;
+
+    group->stale = true;
+}
+
+static bool group_has(const struct notify_group *group, int64_t sub_id)
+{
+    size_t i;
+    for (i = 0; i < group->num_matches; i++)
+	if (group->matches[i].sub_id == sub_id)
+	    return true;
+
+    return false;
+}
+
+/* Turns the notification at the tail of the bulk lane into a group
+   notification, once another subscription is to join it. */
+static void start_group(struct proto_conn *conn, struct out_msg *tail,
+			struct proto_ta *tail_ta, const struct service *service)
+{
+    struct proto_conn *transport = transport_of(conn);
+    struct notify_group *group = ut_calloc(sizeof(struct notify_group));
+
+    group->service_id = tail->service_id;
+    group->session_id = conn->transport != NULL ? conn->session_id : -1;
+
+    /* The tail carries the same state as 'service' */
+    if (!transport->group_key.disappeared)
+	group->service = service_clone(service);
+
+    group_add(group, tail_ta, tail->sub_id, tail->match_type);
+
+    /* Group notifications aren't merged with later notifications */
+    unindex_pending(transport, tail);
+
+    tail->group = group;
+}
+
+/* Returns true if the notification was added to the group
+   notification at the tail of the bulk lane. */
+static bool join_group(struct proto_conn *conn, int64_t sub_id,
+		       struct proto_ta *sub_ta, const struct service *service,
+		       enum sub_match_type match_type)
+{
+    struct proto_conn *transport = transport_of(conn);
+    struct out_msg *tail = transport->group_tail;
+    struct group_key key;
+
+    if (tail == NULL || transport->group_session != conn)
+	return false;
+
+    group_key_init(&key, service, match_type);
+
+    if (!group_key_equal(&key, &transport->group_key))
+	return false;
+
+    if (tail->group == NULL) {
+	/* The tail's subscription may have been canceled since */
+	struct proto_ta *tail_ta =
+	    proto_ta_map_get(conn->sub_tas, tail->sub_id);
+
+	if (tail->sub_id == sub_id || tail_ta == NULL)
+	    return false;
+
+	start_group(conn, tail, tail_ta, service);
+    } else if (group_has(tail->group, sub_id))
+	return false;
+
+    group_add(tail->group, sub_ta, sub_id, match_type);
+
+    return true;
+}
+
+static void set_group_tail(struct proto_conn *conn, struct out_msg *out_msg,
+			   const struct service *service,
+			   enum sub_match_type match_type)
+{
+    struct proto_conn *transport = transport_of(conn);
+
+    transport->group_tail = out_msg;
+    transport->group_session = conn;
+    group_key_init(&transport->group_key, service, match_type);
+}
+
+static struct msg *create_group_notification(struct notify_group *group)
+{
+    const struct service *service = group->service;
+
+    if (service == NULL)
+	return proto_group_notify(group->matches, group->num_matches,
+				  group->session_id, group->service_id, 0,
+				  NULL, 0, 0, NULL);
+
+    double orphan_since_value;
+    const double *orphan_since = NULL;
+
+    if (service_is_orphan(service)) {
+	orphan_since_value = service_get_orphan_since(service);
+	orphan_since = &orphan_since_value;
+    }
+
+    return proto_group_notify(group->matches, group->num_matches,
+			      group->session_id, group->service_id,
+			      service_get_generation(service),
+			      service_get_props(service),
+			      service_get_ttl(service),
+			      service_get_client_id(service), orphan_since);
+}
+
+/* A group notification is serialized once no more subscriptions
+   are to join it, or it's about to be sent. */
+static void finish_group(struct proto_conn *conn)
+{
+    struct out_msg *tail = conn->group_tail;
+
+    if (tail == NULL || tail->group == NULL || !tail->group->stale)
+	return;
+
+    replace_msg(conn, tail, create_group_notification(tail->group));
+
+    tail->group->stale = false;
+}
+
+static void notify_sub_match(struct sub *sub, const struct service *service,
+			     enum sub_match_type match_type, void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
+    struct proto_conn *transport = transport_of(conn);
+
+    /* Whatever the policy, the subscriptions' notifications won't
+       be needed. */
+    if (transport->overloaded)
+	return;
+
+    int64_t sub_id = sub_get_sub_id(sub);
+    struct proto_ta *sub_ta = proto_ta_map_get(conn->sub_tas, sub_id);
+    int64_t service_id = service_get_id(service);
+
+    struct out_msg *pending = get_pending(transport, sub_id, service_id);
+
+    if (pending != NULL) {
+	enum sub_match_type merged_type;
+
+	switch (coalesce(pending->match_type, match_type, &merged_type)) {
+	case coalesce_action_replace:
+	    /* The merged notification no longer carries the state its
+	       group key says */
+	    if (pending == transport->group_tail)
+		transport->group_tail = NULL;
+
+	    /* The client hasn't seen the change a delta would be
+	       relative to */
+	    replace_msg(transport, pending,
+			create_notification(sub_ta, service, merged_type,
+					    false));
+	    pending->match_type = merged_type;
+	    return;
+	case coalesce_action_cancel:
+	    drop_msg(transport, pending);
+	    unindex_pending(transport, pending);
+	    return;
+	case coalesce_action_none:
+	    break;
+	}
+    }
+
+    if ((conn->extensions & EXT_GROUP) &&
+	join_group(conn, sub_id, sub_ta, service, match_type))
+	return;
+
+    struct msg *notification =
+	create_notification(sub_ta, service, match_type,
+			    conn->extensions & EXT_DELTA);
+
+    struct out_msg *out_msg =
+	queue_msg(transport, transport->bulk_queue, notification, sub_id);
+
+    out_msg->service_id = service_id;
+    out_msg->match_type = match_type;
+
+    index_pending(transport, out_msg);
+
+    if (conn->extensions & EXT_GROUP)
+	set_group_tail(conn, out_msg, service, match_type);
+}
+
+static void start_sync(struct proto_conn *conn);
+
+struct marker_param
+{
+    struct proto_conn *conn;
+    int64_t sync_num;
+};
+
+static bool queue_marker(int64_t sub_id, struct resumable *resumable,
+			 void *cb_data)
+{
+    struct marker_param *param = cb_data;
+    struct proto_conn *conn = param->conn;
+
+    if (resumable->sync_after >= param->sync_num ||
+	resumable->synced_seq >= conn->sync_seq)
+	return true;
+
+    struct proto_ta *sub_ta = proto_ta_map_get(conn->sub_tas, sub_id);
+
+    queue_bulk(conn, proto_ta_notify(sub_ta, NULL, NULL, NULL, NULL, NULL,
+				     NULL, NULL, &conn->sync_seq, NULL, NULL));
+
+    resumable->synced_seq = conn->sync_seq;
+
+    return true;
+}
+
+static void sync_cb(int64_t sync_num, int rc, void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
+
+    conn->syncing = false;
+
+    /* The notifications themselves are being dropped */
+    if (!transport_of(conn)->overloaded) {
+	struct marker_param param = {
+	    .conn = conn,
+	    .sync_num = sync_num
+	};
+
+	resumable_map_foreach(conn->resumables, queue_marker, &param);
+    }
+
+    if (conn->sync_again) {
+	conn->sync_again = false;
+	start_sync(conn);
+    }
+}
+
+/* Once all matches for changes up to the current sequence number
+   are queued, each resumable subscription is sent a marker with
+   that number. */
+static void start_sync(struct proto_conn *conn)
+{
+    if (conn->syncing) {
+	conn->sync_again = true;
+	return;
+    }
+
+    conn->syncing = true;
+    conn->sync_seq = shards_get_change_seq(conn->shards);
+    conn->num_syncs++;
+
+    shards_sync(conn->shards, conn->num_syncs, sync_cb, conn);
+}
+
+static void sync_timer_cb(int fd, short ev, void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
+
+    if (resumable_map_size(conn->resumables) > 0 &&
+	shards_get_change_seq(conn->shards) != conn->sync_seq)
+	start_sync(conn);
+}
+
+static void add_resumable(struct proto_conn *conn, int64_t sub_id)
+{
+    struct resumable *resumable = ut_malloc(sizeof(struct resumable));
+
+    *resumable = (struct resumable) {
+	.sync_after = conn->num_syncs
+    };
+
+    resumable_map_add(conn->resumables, sub_id, resumable);
+
+    if (!event_pending(&conn->sync_timer, EV_TIMEOUT, NULL)) {
+	struct timeval interval;
+	ut_f_to_timeval(SYNC_INTERVAL, &interval);
+	event_add(&conn->sync_timer, &interval);
+    }
+}
+
+static void del_resumable(struct proto_conn *conn, int64_t sub_id)
+{
+    struct resumable *resumable = resumable_map_get(conn->resumables, sub_id);
+
+    if (resumable != NULL) {
+	resumable_map_del(conn->resumables, sub_id);
+	ut_free(resumable);
+    }
+}
+
+/* Returns the reason for failing the subscription, or NULL if it was
+   accepted, in which case the connection takes ownership of the
+   transaction. */
+static const char *subscribe(struct proto_conn *conn, struct proto_ta *ta)
+{
+    const int64_t *sub_id = proto_ta_get_req_field_uint63_value(ta, 0);
+    const char *filter_s = proto_ta_get_opt_req_field_str_value(ta, 0);
+    const int64_t *resume_from =
+	proto_ta_get_opt_req_field_uint63_value(ta, 1);
+
+    int rc = shards_create_sub(conn->shards, conn->client_id, *sub_id,
+			       filter_s, notify_sub_match, conn);
+
+    switch (rc) {
+    case SD_ERR_SUB_ALREADY_EXISTS:
+	log_info_c(conn->log_ctx, "Subscription %"PRIx64" already exists.",
+		   *sub_id);
+	return PROTO_FAIL_REASON_SUBSCRIPTION_ID_EXISTS;
+    case SD_ERR_INVALID_FILTER:
+	log_info_c(conn->log_ctx, "Received subscription request with invalid "
+		   "filter \"%s\".", filter_s);
+	return PROTO_FAIL_REASON_INVALID_FILTER_SYNTAX;
+    }
+
+    ut_assert(rc == 0);
+
+    if (filter_s != NULL)
+	log_debug_c(conn->log_ctx, "Installed subscription %"PRIx64" with "
+		    "filter \"%s\".", *sub_id, filter_s);
+    else
+	log_debug_c(conn->log_ctx, "Installed subscription %"PRIx64".",
+		    *sub_id);
+
+    proto_ta_map_add(conn->sub_tas, *sub_id, ta);
+
+    if (resume_from == NULL) {
+	queue_bulk(conn, proto_ta_accept(ta, NULL));
+
+	shards_activate_sub(conn->shards, conn->client_id, *sub_id);
+	return NULL;
+    }
+
+    /* Zero means changes only, without the initial services */
+    int64_t seq = *resume_from > 0 ? *resume_from :
+	shards_get_change_seq(conn->shards);
+
+    /* The accept tells the client whether it's getting a delta, or
+       must start over */
+    if (shards_pin_changes(conn->shards, seq) == 0) {
+	queue_bulk(conn, proto_ta_accept(ta, &seq));
+
+	shards_resume_sub(conn->shards, conn->client_id, *sub_id, seq);
+    } else {
+	log_debug_c(conn->log_ctx, "Changes since %"PRId64" are no longer "
+		    "known, sending all services of subscription %"PRIx64".",
+		    seq, *sub_id);
+
+	queue_bulk(conn, proto_ta_accept(ta, NULL));
+
+	shards_activate_sub(conn->shards, conn->client_id, *sub_id);
+    }
+
+    add_resumable(conn, *sub_id);
+
+    start_sync(conn);
+
+    return NULL;
+}
+
+static void handle_subscribe(struct proto_conn *conn, struct proto_ta *ta)
+{
+    const char *fail_reason = subscribe(conn, ta);
+
+    if (fail_reason != NULL)
+	queue_response(conn, proto_ta_fail(ta, fail_reason));
+}
+
+static void handle_unsubscribe(struct proto_conn *conn,
+			       struct proto_ta *unsub_ta)
+{
+    const int64_t *sub_id = proto_ta_get_req_field_uint63_value(unsub_ta, 0);
+
+    int rc = shards_unsubscribe(conn->shards, conn->client_id, *sub_id);
+
+    struct msg *unsub_response;
+    struct msg *sub_response = NULL;
+
+    switch (rc) {
+    case SD_ERR_NO_SUCH_SUB:
+	log_info_c(conn->log_ctx, "Attempt to unsubscribe to non-existing "
+		   "subscription %"PRIx64".", *sub_id);
+	unsub_response = proto_ta_fail(unsub_ta,
+			       PROTO_FAIL_REASON_NON_EXISTENT_SUBSCRIPTION_ID);
+	break;
+    case SD_ERR_PERM_DENIED:
 	log_info_c(conn->log_ctx, "Permission to unsubscribe subscription "
 		   "%"PRIx64" was denied.", *sub_id);
 	unsub_response = proto_ta_fail(unsub_ta,
@@ -267,6 +1321,12 @@ static void handle_unsubscribe(struct proto_conn *conn,
 
 	proto_ta_map_del(conn->sub_tas, *sub_id);
 
+	/* Queued notifications are still delivered, ahead of the
+	   subscription's complete message, but the id may be reused */
+	unindex_sub(transport_of(conn), *sub_id);
+
+	del_resumable(conn, *sub_id);
+
 	sub_response = proto_ta_complete(sub_ta);
 
 	proto_ta_destroy(sub_ta);
@@ -281,86 +1341,405 @@ static void handle_unsubscribe(struct proto_conn *conn,
     queue_response(conn, unsub_response);
 
     if (sub_response != NULL)
-	queue_response(conn, sub_response);
+	queue_bulk(conn, sub_response);
 }
 
-static void handle_publish(struct proto_conn *conn, struct proto_ta *ta)
+/* Returns the operation id under which the transaction is kept,
+   until the sd result is in. */
+static int64_t add_pending(struct proto_conn *conn, struct proto_ta *ta)
 {
-    const int64_t *service_id = proto_ta_get_req_field_uint63_value(ta, 0);
-    const int64_t *generation = proto_ta_get_req_field_uint63_value(ta, 1);
-    const struct props *props = proto_ta_get_req_field_props_value(ta, 2);
-    const int64_t *ttl = proto_ta_get_req_field_uint63_value(ta, 3);
+    int64_t op_id = conn->next_op_id++;
 
-    int rc = sd_publish(conn->sd, conn->client_id, *service_id, *generation,
-			props, *ttl);
+    proto_ta_map_add(conn->pending_tas, op_id, ta);
 
-    struct msg *response;
+    return op_id;
+}
+
+static void finish_pending(struct proto_conn *conn, int64_t op_id,
+			   struct proto_ta *ta)
+{
+    proto_ta_map_del(conn->pending_tas, op_id);
+    proto_ta_destroy(ta);
+}
 
+/* Returns NULL if the publish succeeded. */
+static const char *publish_fail_reason(struct proto_conn *conn, int rc,
+				       int64_t service_id)
+{
     switch (rc) {
     case SD_ERR_SERVICE_SAME_GENERATION_BUT_DIFFERENT_DATA:
 	log_info_c(conn->log_ctx, "Service %"PRIx64" exists but with "
-		   "different data.", *service_id);
-	response =
-	    proto_ta_fail(ta, PROTO_FAIL_REASON_SAME_GENERATION_BUT_DIFFERENT);
-	break;
+		   "different data.", service_id);
+	return PROTO_FAIL_REASON_SAME_GENERATION_BUT_DIFFERENT;
     case SD_ERR_NEWER_SERVICE_GENERATION_EXISTS:
 	log_info_c(conn->log_ctx, "Service %"PRIx64" already exists with "
-		   "a newer generation.", *service_id);
-	response = proto_ta_fail(ta, PROTO_FAIL_REASON_OLD_GENERATION);
-	break;
+		   "a newer generation.", service_id);
+	return PROTO_FAIL_REASON_OLD_GENERATION;
+    case SD_ERR_PERM_DENIED:
+	log_info_c(conn->log_ctx, "Permission to publish service %"PRIx64" "
+		   "was denied.", service_id);
+	return PROTO_FAIL_REASON_PERMISSION_DENIED;
+    case UPSTREAM_ERR_FAILED:
+	log_info_c(conn->log_ctx, "Upstream server failed publication of "
+		   "service %"PRIx64".", service_id);
+	return PROTO_FAIL_REASON_INSUFFICIENT_RESOURCES;
     case 0:
-	response = proto_ta_complete(ta);
-	break;
+	return NULL;
     default:
 	ut_assert(0);
-	break;
+	return NULL;
     }
+}
+
+static void publish_result_cb(int64_t op_id, int rc, void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
+    struct proto_ta *ta = proto_ta_map_get(conn->pending_tas, op_id);
+    const int64_t *service_id = proto_ta_get_req_field_uint63_value(ta, 0);
+
+    const char *fail_reason = publish_fail_reason(conn, rc, *service_id);
+
+    struct msg *response = fail_reason != NULL ?
+	proto_ta_fail(ta, fail_reason) : proto_ta_complete(ta);
 
     queue_response(conn, response);
+
+    finish_pending(conn, op_id, ta);
 }
 
-static void handle_unpublish(struct proto_conn *conn, struct proto_ta *ta)
+static void publish(struct proto_conn *conn, struct proto_ta *ta,
+		    int64_t op_id, shards_result_cb result_cb)
 {
     const int64_t *service_id = proto_ta_get_req_field_uint63_value(ta, 0);
+    const int64_t *generation = proto_ta_get_req_field_uint63_value(ta, 1);
+    const struct props *props = proto_ta_get_req_field_props_value(ta, 2);
+    const int64_t *ttl = proto_ta_get_req_field_uint63_value(ta, 3);
 
-    int rc = sd_unpublish(conn->sd, conn->client_id, *service_id);
+    if (conn->upstream != NULL)
+	upstream_publish(conn->upstream, conn->client_id, *service_id,
+			 *generation, props, *ttl, op_id, result_cb, conn);
+    else
+	shards_publish(conn->shards, conn->client_id, *service_id,
+		       *generation, props, *ttl, op_id, result_cb, conn);
+}
 
-    struct msg *response;
+static void handle_publish(struct proto_conn *conn, struct proto_ta *ta)
+{
+    publish(conn, ta, add_pending(conn, ta), publish_result_cb);
+}
 
+/* Returns NULL if the unpublish succeeded. */
+static const char *unpublish_fail_reason(struct proto_conn *conn, int rc,
+					 int64_t service_id)
+{
     switch (rc) {
     case SD_ERR_NO_SUCH_SERVICE:
 	log_info_c(conn->log_ctx, "Attempt to unpublish non-existing service "
-		   "%"PRIx64".", *service_id);
-	response =
-	    proto_ta_fail(ta, PROTO_FAIL_REASON_NON_EXISTENT_SERVICE_ID);
-	break;
+		   "%"PRIx64".", service_id);
+	return PROTO_FAIL_REASON_NON_EXISTENT_SERVICE_ID;
+    case SD_ERR_PERM_DENIED:
+	log_info_c(conn->log_ctx, "Permission to unpublish service "
+		   "%"PRIx64" was denied.", service_id);
+	return PROTO_FAIL_REASON_PERMISSION_DENIED;
+    case UPSTREAM_ERR_FAILED:
+	log_info_c(conn->log_ctx, "Upstream server failed unpublication of "
+		   "service %"PRIx64".", service_id);
+	return PROTO_FAIL_REASON_INSUFFICIENT_RESOURCES;
     case 0:
-	response = proto_ta_complete(ta);
-	break;
+	return NULL;
     default:
 	ut_assert(0);
-	break;
+	return NULL;
     }
-
-    queue_response(conn, response);
 }
 
-static void handle_ping(struct proto_conn *conn, struct proto_ta *ta)
+static void unpublish_result_cb(int64_t op_id, int rc, void *cb_data)
 {
-    queue_response(conn, proto_ta_complete(ta));
+    struct proto_conn *conn = cb_data;
+    struct proto_ta *ta = proto_ta_map_get(conn->pending_tas, op_id);
+    const int64_t *service_id = proto_ta_get_req_field_uint63_value(ta, 0);
+
+    const char *fail_reason = unpublish_fail_reason(conn, rc, *service_id);
+
+    struct msg *response = fail_reason != NULL ?
+	proto_ta_fail(ta, fail_reason) : proto_ta_complete(ta);
+
+    queue_response(conn, response);
+
+    finish_pending(conn, op_id, ta);
 }
 
-struct notify_param
+static void unpublish(struct proto_conn *conn, struct proto_ta *ta,
+		      int64_t op_id, shards_result_cb result_cb)
+{
+    const int64_t *service_id = proto_ta_get_req_field_uint63_value(ta, 0);
+
+    if (conn->upstream != NULL)
+	upstream_unpublish(conn->upstream, conn->client_id, *service_id,
+			   op_id, result_cb, conn);
+    else
+	shards_unpublish(conn->shards, conn->client_id, *service_id, op_id,
+			 result_cb, conn);
+}
+
+static void handle_unpublish(struct proto_conn *conn, struct proto_ta *ta)
+{
+    unpublish(conn, ta, add_pending(conn, ta), unpublish_result_cb);
+}
+
+/* A batch request, with the transactions of its operations */
+struct batch
 {
-    struct proto_conn *conn;
     struct proto_ta *ta;
+    struct proto_ta **op_tas;
+    size_t num_ops;
+    /* the results, in operation order */
+    json_t *results;
+    size_t num_pending;
 };
 
-static bool service_notify_cb(int64_t service_id, struct service *service,
+static void batch_destroy(struct batch *batch)
+{
+    if (batch != NULL) {
+	size_t i;
+	for (i = 0; i < batch->num_ops; i++)
+	    proto_ta_destroy(batch->op_tas[i]);
+	ut_free(batch->op_tas);
+
+	proto_ta_destroy(batch->ta);
+	json_decref(batch->results);
+
+	ut_free(batch);
+    }
+}
+
+static void batch_release(struct proto_conn *conn, struct batch *batch)
+{
+    batch->num_pending--;
+
+    if (batch->num_pending == 0) {
+	queue_response(conn, proto_ta_complete(batch->ta, batch->results));
+	batch_destroy(batch);
+    }
+}
+
+static void batch_op_done(struct proto_conn *conn, struct batch *batch,
+			  size_t idx, const char *fail_reason)
+{
+    if (fail_reason != NULL)
+	json_object_set_new(json_array_get(batch->results, idx),
+			    PROTO_FIELD_FAIL_REASON, json_string(fail_reason));
+
+    batch_release(conn, batch);
+}
+
+static void batch_result_cb(int64_t op_id, int rc, void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
+    struct batch_op *op = batch_op_map_get(conn->batch_ops, op_id);
+    struct batch *batch = op->batch;
+    size_t idx = op->idx;
+    struct proto_ta *ta = batch->op_tas[idx];
+    const int64_t *service_id = proto_ta_get_req_field_uint63_value(ta, 0);
+
+    batch_op_map_del(conn->batch_ops, op_id);
+    ut_free(op);
+
+    const char *fail_reason =
+	strcmp(proto_ta_get_cmd(ta), PROTO_CMD_PUBLISH) == 0 ?
+	publish_fail_reason(conn, rc, *service_id) :
+	unpublish_fail_reason(conn, rc, *service_id);
+
+    batch_op_done(conn, batch, idx, fail_reason);
+}
+
+static int64_t add_batch_op(struct proto_conn *conn, struct batch *batch,
+			    size_t idx)
+{
+    struct batch_op *op = ut_malloc(sizeof(struct batch_op));
+
+    *op = (struct batch_op) {
+	.batch = batch,
+	.idx = idx
+    };
+
+    int64_t op_id = conn->next_op_id++;
+
+    batch_op_map_add(conn->batch_ops, op_id, op);
+
+    return op_id;
+}
+
+/* Transactions of a connection having enabled the binary encoding
+   are in that encoding, except for the handshake's. */
+static struct proto_ta *create_ta(struct proto_conn *conn)
+{
+    struct proto_ta *ta = proto_ta_create(conn->log_ctx);
+
+    if (conn->dict != NULL)
+	proto_ta_set_binary(ta, conn->dict);
+
+    if (conn->transport != NULL)
+	proto_ta_set_session(ta, conn->session_id);
+
+    return ta;
+}
+
+/* Parses an operation as the request it stands for. Returns NULL if
+   it's not a valid publish, unpublish or subscribe request. */
+static struct proto_ta *parse_batch_op(struct proto_conn *conn,
+				       struct proto_ta *batch_ta, json_t *op)
+{
+    if (!json_is_object(op))
+	return NULL;
+
+    json_t *req = json_object();
+    const char *field_name;
+    json_t *field_value;
+
+    json_object_foreach(op, field_name, field_value)
+	json_object_set(req, field_name, field_value);
+
+    json_object_set_new(req, PROTO_FIELD_MSG_TYPE,
+			json_string(PROTO_MSG_TYPE_REQ));
+
+    const char *cmd = json_string_value(json_object_get(req,
+							PROTO_FIELD_TA_CMD));
+
+    /* Only a subscription needs a transaction of its own */
+    bool is_sub = cmd != NULL && strcmp(cmd, PROTO_CMD_SUBSCRIBE) == 0;
+
+    if (!is_sub)
+	json_object_set_new(req, PROTO_FIELD_TA_ID,
+			    json_integer(batch_ta->ta_id));
+
+    struct proto_ta *ta = create_ta(conn);
+
+    int rc = proto_ta_req_json(ta, req);
+
+    json_decref(req);
+
+    if (rc < 0 || (!is_sub && strcmp(cmd, PROTO_CMD_PUBLISH) != 0 &&
+		   strcmp(cmd, PROTO_CMD_UNPUBLISH) != 0)) {
+	log_info_c(conn->log_ctx, "Batch request holds an invalid "
+		   "operation.");
+	proto_ta_destroy(ta);
+	return NULL;
+    }
+
+    return ta;
+}
+
+/* Operations are applied back to back, so that any notifications
+   they cause are coalesced before being sent. Returns -1 if an
+   operation is invalid, in which case none is applied. */
+static int handle_batch(struct proto_conn *conn, struct proto_ta *ta)
+{
+    if (!(conn->extensions & EXT_BATCH)) {
+	log_info_c(conn->log_ctx, "Rejected batch request, with the "
+		   "extension not enabled.");
+	queue_response(conn,
+		       proto_ta_fail(ta,
+				     PROTO_FAIL_REASON_EXTENSION_NOT_ENABLED));
+	proto_ta_destroy(ta);
+	return 0;
+    }
+
+    json_t *ops = proto_ta_get_req_field_array_value(ta, 0);
+    struct batch *batch = ut_calloc(sizeof(struct batch));
+    size_t num_ops = json_array_size(ops);
+
+    batch->op_tas = ut_calloc(sizeof(struct proto_ta *) * num_ops);
+
+    for (; batch->num_ops < num_ops; batch->num_ops++) {
+	json_t *op = json_array_get(ops, batch->num_ops);
+	struct proto_ta *op_ta = parse_batch_op(conn, ta, op);
+
+	if (op_ta == NULL) {
+	    batch_destroy(batch);
+	    return -1;
+	}
+
+	batch->op_tas[batch->num_ops] = op_ta;
+    }
+
+    batch->ta = ta;
+    batch->results = json_array();
+    /* Held until all operations are issued */
+    batch->num_pending = num_ops + 1;
+
+    size_t i;
+    for (i = 0; i < num_ops; i++)
+	json_array_append_new(batch->results, json_object());
+
+    log_debug_c(conn->log_ctx, "Applying batch of %zd operations.", num_ops);
+
+    for (i = 0; i < num_ops; i++) {
+	struct proto_ta *op_ta = batch->op_tas[i];
+	const char *cmd = proto_ta_get_cmd(op_ta);
+
+	if (strcmp(cmd, PROTO_CMD_PUBLISH) == 0)
+	    publish(conn, op_ta, add_batch_op(conn, batch, i),
+		    batch_result_cb);
+	else if (strcmp(cmd, PROTO_CMD_UNPUBLISH) == 0)
+	    unpublish(conn, op_ta, add_batch_op(conn, batch, i),
+		      batch_result_cb);
+	else {
+	    const char *fail_reason = subscribe(conn, op_ta);
+
+	    /* An accepted subscription is owned by the connection */
+	    if (fail_reason == NULL)
+		batch->op_tas[i] = NULL;
+
+	    batch_op_done(conn, batch, i, fail_reason);
+	}
+    }
+
+    batch_release(conn, batch);
+
+    return 0;
+}
+
+static void handle_ping(struct proto_conn *conn, struct proto_ta *ta)
+{
+    queue_response(conn, proto_ta_complete(ta));
+}
+
+/* The session is torn down once the request is handled */
+static void handle_close(struct proto_conn *conn, struct proto_ta *ta)
+{
+    struct msg *response;
+
+    if (!(transport_of(conn)->extensions & EXT_MUX)) {
+	log_info_c(conn->log_ctx, "Rejected close request, with the "
+		   "extension not enabled.");
+	response = proto_ta_fail(ta, PROTO_FAIL_REASON_EXTENSION_NOT_ENABLED);
+    } else if (conn->transport == NULL) {
+	log_info_c(conn->log_ctx, "Attempt to close the primary session "
+		   "denied.");
+	response = proto_ta_fail(ta, PROTO_FAIL_REASON_PERMISSION_DENIED);
+    } else {
+	log_debug_c(conn->log_ctx, "Closing session.");
+	response = proto_ta_complete(ta);
+	conn->closed = true;
+    }
+
+    queue_response(conn, response);
+}
+
+static void service_listing_cb(int64_t op_id, const struct service *service,
 			       void *cb_data)
 {
-    struct notify_param *param = cb_data;
+    struct proto_conn *conn = cb_data;
+    struct proto_ta *ta = proto_ta_map_get(conn->pending_tas, op_id);
 
+    if (service == NULL) {
+	queue_bulk(conn, proto_ta_complete(ta));
+	finish_pending(conn, op_id, ta);
+	return;
+    }
+
+    int64_t service_id = service_get_id(service);
     int64_t generation = service_get_generation(service);
     const struct props *props = service_get_props(service);
     int64_t ttl = service_get_ttl(service);
@@ -374,257 +1753,1060 @@ static bool service_notify_cb(int64_t service_id, struct service *service,
 	orphan_since = &orphan_since_value;
     }
 
-    struct msg *msg = proto_ta_notify(param->ta, &service_id, &generation,
-				      props, &ttl, &client_id, orphan_since);
+    struct msg *msg = proto_ta_notify(ta, &service_id, &generation,
+				      props, &ttl, &client_id, orphan_since);
+
+    queue_bulk(conn, msg);
+}
+
+static void handle_query_result(struct proto_ta *ta, struct msg **msgs,
+				size_t num_msgs, bool complete,
+				void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
+
+    size_t i;
+    for (i = 0; i < num_msgs; i++)
+	queue_bulk(conn, msgs[i]);
+
+    if (complete) {
+	proto_ta_destroy(ta);
+	conn->num_queries--;
+    }
+}
+
+static void submit_query(struct proto_conn *conn, enum query_type type,
+			 struct proto_ta *ta, struct filter *filter)
+{
+    query_pool_submit(conn->query_pool, type, ta, filter, handle_query_result,
+		      conn);
+
+    conn->num_queries++;
+}
+
+static void handle_services(struct proto_conn *conn, struct proto_ta *ta)
+{
+    const char *filter_s = proto_ta_get_opt_req_field_str_value(ta, 0);
+
+    struct filter *filter = NULL;
+
+    if (filter_s != NULL) {
+	filter = filter_parse(filter_s);
+
+	if (filter == NULL) {
+	    log_info_c(conn->log_ctx, "Received services request with invalid "
+		       "filter \"%s\".", filter_s);
+	    struct msg *response =
+		proto_ta_fail(ta, PROTO_FAIL_REASON_INVALID_FILTER_SYNTAX);
+	    queue_response(conn, response);
+	    proto_ta_destroy(ta);
+	    return;
+	}
+    }
+
+    queue_bulk(conn, proto_ta_accept(ta));
+
+    /* With shards, the services are not in the core's snapshots */
+    if (conn->query_pool != NULL &&
+	shards_get_num_shards(conn->shards) == 0) {
+	submit_query(conn, query_type_services, ta, filter);
+	return;
+    }
+
+    int64_t op_id = add_pending(conn, ta);
+
+    shards_foreach_service(conn->shards, filter, op_id, service_listing_cb,
+			   conn);
+
+    filter_destroy(filter);
+}
+
+struct notify_param
+{
+    struct proto_conn *conn;
+    struct proto_ta *ta;
+};
+
+static bool sub_notify_cb(int64_t sub_id, struct sub *sub, void *cb_data)
+{
+    struct notify_param *param = cb_data;
+
+    int64_t client_id = sub_get_client_id(sub);
+    char *filter_s = sub_get_filter_str(sub);
+
+    struct msg *msg =
+	proto_ta_notify(param->ta, &sub_id, &client_id, filter_s);
+
+    queue_bulk(param->conn, msg);
+
+    ut_free(filter_s);
+
+    return true;
+}
+
+static void handle_subscriptions(struct proto_conn *conn, struct proto_ta *ta)
+{
+    queue_bulk(conn, proto_ta_accept(ta));
+
+    if (conn->query_pool != NULL) {
+	submit_query(conn, query_type_subscriptions, ta, NULL);
+	return;
+    }
+
+    struct notify_param param = { .conn = conn, .ta = ta };
+
+    shards_foreach_sub(conn->shards, sub_notify_cb, &param);
+
+    queue_bulk(conn, proto_ta_complete(ta));
+    proto_ta_destroy(ta);
+}
+
+static bool client_notify_cb(int64_t client_id, struct client *client,
+			     void *cb_data)
+{
+    if (client_is_connected(client)) {
+	struct notify_param *param = cb_data;
+	const char *client_addr = client_get_conn_remote_addr(client);
+	int64_t connection_time =
+	    (int64_t)client_get_conn_connected_at(client);
+
+	struct msg *msg = proto_ta_notify(param->ta, &client_id, client_addr,
+					  &connection_time);
+
+	queue_bulk(param->conn, msg);
+    }
+    return true;
+}
+
+static void handle_clients(struct proto_conn *conn, struct proto_ta *ta)
+{
+    queue_bulk(conn, proto_ta_accept(ta));
+
+    if (conn->query_pool != NULL) {
+	submit_query(conn, query_type_clients, ta, NULL);
+	return;
+    }
+
+    struct notify_param param = { .conn = conn, .ta = ta };
+
+    shards_foreach_client(conn->shards, client_notify_cb, &param);
+
+    queue_bulk(conn, proto_ta_complete(ta));
+    proto_ta_destroy(ta);
+}
+
+static void disconnect_client(struct proto_conn *conn)
+{
+    if (has_finished_handshake(conn)) {
+	shards_client_disconnect(conn->shards, conn->client_id);
+
+	if (conn->upstream != NULL)
+	    upstream_client_disconnect(conn->upstream, conn->client_id);
+    }
+}
+
+static bool disconnect_session(int64_t session_id,
+			       struct proto_conn *session, void *cb_data)
+{
+    disconnect_client(session);
+    return true;
+}
+
+static void term(struct proto_conn *conn)
+{
+    ut_assert(!conn->term);
+
+    disconnect_client(conn);
+
+    if (conn->sessions != NULL)
+	session_map_foreach(conn->sessions, disconnect_session, NULL);
+
+    if (conn->io == NULL)
+	event_del(&conn->sock_event);
+
+    conn->term = true;
+
+    conn->term_cb(conn, conn->cb_data);
+}
+
+static void drop_notifications(struct proto_conn *conn)
+{
+    size_t i;
+    for (i = 0; i < out_queue_len(conn->bulk_queue); i++) {
+	struct out_msg *out_msg = out_queue_get(conn->bulk_queue, i);
+
+	if (out_msg->sub_id >= 0 && out_msg->msg != NULL)
+	    drop_msg(conn, out_msg);
+    }
+
+    unindex_all(conn);
+}
+
+static bool destroy_resumable(int64_t sub_id, struct resumable *resumable,
+			      void *cb_data)
+{
+    ut_free(resumable);
+    return true;
+}
+
+static bool fail_sub(int64_t sub_id, struct proto_ta *sub_ta, void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
+
+    int rc = shards_unsubscribe(conn->shards, conn->client_id, sub_id);
+    ut_assert(rc == 0);
+
+    struct msg *response =
+	proto_ta_fail(sub_ta, PROTO_FAIL_REASON_INSUFFICIENT_RESOURCES);
+
+    queue_bulk(conn, response);
+
+    proto_ta_destroy(sub_ta);
+
+    return true;
+}
+
+static void fail_subs(struct proto_conn *conn)
+{
+    proto_ta_map_foreach(conn->sub_tas, fail_sub, conn);
+    proto_ta_map_clear(conn->sub_tas);
+
+    resumable_map_foreach(conn->resumables, destroy_resumable, NULL);
+    resumable_map_clear(conn->resumables);
+}
+
+static bool count_session_subs(int64_t session_id,
+			       struct proto_conn *session, void *cb_data)
+{
+    size_t *num_subs = cb_data;
+
+    *num_subs += proto_ta_map_size(session->sub_tas);
+
+    return true;
+}
+
+static bool fail_session_subs(int64_t session_id,
+			      struct proto_conn *session, void *cb_data)
+{
+    fail_subs(session);
+    return true;
+}
+
+/* Returns true if the output queue is back within limits. The
+   subscriptions of all sessions sharing the connection are failed. */
+static bool resync_subs(struct proto_conn *conn)
+{
+    size_t num_subs = proto_ta_map_size(conn->sub_tas);
+
+    if (conn->sessions != NULL)
+	session_map_foreach(conn->sessions, count_session_subs, &num_subs);
+
+    if (num_subs == 0)
+	return false;
+
+    log_info_c(conn->log_ctx, "Failing %zd subscriptions, requiring the "
+	       "client to resynchronize.", num_subs);
+
+    drop_notifications(conn);
+
+    fail_subs(conn);
+
+    if (conn->sessions != NULL)
+	session_map_foreach(conn->sessions, fail_session_subs, NULL);
+
+    return !exceeds(conn->out_bytes, conn->conf.hard_out_limit);
+}
+
+static void overload_cb(int fd, short ev, void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
+
+    if (conn->conf.slow_policy == proto_conn_slow_policy_resync &&
+	resync_subs(conn)) {
+	conn->overloaded = false;
+	await_update(conn);
+	return;
+    }
+
+    log_info_c(conn->log_ctx, "Disconnecting slow consumer.");
+
+    term(conn);
+}
+
+static int handle_req(struct proto_conn *conn, const struct msg *req_msg,
+		      json_t *req_json)
+{
+    struct proto_ta *ta = create_ta(conn);
+
+    int rc = req_json != NULL ?
+	proto_ta_req_json(ta, req_json) : proto_ta_req(ta, req_msg);
+
+    if (rc < 0)
+	goto err;
+
+    const char *cmd = proto_ta_get_cmd(ta);
+
+    if (strcmp(cmd, PROTO_CMD_HELLO) == 0)
+	handle_hello(conn, ta);
+    else if (!has_finished_handshake(conn))
+	handle_no_hello(conn, ta);
+    else if (strcmp(cmd, PROTO_CMD_PUBLISH) == 0 ||
+	     strcmp(cmd, PROTO_CMD_UNPUBLISH) == 0 ||
+	     strcmp(cmd, PROTO_CMD_SERVICES) == 0 ||
+	     strcmp(cmd, PROTO_CMD_SUBSCRIPTIONS) == 0 ||
+	     strcmp(cmd, PROTO_CMD_CLIENTS) == 0 ||
+	     strcmp(cmd, PROTO_CMD_BATCH) == 0) {
+	/* These handlers take ownership of the transaction, which
+	   may be finished (and destroyed) before they return, or
+	   later, when the sd or query result comes in. */
+	if (strcmp(cmd, PROTO_CMD_PUBLISH) == 0)
+	    handle_publish(conn, ta);
+	else if (strcmp(cmd, PROTO_CMD_UNPUBLISH) == 0)
+	    handle_unpublish(conn, ta);
+	else if (strcmp(cmd, PROTO_CMD_SERVICES) == 0)
+	    handle_services(conn, ta);
+	else if (strcmp(cmd, PROTO_CMD_SUBSCRIPTIONS) == 0)
+	    handle_subscriptions(conn, ta);
+	else if (strcmp(cmd, PROTO_CMD_CLIENTS) == 0)
+	    handle_clients(conn, ta);
+	else if (handle_batch(conn, ta) < 0)
+	    goto err;
+	return 0;
+    } else if (strcmp(cmd, PROTO_CMD_SUBSCRIBE) == 0)
+	handle_subscribe(conn, ta);
+    else if (strcmp(cmd, PROTO_CMD_UNSUBSCRIBE) == 0)
+	handle_unsubscribe(conn, ta);
+    else if (strcmp(cmd, PROTO_CMD_PING) == 0)
+	handle_ping(conn, ta);
+    else if (strcmp(cmd, PROTO_CMD_CLOSE) == 0)
+	handle_close(conn, ta);
+    else
+	ut_assert(0);
+
+    if (proto_ta_has_term(ta))
+	proto_ta_destroy(ta);
+
+    return 0;
+
+err:
+    proto_ta_destroy(ta);
+
+    return -1;
+}
+
+static struct proto_conn *session_create(struct proto_conn *transport,
+					 int64_t session_id);
+static void close_session(struct proto_conn *session);
+
+/* A request without a session id is for the primary session. A
+   request for an unknown session starts a new one, which is kept
+   only if the request completes its handshake. */
+static int handle_mux_req(struct proto_conn *conn, json_t *req_json)
+{
+    json_t *session_id_json = json_object_get(req_json,
+					      PROTO_FIELD_SESSION_ID);
+
+    if (session_id_json == NULL)
+	return handle_req(conn, NULL, req_json);
+
+    int64_t session_id = json_integer_value(session_id_json);
+
+    if (!json_is_integer(session_id_json) || session_id < 0) {
+	log_info_c(conn->log_ctx, "Request has an invalid session id.");
+	return -1;
+    }
+
+    /* The field is not a part of the transaction */
+    json_object_del(req_json, PROTO_FIELD_SESSION_ID);
+
+    if (session_id == 0)
+	return handle_req(conn, NULL, req_json);
+
+    struct proto_conn *session = session_map_get(conn->sessions, session_id);
+
+    if (session == NULL) {
+	if (session_map_size(conn->sessions) >= MAX_SESSIONS) {
+	    log_info_c(conn->log_ctx, "Rejected session %"PRId64", with the "
+		       "limit of %d sessions reached.", session_id,
+		       MAX_SESSIONS);
+	    return -1;
+	}
+
+	session = session_create(conn, session_id);
+	session_map_add(conn->sessions, session_id, session);
+    }
+
+    int rc = handle_req(session, NULL, req_json);
+
+    if (session->closed || !has_finished_handshake(session))
+	close_session(session);
+
+    return rc;
+}
+
+static int dispatch_req(struct proto_conn *conn, const struct msg *req_msg,
+			json_t *req_json)
+{
+    if (!(conn->extensions & EXT_MUX))
+	return handle_req(conn, req_msg, req_json);
+
+    if (req_json != NULL)
+	return handle_mux_req(conn, req_json);
+
+    json_error_t json_err;
+    json_t *parsed_json =
+	json_loadb(msg_data(req_msg), msg_len(req_msg), 0, &json_err);
+
+    if (parsed_json == NULL) {
+	log_info_c(conn->log_ctx, "Error parsing request message JSON at "
+		   "(%d, %d): %s.", json_err.line, json_err.column,
+		   json_err.text);
+	return -1;
+    }
+
+    int rc = handle_mux_req(conn, parsed_json);
+
+    json_decref(parsed_json);
+
+    return rc;
+}
+
+/* Answers a ping request of the primary session without parsing it,
+   which makes latency probes cheap. Returns false if the request is
+   to take the ordinary path. */
+static bool try_fast_ping(struct proto_conn *conn, const char *data,
+			  size_t len)
+{
+    int64_t ta_id;
+
+    /* Binary connections are answered in the binary encoding */
+    if (conn->dict != NULL || !has_finished_handshake(conn) ||
+	!proto_ping_scan(data, len, &ta_id))
+	return false;
+
+    log_debug_c(conn->log_ctx, "\"%s\" command request received with "
+		"transaction id %"PRId64".", PROTO_CMD_PING, ta_id);
+
+    queue_response(conn, proto_ping_complete(ta_id));
+
+    return true;
+}
+
+/* Returns 1 if more messages may be available, 0 if not, and -1 if
+   the connection was terminated. */
+static int try_receive(struct proto_conn *conn, size_t max_batch)
+{
+    char buf[65536];
+    char plain[65536];
+
+    size_t i;
+    for (i = 0; i < max_batch; i++) {
+	if (conn->term || !may_receive(conn))
+	    return 0;
+
+	/* Requests causing a large fan-out may generate more output
+	   than can be sent in one scheduler run. */
+	if (i > 0 && out_budget_used(conn->budget) > SCHED_MAX_BACKLOG)
+	    return 1;
+
+	json_t *req_json = NULL;
+	int xcm_rc;
+
+	if (conn->io != NULL)
+	    xcm_rc = io_conn_receive(conn->io, &req_json);
+	else
+	    xcm_rc = xcm_receive(conn->sock, buf, sizeof(buf) - 1);
+
+	if (xcm_rc > 0 && req_json != NULL) {
+	    int rc = dispatch_req(conn, NULL, req_json);
+
+	    json_decref(req_json);
+
+	    if (rc < 0)
+		goto term;
+	} else if (xcm_rc > 0) {
+	    char *data = buf;
+	    int len = xcm_rc;
+
+	    if (conn->inflater != NULL) {
+		data = plain;
+		len = inflater_decompress(conn->inflater, buf, xcm_rc, plain,
+					  sizeof(plain) - 1);
+
+		if (len < 0) {
+		    log_info_c(conn->log_ctx, "Error decompressing %d-byte "
+			       "message.", xcm_rc);
+		    goto term;
+		}
+	    }
+
+	    if (proto_bin_is_bin(data, len))
+		log_debug_c(conn->log_ctx, "Received %d-byte binary "
+			    "message.", len);
+	    else {
+		/* NUL terminate */
+		data[len] = '\0';
+		log_debug_c(conn->log_ctx, "Received message: %s", data);
+
+		if (try_fast_ping(conn, data, len))
+		    continue;
+	    }
+
+	    struct msg *msg = msg_create(data, len);
+
+	    int rc = dispatch_req(conn, msg, NULL);
+
+	    msg_destroy(msg);
+
+	    if (rc < 0)
+		goto term;
+	} else if (xcm_rc < 0) {
+	    if (errno != EAGAIN) {
+		log_info_c(conn->log_ctx, "Error receiving message on "
+			   "socket: %s", strerror(errno));
+		goto term;
+	    }
+	    return 0;
+	} else {
+	    log_info_c(conn->log_ctx, "Peer closed connection.");
+
+	    goto term;
+	}
+    }
+
+    return 1;
+
+term:
+    term(conn);
+    return -1;
+}
+
+/* The high lane is served first, except when it has been for
+   MAX_HIGH_STREAK messages in a row, in which case the bulk lane gets
+   a turn. */
+static struct out_queue *next_lane(struct proto_conn *conn)
+{
+    bool high_waiting = out_queue_len(conn->high_queue) > 0;
+    bool bulk_waiting = out_queue_len(conn->bulk_queue) > 0;
+
+    if (high_waiting && (!bulk_waiting ||
+			 conn->high_streak < MAX_HIGH_STREAK))
+	return conn->high_queue;
+
+    return bulk_waiting ? conn->bulk_queue : NULL;
+}
+
+static struct msg *create_bin_envelope(struct out_queue *lane,
+				       size_t num_entries)
+{
+    struct proto_bin_writer writer;
+    size_t i;
+
+    proto_bin_writer_init(&writer);
+
+    proto_bin_write_u8(&writer, PROTO_BIN_MAGIC);
+    proto_bin_write_u8(&writer, PROTO_BIN_ENVELOPE);
+
+    for (i = 0; i < num_entries; i++) {
+	struct out_msg *out_msg = out_queue_get(lane, i);
+
+	if (out_msg->msg != NULL)
+	    proto_bin_write_str(&writer, msg_data(out_msg->msg),
+				msg_len(out_msg->msg));
+    }
+
+    return proto_bin_writer_morph(&writer);
+}
+
+/* Packs the messages at the head of the bulk lane into an envelope
+   of at most 'max_len' bytes, in the binary encoding if 'binary' is
+   true. Returns NULL if fewer than two messages fit, and otherwise
+   the envelope, with the number of queue entries it covers in
+   'num_entries'. */
+static struct msg *create_envelope(struct out_queue *lane, bool binary,
+				   size_t max_len, size_t *num_entries)
+{
+    size_t len = binary ? BIN_ENVELOPE_HEAD_LEN :
+	strlen(ENVELOPE_HEAD) + strlen(ENVELOPE_TAIL);
+    size_t num_msgs = 0;
+    size_t i;
+
+    for (i = 0; i < out_queue_len(lane); i++) {
+	struct out_msg *out_msg = out_queue_get(lane, i);
+
+	if (out_msg->msg == NULL)
+	    continue;
+
+	/* prefixed by a length, or separated by a comma */
+	size_t sep_len = binary ? sizeof(uint32_t) : (num_msgs > 0 ? 1 : 0);
+	size_t add_len = msg_len(out_msg->msg) + sep_len;
+
+	if (len + add_len > max_len)
+	    break;
+
+	len += add_len;
+	num_msgs++;
+    }
+
+    if (num_msgs < 2)
+	return NULL;
+
+    *num_entries = i;
+
+    if (binary)
+	return create_bin_envelope(lane, i);
+
+    char *data = ut_malloc(len);
+    size_t offset = 0;
+    size_t j;
+
+    memcpy(data, ENVELOPE_HEAD, strlen(ENVELOPE_HEAD));
+    offset += strlen(ENVELOPE_HEAD);
+
+    for (j = 0; j < i; j++) {
+	struct out_msg *out_msg = out_queue_get(lane, j);
+
+	if (out_msg->msg == NULL)
+	    continue;
+
+	if (offset > strlen(ENVELOPE_HEAD))
+	    data[offset++] = ',';
+
+	memcpy(data + offset, msg_data(out_msg->msg), msg_len(out_msg->msg));
+	offset += msg_len(out_msg->msg);
+    }
+
+    memcpy(data + offset, ENVELOPE_TAIL, strlen(ENVELOPE_TAIL));
+
+    return msg_create_prealloc(data, len);
+}
+
+/* Messages dropped, or handed over to an I/O thread, are already
+   accounted for */
+static void dequeue(struct proto_conn *conn, struct out_queue *lane)
+{
+    struct out_msg *out_msg = out_queue_pop(lane);
+
+    if (out_msg->sub_id >= 0)
+	unindex_pending(conn, out_msg);
+
+    if (out_msg == conn->group_tail)
+	conn->group_tail = NULL;
+
+    if (out_msg->msg != NULL) {
+	account_dequeued(conn, msg_len(out_msg->msg));
+	msg_destroy(out_msg->msg);
+    }
+
+    free_out_msg(out_msg);
+}
+
+static void log_sent(struct proto_conn *conn, const struct msg *msg)
+{
+    const void *data = msg_data(msg);
+    size_t len = msg_len(msg);
+
+    if (proto_bin_is_bin(data, len))
+	log_debug_c(conn->log_ctx, "Sent %zd-byte binary message.", len);
+    else if (log_is_debug_enabled()) {
+	/* NUL terminate */
+	char sdata[len + 1];
+	memcpy(sdata, data, len);
+	sdata[len] = '\0';
+
+	log_debug_c(conn->log_ctx, "Sent message: %s", sdata);
+    }
+}
+
+static void update_streak(struct proto_conn *conn, struct out_queue *lane)
+{
+    if (lane == conn->high_queue && out_queue_len(conn->bulk_queue) > 0)
+	conn->high_streak++;
+    else
+	conn->high_streak = 0;
+}
+
+/* Sends the compressed message held by the connection. Returns false
+   if it couldn't be sent, with the return value of try_send() in
+   'rc'. */
+static bool send_deflated(struct proto_conn *conn, size_t *sent, int *rc)
+{
+    struct msg *msg = conn->deflated;
+    size_t len = msg_len(msg);
+
+    if (len > conn->deficit) {
+	*rc = 1;
+	return false;
+    }
+
+    /* An I/O thread takes ownership of the message */
+    int send_rc = conn->io != NULL ? io_conn_send(conn->io, msg) :
+	xcm_send(conn->sock, msg_data(msg), len);
+
+    if (send_rc < 0) {
+	if (errno == EAGAIN) {
+	    conn->deficit = 0;
+	    *rc = 0;
+	} else {
+	    term(conn);
+	    *rc = -1;
+	}
+	return false;
+    }
+
+    if (conn->io == NULL)
+	msg_destroy(msg);
 
-    queue_response(param->conn, msg);
+    conn->deflated = NULL;
+    conn->deficit -= len;
+    *sent += len;
 
     return true;
 }
 
-static void handle_services(struct proto_conn *conn, struct proto_ta *ta)
+/* Compresses the message at the head of the lane, covering
+   'num_entries' entries, which are dequeued right away. Once
+   compressed, a message must be sent as-is, or the compression
+   history of the client and the server would differ. */
+static int deflate_head(struct proto_conn *conn, struct out_queue *lane,
+			struct msg *msg, size_t num_entries)
 {
-    const char *filter_s = proto_ta_get_opt_req_field_str_value(ta, 0);
+    if (conn->io == NULL)
+	log_sent(conn, msg);
 
-    struct filter *filter = NULL;
+    conn->deflated = deflater_compress(conn->deflater, msg_data(msg),
+				       msg_len(msg));
 
-    if (filter_s != NULL) {
-	filter = filter_parse(filter_s);
+    if (msg != out_queue_peek(lane)->msg)
+	msg_destroy(msg);
 
-	if (filter == NULL) {
-	    log_info_c(conn->log_ctx, "Received services request with invalid "
-		       "filter \"%s\".", filter_s);
-	    struct msg *response =
-		proto_ta_fail(ta, PROTO_FAIL_REASON_INVALID_FILTER_SYNTAX);
-	    queue_response(conn, response);
-	    return;
-	}
+    update_streak(conn, lane);
+
+    while (num_entries-- > 0)
+	dequeue(conn, lane);
+
+    if (conn->deflated == NULL) {
+	log_error_c(conn->log_ctx, "Error compressing message.");
+	term(conn);
+	return -1;
     }
 
-    queue_response(conn, proto_ta_accept(ta));
+    return 0;
+}
 
-    struct notify_param param = { .conn = conn, .ta = ta };
+/* Sends messages within the connection's deficit. Returns 1 if the
+   deficit ran out with messages still queued, 0 if the queue was
+   emptied or the socket would block, and -1 if the connection was
+   terminated. */
+static int try_send(struct proto_conn *conn, size_t *sent)
+{
+    /* Once output is attempted, the lane's tail may be compressed
+       or enveloped */
+    finish_group(conn);
+    conn->group_tail = NULL;
 
-    sd_foreach_service(conn->sd, filter, service_notify_cb, &param);
+    for (;;) {
+	int rc;
 
-    queue_response(conn, proto_ta_complete(ta));
+	if (conn->deflated != NULL && !send_deflated(conn, sent, &rc))
+	    return rc;
 
-    filter_destroy(filter);
-}
+	struct out_queue *lane = next_lane(conn);
 
-static bool sub_notify_cb(int64_t sub_id, struct sub *sub, void *cb_data)
-{
-    struct notify_param *param = cb_data;
+	if (lane == NULL)
+	    break;
 
-    int64_t client_id = sub_get_client_id(sub);
-    char *filter_s = sub_get_filter_str(sub);
+	struct out_msg *out_msg = out_queue_peek(lane);
 
-    struct msg *msg =
-	proto_ta_notify(param->ta, &sub_id, &client_id, filter_s);
+	if (out_msg->msg == NULL) {
+	    out_queue_pop(lane);
+	    free_out_msg(out_msg);
+	    continue;
+	}
 
-    queue_response(param->conn, msg);
+	struct msg *msg = out_msg->msg;
+	size_t num_entries = 1;
 
-    ut_free(filter_s);
+	if (lane == conn->bulk_queue && (conn->extensions & EXT_ENVELOPE)) {
+	    size_t max_len = conn->deficit < MAX_ENVELOPE_SIZE ?
+		conn->deficit : MAX_ENVELOPE_SIZE;
+	    struct msg *envelope =
+		create_envelope(lane, conn->dict != NULL, max_len,
+				&num_entries);
 
-    return true;
-}
+	    if (envelope != NULL)
+		msg = envelope;
+	}
 
-static void handle_subscriptions(struct proto_conn *conn, struct proto_ta *ta)
-{
-    queue_response(conn, proto_ta_accept(ta));
+	if (!out_msg->plain) {
+	    if (deflate_head(conn, lane, msg, num_entries) < 0)
+		return -1;
+	    continue;
+	}
 
-    struct notify_param param = { .conn = conn, .ta = ta };
+	const void *data = msg_data(msg);
+	size_t len = msg_len(msg);
 
-    sd_foreach_sub(conn->sd, sub_notify_cb, &param);
+	if (len > conn->deficit)
+	    return 1;
 
-    queue_response(conn, proto_ta_complete(ta));
-}
+	/* An I/O thread takes ownership of the message */
+	rc = conn->io != NULL ? io_conn_send(conn->io, msg) :
+	    xcm_send(conn->sock, data, len);
 
-static bool client_notify_cb(int64_t client_id, struct client *client,
-			     void *cb_data)
-{
-    if (client_is_connected(client)) {
-	struct notify_param *param = cb_data;
-	const char *client_addr = client_get_conn_remote_addr(client);
-	int64_t connection_time =
-	    (int64_t)client_get_conn_connected_at(client);
+	if (rc < 0) {
+	    if (msg != out_msg->msg)
+		UT_PROTECT_ERRNO(msg_destroy(msg));
 
-	struct msg *msg = proto_ta_notify(param->ta, &client_id, client_addr,
-					  &connection_time);
+	    if (errno == EAGAIN) {
+		conn->deficit = 0;
+		return 0;
+	    }
+
+	    term(conn);
+
+	    return -1;
+	}
+
+	if (conn->io == NULL)
+	    log_sent(conn, msg);
+
+	conn->deficit -= len;
+	*sent += len;
 
-	queue_response(param->conn, msg);
+	update_streak(conn, lane);
+
+	if (conn->io != NULL) {
+	    if (msg == out_msg->msg) {
+		out_msg->msg = NULL;
+		account_dequeued(conn, len);
+	    }
+	} else if (msg != out_msg->msg)
+	    msg_destroy(msg);
+
+	while (num_entries-- > 0)
+	    dequeue(conn, lane);
     }
-    return true;
-}
 
-static void handle_clients(struct proto_conn *conn, struct proto_ta *ta)
-{
-    queue_response(conn, proto_ta_accept(ta));
+    /* An idle connection doesn't accumulate send allowance */
+    conn->deficit = 0;
 
-    struct notify_param param = { .conn = conn, .ta = ta };
+    return 0;
+}
 
-    sd_foreach_client(conn->sd, client_notify_cb, &param);
+static void sched_run_later(struct proto_sched *sched)
+{
+    const struct timeval next_iteration = { 0 };
 
-    queue_response(conn, proto_ta_complete(ta));
+    /* A timeout is only considered after the next poll for I/O
+       events, which gives newly readable connections a chance to
+       join the next run. */
+    event_add(&sched->run_event, &next_iteration);
 }
 
-static void term(struct proto_conn *conn)
+static void sched_add(struct proto_sched *sched, struct proto_conn *conn)
 {
-    ut_assert(!conn->term);
+    if (conn->runnable)
+	return;
 
-    if (has_finished_handshake(conn))
-	sd_client_disconnect(conn->sd, conn->client_id);
+    TAILQ_INSERT_TAIL(&sched->runnable, conn, runnable_entry);
+    sched->num_runnable++;
+    conn->runnable = true;
 
-    event_del(&conn->sock_event);
+    /* Connections still runnable at the end of a run are served in
+       the next event loop iteration. */
+    if (!sched->running)
+	event_active(&sched->run_event, 0, 0);
+}
 
-    conn->term = true;
+static void sched_remove(struct proto_sched *sched, struct proto_conn *conn)
+{
+    if (!conn->runnable)
+	return;
 
-    conn->term_cb(conn, conn->cb_data);
+    TAILQ_REMOVE(&sched->runnable, conn, runnable_entry);
+    sched->num_runnable--;
+    conn->runnable = false;
 }
 
-static int handle_req(struct proto_conn *conn, const struct msg *req_msg)
+static size_t clamp(size_t value, size_t min, size_t max)
 {
-    struct proto_ta *ta = proto_ta_create(conn->log_ctx);
+    if (value < min)
+	return min;
+    else if (value > max)
+	return max;
+    else
+	return value;
+}
 
-    int rc = proto_ta_req(ta, req_msg);
+/* Receive processing is done for every runnable connection in every
+   run, keeping control traffic responsive. Transmission is spread
+   over the connections using deficit round-robin, until the domain's
+   send budget for the run is exhausted. Connections not served stay
+   at the head of the queue, and are first in line in the next run. */
+static void sched_run(struct proto_sched *sched)
+{
+    size_t num = sched->num_runnable;
 
-    if (rc < 0)
-	goto err;
+    if (num == 0)
+	return;
 
-    if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_HELLO) == 0)
-	handle_hello(conn, ta);
-    else {
-	if (!has_finished_handshake(conn))
-	    handle_no_hello(conn, ta);
-	else if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_SUBSCRIBE) == 0)
-	    handle_subscribe(conn, ta);
-	else if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_UNSUBSCRIBE) == 0)
-	    handle_unsubscribe(conn, ta);
-	else if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_PUBLISH) == 0)
-	    handle_publish(conn, ta);
-	else if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_UNPUBLISH) == 0)
-	    handle_unpublish(conn, ta);
-	else if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_PING) == 0)
-	    handle_ping(conn, ta);
-	else if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_SERVICES) == 0)
-	    handle_services(conn, ta);
-	else if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_SUBSCRIPTIONS) == 0)
-	    handle_subscriptions(conn, ta);
-	else if (strcmp(proto_ta_get_cmd(ta), PROTO_CMD_CLIENTS) == 0)
-	    handle_clients(conn, ta);
-	else
-	    ut_assert(0);
-    }
+    size_t receive_batch;
 
-    if (proto_ta_has_term(ta))
-	proto_ta_destroy(ta);
+    /* Hold back on new work, if the output already queued will take
+       more than one run to send. */
+    if (out_budget_used(sched->budget) > SCHED_MAX_BACKLOG)
+	receive_batch = MIN_RECEIVE_BATCH;
+    else
+	receive_batch = clamp(SCHED_RECEIVE_BUDGET / num, MIN_RECEIVE_BATCH,
+			      MAX_RECEIVE_BATCH);
 
-    return 0;
+    struct proto_conn *conn = TAILQ_FIRST(&sched->runnable);
+    size_t i;
 
-err:
-    proto_ta_destroy(ta);
+    for (i = 0; i < num && conn != NULL; i++) {
+	struct proto_conn *next = TAILQ_NEXT(conn, runnable_entry);
 
-    return -1;
-}
+	int rc = try_receive(conn, receive_batch);
 
-static int try_receive(struct proto_conn *conn)
-{
-    char buf[65536];
+	if (rc >= 0) {
+	    conn->receive_pending = rc > 0;
+	    await_update(conn);
+	}
 
-    int xcm_rc = xcm_receive(conn->sock, buf, sizeof(buf) - 1);
+	conn = next;
+    }
 
-    if (xcm_rc > 0) {
-	/* NUL terminate */
-	buf[xcm_rc] = '\0';
-	log_debug_c(conn->log_ctx, "Received message: %s", buf);
+    /* Connections may have been terminated while receiving */
+    num = sched->num_runnable;
 
-	struct msg *msg = msg_create(buf, xcm_rc);
+    size_t quantum = num > 0 ?
+	clamp(SCHED_SEND_BUDGET / num, MIN_SEND_QUANTUM, SCHED_SEND_BUDGET) :
+	0;
+    size_t send_budget = SCHED_SEND_BUDGET;
 
-	int rc = handle_req(conn, msg);
+    for (i = 0; i < num && send_budget > 0; i++) {
+	conn = TAILQ_FIRST(&sched->runnable);
 
-	msg_destroy(msg);
+	sched_remove(sched, conn);
+
+	size_t sent = 0;
+
+	conn->deficit += quantum;
+
+	int rc = try_send(conn, &sent);
 
 	if (rc < 0)
-	    goto term;
+	    continue;
 
-    } else if (xcm_rc < 0) {
-	if (errno != EAGAIN) {
-	    log_info_c(conn->log_ctx, "Error receiving message on "
-		       "socket: %s", strerror(errno));
-	    goto term;
-	}
-    } else {
-	log_info_c(conn->log_ctx, "Peer closed connection.");
+	send_budget = sent < send_budget ? send_budget - sent : 0;
 
-	goto term;
+	if (rc > 0 || conn->receive_pending)
+	    sched_add(sched, conn);
     }
 
-    await_update(conn);
+    /* Of the connections not given the opportunity to send, those
+       with nothing to send or receive are done. */
+    conn = TAILQ_FIRST(&sched->runnable);
 
-    return 0;
+    for (; i < num && conn != NULL; i++) {
+	struct proto_conn *next = TAILQ_NEXT(conn, runnable_entry);
 
-term:
-    term(conn);
-    return -1;
+	if (!conn->receive_pending && out_len(conn) == 0)
+	    sched_remove(sched, conn);
+
+	conn = next;
+    }
 }
 
-static int try_send(struct proto_conn *conn)
+static void run_cb(int fd, short ev, void *cb_data)
 {
-    int i;
-    for (i = 0; i < MAX_SEND_BATCH; i++) {
-	struct msg *out_msg = msg_queue_peek(conn->out_queue);
+    struct proto_sched *sched = cb_data;
 
-	if (out_msg == NULL)
-	    return 0;
+    sched->running = true;
 
-	int rc = xcm_send(conn->sock, msg_data(out_msg), msg_len(out_msg));
+    sched_run(sched);
 
-	if (rc < 0) {
-	    if (errno == EAGAIN)
-		return 0;
+    sched->running = false;
 
-	    term(conn);
+    if (sched->num_runnable > 0)
+	sched_run_later(sched);
+}
 
-	    return -1;
-	}
+struct proto_sched *proto_sched_create(struct event_base *event_base,
+				       struct out_budget *budget)
+{
+    struct proto_sched *sched = ut_malloc(sizeof(struct proto_sched));
+
+    *sched = (struct proto_sched) {
+	.event_base = event_base,
+	.budget = budget
+    };
 
-	if (log_is_debug_enabled()) {
-	    size_t len = msg_len(out_msg);
+    TAILQ_INIT(&sched->runnable);
 
-	    /* NUL terminate */
-	    char sdata[len + 1];
-	    memcpy(sdata, msg_data(out_msg), len);
-	    sdata[len] = '\0';
+    event_assign(&sched->run_event, event_base, -1, 0, run_cb, sched);
 
-	    log_debug_c(conn->log_ctx, "Sent message: %s", sdata);
-	}
+    return sched;
+}
 
-	msg_queue_pop(conn->out_queue);
+void proto_sched_destroy(struct proto_sched *sched)
+{
+    if (sched != NULL) {
+	ut_assert(sched->num_runnable == 0);
+
+	event_del(&sched->run_event);
 
-	msg_destroy(out_msg);
+	ut_free(sched);
     }
+}
 
-    await_update(conn);
+static void process_cb(int fd, short ev, void *cb_data)
+{
+    struct proto_conn *conn = cb_data;
 
-    return 0;
+    sched_add(conn->sched, conn);
 }
 
-static void conn_process(struct proto_conn *conn)
+static void io_ready_cb(void *cb_data)
 {
-    if (try_receive(conn) < 0)
-	return;
-    if (try_send(conn) < 0)
-	return;
+    struct proto_conn *conn = cb_data;
+
+    sched_add(conn->sched, conn);
 }
 
-static void process_cb(int fd, short ev, void *cb_data)
+static void flush_cb(int fd, short ev, void *cb_data)
 {
-    conn_process(cb_data);
+    struct proto_conn *conn = cb_data;
+
+    /* For a connection which was idle, start transmission right
+       away, rather than waiting for the socket to become writable. */
+    if (!(conn->condition & XCM_SO_SENDABLE) &&
+	out_len(conn) > 0 && !conn->runnable) {
+	size_t sent = 0;
+
+	conn->deficit += MIN_SEND_QUANTUM;
+
+	int rc = try_send(conn, &sent);
+
+	if (rc < 0)
+	    return;
+	else if (rc > 0)
+	    sched_add(conn->sched, conn);
+    }
+
+    set_condition(conn);
 }
 
 struct proto_conn *proto_conn_create(struct xcm_socket *conn_sock,
-				     struct sd *sd,
+				     struct shards *shards,
 				     struct event_base *event_base,
+				     const struct proto_conn_conf *conf,
+				     struct out_budget *budget,
+				     struct proto_sched *sched,
+				     struct io_pool *io_pool,
+				     struct query_pool *query_pool,
+				     struct upstream *upstream,
 				     const struct log_ctx *log_ctx,
 				     proto_conn_cb handshake_cb,
 				     proto_conn_cb term_cb,
@@ -633,9 +2815,13 @@ struct proto_conn *proto_conn_create(struct xcm_socket *conn_sock,
     struct proto_conn *conn = ut_malloc(sizeof(struct proto_conn));
 
     *conn = (struct proto_conn) {
-	.sock = conn_sock,
-	.sd = sd,
+	.shards = shards,
+	.query_pool = query_pool,
+	.upstream = upstream,
 	.event_base = event_base,
+	.conf = *conf,
+	.budget = budget,
+	.sched = sched,
 	.log_ctx = log_ctx_create_prefix(log_ctx, "%s", "<client: ?> "),
 	.handshake_cb = handshake_cb,
 	.term_cb = term_cb,
@@ -643,9 +2829,30 @@ struct proto_conn *proto_conn_create(struct xcm_socket *conn_sock,
 	.established_at = ut_ftime(),
 	.client_id = -1,
 	.sub_tas = proto_ta_map_create(),
-	.out_queue = msg_queue_create()
+	.pending_tas = proto_ta_map_create(),
+	.batch_ops = batch_op_map_create(),
+	.high_queue = out_queue_create(),
+	.bulk_queue = out_queue_create(),
+	.pending_notifications = sub_pending_map_create(),
+	.resumables = resumable_map_create()
     };
 
+    event_assign(&conn->overload_event, conn->event_base, -1, 0,
+		 overload_cb, conn);
+
+    event_assign(&conn->flush_event, conn->event_base, -1, 0,
+		 flush_cb, conn);
+
+    event_assign(&conn->sync_timer, conn->event_base, -1, EV_PERSIST,
+		 sync_timer_cb, conn);
+
+    if (io_pool != NULL) {
+	conn->io = io_conn_create(io_pool, conn_sock, io_ready_cb, conn);
+	return conn;
+    }
+
+    conn->sock = conn_sock;
+
     int fd = xcm_fd(conn_sock);
 
     event_assign(&conn->sock_event, conn->event_base, fd, EV_READ|EV_PERSIST,
@@ -654,6 +2861,7 @@ struct proto_conn *proto_conn_create(struct xcm_socket *conn_sock,
     event_add(&conn->sock_event, NULL);
 
     xcm_await(conn->sock, XCM_SO_RECEIVABLE);
+    conn->condition = XCM_SO_RECEIVABLE;
 
     return conn;
 }
@@ -665,6 +2873,145 @@ static bool destroy_proto_ta(int64_t sub_id, struct proto_ta *ta,
     return true;
 }
 
+static bool destroy_batch_op(int64_t op_id, struct batch_op *op,
+			     void *cb_data)
+{
+    struct batch *batch = op->batch;
+
+    /* The batch goes with its last pending operation */
+    batch->num_pending--;
+
+    if (batch->num_pending == 0)
+	batch_destroy(batch);
+
+    ut_free(op);
+
+    return true;
+}
+
+static struct proto_conn *session_create(struct proto_conn *transport,
+					 int64_t session_id)
+{
+    struct proto_conn *session = ut_malloc(sizeof(struct proto_conn));
+
+    *session = (struct proto_conn) {
+	.shards = transport->shards,
+	.query_pool = transport->query_pool,
+	.upstream = transport->upstream,
+	.event_base = transport->event_base,
+	.conf = transport->conf,
+	.budget = transport->budget,
+	.sched = transport->sched,
+	.log_ctx = log_ctx_create_prefix(transport->log_ctx, "<session: "
+					 "%"PRId64"> ", session_id),
+	.established_at = ut_ftime(),
+	.client_id = -1,
+	.transport = transport,
+	.session_id = session_id,
+	.extensions = transport->extensions,
+	.sub_tas = proto_ta_map_create(),
+	.pending_tas = proto_ta_map_create(),
+	.batch_ops = batch_op_map_create(),
+	.resumables = resumable_map_create()
+    };
+
+    event_assign(&session->sync_timer, session->event_base, -1, EV_PERSIST,
+		 sync_timer_cb, session);
+
+    log_debug_c(session->log_ctx, "Session started.");
+
+    return session;
+}
+
+/* Releases what's kept per client, as opposed to per transport */
+static void release_client_state(struct proto_conn *conn)
+{
+    event_del(&conn->sync_timer);
+
+    proto_ta_map_foreach(conn->sub_tas, destroy_proto_ta, NULL);
+    proto_ta_map_destroy(conn->sub_tas);
+
+    if (proto_ta_map_size(conn->pending_tas) > 0 ||
+	batch_op_map_size(conn->batch_ops) > 0 || conn->syncing)
+	shards_cancel(conn->shards, conn);
+    proto_ta_map_foreach(conn->pending_tas, destroy_proto_ta, NULL);
+    proto_ta_map_destroy(conn->pending_tas);
+
+    batch_op_map_foreach(conn->batch_ops, destroy_batch_op, NULL);
+    batch_op_map_destroy(conn->batch_ops);
+
+    if (conn->num_queries > 0)
+	query_pool_cancel(conn->query_pool, conn);
+
+    resumable_map_foreach(conn->resumables, destroy_resumable, NULL);
+    resumable_map_destroy(conn->resumables);
+}
+
+static void session_destroy(struct proto_conn *session)
+{
+    log_debug_c(session->log_ctx, "Tearing down session.");
+
+    release_client_state(session);
+
+    log_ctx_destroy(session->log_ctx);
+
+    ut_free(session);
+}
+
+static bool destroy_session(int64_t session_id, struct proto_conn *session,
+			    void *cb_data)
+{
+    session_destroy(session);
+    return true;
+}
+
+static bool unindex_session_sub(int64_t sub_id, struct proto_ta *sub_ta,
+				void *cb_data)
+{
+    struct proto_conn *transport = cb_data;
+
+    unindex_sub(transport, sub_id);
+
+    return true;
+}
+
+/* Notifications not yet sent are of no use to a closed session */
+static void close_session(struct proto_conn *session)
+{
+    struct proto_conn *transport = session->transport;
+    size_t i;
+
+    disconnect_client(session);
+
+    if (transport->group_session == session)
+	transport->group_tail = NULL;
+
+    for (i = 0; i < out_queue_len(transport->bulk_queue); i++) {
+	struct out_msg *out_msg = out_queue_get(transport->bulk_queue, i);
+
+	if (out_msg->sub_id >= 0 && out_msg->msg != NULL &&
+	    proto_ta_map_has_key(session->sub_tas, out_msg->sub_id))
+	    drop_msg(transport, out_msg);
+    }
+
+    proto_ta_map_foreach(session->sub_tas, unindex_session_sub, transport);
+
+    session_map_del(transport->sessions, session->session_id);
+
+    session_destroy(session);
+}
+
+static void destroy_out_queue(struct out_queue *queue)
+{
+    struct out_msg *out_msg;
+    while ((out_msg = out_queue_pop(queue)) != NULL) {
+	msg_destroy(out_msg->msg);
+	free_out_msg(out_msg);
+    }
+
+    out_queue_destroy(queue);
+}
+
 void proto_conn_destroy(struct proto_conn *conn)
 {
     if (conn != NULL) {
@@ -675,18 +3022,39 @@ void proto_conn_destroy(struct proto_conn *conn)
 	    log_debug_c(conn->log_ctx, "Tearing down protocol connection for "
 			"unknown client.");
 
-	event_del(&conn->sock_event);
+	event_del(&conn->overload_event);
+	event_del(&conn->flush_event);
 
-	xcm_close(conn->sock);
+	sched_remove(conn->sched, conn);
 
-	proto_ta_map_foreach(conn->sub_tas, destroy_proto_ta, NULL);
-	proto_ta_map_destroy(conn->sub_tas);
+	if (conn->io != NULL)
+	    io_conn_close(conn->io);
+	else {
+	    event_del(&conn->sock_event);
+	    xcm_close(conn->sock);
+	}
 
-	struct msg *msg;
-	while ((msg = msg_queue_pop(conn->out_queue)) != NULL)
-	    msg_destroy(msg);
+	if (conn->sessions != NULL) {
+	    session_map_foreach(conn->sessions, destroy_session, NULL);
+	    session_map_destroy(conn->sessions);
+	}
+
+	release_client_state(conn);
 
-	msg_queue_destroy(conn->out_queue);
+	destroy_out_queue(conn->high_queue);
+	destroy_out_queue(conn->bulk_queue);
+
+	out_budget_sub(conn->budget, conn->out_bytes);
+
+	unindex_all(conn);
+	sub_pending_map_destroy(conn->pending_notifications);
+
+	proto_dict_dec_ref(conn->dict);
+
+	msg_destroy(conn->deflated);
+	deflater_destroy(conn->deflater);
+	if (conn->io == NULL)
+	    inflater_destroy(conn->inflater);
 
 	log_ctx_destroy(conn->log_ctx);
 
@@ -701,5 +3069,43 @@ double proto_client_get_established_at(struct proto_conn *conn)
 
 const char *proto_conn_remote_addr(struct proto_conn *conn)
 {
-    return xcm_remote_addr(conn->sock);
+    struct proto_conn *transport = transport_of(conn);
+
+    if (transport->io != NULL)
+	return io_conn_remote_addr(transport->io);
+
+    return xcm_remote_addr(transport->sock);
+}
+
+int64_t proto_conn_get_client_id(struct proto_conn *conn)
+{
+    return conn->client_id;
+}
+
+size_t proto_conn_get_num_sessions(struct proto_conn *conn)
+{
+    return conn->sessions != NULL ? session_map_size(conn->sessions) : 0;
+}
+
+size_t proto_conn_get_out_queue_len(struct proto_conn *conn)
+{
+    return out_len(conn);
+}
+
+bool proto_conn_get_compr_stats(struct proto_conn *conn,
+				struct compr_stats *sent,
+				struct compr_stats *received)
+{
+    if (conn->deflater == NULL)
+	return false;
+
+    deflater_get_stats(conn->deflater, sent);
+    inflater_get_stats(conn->inflater, received);
+
+    return true;
+}
+
+size_t proto_conn_get_out_queue_bytes(struct proto_conn *conn)
+{
+    return conn->out_bytes;
 }
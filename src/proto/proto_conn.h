@@ -9,15 +9,55 @@
 #include <event.h>
 #include <xcm.h>
 
-#include "sd.h"
+#include "compr.h"
+#include "io_pool.h"
+#include "out_budget.h"
+#include "query_pool.h"
+#include "shards.h"
+#include "upstream.h"
 
 struct proto_conn;
 
+enum proto_conn_slow_policy {
+    /* Drop the connection */
+    proto_conn_slow_policy_disconnect,
+    /* Fail all subscriptions, forcing the client to resubscribe */
+    proto_conn_slow_policy_resync
+};
+
+/* Limits are in bytes of queued, not-yet-sent, messages. A limit
+   of zero means no limit. */
+struct proto_conn_conf
+{
+    size_t soft_out_limit;
+    size_t hard_out_limit;
+    enum proto_conn_slow_policy slow_policy;
+};
+
+/* Spreads the work of a domain's connections fairly over event loop
+   iterations. */
+struct proto_sched;
+
+struct proto_sched *proto_sched_create(struct event_base *event_base,
+				       struct out_budget *budget);
+void proto_sched_destroy(struct proto_sched *sched);
+
 typedef void (*proto_conn_cb)(struct proto_conn *conn, void *cb_data);
 
+/* If 'io_pool' is non-NULL, socket I/O and request decoding is done
+   by one of the pool's threads. If 'query_pool' is non-NULL,
+   listings are answered by the pool's threads. If 'upstream' is
+   non-NULL, publish and unpublish requests are forwarded to the
+   upstream server. */
 struct proto_conn *proto_conn_create(struct xcm_socket *conn_sock,
-				     struct sd *sd,
+				     struct shards *shards,
 				     struct event_base *event_base,
+				     const struct proto_conn_conf *conf,
+				     struct out_budget *budget,
+				     struct proto_sched *sched,
+				     struct io_pool *io_pool,
+				     struct query_pool *query_pool,
+				     struct upstream *upstream,
 				     const struct log_ctx *log_ctx,
 				     proto_conn_cb handshake_cb,
 				     proto_conn_cb term_cb,
@@ -28,4 +68,17 @@ double proto_client_get_established_at(struct proto_conn *conn);
 
 const char *proto_conn_remote_addr(struct proto_conn *conn);
 
+int64_t proto_conn_get_client_id(struct proto_conn *conn);
+
+/* The number of multiplexed sessions, besides the primary one */
+size_t proto_conn_get_num_sessions(struct proto_conn *conn);
+
+size_t proto_conn_get_out_queue_len(struct proto_conn *conn);
+size_t proto_conn_get_out_queue_bytes(struct proto_conn *conn);
+
+/* Returns false if compression isn't enabled for the connection */
+bool proto_conn_get_compr_stats(struct proto_conn *conn,
+				struct compr_stats *sent,
+				struct compr_stats *received);
+
 #endif
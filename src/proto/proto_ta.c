@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <stdio.h>
 #include <string.h>
 
 #include <jansson.h>
@@ -27,9 +28,16 @@ static const struct proto_ta_type hello_ta =
         { PROTO_FIELD_PROTO_MIN_VERSION, proto_field_type_uint63 },
         { PROTO_FIELD_PROTO_MAX_VERSION, proto_field_type_uint63 }
     },
+    .opt_req_fields = {
+	{ PROTO_FIELD_EXTENSIONS, proto_field_type_str },
+	{ PROTO_FIELD_PROPERTY_NAMES, proto_field_type_array }
+    },
     .complete_fields = {
         { PROTO_FIELD_PROTO_VERSION, proto_field_type_uint63 }
     },
+    .opt_complete_fields = {
+	{ PROTO_FIELD_EXTENSIONS, proto_field_type_str }
+    },
     .opt_fail_fields = {
         { PROTO_FIELD_FAIL_REASON, proto_field_type_str }
     }
@@ -70,18 +78,25 @@ static const struct proto_ta_type subscribe_ta =
         { PROTO_FIELD_SUBSCRIPTION_ID, proto_field_type_uint63 }
     },
     .opt_req_fields = {
-	{ PROTO_FIELD_FILTER, proto_field_type_str }
+	{ PROTO_FIELD_FILTER, proto_field_type_str },
+	{ PROTO_FIELD_RESUME_FROM, proto_field_type_uint63 }
     },
-    .notify_fields = {
-        { PROTO_FIELD_MATCH_TYPE, proto_field_type_match_type },
-        { PROTO_FIELD_SERVICE_ID, proto_field_type_uint63 }
+    .opt_accept_fields = {
+	{ PROTO_FIELD_RESUME_FROM, proto_field_type_uint63 }
     },
+    /* Match type and service id are left out only of the change
+       sequence markers of resumed subscriptions */
     .opt_notify_fields = {
+        { PROTO_FIELD_MATCH_TYPE, proto_field_type_match_type },
+        { PROTO_FIELD_SERVICE_ID, proto_field_type_uint63 },
         { PROTO_FIELD_GENERATION, proto_field_type_uint63 },
         { PROTO_FIELD_SERVICE_PROPS, proto_field_type_props },
         { PROTO_FIELD_TTL, proto_field_type_uint63 },
         { PROTO_FIELD_CLIENT_ID, proto_field_type_uint63 },
-        { PROTO_FIELD_ORPHAN_SINCE, proto_field_type_number }
+        { PROTO_FIELD_ORPHAN_SINCE, proto_field_type_number },
+	{ PROTO_FIELD_CHANGE_SEQ, proto_field_type_uint63 },
+	{ PROTO_FIELD_CHANGED_PROPS, proto_field_type_props },
+	{ PROTO_FIELD_REMOVED_PROPS, proto_field_type_array }
     },
     .opt_fail_fields = {
         { PROTO_FIELD_FAIL_REASON, proto_field_type_str }
@@ -158,6 +173,33 @@ static const struct proto_ta_type clients_ta =
     }
 };
 
+/* Each operation is a publish, unpublish or subscribe request,
+   without "msg-type", and (except for subscribe) without "ta-id" */
+static const struct proto_ta_type batch_ta =
+{
+    .cmd = PROTO_CMD_BATCH,
+    .ia_type = proto_ia_type_single_response,
+    .req_fields = {
+	{ PROTO_FIELD_OPERATIONS, proto_field_type_array }
+    },
+    .complete_fields = {
+	{ PROTO_FIELD_RESULTS, proto_field_type_array }
+    },
+    .opt_fail_fields = {
+        { PROTO_FIELD_FAIL_REASON, proto_field_type_str }
+    }
+};
+
+/* Ends a multiplexed session, other than a connection's primary one */
+static const struct proto_ta_type close_ta =
+{
+    .cmd = PROTO_CMD_CLOSE,
+    .ia_type = proto_ia_type_single_response,
+    .opt_fail_fields = {
+        { PROTO_FIELD_FAIL_REASON, proto_field_type_str }
+    }
+};
+
 static const struct proto_ta_type *proto_ta_types[] = {
     &hello_ta,
     &publish_ta,
@@ -167,7 +209,9 @@ static const struct proto_ta_type *proto_ta_types[] = {
     &ping_ta,
     &services_ta,
     &subscriptions_ta,
-    &clients_ta
+    &clients_ta,
+    &batch_ta,
+    &close_ta
 };
 static const size_t proto_ta_types_len = UT_ARRAY_LEN(proto_ta_types);
 
@@ -216,6 +260,7 @@ GEN_TYPED_GET(integer)
 GEN_TYPED_GET(number)
 GEN_TYPED_GET(string)
 GEN_TYPED_GET(object)
+GEN_TYPED_GET(array)
 
 static int get_uint63(json_t *msg, const char *name, bool opt,
 		      const struct log_ctx *log_ctx, int64_t *uint63_value)
@@ -260,8 +305,8 @@ static enum proto_msg_type get_msg_type(json_t *msg,
     return proto_msg_type_undefined;
 }
 
-static struct props *json_to_props(json_t *json_props,
-				   const struct log_ctx *log_ctx)
+struct props *proto_json_to_props(json_t *json_props,
+				  const struct log_ctx *log_ctx)
 {
     struct props *props = props_create();
 
@@ -316,6 +361,9 @@ static void free_fields(const struct proto_field *fields, void **field_values)
         case proto_field_type_props:
             props_destroy(field_values[i]);
             break;
+        case proto_field_type_array:
+            json_decref(field_values[i]);
+            break;
         default:
             assert(0);
             break;
@@ -411,7 +459,7 @@ static int get_fields(json_t *response, const struct proto_field *fields,
             if (rc < 0)
                 goto err_free_fields;
             else if (json_props != NULL) {
-                struct props *props = json_to_props(json_props, log_ctx);
+                struct props *props = proto_json_to_props(json_props, log_ctx);
                 if (props == NULL)
                     goto err_free_fields;
                 arg = props;
@@ -442,6 +490,16 @@ static int get_fields(json_t *response, const struct proto_field *fields,
 
             break;
         }
+        case proto_field_type_array: {
+            json_t *json_array;
+            int rc = get_json_array(response, fields[i].name, opt, log_ctx,
+				    &json_array);
+            if (rc < 0)
+                goto err_free_fields;
+            else if (json_array != NULL)
+                arg = json_incref(json_array);
+            break;
+        }
         default:
             assert(0);
             break;
@@ -469,6 +527,7 @@ struct proto_ta *proto_ta_create(const struct log_ctx *log_ctx)
     *ta = (struct proto_ta) {
 	.state = proto_ta_state_initialized,
 	.ta_id = -1,
+	.session_id = -1,
 	.log_ctx = log_ctx_create(log_ctx)
     };
 
@@ -483,6 +542,8 @@ void proto_ta_destroy(struct proto_ta *ta)
 	    free_fields(ta->type->opt_req_fields, ta->opt_req_field_values);
 	}
 
+	proto_dict_dec_ref(ta->dict);
+
 	log_ctx_destroy(ta->log_ctx);
 
 	ut_free(ta);
@@ -496,9 +557,37 @@ const char *proto_ta_get_cmd(struct proto_ta *ta)
     return ta->type->cmd;
 }
 
+void proto_ta_set_binary(struct proto_ta *ta, struct proto_dict *dict)
+{
+    ut_assert(ta->dict == NULL);
+
+    if (dict != NULL)
+	proto_dict_inc_ref(dict);
+
+    ta->binary = true;
+    ta->dict = dict;
+}
+
+void proto_ta_set_session(struct proto_ta *ta, int64_t session_id)
+{
+    ta->session_id = session_id;
+}
+
 int proto_ta_req(struct proto_ta *ta, const struct msg *req_msg)
 {
-    ut_assert(ta->state == proto_ta_state_initialized);
+    if (ta->binary && proto_bin_is_bin(msg_data(req_msg), msg_len(req_msg))) {
+	json_t *req_json = proto_req_bin_to_json(msg_data(req_msg),
+						 msg_len(req_msg), ta->dict,
+						 ta->log_ctx);
+	if (req_json == NULL)
+	    return -1;
+
+	int rc = proto_ta_req_json(ta, req_json);
+
+	json_decref(req_json);
+
+	return rc;
+    }
 
     json_error_t json_err;
     json_t *req_json =
@@ -508,12 +597,23 @@ int proto_ta_req(struct proto_ta *ta, const struct msg *req_msg)
 	log_debug_c(ta->log_ctx, "Error parsning request message JSON at "
 		    "(%d, %d): %s.", json_err.line, json_err.column,
 		    json_err.text);
-	goto err;
+	return -1;
     }
 
+    int rc = proto_ta_req_json(ta, req_json);
+
+    json_decref(req_json);
+
+    return rc;
+}
+
+int proto_ta_req_json(struct proto_ta *ta, json_t *req_json)
+{
+    ut_assert(ta->state == proto_ta_state_initialized);
+
     int64_t ta_id;
     if (get_uint63(req_json, PROTO_FIELD_TA_ID, false, ta->log_ctx, &ta_id) < 0)
-        goto err_free_req_json;
+        goto err;
 
     ta->ta_id = ta_id;
 
@@ -522,25 +622,25 @@ int proto_ta_req(struct proto_ta *ta, const struct msg *req_msg)
     json_t *cmd;
     if (get_json_string(req_json, PROTO_FIELD_TA_CMD, false, ta->log_ctx,
 			&cmd) < 0)
-        goto err_free_req_json;
+        goto err;
 
     enum proto_msg_type msg_type = get_msg_type(req_json, ta->log_ctx);
     if (msg_type != proto_msg_type_req)
-        goto err_free_req_json;
+        goto err;
 
     ta->type = lookup_type(json_string_value(cmd));
 
     if (ta->type == NULL) {
 	log_debug_c(ta->log_ctx, "Request message has unknown command \"%s\".",
 		    json_string_value(cmd));
-	goto err_free_req_json;
+	goto err;
     }
 
     int num_req_fields =
 	get_fields(req_json, ta->type->req_fields, false, ta->log_ctx,
 		   ta->req_field_values);
     if (num_req_fields < 0)
-	goto err_free_req_json;
+	goto err;
 
     int num_opt_req_fields =
 	get_fields(req_json, ta->type->opt_req_fields, true, ta->log_ctx,
@@ -561,8 +661,6 @@ int proto_ta_req(struct proto_ta *ta, const struct msg *req_msg)
 	goto err_free_opt_req_fields;
     }
 
-    json_decref(req_json);
-
     ta->state = proto_ta_state_requested;
 
     return 0;
@@ -571,12 +669,178 @@ err_free_opt_req_fields:
     free_fields(ta->type->opt_req_fields, ta->opt_req_field_values);
 err_free_req_fields:
     free_fields(ta->type->req_fields, ta->req_field_values);
-err_free_req_json:
-    json_decref(req_json);
 err:
     return -1;
 }
 
+struct scanner
+{
+    const char *data;
+    size_t len;
+    size_t offset;
+};
+
+static void scan_ws(struct scanner *scanner)
+{
+    while (scanner->offset < scanner->len) {
+	char c = scanner->data[scanner->offset];
+
+	if (c != ' ' && c != '\t' && c != '\n' && c != '\r')
+	    break;
+
+	scanner->offset++;
+    }
+}
+
+static bool scan_char(struct scanner *scanner, char c)
+{
+    scan_ws(scanner);
+
+    if (scanner->offset == scanner->len || scanner->data[scanner->offset] != c)
+	return false;
+
+    scanner->offset++;
+
+    return true;
+}
+
+/* Only strings without escapes, or any other special characters, are
+   recognized. */
+static bool scan_str(struct scanner *scanner, const char **str, size_t *len)
+{
+    if (!scan_char(scanner, '"'))
+	return false;
+
+    size_t start = scanner->offset;
+
+    while (scanner->offset < scanner->len) {
+	char c = scanner->data[scanner->offset];
+
+	if (c == '"') {
+	    *str = scanner->data + start;
+	    *len = scanner->offset - start;
+	    scanner->offset++;
+	    return true;
+	}
+
+	if (c == '\\' || c < ' ' || c > '~')
+	    return false;
+
+	scanner->offset++;
+    }
+
+    return false;
+}
+
+/* Few enough for the value to always fit into an int64_t */
+#define MAX_SCAN_DIGITS 18
+
+static bool scan_uint63(struct scanner *scanner, int64_t *value)
+{
+    scan_ws(scanner);
+
+    size_t start = scanner->offset;
+    int64_t v = 0;
+
+    while (scanner->offset < scanner->len) {
+	char c = scanner->data[scanner->offset];
+
+	if (c < '0' || c > '9')
+	    break;
+
+	v = v * 10 + (c - '0');
+	scanner->offset++;
+    }
+
+    size_t num_digits = scanner->offset - start;
+
+    if (num_digits == 0 || num_digits > MAX_SCAN_DIGITS ||
+	(num_digits > 1 && scanner->data[start] == '0'))
+	return false;
+
+    *value = v;
+
+    return true;
+}
+
+static bool str_equal(const char *str, size_t len, const char *lit)
+{
+    return strlen(lit) == len && memcmp(str, lit, len) == 0;
+}
+
+bool proto_ping_scan(const char *data, size_t len, int64_t *ta_id)
+{
+    struct scanner scanner = {
+	.data = data,
+	.len = len
+    };
+    bool has_cmd = false;
+    bool has_ta_id = false;
+    bool has_msg_type = false;
+
+    if (!scan_char(&scanner, '{'))
+	return false;
+
+    int i;
+    for (i = 0; i < PROTO_NUM_MANDANTORY_FIELDS; i++) {
+	const char *name;
+	size_t name_len;
+
+	if (i > 0 && !scan_char(&scanner, ','))
+	    return false;
+
+	if (!scan_str(&scanner, &name, &name_len) ||
+	    !scan_char(&scanner, ':'))
+	    return false;
+
+	const char *value;
+	size_t value_len;
+
+	if (str_equal(name, name_len, PROTO_FIELD_TA_ID) && !has_ta_id) {
+	    if (!scan_uint63(&scanner, ta_id))
+		return false;
+	    has_ta_id = true;
+	} else if (str_equal(name, name_len, PROTO_FIELD_TA_CMD) &&
+		   !has_cmd) {
+	    if (!scan_str(&scanner, &value, &value_len) ||
+		!str_equal(value, value_len, PROTO_CMD_PING))
+		return false;
+	    has_cmd = true;
+	} else if (str_equal(name, name_len, PROTO_FIELD_MSG_TYPE) &&
+		   !has_msg_type) {
+	    if (!scan_str(&scanner, &value, &value_len) ||
+		!str_equal(value, value_len, PROTO_MSG_TYPE_REQ))
+		return false;
+	    has_msg_type = true;
+	} else
+	    return false;
+    }
+
+    if (!scan_char(&scanner, '}'))
+	return false;
+
+    scan_ws(&scanner);
+
+    return scanner.offset == scanner.len;
+}
+
+#define PING_COMPLETE_TEMPLATE						\
+    "{\"" PROTO_FIELD_TA_CMD "\": \"" PROTO_CMD_PING "\", \""		\
+    PROTO_FIELD_TA_ID "\": %"PRId64", \"" PROTO_FIELD_MSG_TYPE "\": \""	\
+    PROTO_MSG_TYPE_COMPLETE "\"}"
+
+/* Room for the longest int64_t */
+#define PING_COMPLETE_MAX_LEN (sizeof(PING_COMPLETE_TEMPLATE) + 20)
+
+struct msg *proto_ping_complete(int64_t ta_id)
+{
+    char *data = ut_malloc(PING_COMPLETE_MAX_LEN);
+    int len = snprintf(data, PING_COMPLETE_MAX_LEN, PING_COMPLETE_TEMPLATE,
+		       ta_id);
+
+    return msg_create_prealloc(data, len);
+}
+
 static bool prop_to_json(const char *prop_name,
                          const struct pvalue *prop_value, void *user)
 {
@@ -602,7 +866,7 @@ static bool prop_to_json(const char *prop_name,
     return true;
 }
 
-static json_t *props_to_json(const struct props *props)
+json_t *proto_props_to_json(const struct props *props)
 {
     json_t *json_props = json_object();
 
@@ -632,7 +896,7 @@ static void set_field(json_t *req, const struct proto_field *field,
 	break;
     case proto_field_type_props: {
 	const struct props *props = field_value;
-	json_t *json_props = props_to_json(props);
+	json_t *json_props = proto_props_to_json(props);
 	json_object_set_new(req, field->name, json_props);
 	break;
     }
@@ -644,22 +908,115 @@ static void set_field(json_t *req, const struct proto_field *field,
 	json_object_set_new(req, field->name, json_string(match_type_s));
 	break;
     }
+    case proto_field_type_array:
+	json_object_set(req, field->name, (json_t *)field_value);
+	break;
     }
 }
 
-static json_t *create_response(const char *cmd, int64_t ta_id,
-			       const char *msg_type_str)
+static json_t *create_msg(const char *cmd, int64_t ta_id,
+			  const char *msg_type_str)
 {
-    json_t *response = json_object();
+    json_t *msg = json_object();
 
-    if (response == NULL)
+    if (msg == NULL)
 	ut_mem_exhausted();
 
-    json_object_set_new(response, PROTO_FIELD_TA_CMD, json_string(cmd));
-    json_object_set_new(response, PROTO_FIELD_TA_ID, json_integer(ta_id));
-    json_object_set_new(response, PROTO_FIELD_MSG_TYPE,
-			json_string(msg_type_str));
-    return response;
+    json_object_set_new(msg, PROTO_FIELD_TA_CMD, json_string(cmd));
+    json_object_set_new(msg, PROTO_FIELD_TA_ID, json_integer(ta_id));
+    json_object_set_new(msg, PROTO_FIELD_MSG_TYPE, json_string(msg_type_str));
+
+    return msg;
+}
+
+static size_t num_fields(const struct proto_field *fields)
+{
+    size_t num = 0;
+
+    while (fields != NULL && fields[num].name != NULL)
+	num++;
+
+    return num;
+}
+
+static uint8_t cmd_idx(const struct proto_ta_type *type)
+{
+    uint8_t i;
+
+    for (i = 0; proto_ta_types[i] != type; i++)
+	;
+
+    return i;
+}
+
+static void write_field(struct proto_bin_writer *writer,
+			const struct proto_dict *dict, uint8_t tag,
+			const struct proto_field *field,
+			const void *field_value)
+{
+    proto_bin_write_u8(writer, tag);
+
+    switch (field->type) {
+    case proto_field_type_uint63:
+	proto_bin_write_i64(writer, *((const int64_t *)field_value));
+	break;
+    case proto_field_type_number:
+	proto_bin_write_f64(writer, *((const double *)field_value));
+	break;
+    case proto_field_type_str: {
+	const char *str = field_value;
+	proto_bin_write_str(writer, str, strlen(str));
+	break;
+    }
+    case proto_field_type_props:
+	proto_bin_write_props(writer, dict, field_value);
+	break;
+    case proto_field_type_match_type:
+	proto_bin_write_u8(writer,
+			   *((const enum sub_match_type *)field_value));
+	break;
+    case proto_field_type_array: {
+	char *json = json_dumps(field_value, JSON_COMPACT);
+	proto_bin_write_str(writer, json, strlen(json));
+	free(json);
+	break;
+    }
+    }
+}
+
+static struct msg *produce_bin_response(struct proto_ta *ta,
+					enum proto_msg_type msg_type,
+					const struct proto_field *fields,
+					const struct proto_field *opt_fields,
+					va_list ap)
+{
+    struct proto_bin_writer writer;
+
+    proto_bin_writer_init(&writer);
+
+    proto_bin_write_u8(&writer, PROTO_BIN_MAGIC);
+    proto_bin_write_u8(&writer, msg_type);
+    proto_bin_write_u8(&writer, cmd_idx(ta->type));
+    proto_bin_write_i64(&writer, ta->ta_id);
+
+    size_t num = num_fields(fields);
+    size_t i;
+
+    for (i = 0; i < num; i++) {
+	const void *field_value = va_arg(ap, const void *);
+
+	write_field(&writer, ta->dict, i, &fields[i], field_value);
+    }
+
+    for (i = 0; opt_fields != NULL && opt_fields[i].name != NULL; i++) {
+	const void *field_value = va_arg(ap, const void *);
+
+	if (field_value != NULL)
+	    write_field(&writer, ta->dict, num + i, &opt_fields[i],
+			field_value);
+    }
+
+    return proto_bin_writer_morph(&writer);
 }
 
 static struct msg *produce_response(struct proto_ta *ta,
@@ -674,7 +1031,7 @@ static struct msg *produce_response(struct proto_ta *ta,
     case proto_msg_type_accept:
 	msg_type_str = PROTO_MSG_TYPE_ACCEPT;
 	fields = NULL;
-	opt_fields = NULL;
+	opt_fields = ta->type->opt_accept_fields;
 	break;
     case proto_msg_type_notify:
 	msg_type_str = PROTO_MSG_TYPE_NOTIFY;
@@ -684,7 +1041,7 @@ static struct msg *produce_response(struct proto_ta *ta,
     case proto_msg_type_complete:
 	msg_type_str = PROTO_MSG_TYPE_COMPLETE;
 	fields = ta->type->complete_fields;
-	opt_fields = NULL;
+	opt_fields = ta->type->opt_complete_fields;
 	break;
     case proto_msg_type_fail:
 	msg_type_str = PROTO_MSG_TYPE_FAIL;
@@ -696,7 +1053,14 @@ static struct msg *produce_response(struct proto_ta *ta,
 	break;
     }
 
-    json_t *response = create_response(ta->type->cmd, ta->ta_id, msg_type_str);
+    if (ta->binary)
+	return produce_bin_response(ta, msg_type, fields, opt_fields, ap);
+
+    json_t *response = create_msg(ta->type->cmd, ta->ta_id, msg_type_str);
+
+    if (ta->session_id >= 0)
+	json_object_set_new(response, PROTO_FIELD_SESSION_ID,
+			    json_integer(ta->session_id));
 
     int i;
     for (i = 0; fields != NULL && fields[i].name != NULL; i++) {
@@ -719,6 +1083,273 @@ static struct msg *produce_response(struct proto_ta *ta,
     return msg_create_prealloc(data, strlen(data));
 }
 
+struct msg *proto_group_notify(const struct proto_group_match *matches,
+			       size_t num_matches, int64_t session_id,
+			       int64_t service_id, int64_t generation,
+			       const struct props *props, int64_t ttl,
+			       int64_t client_id, const double *orphan_since)
+{
+    json_t *msg = json_object();
+
+    if (msg == NULL)
+	ut_mem_exhausted();
+
+    json_object_set_new(msg, PROTO_FIELD_MSG_TYPE,
+			json_string(PROTO_MSG_TYPE_GROUP_NOTIFY));
+
+    if (session_id >= 0)
+	json_object_set_new(msg, PROTO_FIELD_SESSION_ID,
+			    json_integer(session_id));
+
+    json_t *json_matches = json_array();
+    size_t i;
+
+    for (i = 0; i < num_matches; i++) {
+	const struct proto_group_match *match = &matches[i];
+	json_t *json_match = json_object();
+
+	json_object_set_new(json_match, PROTO_FIELD_TA_ID,
+			    json_integer(match->ta_id));
+	json_object_set_new(json_match, PROTO_FIELD_SUBSCRIPTION_ID,
+			    json_integer(match->sub_id));
+	json_object_set_new(json_match, PROTO_FIELD_MATCH_TYPE,
+			    json_string(enum_to_proto_match_type(
+					    match->match_type)));
+
+	json_array_append_new(json_matches, json_match);
+    }
+
+    json_object_set_new(msg, PROTO_FIELD_MATCHES, json_matches);
+
+    json_object_set_new(msg, PROTO_FIELD_SERVICE_ID, json_integer(service_id));
+
+    if (props != NULL) {
+	json_object_set_new(msg, PROTO_FIELD_GENERATION,
+			    json_integer(generation));
+	json_object_set_new(msg, PROTO_FIELD_SERVICE_PROPS,
+			    proto_props_to_json(props));
+	json_object_set_new(msg, PROTO_FIELD_TTL, json_integer(ttl));
+	json_object_set_new(msg, PROTO_FIELD_CLIENT_ID,
+			    json_integer(client_id));
+
+	if (orphan_since != NULL)
+	    json_object_set_new(msg, PROTO_FIELD_ORPHAN_SINCE,
+				json_real(*orphan_since));
+    }
+
+    char *data = json_dumps(msg, 0);
+
+    json_decref(msg);
+
+    return msg_create_prealloc(data, strlen(data));
+}
+
+static char *dup_name(const char *name, size_t len)
+{
+    char *copy = ut_malloc(len + 1);
+
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+
+    return copy;
+}
+
+static json_t *read_bin_props(struct proto_bin_reader *reader,
+			      const struct proto_dict *dict)
+{
+    uint32_t num_values;
+
+    if (proto_bin_read_u32(reader, &num_values) < 0)
+	return NULL;
+
+    json_t *json_props = json_object();
+    uint32_t i;
+
+    for (i = 0; i < num_values; i++) {
+	const char *name;
+	size_t name_len;
+	uint8_t value_type;
+	json_t *value;
+
+	if (proto_bin_read_name(reader, dict, &name, &name_len) < 0 ||
+	    proto_bin_read_u8(reader, &value_type) < 0)
+	    goto err;
+
+	if (value_type == PROTO_BIN_INT64) {
+	    int64_t int_value;
+
+	    if (proto_bin_read_i64(reader, &int_value) < 0)
+		goto err;
+
+	    value = json_integer(int_value);
+	} else if (value_type == PROTO_BIN_STR) {
+	    const char *str;
+	    size_t str_len;
+
+	    if (proto_bin_read_str(reader, &str, &str_len) < 0)
+		goto err;
+
+	    value = json_stringn(str, str_len);
+	} else
+	    goto err;
+
+	if (value == NULL)
+	    goto err;
+
+	/* A name with a NUL would be cut short by the copy */
+	if (memchr(name, '\0', name_len) != NULL) {
+	    json_decref(value);
+	    goto err;
+	}
+
+	char *prop_name = dup_name(name, name_len);
+	json_t *value_list = json_object_get(json_props, prop_name);
+
+	if (value_list == NULL) {
+	    value_list = json_array();
+
+	    /* Fails on invalid UTF-8, in which case the array is freed */
+	    if (json_object_set_new(json_props, prop_name, value_list) < 0) {
+		ut_free(prop_name);
+		json_decref(value);
+		goto err;
+	    }
+	}
+
+	json_array_append_new(value_list, value);
+
+	ut_free(prop_name);
+    }
+
+    return json_props;
+
+err:
+    json_decref(json_props);
+    return NULL;
+}
+
+static json_t *read_bin_value(struct proto_bin_reader *reader,
+			      const struct proto_dict *dict,
+			      enum proto_field_type field_type)
+{
+    switch (field_type) {
+    case proto_field_type_uint63: {
+	int64_t value;
+	if (proto_bin_read_i64(reader, &value) < 0)
+	    return NULL;
+	return json_integer(value);
+    }
+    case proto_field_type_number: {
+	double value;
+	if (proto_bin_read_f64(reader, &value) < 0)
+	    return NULL;
+	return json_real(value);
+    }
+    case proto_field_type_str: {
+	const char *str;
+	size_t len;
+	if (proto_bin_read_str(reader, &str, &len) < 0)
+	    return NULL;
+	return json_stringn(str, len);
+    }
+    case proto_field_type_props:
+	return read_bin_props(reader, dict);
+    case proto_field_type_match_type: {
+	uint8_t value;
+	if (proto_bin_read_u8(reader, &value) < 0 ||
+	    value > sub_match_type_disappeared)
+	    return NULL;
+	return json_string(enum_to_proto_match_type(value));
+    }
+    case proto_field_type_array: {
+	const char *str;
+	size_t len;
+	if (proto_bin_read_str(reader, &str, &len) < 0)
+	    return NULL;
+	json_t *array = json_loadb(str, len, 0, NULL);
+	if (array != NULL && !json_is_array(array)) {
+	    json_decref(array);
+	    return NULL;
+	}
+	return array;
+    }
+    default:
+	ut_assert(0);
+	return NULL;
+    }
+}
+
+json_t *proto_req_bin_to_json(const void *data, size_t len,
+			      const struct proto_dict *dict,
+			      const struct log_ctx *log_ctx)
+{
+    struct proto_bin_reader reader;
+    uint8_t magic;
+    uint8_t msg_type;
+    uint8_t cmd;
+    int64_t ta_id;
+
+    proto_bin_reader_init(&reader, data, len);
+
+    if (proto_bin_read_u8(&reader, &magic) < 0 ||
+	proto_bin_read_u8(&reader, &msg_type) < 0 ||
+	proto_bin_read_u8(&reader, &cmd) < 0 ||
+	proto_bin_read_i64(&reader, &ta_id) < 0) {
+	log_debug_c(log_ctx, "Binary request message is truncated.");
+	return NULL;
+    }
+
+    if (magic != PROTO_BIN_MAGIC || msg_type != proto_msg_type_req ||
+	cmd >= proto_ta_types_len) {
+	log_debug_c(log_ctx, "Binary request message has an invalid "
+		    "header.");
+	return NULL;
+    }
+
+    const struct proto_ta_type *type = proto_ta_types[cmd];
+    size_t num_req_fields = num_fields(type->req_fields);
+    size_t num_opt_req_fields = num_fields(type->opt_req_fields);
+
+    json_t *req = create_msg(type->cmd, ta_id, PROTO_MSG_TYPE_REQ);
+
+    while (!proto_bin_reader_at_end(&reader)) {
+	uint8_t tag;
+
+	if (proto_bin_read_u8(&reader, &tag) < 0 ||
+	    tag >= num_req_fields + num_opt_req_fields) {
+	    log_debug_c(log_ctx, "Binary request message has an invalid "
+			"field tag.");
+	    goto err;
+	}
+
+	const struct proto_field *field = tag < num_req_fields ?
+	    &type->req_fields[tag] :
+	    &type->opt_req_fields[tag - num_req_fields];
+
+	if (json_object_get(req, field->name) != NULL) {
+	    log_debug_c(log_ctx, "Binary request message has duplicate "
+			"\"%s\" fields.", field->name);
+	    goto err;
+	}
+
+	json_t *value = read_bin_value(&reader, dict, field->type);
+
+	if (value == NULL) {
+	    log_debug_c(log_ctx, "Binary request message has an invalid "
+			"\"%s\" field.", field->name);
+	    goto err;
+	}
+
+	json_object_set_new(req, field->name, value);
+    }
+
+    return req;
+
+err:
+    json_decref(req);
+    return NULL;
+}
+
 static const void *get_req_field_value(const struct proto_ta *ta,
 				       enum proto_field_type field_type,
 				       size_t field_idx)
@@ -762,6 +1393,13 @@ const enum sub_match_type *proto_ta_get_req_field_match_type_value(
     return get_req_field_value(ta, proto_field_type_match_type, field_idx);
 }
 
+json_t *proto_ta_get_req_field_array_value(const struct proto_ta *ta,
+					   size_t field_idx)
+{
+    return (json_t *)get_req_field_value(ta, proto_field_type_array,
+					 field_idx);
+}
+
 const char *proto_ta_get_req_opt_field_str_value(const struct proto_ta *ta,
 						 size_t field_idx);
 const int64_t *proto_ta_get_req_opt_field_uint63_value(
@@ -813,6 +1451,13 @@ const enum sub_match_type *proto_ta_get_opt_req_field_match_type_value(
     return get_opt_req_field_value(ta, proto_field_type_match_type, field_idx);
 }
 
+json_t *proto_ta_get_opt_req_field_array_value(const struct proto_ta *ta,
+					       size_t field_idx)
+{
+    return (json_t *)get_opt_req_field_value(ta, proto_field_type_array,
+					     field_idx);
+}
+
 const char *proto_ta_get_opt_req_opt_field_str_value(
     const struct proto_ta *ta, size_t field_idx);
 const int64_t *proto_ta_get_opt_req_opt_field_uint63_value(
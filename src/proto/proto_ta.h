@@ -6,9 +6,12 @@
 #ifndef PROTO_H
 #define PROTO_H
 
+#include <jansson.h>
 #include <stdarg.h>
 
 #include "msg.h"
+#include "proto_bin.h"
+#include "sub_match.h"
 
 #define PROTO_VERSION ((int64_t)2)
 
@@ -17,6 +20,10 @@
 #define PROTO_MSG_TYPE_NOTIFY "notify"
 #define PROTO_MSG_TYPE_COMPLETE "complete"
 #define PROTO_MSG_TYPE_FAIL "fail"
+/* Not part of a transaction; holds other messages */
+#define PROTO_MSG_TYPE_ENVELOPE "envelope"
+/* Not part of a transaction; notifies several subscriptions */
+#define PROTO_MSG_TYPE_GROUP_NOTIFY "group-notify"
 
 #define PROTO_CMD_HELLO "hello"
 #define PROTO_CMD_SUBSCRIBE "subscribe"
@@ -27,6 +34,8 @@
 #define PROTO_CMD_SUBSCRIPTIONS "subscriptions"
 #define PROTO_CMD_SERVICES "services"
 #define PROTO_CMD_CLIENTS "clients"
+#define PROTO_CMD_BATCH "batch"
+#define PROTO_CMD_CLOSE "close"
 
 #define PROTO_NUM_MANDANTORY_FIELDS 3 /* TA_CMD, TA_ID and MSG_TYPE */
 
@@ -40,6 +49,20 @@
 #define PROTO_FIELD_PROTO_MAX_VERSION "protocol-maximum-version"
 #define PROTO_FIELD_PROTO_VERSION "protocol-version"
 
+/* Protocol extensions, as whitespace-separated names */
+#define PROTO_FIELD_EXTENSIONS "extensions"
+
+#define PROTO_EXT_BATCH "batch"
+#define PROTO_EXT_ENVELOPE "envelope"
+#define PROTO_EXT_DELTA "delta"
+#define PROTO_EXT_BINARY "binary"
+#define PROTO_EXT_DEFLATE "deflate"
+#define PROTO_EXT_MUX "mux"
+#define PROTO_EXT_GROUP "group"
+
+/* The dictionary of property names used by the binary encoding */
+#define PROTO_FIELD_PROPERTY_NAMES "property-names"
+
 #define PROTO_FIELD_SERVICE_ID "service-id"
 #define PROTO_FIELD_SERVICE_PROPS "service-props"
 
@@ -56,6 +79,23 @@
 
 #define PROTO_FIELD_MATCH_TYPE "match-type"
 
+#define PROTO_FIELD_RESUME_FROM "resume-from"
+#define PROTO_FIELD_CHANGE_SEQ "change-seq"
+
+/* Replace the service properties of delta "modified" notifications */
+#define PROTO_FIELD_CHANGED_PROPS "changed-props"
+#define PROTO_FIELD_REMOVED_PROPS "removed-props"
+
+#define PROTO_FIELD_OPERATIONS "operations"
+#define PROTO_FIELD_RESULTS "results"
+
+#define PROTO_FIELD_MESSAGES "messages"
+
+#define PROTO_FIELD_MATCHES "matches"
+
+/* The multiplexed session a message belongs to, if not the primary */
+#define PROTO_FIELD_SESSION_ID "session-id"
+
 #define PROTO_MATCH_TYPE_APPEARED "appeared"
 #define PROTO_MATCH_TYPE_MODIFIED "modified"
 #define PROTO_MATCH_TYPE_DISAPPEARED "disappeared"
@@ -74,6 +114,7 @@
 #define PROTO_FAIL_REASON_SAME_GENERATION_BUT_DIFFERENT \
     "same-generation-but-different"
 #define PROTO_FAIL_REASON_INSUFFICIENT_RESOURCES "insufficient-resources"
+#define PROTO_FAIL_REASON_EXTENSION_NOT_ENABLED "extension-not-enabled"
 
 enum proto_msg_type {
     proto_msg_type_req,
@@ -94,7 +135,9 @@ enum proto_field_type {
     proto_field_type_uint63, 
     proto_field_type_number,
     proto_field_type_props,
-    proto_field_type_match_type
+    proto_field_type_match_type,
+    /* a JSON array, kept as-is */
+    proto_field_type_array
 };
 
 struct proto_field
@@ -116,9 +159,11 @@ struct proto_ta_type
     enum proto_ia_type ia_type;
     struct proto_field req_fields[MAX_FIELDS];
     struct proto_field opt_req_fields[MAX_FIELDS];
+    struct proto_field opt_accept_fields[MAX_FIELDS];
     struct proto_field notify_fields[MAX_FIELDS];
     struct proto_field opt_notify_fields[MAX_FIELDS];
     struct proto_field complete_fields[MAX_FIELDS];
+    struct proto_field opt_complete_fields[MAX_FIELDS];
     struct proto_field opt_fail_fields[MAX_FIELDS];
 };
 
@@ -142,6 +187,13 @@ struct proto_ta
     void *req_field_values[MAX_FIELDS];
     void *opt_req_field_values[MAX_FIELDS];
 
+    /* responses are produced in the binary encoding */
+    bool binary;
+    struct proto_dict *dict;
+
+    /* the multiplexed session responses are tagged with, or -1 */
+    int64_t session_id;
+
     struct log_ctx *log_ctx;
 };
 
@@ -150,7 +202,18 @@ void proto_ta_destroy(struct proto_ta *ta);
 
 const char *proto_ta_get_cmd(struct proto_ta *ta);
 
+/* Makes the transaction produce its responses in the binary
+   encoding, using the (optional) property name dictionary. */
+void proto_ta_set_binary(struct proto_ta *ta, struct proto_dict *dict);
+
+/* Makes the transaction's (JSON) responses carry a session id. */
+void proto_ta_set_session(struct proto_ta *ta, int64_t session_id);
+
+/* The request may be in either encoding. */
 int proto_ta_req(struct proto_ta *ta, const struct msg *req_msg);
+/* For an already-parsed request. Ownership of 'req_json' remains
+   with the caller. */
+int proto_ta_req_json(struct proto_ta *ta, json_t *req_json);
 
 const char *proto_ta_get_req_field_str_value(const struct proto_ta *ta,
 					     size_t field_idx);
@@ -162,6 +225,8 @@ const struct props *proto_ta_get_req_field_props_value(
     const struct proto_ta *ta, size_t field_idx);
 const enum sub_match_type *proto_ta_get_req_field_match_type_value(
     const struct proto_ta *ta, size_t field_idx);
+json_t *proto_ta_get_req_field_array_value(const struct proto_ta *ta,
+					   size_t field_idx);
 
 const char *proto_ta_get_opt_req_field_str_value(const struct proto_ta *ta,
 						 size_t field_idx);
@@ -173,6 +238,8 @@ const struct props *proto_ta_get_opt_req_field_props_value(
     const struct proto_ta *ta, size_t field_idx);
 const enum sub_match_type *proto_ta_get_opt_req_field_match_type_value(
     const struct proto_ta *ta, size_t field_idx);
+json_t *proto_ta_get_opt_req_field_array_value(const struct proto_ta *ta,
+					       size_t field_idx);
 
 struct msg *proto_ta_accept(struct proto_ta *ta, ...);
 struct msg *proto_ta_notify(struct proto_ta *ta, ...);
@@ -181,4 +248,44 @@ struct msg *proto_ta_fail(struct proto_ta *ta, ...);
 
 bool proto_ta_has_term(struct proto_ta *ta);
 
+/* Recognizes a JSON ping request by a structural scan, without
+   parsing it or allocating memory. Returns true, and the transaction
+   id in 'ta_id', only if 'data' holds a well-formed request carrying
+   nothing but the mandatory fields. Anything else, including valid
+   but unusually formatted requests, is left to proto_ta_req(). */
+bool proto_ping_scan(const char *data, size_t len, int64_t *ta_id);
+
+/* Produces the response of a successful ping transaction from a
+   preformatted template, as proto_ta_complete() would have. */
+struct msg *proto_ping_complete(int64_t ta_id);
+
+/* A subscription's part of a group notification */
+struct proto_group_match
+{
+    int64_t ta_id;
+    int64_t sub_id;
+    enum sub_match_type match_type;
+};
+
+/* Produces a message notifying several subscriptions of the same
+   service state. The state fields are left out if 'props' is NULL,
+   and the session id if it's negative. */
+struct msg *proto_group_notify(const struct proto_group_match *matches,
+			       size_t num_matches, int64_t session_id,
+			       int64_t service_id, int64_t generation,
+			       const struct props *props, int64_t ttl,
+			       int64_t client_id, const double *orphan_since);
+
+/* Conversion between service properties and their protocol JSON
+   representation. */
+struct props *proto_json_to_props(json_t *json_props,
+				  const struct log_ctx *log_ctx);
+json_t *proto_props_to_json(const struct props *props);
+
+/* Decodes a binary request message into its JSON representation.
+   Returns NULL if the message is malformed. */
+json_t *proto_req_bin_to_json(const void *data, size_t len,
+			      const struct proto_dict *dict,
+			      const struct log_ctx *log_ctx);
+
 #endif
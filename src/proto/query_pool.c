@@ -0,0 +1,621 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#include "query_pool.h"
+
+/* Smaller snapshots are scanned by a single thread, since the
+   cost of splitting up the work would outweigh the gain. */
+#define PARALLEL_SCAN_THRESHOLD 10000
+
+struct query_part
+{
+    struct msg **msgs;
+    size_t num_msgs;
+    size_t capacity;
+    /* protected by the pool lock */
+    bool done;
+};
+
+/* A query is run by one worker (the coordinator), which enters the
+   snapshot, and keeps it entered until all the query's parts are
+   done. Idle workers help out with the parts. */
+struct query
+{
+    enum query_type type;
+    struct proto_ta *ta;
+    struct filter *filter;
+    query_result_cb result_cb;
+    void *cb_data;
+
+    const struct sd_snapshot *snapshot;
+    struct query_part *parts;
+
+    /* below fields are protected by the pool lock */
+    size_t num_parts;
+    size_t next_part;
+    size_t num_done_parts;
+    struct msg *complete_msg;
+    bool finished;
+    bool posted;
+    bool cancelled;
+
+    /* owned by the core thread */
+    size_t next_delivered_part;
+
+    /* pending or running */
+    TAILQ_ENTRY(query) entry;
+    /* with parts not yet started */
+    TAILQ_ENTRY(query) split_entry;
+    /* with results for the core thread */
+    TAILQ_ENTRY(query) ready_entry;
+};
+
+TAILQ_HEAD(query_list, query);
+
+struct query_worker
+{
+    struct query_pool *pool;
+    size_t reader_idx;
+    pthread_t thread;
+};
+
+struct query_pool
+{
+    struct sd *sd;
+
+    struct query_worker *workers;
+    size_t num_workers;
+    bool running;
+
+    pthread_mutex_t lock;
+    /* signaled when there's new work */
+    pthread_cond_t work_cond;
+    /* signaled when a query part is done */
+    pthread_cond_t part_cond;
+    bool stop;
+    struct query_list pending;
+    struct query_list running_queries;
+    struct query_list split;
+    struct query_list ready;
+
+    /* wakes up the core thread when there are query results */
+    int fds[2];
+    struct event ready_event;
+
+    struct log_ctx *log_ctx;
+};
+
+static void destroy_msgs(struct msg **msgs, size_t num_msgs)
+{
+    size_t i;
+    for (i = 0; i < num_msgs; i++)
+	msg_destroy(msgs[i]);
+}
+
+static void query_free(struct query *query)
+{
+    size_t i;
+    for (i = 0; i < query->num_parts; i++)
+	ut_free(query->parts[i].msgs);
+    ut_free(query->parts);
+
+    filter_destroy(query->filter);
+
+    ut_free(query);
+}
+
+static void query_destroy(struct query *query)
+{
+    size_t i;
+    for (i = 0; i < query->num_parts; i++) {
+	struct query_part *part = &query->parts[i];
+	destroy_msgs(part->msgs, part->num_msgs);
+    }
+
+    msg_destroy(query->complete_msg);
+    proto_ta_destroy(query->ta);
+
+    query_free(query);
+}
+
+static void add_msg(struct query_part *part, struct msg *msg)
+{
+    if (part->num_msgs == part->capacity) {
+	part->capacity = part->capacity == 0 ? 16 : 2 * part->capacity;
+	part->msgs = ut_realloc(part->msgs,
+				sizeof(struct msg *) * part->capacity);
+    }
+
+    part->msgs[part->num_msgs++] = msg;
+}
+
+struct part_param
+{
+    struct query *query;
+    struct query_part *part;
+};
+
+static bool service_cb(const struct service *service, void *cb_data)
+{
+    struct part_param *param = cb_data;
+
+    int64_t service_id = service_get_id(service);
+    int64_t generation = service_get_generation(service);
+    const struct props *props = service_get_props(service);
+    int64_t ttl = service_get_ttl(service);
+    int64_t client_id = service_get_client_id(service);
+
+    double orphan_since_value;
+    const double *orphan_since = NULL;
+
+    if (service_is_orphan(service)) {
+	orphan_since_value = service_get_orphan_since(service);
+	orphan_since = &orphan_since_value;
+    }
+
+    add_msg(param->part,
+	    proto_ta_notify(param->query->ta, &service_id, &generation,
+			    props, &ttl, &client_id, orphan_since));
+
+    return true;
+}
+
+static bool sub_cb(int64_t sub_id, int64_t client_id, const char *filter_s,
+		   void *cb_data)
+{
+    struct part_param *param = cb_data;
+
+    add_msg(param->part, proto_ta_notify(param->query->ta, &sub_id,
+					 &client_id, filter_s));
+
+    return true;
+}
+
+static bool client_cb(int64_t client_id, const char *remote_addr,
+		      double connected_at, void *cb_data)
+{
+    struct part_param *param = cb_data;
+    int64_t connection_time = (int64_t)connected_at;
+
+    add_msg(param->part, proto_ta_notify(param->query->ta, &client_id,
+					 remote_addr, &connection_time));
+
+    return true;
+}
+
+static void run_part(struct query *query, size_t part_idx)
+{
+    struct part_param param = {
+	.query = query,
+	.part = &query->parts[part_idx]
+    };
+
+    switch (query->type) {
+    case query_type_services:
+	sd_snapshot_foreach_service_part(query->snapshot, query->filter,
+					 part_idx, query->num_parts,
+					 service_cb, &param);
+	break;
+    case query_type_subscriptions:
+	sd_snapshot_foreach_sub(query->snapshot, sub_cb, &param);
+	break;
+    case query_type_clients:
+	sd_snapshot_foreach_client(query->snapshot, client_cb, &param);
+	break;
+    }
+}
+
+static void wakeup(int fd)
+{
+    char c = 0;
+    ssize_t rc;
+
+    /* A full pipe already is a pending wakeup */
+    do {
+	rc = write(fd, &c, 1);
+    } while (rc < 0 && errno == EINTR);
+}
+
+/* Must be called with the pool lock held. */
+static void post(struct query_pool *pool, struct query *query)
+{
+    if (query->posted)
+	return;
+
+    query->posted = true;
+
+    bool was_empty = TAILQ_EMPTY(&pool->ready);
+    TAILQ_INSERT_TAIL(&pool->ready, query, ready_entry);
+
+    if (was_empty)
+	wakeup(pool->fds[1]);
+}
+
+/* Runs not-yet-started parts of the query, until there are no
+   more. Must be called with the pool lock held. */
+static void run_parts(struct query_pool *pool, struct query *query)
+{
+    while (query->next_part < query->num_parts) {
+	size_t part_idx = query->next_part++;
+
+	if (query->next_part == query->num_parts)
+	    TAILQ_REMOVE(&pool->split, query, split_entry);
+
+	pthread_mutex_unlock(&pool->lock);
+
+	run_part(query, part_idx);
+
+	pthread_mutex_lock(&pool->lock);
+
+	query->parts[part_idx].done = true;
+	query->num_done_parts++;
+
+	post(pool, query);
+
+	pthread_cond_broadcast(&pool->part_cond);
+    }
+}
+
+static void coordinate(struct query_worker *worker, struct query *query)
+{
+    struct query_pool *pool = worker->pool;
+    struct sd *sd = pool->sd;
+
+    const struct sd_snapshot *snapshot =
+	sd_snapshot_enter(sd, worker->reader_idx);
+
+    size_t num_parts = 1;
+
+    if (query->type == query_type_services &&
+	sd_snapshot_num_services(snapshot) >= PARALLEL_SCAN_THRESHOLD)
+	num_parts = pool->num_workers < SD_SNAPSHOT_MAX_PARTS ?
+	    pool->num_workers : SD_SNAPSHOT_MAX_PARTS;
+
+    query->snapshot = snapshot;
+    query->parts = ut_calloc(sizeof(struct query_part) * num_parts);
+
+    pthread_mutex_lock(&pool->lock);
+
+    query->num_parts = num_parts;
+    TAILQ_INSERT_TAIL(&pool->split, query, split_entry);
+
+    if (num_parts > 1)
+	pthread_cond_broadcast(&pool->work_cond);
+
+    run_parts(pool, query);
+
+    while (query->num_done_parts < query->num_parts)
+	pthread_cond_wait(&pool->part_cond, &pool->lock);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    sd_snapshot_leave(sd, worker->reader_idx);
+
+    struct msg *complete_msg = proto_ta_complete(query->ta);
+
+    pthread_mutex_lock(&pool->lock);
+
+    query->complete_msg = complete_msg;
+    query->finished = true;
+    post(pool, query);
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *worker_run(void *arg)
+{
+    struct query_worker *worker = arg;
+    struct query_pool *pool = worker->pool;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (;;) {
+	while (!pool->stop && TAILQ_EMPTY(&pool->split) &&
+	       TAILQ_EMPTY(&pool->pending))
+	    pthread_cond_wait(&pool->work_cond, &pool->lock);
+
+	if (pool->stop)
+	    break;
+
+	struct query *query = TAILQ_FIRST(&pool->split);
+
+	if (query != NULL) {
+	    run_parts(pool, query);
+	    continue;
+	}
+
+	query = TAILQ_FIRST(&pool->pending);
+	TAILQ_REMOVE(&pool->pending, query, entry);
+	TAILQ_INSERT_TAIL(&pool->running_queries, query, entry);
+
+	pthread_mutex_unlock(&pool->lock);
+
+	coordinate(worker, query);
+
+	pthread_mutex_lock(&pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* Hands over the messages of the query's parts done, and not yet
+   delivered, to the core thread, in part order. Must be called with
+   the pool lock held. */
+static void take_results(struct query *query, struct msg ***msgs,
+			 size_t *num_msgs)
+{
+    while (query->next_delivered_part < query->num_parts) {
+	struct query_part *part = &query->parts[query->next_delivered_part];
+
+	if (!part->done)
+	    break;
+
+	/* room for the completion message */
+	*msgs = ut_realloc(*msgs, sizeof(struct msg *) *
+			   (*num_msgs + part->num_msgs + 1));
+
+	if (part->num_msgs > 0)
+	    memcpy(*msgs + *num_msgs, part->msgs,
+		   sizeof(struct msg *) * part->num_msgs);
+	*num_msgs += part->num_msgs;
+
+	ut_free(part->msgs);
+	part->msgs = NULL;
+	part->num_msgs = 0;
+
+	query->next_delivered_part++;
+    }
+}
+
+static void deliver(struct query_pool *pool, struct query *query)
+{
+    struct msg **msgs = NULL;
+    size_t num_msgs = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    query->posted = false;
+
+    take_results(query, &msgs, &num_msgs);
+
+    bool complete = query->finished;
+    bool cancelled = query->cancelled;
+
+    if (complete)
+	TAILQ_REMOVE(&pool->running_queries, query, entry);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (cancelled) {
+	destroy_msgs(msgs, num_msgs);
+	ut_free(msgs);
+
+	if (complete)
+	    query_destroy(query);
+	return;
+    }
+
+    if (complete) {
+	msgs = ut_realloc(msgs, sizeof(struct msg *) * (num_msgs + 1));
+	msgs[num_msgs++] = query->complete_msg;
+    }
+
+    if (num_msgs > 0)
+	query->result_cb(query->ta, msgs, num_msgs, complete,
+			 query->cb_data);
+
+    ut_free(msgs);
+
+    if (complete)
+	query_free(query);
+}
+
+static void core_ready_cb(int fd, short ev, void *cb_data)
+{
+    struct query_pool *pool = cb_data;
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+	;
+
+    struct query_list ready = TAILQ_HEAD_INITIALIZER(ready);
+
+    pthread_mutex_lock(&pool->lock);
+    TAILQ_CONCAT(&ready, &pool->ready, ready_entry);
+    pthread_mutex_unlock(&pool->lock);
+
+    struct query *query;
+    while ((query = TAILQ_FIRST(&ready)) != NULL) {
+	/* Once taken off the list, the query may be posted again */
+	TAILQ_REMOVE(&ready, query, ready_entry);
+
+	deliver(pool, query);
+    }
+}
+
+struct query_pool *query_pool_create(struct event_base *event_base,
+				     struct sd *sd, size_t num_threads,
+				     const struct log_ctx *log_ctx)
+{
+    struct query_pool *pool = ut_calloc(sizeof(struct query_pool));
+
+    pool->log_ctx = log_ctx_create(log_ctx);
+
+    if (pipe2(pool->fds, O_CLOEXEC|O_NONBLOCK) < 0) {
+	log_error_c(pool->log_ctx, "Error creating query notification pipe: "
+		    "%s.", strerror(errno));
+	log_ctx_destroy(pool->log_ctx);
+	ut_free(pool);
+	return NULL;
+    }
+
+    pool->sd = sd;
+
+    pool->workers = ut_calloc(sizeof(struct query_worker) * num_threads);
+    pool->num_workers = num_threads;
+
+    size_t i;
+    for (i = 0; i < num_threads; i++)
+	pool->workers[i] = (struct query_worker) {
+	    .pool = pool,
+	    .reader_idx = i
+	};
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->part_cond, NULL);
+    TAILQ_INIT(&pool->pending);
+    TAILQ_INIT(&pool->running_queries);
+    TAILQ_INIT(&pool->split);
+    TAILQ_INIT(&pool->ready);
+
+    event_assign(&pool->ready_event, event_base, pool->fds[0],
+		 EV_READ|EV_PERSIST, core_ready_cb, pool);
+    event_add(&pool->ready_event, NULL);
+
+    return pool;
+}
+
+static void stop_workers(struct query_pool *pool, size_t num)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    size_t i;
+    for (i = 0; i < num; i++)
+	pthread_join(pool->workers[i].thread, NULL);
+}
+
+static void destroy_list(struct query_list *list)
+{
+    struct query *query;
+
+    while ((query = TAILQ_FIRST(list)) != NULL) {
+	TAILQ_REMOVE(list, query, entry);
+	query_destroy(query);
+    }
+}
+
+void query_pool_destroy(struct query_pool *pool)
+{
+    if (pool != NULL) {
+	if (pool->running)
+	    stop_workers(pool, pool->num_workers);
+
+	/* With the workers stopped, all running queries are finished */
+	destroy_list(&pool->pending);
+	destroy_list(&pool->running_queries);
+
+	event_del(&pool->ready_event);
+	close(pool->fds[0]);
+	close(pool->fds[1]);
+
+	pthread_cond_destroy(&pool->part_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->lock);
+
+	ut_free(pool->workers);
+	log_ctx_destroy(pool->log_ctx);
+	ut_free(pool);
+    }
+}
+
+int query_pool_start(struct query_pool *pool)
+{
+    ut_assert(!pool->running);
+
+    /* Signals are left to the main thread */
+    sigset_t all;
+    sigset_t orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &orig);
+
+    size_t i;
+    int rc = 0;
+
+    for (i = 0; i < pool->num_workers; i++) {
+	rc = pthread_create(&pool->workers[i].thread, NULL, worker_run,
+			    &pool->workers[i]);
+	if (rc != 0)
+	    break;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    if (rc != 0) {
+	log_error_c(pool->log_ctx, "Unable to create query thread: %s.",
+		    strerror(rc));
+	stop_workers(pool, i);
+	pool->stop = false;
+	return -1;
+    }
+
+    pool->running = true;
+
+    log_debug_c(pool->log_ctx, "Started %zd query threads.",
+		pool->num_workers);
+
+    return 0;
+}
+
+void query_pool_submit(struct query_pool *pool, enum query_type type,
+		       struct proto_ta *ta, struct filter *filter,
+		       query_result_cb result_cb, void *cb_data)
+{
+    struct query *query = ut_calloc(sizeof(struct query));
+
+    query->type = type;
+    query->ta = ta;
+    query->filter = filter;
+    query->result_cb = result_cb;
+    query->cb_data = cb_data;
+
+    pthread_mutex_lock(&pool->lock);
+    TAILQ_INSERT_TAIL(&pool->pending, query, entry);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void query_pool_cancel(struct query_pool *pool, void *cb_data)
+{
+    struct query_list cancelled = TAILQ_HEAD_INITIALIZER(cancelled);
+
+    pthread_mutex_lock(&pool->lock);
+
+    struct query *query = TAILQ_FIRST(&pool->pending);
+
+    while (query != NULL) {
+	struct query *next = TAILQ_NEXT(query, entry);
+
+	if (query->cb_data == cb_data) {
+	    TAILQ_REMOVE(&pool->pending, query, entry);
+	    TAILQ_INSERT_TAIL(&cancelled, query, entry);
+	}
+
+	query = next;
+    }
+
+    /* Running queries are dropped once finished */
+    TAILQ_FOREACH(query, &pool->running_queries, entry)
+	if (query->cb_data == cb_data)
+	    query->cancelled = true;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    destroy_list(&cancelled);
+}
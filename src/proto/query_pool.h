@@ -0,0 +1,62 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef QUERY_POOL_H
+#define QUERY_POOL_H
+
+#include <event.h>
+#include <stdbool.h>
+
+#include "filter.h"
+#include "log.h"
+#include "msg.h"
+#include "proto_ta.h"
+#include "sd.h"
+
+/* A pool of reader threads, answering read-only queries (i.e.,
+   listings) from an sd instance's snapshots, without involving the
+   domain's event loop thread. The sd instance must have snapshots
+   enabled, with room for at least as many readers as there are
+   threads in the pool.
+
+   All functions below are to be called from the thread owning the
+   sd instance. */
+struct query_pool;
+
+enum query_type {
+    query_type_services,
+    query_type_subscriptions,
+    query_type_clients
+};
+
+struct query_pool *query_pool_create(struct event_base *event_base,
+				     struct sd *sd, size_t num_threads,
+				     const struct log_ctx *log_ctx);
+void query_pool_destroy(struct query_pool *pool);
+
+int query_pool_start(struct query_pool *pool);
+
+/* Called one or more times, with the transaction's messages, in
+   order, all of which are handed over to the callee. On the last
+   call, 'complete' is true, the messages end with the completion
+   message, and the transaction is handed back to the callee. */
+typedef void (*query_result_cb)(struct proto_ta *ta, struct msg **msgs,
+				size_t num_msgs, bool complete,
+				void *cb_data);
+
+/* The pool takes ownership of the transaction and the (optional)
+   services filter, until the query is complete.
+
+   Services listings of large enough snapshots are partitioned, and
+   the parts scanned in parallel by the pool's threads. The results
+   are delivered in part order, as parts finish. */
+void query_pool_submit(struct query_pool *pool, enum query_type type,
+		       struct proto_ta *ta, struct filter *filter,
+		       query_result_cb result_cb, void *cb_data);
+
+/* Drops all not-yet-delivered queries submitted with 'cb_data'. */
+void query_pool_cancel(struct query_pool *pool, void *cb_data);
+
+#endif
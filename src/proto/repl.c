@@ -0,0 +1,765 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <xcm.h>
+
+#include "srec.h"
+#include "srec_table.h"
+#include "util.h"
+
+#include "repl.h"
+
+#define MAX_MSG 65535
+#define RECONNECT_INTERVAL 1.0
+
+/* Records queued, in bytes, at which the source gives up on the
+   current connection, and starts over with a new one. */
+#define MAX_QUEUED (64 * 1024 * 1024)
+
+/* A message is a header followed by a number of service records. A
+   reset message, carrying the first part of the copy of the active
+   server's services, is sent first on every connection. The end of
+   the copy is marked by a synced message, carrying no records. */
+enum msg_type {
+    msg_type_reset = 1,
+    msg_type_records = 2,
+    msg_type_synced = 3
+};
+
+struct msg_header
+{
+    uint32_t type;
+    uint32_t reserved;
+};
+
+enum source_state {
+    source_state_disconnected,
+    /* awaiting the start of the listing of all services */
+    source_state_syncing,
+    source_state_streaming
+};
+
+struct repl_source
+{
+    char *standby_addr;
+    struct event_base *event_base;
+    struct shards *shards;
+
+    pthread_t thread;
+    bool started;
+    /* interrupts the sender thread's socket I/O waits */
+    int stop_fds[2];
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* protected by 'lock' */
+    enum source_state state;
+    uint64_t epoch;
+    struct srec_buf queue;
+    bool overflowed;
+    struct srec_buf dump;
+    bool dump_ready;
+    bool stop;
+
+    /* only accessed by the server thread */
+    int wake_fds[2];
+    struct event wake_event;
+    bool listing;
+    struct srec_buf listing_buf;
+
+    const struct log_ctx *log_ctx;
+};
+
+static void write_byte(int fd)
+{
+    char c = 0;
+    ssize_t rc;
+
+    /* A full pipe already is a pending wakeup */
+    do {
+	rc = write(fd, &c, 1);
+    } while (rc < 0 && errno == EINTR);
+}
+
+static void drain(int fd)
+{
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+	;
+}
+
+static void begin_listing(struct repl_source *source, uint64_t epoch);
+
+static void listing_cb(int64_t op_id, const struct service *service,
+		       void *cb_data)
+{
+    struct repl_source *source = cb_data;
+
+    if (service != NULL) {
+	/* mirrored services are replicated by their own server */
+	if (!service_is_mirrored(service))
+	    srec_add_service(&source->listing_buf, ut_ftime(), service);
+	return;
+    }
+
+    source->listing = false;
+
+    pthread_mutex_lock(&source->lock);
+
+    if ((uint64_t)op_id == source->epoch &&
+	source->state == source_state_streaming) {
+	struct srec_buf dump = source->dump;
+
+	source->dump = source->listing_buf;
+	source->dump_ready = true;
+	source->listing_buf = dump;
+
+	pthread_cond_signal(&source->cond);
+    }
+
+    source->listing_buf.len = 0;
+
+    /* the connection was replaced while listing */
+    bool resync = source->state == source_state_syncing;
+    uint64_t epoch = source->epoch;
+
+    if (resync)
+	source->state = source_state_streaming;
+
+    pthread_mutex_unlock(&source->lock);
+
+    if (resync)
+	begin_listing(source, epoch);
+}
+
+static void begin_listing(struct repl_source *source, uint64_t epoch)
+{
+    source->listing = true;
+
+    shards_foreach_service(source->shards, NULL, epoch, listing_cb, source);
+}
+
+static void wake_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct repl_source *source = cb_data;
+
+    drain(fd);
+
+    pthread_mutex_lock(&source->lock);
+
+    bool sync = source->state == source_state_syncing && !source->listing;
+    uint64_t epoch = source->epoch;
+
+    /* Changes made from now on are queued, and sent after the
+       listing, which thus may be stale, but never newer */
+    if (sync)
+	source->state = source_state_streaming;
+
+    pthread_mutex_unlock(&source->lock);
+
+    if (sync)
+	begin_listing(source, epoch);
+}
+
+struct repl_source *repl_source_create(struct event_base *event_base,
+				       struct shards *shards,
+				       const char *standby_addr,
+				       const struct log_ctx *log_ctx)
+{
+    struct repl_source *source = ut_malloc(sizeof(struct repl_source));
+
+    *source = (struct repl_source) {
+	.standby_addr = ut_strdup(standby_addr),
+	.event_base = event_base,
+	.shards = shards,
+	.log_ctx = log_ctx
+    };
+
+    if (pipe2(source->stop_fds, O_CLOEXEC|O_NONBLOCK) < 0)
+	goto err_free;
+
+    if (pipe2(source->wake_fds, O_CLOEXEC|O_NONBLOCK) < 0)
+	goto err_close_stop;
+
+    pthread_mutex_init(&source->lock, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&source->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    srec_buf_init(&source->queue);
+    srec_buf_init(&source->dump);
+    srec_buf_init(&source->listing_buf);
+
+    event_assign(&source->wake_event, event_base, source->wake_fds[0],
+		 EV_READ|EV_PERSIST, wake_cb, source);
+    event_add(&source->wake_event, NULL);
+
+    return source;
+
+err_close_stop:
+    close(source->stop_fds[0]);
+    close(source->stop_fds[1]);
+err_free:
+    log_error_c(log_ctx, "Error creating replication pipe: %s.",
+		strerror(errno));
+    ut_free(source->standby_addr);
+    ut_free(source);
+    return NULL;
+}
+
+/* The shards must be destroyed before the source. */
+void repl_source_destroy(struct repl_source *source)
+{
+    if (source != NULL) {
+	if (source->started) {
+	    pthread_mutex_lock(&source->lock);
+	    source->stop = true;
+	    pthread_cond_signal(&source->cond);
+	    pthread_mutex_unlock(&source->lock);
+
+	    write_byte(source->stop_fds[1]);
+
+	    pthread_join(source->thread, NULL);
+	}
+
+	event_del(&source->wake_event);
+
+	close(source->wake_fds[0]);
+	close(source->wake_fds[1]);
+	close(source->stop_fds[0]);
+	close(source->stop_fds[1]);
+
+	srec_buf_deinit(&source->queue);
+	srec_buf_deinit(&source->dump);
+	srec_buf_deinit(&source->listing_buf);
+
+	pthread_cond_destroy(&source->cond);
+	pthread_mutex_destroy(&source->lock);
+
+	ut_free(source->standby_addr);
+	ut_free(source);
+    }
+}
+
+/* Returns -1 if the source is being stopped. */
+static int await_sock(struct repl_source *source, struct xcm_socket *sock,
+		      int condition)
+{
+    if (xcm_await(sock, condition) < 0)
+	return -1;
+
+    struct pollfd pfds[] = {
+	{ .fd = xcm_fd(sock), .events = POLLIN },
+	{ .fd = source->stop_fds[0], .events = POLLIN }
+    };
+
+    int rc;
+
+    do {
+	rc = poll(pfds, 2, -1);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc < 0 || pfds[1].revents != 0 ? -1 : 0;
+}
+
+static struct xcm_socket *connect_standby(struct repl_source *source)
+{
+    struct xcm_socket *sock = xcm_connect(source->standby_addr, XCM_NONBLOCK);
+
+    if (sock == NULL)
+	return NULL;
+
+    for (;;) {
+	if (xcm_finish(sock) == 0)
+	    return sock;
+
+	if (errno != EAGAIN ||
+	    await_sock(source, sock, XCM_SO_SENDABLE) < 0) {
+	    int err = errno;
+	    xcm_close(sock);
+	    errno = err;
+	    return NULL;
+	}
+    }
+}
+
+static int send_msg(struct repl_source *source, struct xcm_socket *sock,
+		    const char *msg, size_t len)
+{
+    for (;;) {
+	if (xcm_send(sock, msg, len) == 0)
+	    return 0;
+
+	if (errno != EAGAIN) {
+	    log_info_c(source->log_ctx, "Error sending to standby: %s.",
+		       strerror(errno));
+	    return -1;
+	}
+
+	if (await_sock(source, sock, XCM_SO_SENDABLE) < 0)
+	    return -1;
+    }
+}
+
+/* Packs the records into as few messages as possible. */
+static int send_records(struct repl_source *source, struct xcm_socket *sock,
+			enum msg_type type, const struct srec_buf *buf)
+{
+    char msg[MAX_MSG];
+    struct msg_header header = {
+	.type = type
+    };
+    size_t msg_len = sizeof(header);
+    size_t offset = 0;
+
+    memcpy(msg, &header, sizeof(header));
+
+    while (offset < buf->len) {
+	size_t rec_len = srec_len(buf->data + offset);
+
+	if (rec_len > sizeof(msg) - sizeof(header)) {
+	    log_warn_c(source->log_ctx, "Service record of %zd bytes is too "
+		       "large to be replicated.", rec_len);
+	    offset += rec_len;
+	    continue;
+	}
+
+	if (msg_len + rec_len > sizeof(msg)) {
+	    if (send_msg(source, sock, msg, msg_len) < 0)
+		return -1;
+
+	    header.type = msg_type_records;
+	    memcpy(msg, &header, sizeof(header));
+	    msg_len = sizeof(header);
+	}
+
+	memcpy(msg + msg_len, buf->data + offset, rec_len);
+	msg_len += rec_len;
+	offset += rec_len;
+    }
+
+    if (msg_len > sizeof(header) || header.type == msg_type_reset)
+	return send_msg(source, sock, msg, msg_len);
+
+    return 0;
+}
+
+static int send_synced(struct repl_source *source, struct xcm_socket *sock)
+{
+    struct msg_header header = {
+	.type = msg_type_synced
+    };
+
+    return send_msg(source, sock, (const char *)&header, sizeof(header));
+}
+
+/* Called, and returns, with the lock held. */
+static void stream(struct repl_source *source, struct xcm_socket *sock)
+{
+    source->epoch++;
+    source->state = source_state_syncing;
+    source->dump_ready = false;
+    source->overflowed = false;
+    source->queue.len = 0;
+
+    write_byte(source->wake_fds[1]);
+
+    while (!source->stop && !source->dump_ready)
+	pthread_cond_wait(&source->cond, &source->lock);
+
+    if (source->stop)
+	return;
+
+    struct srec_buf batch = source->dump;
+    srec_buf_init(&source->dump);
+
+    pthread_mutex_unlock(&source->lock);
+
+    int rc = send_records(source, sock, msg_type_reset, &batch);
+
+    if (rc == 0)
+	rc = send_synced(source, sock);
+
+    pthread_mutex_lock(&source->lock);
+
+    while (rc == 0) {
+	while (!source->stop && source->queue.len == 0 &&
+	       !source->overflowed)
+	    pthread_cond_wait(&source->cond, &source->lock);
+
+	if (source->stop)
+	    break;
+
+	if (source->overflowed) {
+	    log_warn_c(source->log_ctx, "Standby is falling behind. "
+		       "Reconnecting.");
+	    break;
+	}
+
+	/* The batch is whatever has been queued */
+	struct srec_buf queue = source->queue;
+	source->queue = batch;
+	source->queue.len = 0;
+	batch = queue;
+
+	pthread_mutex_unlock(&source->lock);
+
+	rc = send_records(source, sock, msg_type_records, &batch);
+
+	pthread_mutex_lock(&source->lock);
+    }
+
+    srec_buf_deinit(&batch);
+}
+
+static void await_reconnect(struct repl_source *source)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += (time_t)RECONNECT_INTERVAL;
+
+    while (!source->stop &&
+	   pthread_cond_timedwait(&source->cond, &source->lock,
+				  &deadline) != ETIMEDOUT)
+	;
+}
+
+static void *sender_run(void *arg)
+{
+    struct repl_source *source = arg;
+    bool failing = false;
+
+    pthread_mutex_lock(&source->lock);
+
+    while (!source->stop) {
+	pthread_mutex_unlock(&source->lock);
+
+	struct xcm_socket *sock = connect_standby(source);
+	int err = errno;
+
+	pthread_mutex_lock(&source->lock);
+
+	if (sock == NULL) {
+	    if (!failing && !source->stop)
+		log_info_c(source->log_ctx, "Unable to connect to standby "
+			   "at \"%s\": %s. Retrying.", source->standby_addr,
+			   strerror(err));
+	    failing = true;
+	    await_reconnect(source);
+	    continue;
+	}
+
+	failing = false;
+
+	log_info_c(source->log_ctx, "Replicating to standby at \"%s\".",
+		   source->standby_addr);
+
+	stream(source, sock);
+
+	source->state = source_state_disconnected;
+
+	pthread_mutex_unlock(&source->lock);
+
+	xcm_close(sock);
+
+	pthread_mutex_lock(&source->lock);
+    }
+
+    pthread_mutex_unlock(&source->lock);
+
+    return NULL;
+}
+
+int repl_source_start(struct repl_source *source)
+{
+    sigset_t all;
+    sigset_t orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &orig);
+
+    int rc = pthread_create(&source->thread, NULL, sender_run, source);
+
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    if (rc != 0) {
+	log_error_c(source->log_ctx, "Unable to create replication "
+		    "thread: %s.", strerror(rc));
+	return -1;
+    }
+
+    source->started = true;
+
+    return 0;
+}
+
+void repl_source_change_cb(const struct service *service,
+			   enum service_change_type change_type,
+			   void *cb_data)
+{
+    struct repl_source *source = cb_data;
+    double now = ut_ftime();
+
+    if (service_is_mirrored(service))
+	return;
+
+    pthread_mutex_lock(&source->lock);
+
+    if (source->state == source_state_streaming && !source->overflowed) {
+	if (change_type == service_change_type_removed)
+	    srec_add_removed(&source->queue, now, service_get_id(service));
+	else
+	    srec_add_service(&source->queue, now, service);
+
+	if (source->queue.len > MAX_QUEUED)
+	    source->overflowed = true;
+
+	pthread_cond_signal(&source->cond);
+    }
+
+    pthread_mutex_unlock(&source->lock);
+}
+
+struct repl_sink
+{
+    struct event_base *event_base;
+    struct shards *shards;
+
+    struct xcm_socket *server_sock;
+    struct event accept_event;
+
+    struct xcm_socket *conn;
+    struct event conn_event;
+
+    /* the last complete copy of the active server's services */
+    struct srec_table *table;
+    /* a copy being received, swapped in once complete */
+    struct srec_table *staged;
+    double lost_at;
+    bool promoted;
+
+    const struct log_ctx *log_ctx;
+};
+
+struct repl_sink *repl_sink_create(struct event_base *event_base,
+				   struct shards *shards, const char *addr,
+				   const struct log_ctx *log_ctx)
+{
+    struct xcm_socket *server_sock = xcm_server(addr);
+
+    if (server_sock == NULL) {
+	log_error_c(log_ctx, "Error creating replication server socket "
+		    "\"%s\": %s", addr, strerror(errno));
+	return NULL;
+    }
+
+    struct repl_sink *sink = ut_malloc(sizeof(struct repl_sink));
+
+    *sink = (struct repl_sink) {
+	.event_base = event_base,
+	.shards = shards,
+	.server_sock = server_sock,
+	.table = srec_table_create(),
+	.log_ctx = log_ctx
+    };
+
+    return sink;
+}
+
+static void close_conn(struct repl_sink *sink)
+{
+    if (sink->conn != NULL) {
+	event_del(&sink->conn_event);
+	xcm_close(sink->conn);
+	sink->conn = NULL;
+	sink->lost_at = ut_ftime();
+    }
+
+    if (sink->staged != NULL) {
+	log_info_c(sink->log_ctx, "Discarding incomplete copy of %zd "
+		   "replicated services.", srec_table_size(sink->staged));
+	srec_table_destroy(sink->staged);
+	sink->staged = NULL;
+    }
+}
+
+static void close_server_sock(struct repl_sink *sink)
+{
+    if (sink->server_sock != NULL) {
+	event_del(&sink->accept_event);
+	xcm_close(sink->server_sock);
+	sink->server_sock = NULL;
+    }
+}
+
+void repl_sink_destroy(struct repl_sink *sink)
+{
+    if (sink != NULL) {
+	close_conn(sink);
+	close_server_sock(sink);
+	srec_table_destroy(sink->table);
+	ut_free(sink);
+    }
+}
+
+static int process_msg(struct repl_sink *sink, const char *msg, size_t len)
+{
+    struct msg_header header;
+
+    if (len < sizeof(header))
+	return -1;
+
+    memcpy(&header, msg, sizeof(header));
+
+    switch (header.type) {
+    case msg_type_reset:
+	if (sink->staged == NULL)
+	    sink->staged = srec_table_create();
+	else
+	    srec_table_clear(sink->staged);
+	break;
+    case msg_type_records:
+	break;
+    case msg_type_synced:
+	if (sink->staged == NULL || len > sizeof(header))
+	    return -1;
+
+	srec_table_destroy(sink->table);
+	sink->table = sink->staged;
+	sink->staged = NULL;
+
+	log_info_c(sink->log_ctx, "Synchronized %zd replicated services.",
+		   srec_table_size(sink->table));
+	return 0;
+    default:
+	return -1;
+    }
+
+    /* Until the copy is complete, changes apply to it */
+    struct srec_table *table =
+	sink->staged != NULL ? sink->staged : sink->table;
+    size_t offset = sizeof(header);
+
+    while (offset < len) {
+	struct srec rec;
+	ssize_t rec_len = srec_parse(msg + offset, len - offset, &rec);
+
+	if (rec_len < 0)
+	    return -1;
+
+	srec_table_apply(table, &rec);
+
+	props_destroy(rec.props);
+
+	offset += rec_len;
+    }
+
+    return 0;
+}
+
+static void conn_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct repl_sink *sink = cb_data;
+
+    for (;;) {
+	char msg[MAX_MSG];
+	int rc = xcm_receive(sink->conn, msg, sizeof(msg));
+
+	if (rc < 0 && errno == EAGAIN)
+	    return;
+
+	if (rc <= 0) {
+	    log_info_c(sink->log_ctx, "Replication connection lost. "
+		       "Keeping %zd replicated services.",
+		       srec_table_size(sink->table));
+	    close_conn(sink);
+	    return;
+	}
+
+	if (process_msg(sink, msg, rc) < 0) {
+	    log_error_c(sink->log_ctx, "Received malformed replication "
+			"message. Closing connection.");
+	    close_conn(sink);
+	    return;
+	}
+    }
+}
+
+static void accept_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct repl_sink *sink = cb_data;
+
+    struct xcm_socket *conn = xcm_accept(sink->server_sock);
+
+    if (conn == NULL)
+	return;
+
+    if (xcm_set_blocking(conn, false) < 0 ||
+	xcm_await(conn, XCM_SO_RECEIVABLE) < 0) {
+	log_error_c(sink->log_ctx, "Unable to configure replication "
+		    "connection: %s.", strerror(errno));
+	xcm_close(conn);
+	return;
+    }
+
+    /* The active server has reconnected */
+    close_conn(sink);
+
+    sink->conn = conn;
+
+    event_assign(&sink->conn_event, sink->event_base, xcm_fd(conn),
+		 EV_READ|EV_PERSIST, conn_cb, sink);
+    event_add(&sink->conn_event, NULL);
+
+    log_info_c(sink->log_ctx, "Accepted replication connection from "
+	       "\"%s\".", xcm_remote_addr(conn));
+}
+
+int repl_sink_start(struct repl_sink *sink)
+{
+    if (xcm_set_blocking(sink->server_sock, false) < 0 ||
+	xcm_await(sink->server_sock, XCM_SO_ACCEPTABLE) < 0) {
+	log_error_c(sink->log_ctx, "Unable to configure replication "
+		    "server socket: %s.", strerror(errno));
+	return -1;
+    }
+
+    event_assign(&sink->accept_event, sink->event_base,
+		 xcm_fd(sink->server_sock), EV_READ|EV_PERSIST, accept_cb,
+		 sink);
+    event_add(&sink->accept_event, NULL);
+
+    return 0;
+}
+
+void repl_sink_promote(struct repl_sink *sink)
+{
+    if (sink->promoted)
+	return;
+
+    sink->promoted = true;
+
+    close_conn(sink);
+    close_server_sock(sink);
+
+    size_t num_expired;
+    size_t num_restored = srec_table_restore(sink->table, sink->shards,
+					     sink->lost_at, &num_expired);
+
+    log_info_c(sink->log_ctx, "Promoted to active. Restored %zd "
+	       "replicated services as orphans. %zd services had already "
+	       "expired.", num_restored, num_expired);
+}
@@ -0,0 +1,58 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef REPL_H
+#define REPL_H
+
+#include <event.h>
+
+#include "log.h"
+#include "shards.h"
+
+/* Hot-standby replication of a domain's services.
+
+   The active server's replication source connects to the standby
+   server's replication sink, sends a copy of all services, and then
+   streams every service change, as service records batched into XCM
+   messages. Records are queued by whatever thread made the change,
+   and are sent by a dedicated thread, without waiting for any
+   acknowledgement. A source falling too far behind reconnects and
+   starts over.
+
+   The sink keeps the replicated services aside, in the standby
+   server's thread, until it is promoted. Upon promotion, the services
+   are restored as orphans, for their clients to reclaim. */
+
+struct repl_source;
+
+struct repl_source *repl_source_create(struct event_base *event_base,
+				       struct shards *shards,
+				       const char *standby_addr,
+				       const struct log_ctx *log_ctx);
+void repl_source_destroy(struct repl_source *source);
+
+int repl_source_start(struct repl_source *source);
+
+/* For use with shards_add_change_cb(). */
+void repl_source_change_cb(const struct service *service,
+			   enum service_change_type change_type,
+			   void *cb_data);
+
+struct repl_sink;
+
+struct repl_sink *repl_sink_create(struct event_base *event_base,
+				   struct shards *shards, const char *addr,
+				   const struct log_ctx *log_ctx);
+void repl_sink_destroy(struct repl_sink *sink);
+
+int repl_sink_start(struct repl_sink *sink);
+
+/* Stops accepting replication connections, and restores the
+   replicated services. Services which were not orphans at the
+   active server are considered orphans since the replication
+   connection was lost, or since now, if it's still up. */
+void repl_sink_promote(struct repl_sink *sink);
+
+#endif
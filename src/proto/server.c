@@ -3,13 +3,29 @@
  * Copyright(c) 2023 Ericsson AB
  */
 
+#include <ctype.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include <xcm.h>
 
+#include "federation.h"
+#include "io_pool.h"
+#include "journal.h"
 #include "log.h"
+#include "out_budget.h"
 #include "plist.h"
 #include "proto_conn.h"
-#include "sd.h"
+#include "query_pool.h"
+#include "repl.h"
+#include "shards.h"
+#include "srec_table.h"
+#include "shm.h"
+#include "state_file.h"
+#include "upstream.h"
 #include "util.h"
 
 #include "server.h"
@@ -17,6 +33,11 @@
 #define CLEAN_OUT_INTERVAL 1.0
 #define MAX_HANDSHAKE_TIME 2.0
 
+/* Commands sent to the server thread over its control pipe */
+#define CMD_STOP 'q'
+#define CMD_LOG_STATS 's'
+#define CMD_PROMOTE 'p'
+
 static bool proto_conn_equal(const void *a, const void *b)
 {
     return a == b;
@@ -30,14 +51,50 @@ struct server
 {
     char *name;
 
+    struct server_conf conf;
+
     struct event_base *event_base;
 
+    /* The server thread owns all of the server's state, including
+       its event loop. Other threads use the control pipe. */
+    pthread_t thread;
+    int ctl_fds[2];
+    struct event ctl_event;
+
     struct xcm_socket *sock;
     struct event sock_event;
 
     struct event clean_out_event;
 
-    struct sd *sd;
+    struct shards *shards;
+
+    struct out_budget *budget;
+
+    struct proto_sched *sched;
+
+    struct io_pool *io_pool;
+
+    struct query_pool *query_pool;
+
+    char *state_path;
+    struct event state_event;
+    /* Non-NULL while a save is in progress */
+    struct state_writer *state_writer;
+    uint64_t state_journal_seq;
+    bool stop_after_save;
+
+    struct journal *journal;
+
+    struct repl_source *repl_source;
+    struct repl_sink *repl_sink;
+
+    struct upstream *upstream;
+
+    struct fed_export *fed_export;
+    struct fed_import **fed_imports;
+    size_t num_fed_imports;
+
+    struct shm_writer *shm_writer;
 
     bool running;
 
@@ -47,8 +104,154 @@ struct server
     struct log_ctx *log_ctx;
 };
 
+/* The server address, with characters not safe in a file name
+   %-escaped, in 'state_dir'. */
+static char *get_state_base(const char *state_dir, const char *server_addr)
+{
+    char *base = ut_asprintf("%s/", state_dir);
+    const char *c;
+
+    for (c = server_addr; *c != '\0'; c++) {
+	char *prev = base;
+
+	if (isalnum((unsigned char)*c) || *c == '-' || *c == '_' || *c == '.')
+	    base = ut_asprintf("%s%c", prev, *c);
+	else
+	    base = ut_asprintf("%s%%%02X", prev, (unsigned char)*c);
+
+	ut_free(prev);
+    }
+
+    return base;
+}
+
+static void table_apply_cb(const struct srec *rec, void *cb_data)
+{
+    struct srec_table *table = cb_data;
+
+    srec_table_apply(table, rec);
+}
+
+/* Restores the services from the state file and, if 'journal_prefix'
+   is non-NULL, from the journal. Returns the sequence number to use
+   for the next journal file. */
+static uint64_t restore(struct shards *shards, const char *state_path,
+			const char *journal_prefix,
+			const struct log_ctx *log_ctx)
+{
+    struct srec_table *table = srec_table_create();
+    struct state_info info;
+    uint64_t last_seq = 0;
+
+    ssize_t num_loaded = state_load(state_path, &info, table_apply_cb,
+				    table, log_ctx);
+
+    if (num_loaded < 0) {
+	log_warn_c(log_ctx, "Failed to load state from \"%s\". Starting "
+		   "with an empty domain.", state_path);
+	srec_table_clear(table);
+	info.journal_seq = STATE_NO_JOURNAL;
+    }
+
+    ssize_t num_replayed = 0;
+
+    if (journal_prefix != NULL) {
+	/* A state file saved without a journal supersedes any
+	   journal files lying around */
+	num_replayed = journal_replay(journal_prefix, info.journal_seq,
+				      &last_seq, table_apply_cb, table,
+				      log_ctx);
+
+	if (num_replayed < 0) {
+	    log_warn_c(log_ctx, "Failed to replay journal \"%s\".",
+		       journal_prefix);
+	    num_replayed = 0;
+	}
+
+	if (info.journal_seq != STATE_NO_JOURNAL &&
+	    info.journal_seq > last_seq)
+	    last_seq = info.journal_seq;
+    }
+
+    if (srec_table_size(table) > 0) {
+	size_t num_expired;
+
+	/* The services' clients are disconnected by the restart, and
+	   are assumed to have been so since the state was last
+	   known. */
+	size_t num_restored =
+	    srec_table_restore(table, shards, srec_table_last_known(table),
+			       &num_expired);
+
+	log_info_c(log_ctx, "Restored %zd orphan services from \"%s\" "
+		   "and %zd journal records. %zd services had already "
+		   "expired.", num_restored, state_path, num_replayed,
+		   num_expired);
+    }
+
+    srec_table_destroy(table);
+
+    return last_seq + 1;
+}
+
+static void destroy_imports(struct fed_import **imports, size_t num_imports)
+{
+    size_t i;
+    for (i = 0; i < num_imports; i++)
+	fed_import_destroy(imports[i]);
+
+    ut_free(imports);
+}
+
+/* One import per peer address in 'import_from'. */
+static int create_imports(struct event_base *event_base,
+			  struct shards *shards, const char *import_from,
+			  const char *import_filter,
+			  const struct log_ctx *log_ctx,
+			  struct fed_import ***imports, size_t *num_imports)
+{
+    char *addrs = ut_strdup(import_from);
+    char *save;
+    char *addr;
+
+    *imports = NULL;
+    *num_imports = 0;
+
+    for (addr = strtok_r(addrs, " \t", &save); addr != NULL;
+	 addr = strtok_r(NULL, " \t", &save)) {
+	struct fed_import *import =
+	    fed_import_create(event_base, shards, addr, import_filter,
+			      log_ctx);
+
+	if (import == NULL) {
+	    destroy_imports(*imports, *num_imports);
+	    ut_free(addrs);
+	    return -1;
+	}
+
+	*imports = ut_realloc(*imports, sizeof(struct fed_import *) *
+			      (*num_imports + 1));
+	(*imports)[(*num_imports)++] = import;
+    }
+
+    ut_free(addrs);
+
+    return 0;
+}
+
+static void journal_change_cb(const struct service *service,
+			      enum service_change_type change_type,
+			      void *cb_data)
+{
+    struct journal *journal = cb_data;
+
+    /* Mirrored services are kept by their own server */
+    if (!service_is_mirrored(service))
+	journal_add(journal, service, change_type);
+}
+
 struct server *server_create(const char *name, const char *server_addr,
-			     struct event_base *event_base)
+			     const struct server_conf *conf)
 {
     struct log_ctx *log_ctx;
 
@@ -57,24 +260,183 @@ struct server *server_create(const char *name, const char *server_addr,
     else
 	log_ctx = log_ctx_create(NULL);
 
+    struct event_base *event_base = event_base_new();
+
+    if (event_base == NULL) {
+	log_error_c(log_ctx, "Error creating event base.");
+	goto err_log_ctx;
+    }
+
+    int ctl_fds[2];
+
+    if (pipe2(ctl_fds, O_CLOEXEC) < 0) {
+	log_error_c(log_ctx, "Error creating control pipe: %s",
+		    strerror(errno));
+	goto err_event_base;
+    }
+
+    struct io_pool *io_pool = NULL;
+
+    if (conf->num_io_threads > 0) {
+	io_pool = io_pool_create(event_base, conf->num_io_threads, log_ctx);
+
+	if (io_pool == NULL)
+	    goto err_ctl_fds;
+    }
+
+    struct shards *shards =
+	shards_create(event_base, conf->num_shards, log_ctx);
+
+    if (shards == NULL)
+	goto err_io_pool;
+
+    struct upstream *upstream = NULL;
+
+    if (conf->upstream_addr != NULL) {
+	if (conf->state_dir != NULL || conf->replicate_to != NULL ||
+	    conf->standby_addr != NULL) {
+	    log_error_c(log_ctx, "A proxy domain can't keep state of its "
+			"own.");
+	    goto err_shards;
+	}
+
+	if (conf->export_addr != NULL || conf->import_from != NULL) {
+	    log_error_c(log_ctx, "A proxy domain can't be federated.");
+	    goto err_shards;
+	}
+
+	upstream = upstream_create(event_base, shards, conf->upstream_addr,
+				   log_ctx);
+    }
+
+    struct shm_writer *shm_writer = NULL;
+
+    /* Added before the state is restored, for the segment to include
+       the restored services */
+    if (conf->shm_name != NULL) {
+	shm_writer = shm_writer_create(conf->shm_name, conf->shm_slots,
+				       log_ctx);
+
+	if (shm_writer == NULL)
+	    goto err_upstream;
+
+	shards_add_change_cb(shards, shm_writer_change_cb, shm_writer);
+    }
+
+    struct query_pool *query_pool = NULL;
+
+    if (conf->num_query_threads > 0) {
+	struct sd *core = shards_get_core(shards);
+
+	sd_enable_snapshots(core, conf->num_query_threads);
+
+	query_pool = query_pool_create(event_base, core,
+				       conf->num_query_threads, log_ctx);
+
+	if (query_pool == NULL)
+	    goto err_shm;
+    }
+
+    char *state_path = NULL;
+    struct journal *journal = NULL;
+
+    if (conf->state_dir != NULL) {
+	char *state_base = get_state_base(conf->state_dir, server_addr);
+	char *journal_prefix = conf->journal ?
+	    ut_asprintf("%s.journal", state_base) : NULL;
+
+	state_path = ut_asprintf("%s.state", state_base);
+
+	uint64_t journal_seq =
+	    restore(shards, state_path, journal_prefix, log_ctx);
+
+	/* Enabled only now, since restoring doesn't change anything
+	   worth journaling */
+	if (journal_prefix != NULL) {
+	    journal = journal_create(journal_prefix, journal_seq,
+				     conf->journal_sync, log_ctx);
+	    shards_add_change_cb(shards, journal_change_cb, journal);
+	}
+
+	ut_free(journal_prefix);
+	ut_free(state_base);
+    }
+
+    struct repl_source *repl_source = NULL;
+
+    if (conf->replicate_to != NULL) {
+	repl_source = repl_source_create(event_base, shards,
+					 conf->replicate_to, log_ctx);
+
+	if (repl_source == NULL)
+	    goto err_query_pool;
+
+	shards_add_change_cb(shards, repl_source_change_cb, repl_source);
+    }
+
+    struct repl_sink *repl_sink = NULL;
+
+    if (conf->standby_addr != NULL) {
+	repl_sink = repl_sink_create(event_base, shards, conf->standby_addr,
+				     log_ctx);
+
+	if (repl_sink == NULL)
+	    goto err_repl;
+    }
+
+    struct fed_export *fed_export = NULL;
+
+    if (conf->export_addr != NULL) {
+	fed_export = fed_export_create(event_base, shards, conf->export_addr,
+				       log_ctx);
+
+	if (fed_export == NULL)
+	    goto err_repl;
+    }
+
+    struct fed_import **fed_imports = NULL;
+    size_t num_fed_imports = 0;
+
+    if (conf->import_from != NULL &&
+	create_imports(event_base, shards, conf->import_from,
+		       conf->import_filter, log_ctx, &fed_imports,
+		       &num_fed_imports) < 0)
+	goto err_fed_export;
+
     struct xcm_socket *server_sock = xcm_server(server_addr);
 
     if (server_sock == NULL) {
 	log_error_c(log_ctx, "Error creating server socket \"%s\": %s",
 		    server_addr, strerror(errno));
-
-	log_ctx_destroy(log_ctx);
-
-	return NULL;
+	goto err_fed_imports;
     }
 
     struct server *server = ut_malloc(sizeof(struct server));
 
+    struct out_budget *budget =
+	out_budget_create(log_ctx, conf->domain_soft_out_limit,
+			  conf->domain_hard_out_limit);
+
     *server = (struct server) {
 	.name = ut_strdup_non_null(name),
+	.conf = *conf,
 	.event_base = event_base,
+	.ctl_fds = { ctl_fds[0], ctl_fds[1] },
 	.sock = server_sock,
-	.sd = sd_create(event_base),
+	.shards = shards,
+	.budget = budget,
+	.sched = proto_sched_create(event_base, budget),
+	.io_pool = io_pool,
+	.query_pool = query_pool,
+	.state_path = state_path,
+	.journal = journal,
+	.repl_source = repl_source,
+	.repl_sink = repl_sink,
+	.upstream = upstream,
+	.fed_export = fed_export,
+	.fed_imports = fed_imports,
+	.num_fed_imports = num_fed_imports,
+	.shm_writer = shm_writer,
 	.client_conns = proto_conn_list_create(),
 	.clientless_conns = proto_conn_list_create(),
 	.log_ctx = log_ctx
@@ -83,6 +445,45 @@ struct server *server_create(const char *name, const char *server_addr,
     log_info_c(log_ctx, "Configured domain bound to \"%s\".", server_addr);
 
     return server;
+
+err_fed_imports:
+    destroy_imports(fed_imports, num_fed_imports);
+err_fed_export:
+    fed_export_destroy(fed_export);
+err_repl:
+    repl_sink_destroy(repl_sink);
+    repl_source_destroy(repl_source);
+err_query_pool:
+    journal_destroy(journal);
+    ut_free(state_path);
+    query_pool_destroy(query_pool);
+err_shm:
+    shm_writer_destroy(shm_writer);
+err_upstream:
+    upstream_destroy(upstream);
+err_shards:
+    shards_destroy(shards);
+err_io_pool:
+    io_pool_destroy(io_pool);
+err_ctl_fds:
+    close(ctl_fds[0]);
+    close(ctl_fds[1]);
+err_event_base:
+    event_base_free(event_base);
+err_log_ctx:
+    log_ctx_destroy(log_ctx);
+    return NULL;
+}
+
+static void send_cmd(struct server *server, char cmd)
+{
+    ssize_t rc;
+
+    do {
+	rc = write(server->ctl_fds[1], &cmd, 1);
+    } while (rc < 0 && errno == EINTR);
+
+    ut_assert(rc == 1);
 }
 
 static bool destroy_conn(struct proto_conn *conn, void *cb_data)
@@ -98,8 +499,17 @@ void server_destroy(struct server *server)
 	log_info_c(server->log_ctx, "Tearing down domain server.");
 
 	if (server->running) {
+	    send_cmd(server, CMD_STOP);
+
+	    int rc = pthread_join(server->thread, NULL);
+	    ut_assert(rc == 0);
+
 	    event_del(&server->sock_event);
 	    event_del(&server->clean_out_event);
+	    event_del(&server->ctl_event);
+
+	    if (server->state_path != NULL)
+		event_del(&server->state_event);
 	}
 
 	xcm_close(server->sock);
@@ -112,7 +522,37 @@ void server_destroy(struct server *server)
 	proto_conn_list_foreach(server->clientless_conns, destroy_conn, NULL);
 	proto_conn_list_destroy(server->clientless_conns);
 
-	sd_destroy(server->sd);
+	/* Closes the sockets of the connections just destroyed */
+	io_pool_destroy(server->io_pool);
+
+	query_pool_destroy(server->query_pool);
+
+	upstream_destroy(server->upstream);
+
+	destroy_imports(server->fed_imports, server->num_fed_imports);
+	fed_export_destroy(server->fed_export);
+
+	shards_destroy(server->shards);
+
+	shm_writer_destroy(server->shm_writer);
+
+	/* Writes whatever the shards journaled before being stopped */
+	journal_destroy(server->journal);
+
+	repl_source_destroy(server->repl_source);
+	repl_sink_destroy(server->repl_sink);
+
+	state_writer_destroy(server->state_writer);
+	ut_free(server->state_path);
+
+	proto_sched_destroy(server->sched);
+
+	out_budget_destroy(server->budget);
+
+	close(server->ctl_fds[0]);
+	close(server->ctl_fds[1]);
+
+	event_base_free(server->event_base);
 
 	log_ctx_destroy(server->log_ctx);
 
@@ -156,15 +596,19 @@ static void accept_cb(int fd, short ev, void *cb_data)
 	return;
 
     struct proto_conn *conn =
-	proto_conn_create(conn_sock, server->sd, server->event_base,
-			  server->log_ctx, conn_handshake_cb, conn_term_cb,
-			  server);
+	proto_conn_create(conn_sock, server->shards, server->event_base,
+			  &server->conf.conn_conf, server->budget,
+			  server->sched, server->io_pool, server->query_pool,
+			  server->upstream, server->log_ctx,
+			  conn_handshake_cb, conn_term_cb, server);
+
+    if (conn == NULL)
+	return;
 
-    if (conn != NULL)
-	proto_conn_list_append(server->clientless_conns, conn);
+    proto_conn_list_append(server->clientless_conns, conn);
 
     log_info_c(server->log_ctx, "Accepted new client from \"%s\".",
-	       xcm_remote_addr(conn_sock));
+	       proto_conn_remote_addr(conn));
 }
 
 static bool consider_disconnect(struct proto_conn *clientless_conn,
@@ -213,6 +657,104 @@ static void clean_out_cb(int fd, short ev, void *cb_data)
     proto_conn_list_destroy(expired);
 }
 
+static void save_listing_cb(int64_t op_id, const struct service *service,
+			    void *cb_data)
+{
+    struct server *server = cb_data;
+
+    if (service != NULL) {
+	if (!service_is_mirrored(service))
+	    state_writer_add(server->state_writer, service);
+	return;
+    }
+
+    int rc = state_writer_save(server->state_writer, server->state_path,
+			       server->log_ctx);
+
+    /* The journal files preceding the one in use when the listing
+       started are superseded by the state file */
+    if (rc == 0 && server->journal != NULL)
+	journal_compact(server->journal, server->state_journal_seq);
+
+    state_writer_destroy(server->state_writer);
+    server->state_writer = NULL;
+
+    if (server->stop_after_save)
+	event_base_loopbreak(server->event_base);
+}
+
+static void save_state(struct server *server)
+{
+    if (server->state_writer != NULL)
+	return;
+
+    server->state_journal_seq = server->journal != NULL ?
+	journal_rotate(server->journal) : STATE_NO_JOURNAL;
+
+    server->state_writer = state_writer_create(server->state_journal_seq);
+
+    shards_foreach_service(server->shards, NULL, 0, save_listing_cb, server);
+}
+
+static void state_cb(int fd, short ev, void *cb_data)
+{
+    struct server *server = cb_data;
+
+    save_state(server);
+}
+
+static void stop(struct server *server)
+{
+    if (server->state_path == NULL) {
+	event_base_loopbreak(server->event_base);
+	return;
+    }
+
+    /* The loop is left once the final save is complete */
+    server->stop_after_save = true;
+
+    if (server->state_writer != NULL)
+	return;
+
+    save_state(server);
+}
+
+static void log_stats(struct server *server);
+
+static void ctl_cb(int fd, short ev, void *cb_data)
+{
+    struct server *server = cb_data;
+
+    char cmd;
+    ssize_t rc = read(fd, &cmd, 1);
+
+    if (rc != 1)
+	return;
+
+    switch (cmd) {
+    case CMD_STOP:
+	stop(server);
+	break;
+    case CMD_LOG_STATS:
+	log_stats(server);
+	break;
+    case CMD_PROMOTE:
+	repl_sink_promote(server->repl_sink);
+	break;
+    default:
+	ut_assert(0);
+    }
+}
+
+static void *run(void *arg)
+{
+    struct server *server = arg;
+
+    event_base_dispatch(server->event_base);
+
+    return NULL;
+}
+
 int server_start(struct server *server)
 {
     ut_assert(!server->running);
@@ -250,9 +792,173 @@ int server_start(struct server *server)
 
     event_add(&server->clean_out_event, &clean_out_interval);
 
+    event_assign(&server->ctl_event, server->event_base, server->ctl_fds[0],
+		 EV_READ|EV_PERSIST, ctl_cb, server);
+
+    event_add(&server->ctl_event, NULL);
+
+    if (server->state_path != NULL) {
+	event_assign(&server->state_event, server->event_base,
+		     -1, EV_PERSIST, state_cb, server);
+
+	struct timeval state_interval;
+	ut_f_to_timeval(server->conf.state_interval, &state_interval);
+
+	event_add(&server->state_event, &state_interval);
+    }
+
+    if (server->io_pool != NULL && io_pool_start(server->io_pool) < 0)
+	goto err;
+
+    if (server->journal != NULL && journal_start(server->journal) < 0)
+	goto err;
+
+    if (server->query_pool != NULL &&
+	query_pool_start(server->query_pool) < 0)
+	goto err;
+
+    if (shards_start(server->shards) < 0)
+	goto err;
+
+    if (server->repl_source != NULL &&
+	repl_source_start(server->repl_source) < 0)
+	goto err;
+
+    if (server->repl_sink != NULL && repl_sink_start(server->repl_sink) < 0)
+	goto err;
+
+    if (server->upstream != NULL && upstream_start(server->upstream) < 0)
+	goto err;
+
+    if (server->fed_export != NULL &&
+	fed_export_start(server->fed_export) < 0)
+	goto err;
+
+    size_t i;
+    for (i = 0; i < server->num_fed_imports; i++)
+	if (fed_import_start(server->fed_imports[i]) < 0)
+	    goto err;
+
+    /* Signals are left to the main thread. The mask is inherited by
+       the server thread, from the start. */
+    sigset_t all;
+    sigset_t orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &orig);
+
+    int rc = pthread_create(&server->thread, NULL, run, server);
+
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    if (rc != 0) {
+	log_error_c(server->log_ctx, "Unable to create server thread: %s.",
+		    strerror(rc));
+	goto err;
+    }
+
     server->running = true;
 
     log_debug_c(server->log_ctx, "Started serving domain.");
 
     return 0;
+
+err:
+    event_del(&server->sock_event);
+    event_del(&server->clean_out_event);
+    event_del(&server->ctl_event);
+    if (server->state_path != NULL)
+	event_del(&server->state_event);
+    return -1;
+}
+
+static double compr_ratio(const struct compr_stats *stats)
+{
+    if (stats->compressed_bytes == 0)
+	return 1;
+
+    return (double)stats->plain_bytes / stats->compressed_bytes;
+}
+
+static bool log_conn_stats(struct proto_conn *conn, void *cb_data)
+{
+    struct server *server = cb_data;
+
+    size_t queue_len = proto_conn_get_out_queue_len(conn);
+    struct compr_stats sent;
+    struct compr_stats received;
+    bool compressed = proto_conn_get_compr_stats(conn, &sent, &received);
+    size_t num_sessions = proto_conn_get_num_sessions(conn);
+
+    if (queue_len == 0 && !compressed && num_sessions == 0)
+	return true;
+
+    int64_t client_id = proto_conn_get_client_id(conn);
+    char client_id_s[32];
+
+    if (client_id >= 0)
+	snprintf(client_id_s, sizeof(client_id_s), "%"PRIx64, client_id);
+    else
+	snprintf(client_id_s, sizeof(client_id_s), "?");
+
+    if (queue_len > 0)
+	log_info_c(server->log_ctx, "Client %s at \"%s\" has %zd messages "
+		   "(%zd bytes) queued.", client_id_s,
+		   proto_conn_remote_addr(conn), queue_len,
+		   proto_conn_get_out_queue_bytes(conn));
+
+    if (num_sessions > 0)
+	log_info_c(server->log_ctx, "Client %s at \"%s\" multiplexes %zd "
+		   "additional sessions.", client_id_s,
+		   proto_conn_remote_addr(conn), num_sessions);
+
+    if (compressed)
+	log_info_c(server->log_ctx, "Client %s at \"%s\" compression: "
+		   "%"PRIu64" bytes sent as %"PRIu64" (ratio %.2f), using "
+		   "%.3f s of CPU time, and %"PRIu64" bytes received as "
+		   "%"PRIu64" (ratio %.2f), using %.3f s.", client_id_s,
+		   proto_conn_remote_addr(conn), sent.plain_bytes,
+		   sent.compressed_bytes, compr_ratio(&sent), sent.cpu_time,
+		   received.plain_bytes, received.compressed_bytes,
+		   compr_ratio(&received), received.cpu_time);
+
+    return true;
+}
+
+static void log_stats(struct server *server)
+{
+    log_info_c(server->log_ctx, "Serving %zd clients, with %zd connections "
+	       "pending handshake. Output queues hold %zd bytes.",
+	       proto_conn_list_len(server->client_conns),
+	       proto_conn_list_len(server->clientless_conns),
+	       out_budget_used(server->budget));
+
+    if (server->query_pool != NULL) {
+	struct sd *core = shards_get_core(server->shards);
+
+	log_info_c(server->log_ctx, "Snapshot data awaiting reclamation: "
+		   "%zd items, the oldest retired %.3f s ago.",
+		   sd_snapshot_pending(core), sd_snapshot_max_delay(core));
+    }
+
+    proto_conn_list_foreach(server->client_conns, log_conn_stats, server);
+    proto_conn_list_foreach(server->clientless_conns, log_conn_stats, server);
+}
+
+void server_log_stats(struct server *server)
+{
+    if (server->running)
+	send_cmd(server, CMD_LOG_STATS);
+    else
+	log_stats(server);
+}
+
+void server_promote(struct server *server)
+{
+    if (server->repl_sink == NULL)
+	return;
+
+    if (server->running)
+	send_cmd(server, CMD_PROMOTE);
+    else
+	repl_sink_promote(server->repl_sink);
 }
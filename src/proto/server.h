@@ -8,14 +8,75 @@
 
 #include <event.h>
 
-#include "sd.h"
+#include "journal.h"
+#include "proto_conn.h"
+#include "shards.h"
 
 struct server;
 
+struct server_conf
+{
+    struct proto_conn_conf conn_conf;
+    /* Limits, in bytes, for all of the domain's output queues
+       combined. Zero means no limit. */
+    size_t domain_soft_out_limit;
+    size_t domain_hard_out_limit;
+    /* Threads doing socket I/O and request decoding for the domain.
+       With zero, all work is done by the server thread. */
+    size_t num_io_threads;
+    /* Threads among which the domain's services are partitioned.
+       With zero, the services are kept by the server thread. */
+    size_t num_shards;
+    /* Threads answering listings from snapshots of the domain's
+       state. With zero, listings are done by the server thread. */
+    size_t num_query_threads;
+    /* Directory in which the domain's services are saved, to survive
+       a restart. NULL disables saving. */
+    const char *state_dir;
+    /* Seconds between saves. The state is also saved on shutdown. */
+    double state_interval;
+    /* Record every change in a journal in 'state_dir', replayed on
+       top of the state file at startup. */
+    bool journal;
+    enum journal_sync journal_sync;
+    /* Address of a standby server to replicate the domain's services
+       to. NULL disables replication. */
+    const char *replicate_to;
+    /* Address on which to accept replication from an active server.
+       NULL means the server is not a standby. */
+    const char *standby_addr;
+    /* Address of an upstream server, of which the server is to act
+       as a proxy. NULL means the server keeps services of its own. */
+    const char *upstream_addr;
+    /* Address on which to export the domain's services to federation
+       peers. NULL disables exporting. */
+    const char *export_addr;
+    /* Whitespace-separated addresses of federation peers to import
+       services from, and the filter selecting which. NULL disables
+       importing, and a NULL filter imports all services. */
+    const char *import_from;
+    const char *import_filter;
+    /* Name of a POSIX shared memory segment in which to publish a
+       read-only copy of the domain's services, with room for
+       'shm_slots' services. NULL disables publishing. */
+    const char *shm_name;
+    size_t shm_slots;
+};
+
+/* Each server has its own event loop, run by a dedicated thread
+   once the server is started. A started server must only be
+   accessed through the functions below. */
 struct server *server_create(const char *name, const char *server_addr,
-			     struct event_base *event_base);
+			     const struct server_conf *conf);
 void server_destroy(struct server *server);
 
 int server_start(struct server *server);
 
+/* The statistics are logged asynchronously, by the server thread. */
+void server_log_stats(struct server *server);
+
+/* Restores the services replicated from the active server. Has no
+   effect unless the server is a standby. */
+void server_promote(struct server *server);
+
 #endif
@@ -0,0 +1,789 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <errno.h>
+#include <jansson.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <xcm.h>
+
+#include "pmap.h"
+#include "proto_ta.h"
+#include "sd_err.h"
+#include "util.h"
+
+#include "upstream.h"
+
+#define MAX_MSG 65535
+#define RECONNECT_INTERVAL 1.0
+
+/* Transactions of the mirror connection. Forwarding connections use
+   the hello transaction id, and number their requests from there. */
+#define HELLO_TA_ID 0
+#define SUB_TA_ID 1
+#define SERVICES_TA_ID 2
+
+#define MIRROR_SUB_ID 0
+
+struct out_msg
+{
+    char *data;
+    TAILQ_ENTRY(out_msg) entry;
+};
+
+TAILQ_HEAD(out_msg_queue, out_msg);
+
+/* Returns -1 if the connection should be closed. */
+typedef int (*uconn_msg_cb)(json_t *msg, void *cb_data);
+typedef void (*uconn_term_cb)(void *cb_data);
+
+/* A client connection to the upstream server */
+struct uconn
+{
+    struct xcm_socket *sock;
+    struct event event;
+    struct out_msg_queue out;
+
+    uconn_msg_cb msg_cb;
+    uconn_term_cb term_cb;
+    void *cb_data;
+
+    const struct log_ctx *log_ctx;
+};
+
+struct request
+{
+    int64_t op_id;
+    shards_result_cb result_cb;
+    void *cb_data;
+};
+
+PMAP_GEN_WRAPPER(request_map, struct request_map, int64_t, struct request,
+		 static __attribute__((unused)))
+
+/* Connection forwarding a proxy client's requests */
+struct fwd
+{
+    struct upstream *upstream;
+    int64_t client_id;
+    struct uconn *uconn;
+    int64_t next_ta_id;
+    struct request_map *requests;
+};
+
+PMAP_GEN_WRAPPER(fwd_map, struct fwd_map, int64_t, struct fwd,
+		 static __attribute__((unused)))
+
+/* The mirror connection epoch in which a service was last seen */
+struct mirrored
+{
+    uint64_t epoch;
+};
+
+PMAP_GEN_WRAPPER(mirrored_map, struct mirrored_map, int64_t, struct mirrored,
+		 static __attribute__((unused)))
+
+struct upstream
+{
+    struct event_base *event_base;
+    struct shards *shards;
+    char *addr;
+
+    struct uconn *mirror_conn;
+    struct event reconnect_event;
+    bool failing;
+    uint64_t epoch;
+    struct mirrored_map *mirrored;
+
+    struct fwd_map *fwds;
+
+    const struct log_ctx *log_ctx;
+};
+
+static void uconn_update(struct uconn *uconn)
+{
+    int condition = XCM_SO_RECEIVABLE;
+
+    if (!TAILQ_EMPTY(&uconn->out))
+	condition |= XCM_SO_SENDABLE;
+
+    xcm_await(uconn->sock, condition);
+}
+
+static void uconn_send(struct uconn *uconn, json_t *msg)
+{
+    struct out_msg *out_msg = ut_malloc(sizeof(struct out_msg));
+
+    out_msg->data = json_dumps(msg, JSON_COMPACT);
+
+    json_decref(msg);
+
+    TAILQ_INSERT_TAIL(&uconn->out, out_msg, entry);
+
+    uconn_update(uconn);
+}
+
+static json_t *create_req(const char *cmd, int64_t ta_id)
+{
+    json_t *req = json_object();
+
+    json_object_set_new(req, PROTO_FIELD_TA_CMD, json_string(cmd));
+    json_object_set_new(req, PROTO_FIELD_TA_ID, json_integer(ta_id));
+    json_object_set_new(req, PROTO_FIELD_MSG_TYPE,
+			json_string(PROTO_MSG_TYPE_REQ));
+
+    return req;
+}
+
+static int uconn_try_send(struct uconn *uconn)
+{
+    struct out_msg *out_msg;
+
+    while ((out_msg = TAILQ_FIRST(&uconn->out)) != NULL) {
+	size_t len = strlen(out_msg->data);
+
+	if (xcm_send(uconn->sock, out_msg->data, len) < 0) {
+	    if (errno == EAGAIN)
+		return 0;
+
+	    log_info_c(uconn->log_ctx, "Error sending to upstream server: "
+		       "%s.", strerror(errno));
+	    return -1;
+	}
+
+	TAILQ_REMOVE(&uconn->out, out_msg, entry);
+	ut_free(out_msg->data);
+	ut_free(out_msg);
+    }
+
+    return 0;
+}
+
+static int uconn_try_receive(struct uconn *uconn)
+{
+    for (;;) {
+	char buf[MAX_MSG];
+	int rc = xcm_receive(uconn->sock, buf, sizeof(buf));
+
+	if (rc < 0 && errno == EAGAIN)
+	    return 0;
+
+	if (rc == 0) {
+	    log_info_c(uconn->log_ctx, "Upstream server closed the "
+		       "connection.");
+	    return -1;
+	}
+
+	if (rc < 0) {
+	    log_info_c(uconn->log_ctx, "Error receiving from upstream "
+		       "server: %s.", strerror(errno));
+	    return -1;
+	}
+
+	json_error_t json_err;
+	json_t *msg = json_loadb(buf, rc, 0, &json_err);
+
+	if (msg == NULL) {
+	    log_info_c(uconn->log_ctx, "Upstream server sent invalid JSON: "
+		       "%s.", json_err.text);
+	    return -1;
+	}
+
+	rc = uconn->msg_cb(msg, uconn->cb_data);
+
+	json_decref(msg);
+
+	if (rc < 0)
+	    return -1;
+    }
+}
+
+static void uconn_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct uconn *uconn = cb_data;
+
+    if (uconn_try_send(uconn) < 0 || uconn_try_receive(uconn) < 0) {
+	/* Destroys the connection */
+	uconn->term_cb(uconn->cb_data);
+	return;
+    }
+
+    uconn_update(uconn);
+}
+
+static struct uconn *uconn_create(struct upstream *upstream,
+				  int64_t client_id, uconn_msg_cb msg_cb,
+				  uconn_term_cb term_cb, void *cb_data)
+{
+    struct xcm_socket *sock = xcm_connect(upstream->addr, XCM_NONBLOCK);
+
+    if (sock == NULL)
+	return NULL;
+
+    struct uconn *uconn = ut_malloc(sizeof(struct uconn));
+
+    *uconn = (struct uconn) {
+	.sock = sock,
+	.msg_cb = msg_cb,
+	.term_cb = term_cb,
+	.cb_data = cb_data,
+	.log_ctx = upstream->log_ctx
+    };
+
+    TAILQ_INIT(&uconn->out);
+
+    event_assign(&uconn->event, upstream->event_base, xcm_fd(sock),
+		 EV_READ|EV_PERSIST, uconn_cb, uconn);
+    event_add(&uconn->event, NULL);
+
+    json_t *hello = create_req(PROTO_CMD_HELLO, HELLO_TA_ID);
+
+    json_object_set_new(hello, PROTO_FIELD_CLIENT_ID,
+			json_integer(client_id));
+    json_object_set_new(hello, PROTO_FIELD_PROTO_MIN_VERSION,
+			json_integer(PROTO_VERSION));
+    json_object_set_new(hello, PROTO_FIELD_PROTO_MAX_VERSION,
+			json_integer(PROTO_VERSION));
+
+    uconn_send(uconn, hello);
+
+    return uconn;
+}
+
+static void uconn_destroy(struct uconn *uconn)
+{
+    if (uconn != NULL) {
+	event_del(&uconn->event);
+	xcm_close(uconn->sock);
+
+	struct out_msg *out_msg;
+	while ((out_msg = TAILQ_FIRST(&uconn->out)) != NULL) {
+	    TAILQ_REMOVE(&uconn->out, out_msg, entry);
+	    ut_free(out_msg->data);
+	    ut_free(out_msg);
+	}
+
+	ut_free(uconn);
+    }
+}
+
+static bool get_int(json_t *msg, const char *name, int64_t *value)
+{
+    json_t *field = json_object_get(msg, name);
+
+    if (!json_is_integer(field))
+	return false;
+
+    *value = json_integer_value(field);
+
+    return true;
+}
+
+static const char *get_str(json_t *msg, const char *name)
+{
+    return json_string_value(json_object_get(msg, name));
+}
+
+static bool is_msg_type(json_t *msg, const char *msg_type)
+{
+    const char *value = get_str(msg, PROTO_FIELD_MSG_TYPE);
+
+    return value != NULL && strcmp(value, msg_type) == 0;
+}
+
+static void schedule_reconnect(struct upstream *upstream)
+{
+    struct timeval tv;
+    ut_f_to_timeval(RECONNECT_INTERVAL, &tv);
+
+    event_add(&upstream->reconnect_event, &tv);
+}
+
+static void mirror_term_cb(void *cb_data)
+{
+    struct upstream *upstream = cb_data;
+
+    uconn_destroy(upstream->mirror_conn);
+    upstream->mirror_conn = NULL;
+
+    if (!upstream->failing)
+	log_info_c(upstream->log_ctx, "Lost connection to upstream server. "
+		   "Keeping %zd mirrored services.",
+		   mirrored_map_size(upstream->mirrored));
+
+    upstream->failing = true;
+
+    schedule_reconnect(upstream);
+}
+
+static void mirror_update(struct upstream *upstream, json_t *msg,
+			  int64_t service_id)
+{
+    int64_t generation;
+    int64_t ttl;
+    int64_t client_id;
+    json_t *json_props = json_object_get(msg, PROTO_FIELD_SERVICE_PROPS);
+    json_t *orphan_since = json_object_get(msg, PROTO_FIELD_ORPHAN_SINCE);
+
+    if (!get_int(msg, PROTO_FIELD_GENERATION, &generation) ||
+	!get_int(msg, PROTO_FIELD_TTL, &ttl) ||
+	!get_int(msg, PROTO_FIELD_CLIENT_ID, &client_id) ||
+	!json_is_object(json_props)) {
+	log_info_c(upstream->log_ctx, "Ignoring incomplete notification "
+		   "for service %"PRIx64".", service_id);
+	return;
+    }
+
+    struct props *props = proto_json_to_props(json_props, upstream->log_ctx);
+
+    if (props == NULL)
+	return;
+
+    shards_mirror(upstream->shards, client_id, service_id, generation,
+		  props, ttl, json_is_number(orphan_since) ?
+		  json_number_value(orphan_since) : -1);
+
+    props_destroy(props);
+
+    struct mirrored *mirrored =
+	mirrored_map_get(upstream->mirrored, service_id);
+
+    if (mirrored == NULL) {
+	mirrored = ut_malloc(sizeof(struct mirrored));
+	mirrored_map_add(upstream->mirrored, service_id, mirrored);
+    }
+
+    mirrored->epoch = upstream->epoch;
+}
+
+static void mirror_remove(struct upstream *upstream, int64_t service_id)
+{
+    struct mirrored *mirrored =
+	mirrored_map_get(upstream->mirrored, service_id);
+
+    if (mirrored == NULL)
+	return;
+
+    shards_mirror_remove(upstream->shards, service_id);
+
+    mirrored_map_del(upstream->mirrored, service_id);
+    ut_free(mirrored);
+}
+
+static void handle_match(struct upstream *upstream, json_t *msg)
+{
+    int64_t service_id;
+    const char *match_type = get_str(msg, PROTO_FIELD_MATCH_TYPE);
+
+    if (match_type == NULL ||
+	!get_int(msg, PROTO_FIELD_SERVICE_ID, &service_id))
+	return;
+
+    if (strcmp(match_type, PROTO_MATCH_TYPE_DISAPPEARED) == 0)
+	mirror_remove(upstream, service_id);
+    else
+	mirror_update(upstream, msg, service_id);
+}
+
+/* Services present in the listing are still around, although their
+   current state is left to the subscription. */
+static void handle_listed(struct upstream *upstream, json_t *msg)
+{
+    int64_t service_id;
+
+    if (!get_int(msg, PROTO_FIELD_SERVICE_ID, &service_id))
+	return;
+
+    struct mirrored *mirrored =
+	mirrored_map_get(upstream->mirrored, service_id);
+
+    if (mirrored != NULL)
+	mirrored->epoch = upstream->epoch;
+}
+
+struct sweep_param
+{
+    struct upstream *upstream;
+    int64_t *stale_ids;
+    size_t num_stale;
+};
+
+static bool find_stale_cb(int64_t service_id, struct mirrored *mirrored,
+			  void *cb_data)
+{
+    struct sweep_param *param = cb_data;
+
+    if (mirrored->epoch != param->upstream->epoch)
+	param->stale_ids[param->num_stale++] = service_id;
+
+    return true;
+}
+
+/* Removes services which went away while the proxy was disconnected,
+   i.e., those neither notified nor listed since it reconnected. */
+static void sweep(struct upstream *upstream)
+{
+    struct sweep_param param = {
+	.upstream = upstream,
+	.stale_ids = ut_malloc(sizeof(int64_t) *
+			       (mirrored_map_size(upstream->mirrored) + 1))
+    };
+
+    mirrored_map_foreach(upstream->mirrored, find_stale_cb, &param);
+
+    size_t i;
+    for (i = 0; i < param.num_stale; i++)
+	mirror_remove(upstream, param.stale_ids[i]);
+
+    if (param.num_stale > 0)
+	log_info_c(upstream->log_ctx, "Removed %zd mirrored services gone "
+		   "from upstream server.", param.num_stale);
+
+    ut_free(param.stale_ids);
+}
+
+static int mirror_msg_cb(json_t *msg, void *cb_data)
+{
+    struct upstream *upstream = cb_data;
+    int64_t ta_id;
+
+    if (!get_int(msg, PROTO_FIELD_TA_ID, &ta_id))
+	return -1;
+
+    if (is_msg_type(msg, PROTO_MSG_TYPE_FAIL)) {
+	const char *reason = get_str(msg, PROTO_FIELD_FAIL_REASON);
+
+	log_warn_c(upstream->log_ctx, "Upstream server failed mirror "
+		   "transaction %"PRId64": %s.", ta_id,
+		   reason != NULL ? reason : "unknown reason");
+	return -1;
+    }
+
+    switch (ta_id) {
+    case HELLO_TA_ID:
+	if (is_msg_type(msg, PROTO_MSG_TYPE_COMPLETE)) {
+	    log_info_c(upstream->log_ctx, "Mirroring services of upstream "
+		       "server \"%s\".", upstream->addr);
+	    upstream->failing = false;
+	}
+	break;
+    case SUB_TA_ID:
+	if (is_msg_type(msg, PROTO_MSG_TYPE_NOTIFY))
+	    handle_match(upstream, msg);
+	else if (is_msg_type(msg, PROTO_MSG_TYPE_COMPLETE))
+	    return -1;
+	break;
+    case SERVICES_TA_ID:
+	if (is_msg_type(msg, PROTO_MSG_TYPE_NOTIFY))
+	    handle_listed(upstream, msg);
+	else if (is_msg_type(msg, PROTO_MSG_TYPE_COMPLETE))
+	    sweep(upstream);
+	break;
+    }
+
+    return 0;
+}
+
+static void mirror_connect(struct upstream *upstream)
+{
+    upstream->mirror_conn = uconn_create(upstream, ut_rand_id(),
+					 mirror_msg_cb, mirror_term_cb,
+					 upstream);
+
+    if (upstream->mirror_conn == NULL) {
+	if (!upstream->failing)
+	    log_info_c(upstream->log_ctx, "Unable to connect to upstream "
+		       "server \"%s\": %s. Retrying.", upstream->addr,
+		       strerror(errno));
+	upstream->failing = true;
+	schedule_reconnect(upstream);
+	return;
+    }
+
+    upstream->epoch++;
+
+    /* The subscription is in place before the listing is made, so
+       any service not listed, nor notified, is gone */
+    json_t *subscribe = create_req(PROTO_CMD_SUBSCRIBE, SUB_TA_ID);
+    json_object_set_new(subscribe, PROTO_FIELD_SUBSCRIPTION_ID,
+			json_integer(MIRROR_SUB_ID));
+    uconn_send(upstream->mirror_conn, subscribe);
+
+    uconn_send(upstream->mirror_conn,
+	       create_req(PROTO_CMD_SERVICES, SERVICES_TA_ID));
+}
+
+static void reconnect_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct upstream *upstream = cb_data;
+
+    mirror_connect(upstream);
+}
+
+struct upstream *upstream_create(struct event_base *event_base,
+				 struct shards *shards, const char *addr,
+				 const struct log_ctx *log_ctx)
+{
+    struct upstream *upstream = ut_malloc(sizeof(struct upstream));
+
+    *upstream = (struct upstream) {
+	.event_base = event_base,
+	.shards = shards,
+	.addr = ut_strdup(addr),
+	.mirrored = mirrored_map_create(),
+	.fwds = fwd_map_create(),
+	.log_ctx = log_ctx
+    };
+
+    event_assign(&upstream->reconnect_event, event_base, -1, 0,
+		 reconnect_cb, upstream);
+
+    return upstream;
+}
+
+static void fwd_destroy(struct fwd *fwd);
+
+static bool destroy_fwd_cb(int64_t client_id, struct fwd *fwd, void *cb_data)
+{
+    fwd_destroy(fwd);
+
+    return true;
+}
+
+static bool free_mirrored_cb(int64_t service_id, struct mirrored *mirrored,
+			     void *cb_data)
+{
+    ut_free(mirrored);
+
+    return true;
+}
+
+void upstream_destroy(struct upstream *upstream)
+{
+    if (upstream != NULL) {
+	event_del(&upstream->reconnect_event);
+
+	uconn_destroy(upstream->mirror_conn);
+
+	fwd_map_foreach(upstream->fwds, destroy_fwd_cb, NULL);
+	fwd_map_destroy(upstream->fwds);
+
+	mirrored_map_foreach(upstream->mirrored, free_mirrored_cb, NULL);
+	mirrored_map_destroy(upstream->mirrored);
+
+	ut_free(upstream->addr);
+	ut_free(upstream);
+    }
+}
+
+int upstream_start(struct upstream *upstream)
+{
+    mirror_connect(upstream);
+
+    return 0;
+}
+
+static bool free_request_cb(int64_t ta_id, struct request *request,
+			    void *cb_data)
+{
+    ut_free(request);
+
+    return true;
+}
+
+static void fwd_destroy(struct fwd *fwd)
+{
+    if (fwd != NULL) {
+	uconn_destroy(fwd->uconn);
+
+	request_map_foreach(fwd->requests, free_request_cb, NULL);
+	request_map_destroy(fwd->requests);
+
+	ut_free(fwd);
+    }
+}
+
+static bool fail_request_cb(int64_t ta_id, struct request *request,
+			    void *cb_data)
+{
+    request->result_cb(request->op_id, UPSTREAM_ERR_FAILED,
+		       request->cb_data);
+
+    return true;
+}
+
+static void fwd_term_cb(void *cb_data)
+{
+    struct fwd *fwd = cb_data;
+    struct upstream *upstream = fwd->upstream;
+
+    fwd_map_del(upstream->fwds, fwd->client_id);
+
+    request_map_foreach(fwd->requests, fail_request_cb, NULL);
+
+    fwd_destroy(fwd);
+}
+
+static int reason_to_err(const char *reason)
+{
+    if (reason == NULL)
+	return UPSTREAM_ERR_FAILED;
+    else if (strcmp(reason, PROTO_FAIL_REASON_OLD_GENERATION) == 0)
+	return SD_ERR_NEWER_SERVICE_GENERATION_EXISTS;
+    else if (strcmp(reason,
+		    PROTO_FAIL_REASON_SAME_GENERATION_BUT_DIFFERENT) == 0)
+	return SD_ERR_SERVICE_SAME_GENERATION_BUT_DIFFERENT_DATA;
+    else if (strcmp(reason, PROTO_FAIL_REASON_NON_EXISTENT_SERVICE_ID) == 0)
+	return SD_ERR_NO_SUCH_SERVICE;
+    else if (strcmp(reason, PROTO_FAIL_REASON_PERMISSION_DENIED) == 0)
+	return SD_ERR_PERM_DENIED;
+    else
+	return UPSTREAM_ERR_FAILED;
+}
+
+static int fwd_msg_cb(json_t *msg, void *cb_data)
+{
+    struct fwd *fwd = cb_data;
+    int64_t ta_id;
+
+    if (!get_int(msg, PROTO_FIELD_TA_ID, &ta_id))
+	return -1;
+
+    bool failed = is_msg_type(msg, PROTO_MSG_TYPE_FAIL);
+
+    if (ta_id == HELLO_TA_ID) {
+	if (failed) {
+	    const char *reason = get_str(msg, PROTO_FIELD_FAIL_REASON);
+
+	    log_info_c(fwd->upstream->log_ctx, "Upstream server refused "
+		       "client %"PRIx64": %s.", fwd->client_id,
+		       reason != NULL ? reason : "unknown reason");
+	    return -1;
+	}
+	return 0;
+    }
+
+    struct request *request = request_map_get(fwd->requests, ta_id);
+
+    if (request == NULL)
+	return 0;
+
+    int rc = 0;
+
+    if (failed)
+	rc = reason_to_err(get_str(msg, PROTO_FIELD_FAIL_REASON));
+    else if (!is_msg_type(msg, PROTO_MSG_TYPE_COMPLETE))
+	return 0;
+
+    request_map_del(fwd->requests, ta_id);
+
+    request->result_cb(request->op_id, rc, request->cb_data);
+
+    ut_free(request);
+
+    return 0;
+}
+
+static struct fwd *get_fwd(struct upstream *upstream, int64_t client_id)
+{
+    struct fwd *fwd = fwd_map_get(upstream->fwds, client_id);
+
+    if (fwd != NULL)
+	return fwd;
+
+    fwd = ut_malloc(sizeof(struct fwd));
+
+    *fwd = (struct fwd) {
+	.upstream = upstream,
+	.client_id = client_id,
+	.next_ta_id = HELLO_TA_ID + 1,
+	.requests = request_map_create()
+    };
+
+    fwd->uconn = uconn_create(upstream, client_id, fwd_msg_cb, fwd_term_cb,
+			      fwd);
+
+    if (fwd->uconn == NULL) {
+	log_info_c(upstream->log_ctx, "Unable to connect to upstream "
+		   "server \"%s\": %s.", upstream->addr, strerror(errno));
+	fwd_destroy(fwd);
+	return NULL;
+    }
+
+    fwd_map_add(upstream->fwds, client_id, fwd);
+
+    return fwd;
+}
+
+static void forward(struct upstream *upstream, int64_t client_id,
+		    json_t *req, int64_t op_id, shards_result_cb result_cb,
+		    void *cb_data)
+{
+    struct fwd *fwd = get_fwd(upstream, client_id);
+
+    if (fwd == NULL) {
+	json_decref(req);
+	result_cb(op_id, UPSTREAM_ERR_FAILED, cb_data);
+	return;
+    }
+
+    int64_t ta_id = fwd->next_ta_id++;
+
+    json_object_set_new(req, PROTO_FIELD_TA_ID, json_integer(ta_id));
+
+    struct request *request = ut_malloc(sizeof(struct request));
+
+    *request = (struct request) {
+	.op_id = op_id,
+	.result_cb = result_cb,
+	.cb_data = cb_data
+    };
+
+    request_map_add(fwd->requests, ta_id, request);
+
+    uconn_send(fwd->uconn, req);
+}
+
+void upstream_publish(struct upstream *upstream, int64_t client_id,
+		      int64_t service_id, int64_t generation,
+		      const struct props *props, int64_t ttl,
+		      int64_t op_id, shards_result_cb result_cb,
+		      void *cb_data)
+{
+    json_t *req = create_req(PROTO_CMD_PUBLISH, 0);
+
+    json_object_set_new(req, PROTO_FIELD_SERVICE_ID,
+			json_integer(service_id));
+    json_object_set_new(req, PROTO_FIELD_GENERATION,
+			json_integer(generation));
+    json_object_set_new(req, PROTO_FIELD_SERVICE_PROPS,
+			proto_props_to_json(props));
+    json_object_set_new(req, PROTO_FIELD_TTL, json_integer(ttl));
+
+    forward(upstream, client_id, req, op_id, result_cb, cb_data);
+}
+
+void upstream_unpublish(struct upstream *upstream, int64_t client_id,
+			int64_t service_id, int64_t op_id,
+			shards_result_cb result_cb, void *cb_data)
+{
+    json_t *req = create_req(PROTO_CMD_UNPUBLISH, 0);
+
+    json_object_set_new(req, PROTO_FIELD_SERVICE_ID,
+			json_integer(service_id));
+
+    forward(upstream, client_id, req, op_id, result_cb, cb_data);
+}
+
+void upstream_client_disconnect(struct upstream *upstream,
+				int64_t client_id)
+{
+    struct fwd *fwd = fwd_map_get(upstream->fwds, client_id);
+
+    if (fwd != NULL) {
+	fwd_map_del(upstream->fwds, client_id);
+	fwd_destroy(fwd);
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+#include <event.h>
+
+#include "log.h"
+#include "shards.h"
+
+/* A proxy server's link to its upstream server.
+
+   The upstream server's services are mirrored into the proxy's
+   shards, by means of a single unfiltered subscription, from which
+   the proxy's clients' subscriptions and listings are served.
+
+   Publish and unpublish requests are forwarded to the upstream
+   server, over one connection per proxy client, using the client's
+   id. The upstream server thus sees the client as its own, and
+   orphans the client's services when it leaves the proxy. The
+   result of a publish is not reflected in the mirror until the
+   upstream server's notification has arrived. */
+struct upstream;
+
+/* The upstream server could not be reached, or failed the request
+   for a reason with no SD_ERR_* equivalent. */
+#define UPSTREAM_ERR_FAILED (-100)
+
+/* The shards must be in mirror mode. */
+struct upstream *upstream_create(struct event_base *event_base,
+				 struct shards *shards, const char *addr,
+				 const struct log_ctx *log_ctx);
+void upstream_destroy(struct upstream *upstream);
+
+int upstream_start(struct upstream *upstream);
+
+/* The result is delivered as per shards_publish(), with the rc being
+   zero, an SD_ERR_* code or UPSTREAM_ERR_FAILED. */
+void upstream_publish(struct upstream *upstream, int64_t client_id,
+		      int64_t service_id, int64_t generation,
+		      const struct props *props, int64_t ttl,
+		      int64_t op_id, shards_result_cb result_cb,
+		      void *cb_data);
+void upstream_unpublish(struct upstream *upstream, int64_t client_id,
+			int64_t service_id, int64_t op_id,
+			shards_result_cb result_cb, void *cb_data);
+
+/* Closes the client's forwarding connection, if any. Results not yet
+   delivered for the client are dropped. */
+void upstream_client_disconnect(struct upstream *upstream,
+				int64_t client_id);
+
+#endif
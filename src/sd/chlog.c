@@ -0,0 +1,253 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <stdatomic.h>
+
+#include "pmap.h"
+#include "util.h"
+
+#include "chlog.h"
+
+#define INITIAL_SIZE 64
+
+struct chlog_seq
+{
+    _Atomic int64_t last;
+    /* the lowest pin, or INT64_MAX */
+    _Atomic int64_t pin;
+
+    int64_t *pins;
+    size_t num_pins;
+};
+
+struct chlog_seq *chlog_seq_create(void)
+{
+    struct chlog_seq *seq = ut_calloc(sizeof(struct chlog_seq));
+
+    /* Leaves room for 2^32 changes before the random part is
+       affected */
+    int64_t start = ((ut_rand_id() & 0x3fffffff) + 1) << 32;
+
+    atomic_init(&seq->last, start);
+    atomic_init(&seq->pin, INT64_MAX);
+
+    return seq;
+}
+
+void chlog_seq_destroy(struct chlog_seq *seq)
+{
+    if (seq != NULL) {
+	ut_free(seq->pins);
+	ut_free(seq);
+    }
+}
+
+int64_t chlog_seq_last(const struct chlog_seq *seq)
+{
+    return atomic_load(&seq->last);
+}
+
+static void update_pin(struct chlog_seq *seq)
+{
+    int64_t pin = INT64_MAX;
+    size_t i;
+
+    for (i = 0; i < seq->num_pins; i++)
+	if (seq->pins[i] < pin)
+	    pin = seq->pins[i];
+
+    atomic_store(&seq->pin, pin);
+}
+
+void chlog_seq_pin(struct chlog_seq *seq, int64_t from)
+{
+    seq->pins = ut_realloc(seq->pins, sizeof(int64_t) * (seq->num_pins + 1));
+    seq->pins[seq->num_pins] = from;
+    seq->num_pins++;
+
+    update_pin(seq);
+}
+
+void chlog_seq_unpin(struct chlog_seq *seq, int64_t from)
+{
+    size_t i;
+
+    for (i = 0; i < seq->num_pins; i++)
+	if (seq->pins[i] == from) {
+	    seq->pins[i] = seq->pins[seq->num_pins - 1];
+	    seq->num_pins--;
+	    break;
+	}
+
+    update_pin(seq);
+}
+
+struct change
+{
+    int64_t seq;
+    int64_t service_id;
+    struct props *prev_props;
+};
+
+PMAP_GEN_WRAPPER(change_map, struct change_map, int64_t, struct change,
+		 static __attribute__((unused)))
+
+struct chlog
+{
+    struct chlog_seq *seq;
+    size_t capacity;
+
+    /* a ring buffer, in sequence number order */
+    struct change *changes;
+    size_t size;
+    size_t head;
+    size_t len;
+
+    /* the most recent change discarded */
+    _Atomic int64_t trimmed;
+};
+
+struct chlog *chlog_create(struct chlog_seq *seq, size_t capacity)
+{
+    struct chlog *log = ut_malloc(sizeof(struct chlog));
+
+    *log = (struct chlog) {
+	.seq = seq,
+	.capacity = capacity
+    };
+
+    atomic_init(&log->trimmed, chlog_seq_last(seq));
+
+    return log;
+}
+
+static struct change *get_change(const struct chlog *log, size_t idx)
+{
+    return &log->changes[(log->head + idx) % log->size];
+}
+
+void chlog_destroy(struct chlog *log)
+{
+    if (log != NULL) {
+	size_t i;
+
+	for (i = 0; i < log->len; i++)
+	    props_destroy(get_change(log, i)->prev_props);
+
+	ut_free(log->changes);
+	ut_free(log);
+    }
+}
+
+static bool trim_oldest(struct chlog *log)
+{
+    struct change *oldest = get_change(log, 0);
+    int64_t trimmed = atomic_load_explicit(&log->trimmed,
+					   memory_order_relaxed);
+
+    /* Published before the pin is checked, so that a concurrent
+       pinner either sees the change is gone, or has its pin seen */
+    atomic_store(&log->trimmed, oldest->seq);
+
+    if (oldest->seq > atomic_load(&log->seq->pin)) {
+	atomic_store(&log->trimmed, trimmed);
+	return false;
+    }
+
+    props_destroy(oldest->prev_props);
+
+    log->head = (log->head + 1) % log->size;
+    log->len--;
+
+    return true;
+}
+
+static void grow(struct chlog *log)
+{
+    size_t size = log->size > 0 ? 2 * log->size : INITIAL_SIZE;
+    struct change *changes = ut_malloc(sizeof(struct change) * size);
+    size_t i;
+
+    for (i = 0; i < log->len; i++)
+	changes[i] = *get_change(log, i);
+
+    ut_free(log->changes);
+
+    log->changes = changes;
+    log->size = size;
+    log->head = 0;
+}
+
+int64_t chlog_add(struct chlog *log, int64_t service_id,
+		  const struct props *prev_props)
+{
+    while (log->len > 0 && log->len >= log->capacity && trim_oldest(log))
+	;
+
+    if (log->len == log->size)
+	grow(log);
+
+    int64_t seq = atomic_fetch_add(&log->seq->last, 1) + 1;
+
+    *get_change(log, log->len) = (struct change) {
+	.seq = seq,
+	.service_id = service_id,
+	.prev_props = prev_props != NULL ? props_clone(prev_props) : NULL
+    };
+
+    log->len++;
+
+    return seq;
+}
+
+bool chlog_covers(const struct chlog *log, int64_t from)
+{
+    return from >= atomic_load(&log->trimmed) &&
+	from <= chlog_seq_last(log->seq);
+}
+
+size_t chlog_len(const struct chlog *log)
+{
+    return log->len;
+}
+
+/* The index of the first change made after 'from' */
+static size_t find_since(const struct chlog *log, int64_t from)
+{
+    size_t low = 0;
+    size_t high = log->len;
+
+    while (low < high) {
+	size_t mid = low + (high - low) / 2;
+
+	if (get_change(log, mid)->seq <= from)
+	    low = mid + 1;
+	else
+	    high = mid;
+    }
+
+    return low;
+}
+
+void chlog_foreach_since(const struct chlog *log, int64_t from,
+			 chlog_cb cb, void *cb_data)
+{
+    struct change_map *seen = change_map_create();
+    size_t i;
+
+    /* The first change to a service holds its state as of 'from' */
+    for (i = find_since(log, from); i < log->len; i++) {
+	struct change *change = get_change(log, i);
+
+	if (change_map_has_key(seen, change->service_id))
+	    continue;
+
+	change_map_add(seen, change->service_id, change);
+
+	cb(change->service_id, change->prev_props, cb_data);
+    }
+
+    change_map_destroy(seen);
+}
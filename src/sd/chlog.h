@@ -0,0 +1,68 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef CHLOG_H
+#define CHLOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "props.h"
+
+/* A bounded log of recent service changes, recording the state of
+   each service before it was changed. From the log, a subscriber may
+   be brought up to date from any point in time it still covers.
+
+   Changes are numbered from a sequence, which may be shared by the
+   logs of several sd instances (e.g., the shards of a domain), to
+   give the changes a domain-wide order. Sequence numbers start at a
+   random point, so numbers from a different sequence are unlikely to
+   be mistaken as being covered by a log. Zero is never a valid
+   sequence number. */
+
+struct chlog_seq;
+
+struct chlog_seq *chlog_seq_create(void);
+void chlog_seq_destroy(struct chlog_seq *seq);
+
+/* The number of the most recent change. May be called from any
+   thread. */
+int64_t chlog_seq_last(const struct chlog_seq *seq);
+
+/* Keeps the logs of the sequence from discarding changes made after
+   'from', until unpinned. Pins must be managed by a single
+   thread. */
+void chlog_seq_pin(struct chlog_seq *seq, int64_t from);
+void chlog_seq_unpin(struct chlog_seq *seq, int64_t from);
+
+struct chlog;
+
+/* The log holds at least 'capacity' changes, and more only when
+   pinned. */
+struct chlog *chlog_create(struct chlog_seq *seq, size_t capacity);
+void chlog_destroy(struct chlog *log);
+
+/* 'prev_props' is NULL if the service didn't exist before the
+   change. Returns the change's sequence number. */
+int64_t chlog_add(struct chlog *log, int64_t service_id,
+		  const struct props *prev_props);
+
+/* True if every change made after 'from' is still in the log. May be
+   called from any thread. */
+bool chlog_covers(const struct chlog *log, int64_t from);
+
+size_t chlog_len(const struct chlog *log);
+
+/* Called once for every service changed after 'from', with the
+   properties of the service at that point, or NULL if it didn't
+   exist. */
+typedef void (*chlog_cb)(int64_t service_id, const struct props *props,
+			 void *cb_data);
+
+void chlog_foreach_since(const struct chlog *log, int64_t from,
+			 chlog_cb cb, void *cb_data);
+
+#endif
@@ -437,6 +437,57 @@ int client_unsubscribe(struct client *client, int64_t sub_id)
     return 0;
 }
 
+static bool find_inactive(struct conn *conn, void *cb_data)
+{
+    struct conn **inactive = cb_data;
+
+    if (!conn_is_connected(conn)) {
+	*inactive = conn;
+	return false;
+    }
+
+    return true;
+}
+
+void client_restore(struct client *client, int64_t service_id,
+		    int64_t generation, const struct props *props,
+		    int64_t ttl, double orphan_since,
+		    service_change_cb change_cb, void *change_cb_data)
+{
+    ut_assert(!client_is_connected(client));
+    ut_assert(!db_has_service(client->db, service_id));
+
+    struct conn *conn = NULL;
+
+    conn_list_foreach(client->inactive_conns, find_inactive, &conn);
+
+    if (conn == NULL) {
+	conn = conn_create(client, NULL);
+	conn_mark_disconnected(conn);
+	conn_list_append(client->inactive_conns, conn);
+    }
+
+    if (!db_has_client(client->db, client->client_id))
+	db_add_client(client->db, client->client_id, client);
+
+    struct service *service =
+	service_create(service_id, change_cb, change_cb_data);
+
+    service_add_begin(service);
+    service_set_generation(service, generation);
+    service_set_props(service, props);
+    service_set_ttl(service, ttl);
+    service_set_orphan_since(service, orphan_since);
+    service_set_client_id(service, client->client_id);
+    service_commit(service);
+
+    db_add_service(client->db, service_id, service);
+
+    conn_add_service(conn, service_id, service);
+
+    service_dec_ref(service);
+}
+
 void client_purge_orphan(struct client *client, int64_t service_id)
 {
     ut_assert(!client_is_connected(client));
@@ -49,6 +49,13 @@ int client_create_sub(struct client *client, int64_t sub_id,
 void client_activate_sub(struct client *client, int64_t sub_id);
 int client_unsubscribe(struct client *client, int64_t sub_id);
 
+/* Adds an orphan service, e.g., one loaded from a state file. The
+   client must not be connected. */
+void client_restore(struct client *client, int64_t service_id,
+		    int64_t generation, const struct props *props,
+		    int64_t ttl, double orphan_since,
+		    service_change_cb change_cb, void *change_cb_data);
+
 void client_purge_orphan(struct client *client, int64_t service_id);
 
 typedef bool (*client_foreach_cb)(int64_t sub_id, struct sub *sub,
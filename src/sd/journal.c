@@ -0,0 +1,675 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC "TPAFJRNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BYTE_ORDER UINT32_C(0x01020304)
+
+/* The amount of records, in bytes, buffered but not yet picked up by
+   the writer, at which the current file is abandoned. */
+#define MAX_BUFFERED (64 * 1024 * 1024)
+
+#define SEQ_DIGITS 16
+
+struct journal_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t seq;
+};
+
+/* Records destined for a particular file */
+struct chunk
+{
+    uint64_t seq;
+    struct srec_buf buf;
+    TAILQ_ENTRY(chunk) entry;
+};
+
+TAILQ_HEAD(chunk_queue, chunk);
+
+struct journal
+{
+    char *prefix;
+    enum journal_sync sync;
+
+    pthread_t thread;
+    bool started;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* protected by 'lock' */
+    struct chunk_queue chunks;
+    uint64_t seq;
+    size_t buffered;
+    bool abandoned;
+    uint64_t compact_seq;
+    bool stop;
+
+    /* only accessed by the writer thread */
+    int fd;
+    uint64_t fd_seq;
+    /* a file failed to be opened, written or synced */
+    bool failed;
+    uint64_t failed_seq;
+    bool unsynced;
+    double last_sync;
+
+    const struct log_ctx *log_ctx;
+};
+
+struct journal *journal_create(const char *prefix, uint64_t seq,
+			       enum journal_sync sync,
+			       const struct log_ctx *log_ctx)
+{
+    struct journal *journal = ut_malloc(sizeof(struct journal));
+
+    *journal = (struct journal) {
+	.prefix = ut_strdup(prefix),
+	.sync = sync,
+	.seq = seq,
+	.fd = -1,
+	.log_ctx = log_ctx
+    };
+
+    pthread_mutex_init(&journal->lock, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&journal->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    TAILQ_INIT(&journal->chunks);
+
+    return journal;
+}
+
+static void chunk_destroy(struct chunk *chunk)
+{
+    srec_buf_deinit(&chunk->buf);
+    ut_free(chunk);
+}
+
+static char *file_path(const char *prefix, uint64_t seq)
+{
+    return ut_asprintf("%s.%0*"PRIx64, prefix, SEQ_DIGITS, seq);
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+	ssize_t rc = write(fd, buf, len);
+
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	buf += rc;
+	len -= rc;
+    }
+
+    return 0;
+}
+
+/* Gives up on the file until the next rotation, since records
+   written after a failure may be lost, or unreadable on replay. */
+static void fail_file(struct journal *journal, uint64_t seq)
+{
+    if (journal->fd >= 0) {
+	close(journal->fd);
+	journal->fd = -1;
+    }
+
+    journal->failed = true;
+    journal->failed_seq = seq;
+    journal->unsynced = false;
+
+    pthread_mutex_lock(&journal->lock);
+
+    if (journal->seq == seq)
+	journal->abandoned = true;
+
+    pthread_mutex_unlock(&journal->lock);
+
+    log_warn_c(journal->log_ctx, "Abandoning journal file until the next "
+	       "state save.");
+}
+
+static void sync_file(struct journal *journal)
+{
+    if (journal->fd >= 0 && journal->unsynced) {
+	journal->last_sync = ut_ftime();
+
+	if (fsync(journal->fd) < 0) {
+	    log_error_c(journal->log_ctx, "Error syncing journal: %s.",
+			strerror(errno));
+	    fail_file(journal, journal->fd_seq);
+	    return;
+	}
+
+	journal->unsynced = false;
+    }
+}
+
+static void close_file(struct journal *journal)
+{
+    if (journal->fd >= 0) {
+	if (journal->sync != journal_sync_none)
+	    sync_file(journal);
+
+	close(journal->fd);
+	journal->fd = -1;
+    }
+}
+
+static void open_file(struct journal *journal, uint64_t seq)
+{
+    close_file(journal);
+
+    journal->fd_seq = seq;
+
+    char *path = file_path(journal->prefix, seq);
+
+    journal->fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+
+    if (journal->fd < 0) {
+	log_error_c(journal->log_ctx, "Unable to open journal file \"%s\": "
+		    "%s.", path, strerror(errno));
+	fail_file(journal, seq);
+	goto out;
+    }
+
+    struct stat st;
+
+    if (fstat(journal->fd, &st) < 0 || st.st_size > 0)
+	goto out;
+
+    struct journal_header header = {
+	.magic = JOURNAL_MAGIC,
+	.version = JOURNAL_VERSION,
+	.byte_order = JOURNAL_BYTE_ORDER,
+	.seq = seq
+    };
+
+    if (write_all(journal->fd, (const char *)&header, sizeof(header)) < 0) {
+	log_error_c(journal->log_ctx, "Error writing journal file \"%s\": "
+		    "%s.", path, strerror(errno));
+	fail_file(journal, seq);
+	goto out;
+    }
+
+    log_debug_c(journal->log_ctx, "Created journal file \"%s\".", path);
+
+out:
+    ut_free(path);
+}
+
+static void write_chunk(struct journal *journal, struct chunk *chunk)
+{
+    /* Records buffered before the file was abandoned */
+    if (journal->failed && chunk->seq == journal->failed_seq)
+	return;
+
+    if (journal->fd < 0 || chunk->seq != journal->fd_seq)
+	open_file(journal, chunk->seq);
+
+    if (journal->fd < 0)
+	return;
+
+    if (write_all(journal->fd, chunk->buf.data, chunk->buf.len) < 0) {
+	log_error_c(journal->log_ctx, "Error writing journal: %s.",
+		    strerror(errno));
+	fail_file(journal, chunk->seq);
+	return;
+    }
+
+    journal->unsynced = true;
+}
+
+typedef void (*file_cb)(uint64_t seq, void *cb_data);
+
+static int foreach_file(const char *prefix, file_cb cb, void *cb_data)
+{
+    const char *slash = strrchr(prefix, '/');
+    char *dir_path = slash != NULL ?
+	ut_asprintf("%.*s", (int)(slash - prefix + 1), prefix) :
+	ut_strdup(".");
+    const char *base = slash != NULL ? slash + 1 : prefix;
+    size_t base_len = strlen(base);
+
+    DIR *dir = opendir(dir_path);
+
+    ut_free(dir_path);
+
+    if (dir == NULL)
+	return -1;
+
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+	const char *name = entry->d_name;
+
+	if (strncmp(name, base, base_len) != 0 || name[base_len] != '.' ||
+	    strlen(name + base_len + 1) != SEQ_DIGITS)
+	    continue;
+
+	char *end;
+	uint64_t seq = strtoull(name + base_len + 1, &end, 16);
+
+	if (*end == '\0')
+	    cb(seq, cb_data);
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+struct compact_param
+{
+    struct journal *journal;
+    uint64_t seq;
+};
+
+static void consider_remove(uint64_t seq, void *cb_data)
+{
+    struct compact_param *param = cb_data;
+
+    if (seq >= param->seq)
+	return;
+
+    char *path = file_path(param->journal->prefix, seq);
+
+    if (unlink(path) < 0)
+	log_error_c(param->journal->log_ctx, "Unable to remove journal "
+		    "file \"%s\": %s.", path, strerror(errno));
+    else
+	log_debug_c(param->journal->log_ctx, "Removed journal file \"%s\".",
+		    path);
+
+    ut_free(path);
+}
+
+static void compact(struct journal *journal, uint64_t seq)
+{
+    if (journal->fd >= 0 && journal->fd_seq < seq)
+	close_file(journal);
+
+    struct compact_param param = {
+	.journal = journal,
+	.seq = seq
+    };
+
+    foreach_file(journal->prefix, consider_remove, &param);
+}
+
+static void await_work(struct journal *journal)
+{
+    if (journal->sync == journal_sync_periodic && journal->unsynced) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	double left = journal->last_sync + JOURNAL_SYNC_INTERVAL - ut_ftime();
+
+	if (left > 0) {
+	    struct timespec tmo;
+	    ut_f_to_timespec(left, &tmo);
+
+	    deadline.tv_sec += tmo.tv_sec;
+	    deadline.tv_nsec += tmo.tv_nsec;
+	    if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	    }
+
+	    if (pthread_cond_timedwait(&journal->cond, &journal->lock,
+				       &deadline) != ETIMEDOUT)
+		return;
+	}
+
+	pthread_mutex_unlock(&journal->lock);
+	sync_file(journal);
+	pthread_mutex_lock(&journal->lock);
+    } else
+	pthread_cond_wait(&journal->cond, &journal->lock);
+}
+
+static void *writer_run(void *arg)
+{
+    struct journal *journal = arg;
+
+    pthread_mutex_lock(&journal->lock);
+
+    for (;;) {
+	bool idle =
+	    TAILQ_EMPTY(&journal->chunks) && journal->compact_seq == 0;
+
+	if (idle && journal->stop)
+	    break;
+
+	if (idle) {
+	    await_work(journal);
+	    continue;
+	}
+
+	/* The group of records to commit is whatever is buffered */
+	struct chunk_queue chunks;
+	TAILQ_INIT(&chunks);
+	TAILQ_CONCAT(&chunks, &journal->chunks, entry);
+	journal->buffered = 0;
+
+	uint64_t compact_seq = journal->compact_seq;
+	journal->compact_seq = 0;
+
+	pthread_mutex_unlock(&journal->lock);
+
+	struct chunk *chunk;
+	while ((chunk = TAILQ_FIRST(&chunks)) != NULL) {
+	    TAILQ_REMOVE(&chunks, chunk, entry);
+	    write_chunk(journal, chunk);
+	    chunk_destroy(chunk);
+	}
+
+	if (journal->sync == journal_sync_batch ||
+	    (journal->sync == journal_sync_periodic &&
+	     ut_ftime() - journal->last_sync >= JOURNAL_SYNC_INTERVAL))
+	    sync_file(journal);
+
+	if (compact_seq > 0)
+	    compact(journal, compact_seq);
+
+	pthread_mutex_lock(&journal->lock);
+    }
+
+    pthread_mutex_unlock(&journal->lock);
+
+    close_file(journal);
+
+    return NULL;
+}
+
+int journal_start(struct journal *journal)
+{
+    sigset_t all;
+    sigset_t orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &orig);
+
+    int rc = pthread_create(&journal->thread, NULL, writer_run, journal);
+
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    if (rc != 0) {
+	log_error_c(journal->log_ctx, "Unable to create journal writer "
+		    "thread: %s.", strerror(rc));
+	return -1;
+    }
+
+    journal->started = true;
+
+    return 0;
+}
+
+void journal_destroy(struct journal *journal)
+{
+    if (journal != NULL) {
+	if (journal->started) {
+	    pthread_mutex_lock(&journal->lock);
+	    journal->stop = true;
+	    pthread_cond_signal(&journal->cond);
+	    pthread_mutex_unlock(&journal->lock);
+
+	    pthread_join(journal->thread, NULL);
+	}
+
+	struct chunk *chunk;
+	while ((chunk = TAILQ_FIRST(&journal->chunks)) != NULL) {
+	    TAILQ_REMOVE(&journal->chunks, chunk, entry);
+	    chunk_destroy(chunk);
+	}
+
+	pthread_cond_destroy(&journal->cond);
+	pthread_mutex_destroy(&journal->lock);
+
+	ut_free(journal->prefix);
+	ut_free(journal);
+    }
+}
+
+void journal_add(struct journal *journal, const struct service *service,
+		 enum service_change_type change_type)
+{
+    double now = ut_ftime();
+    bool abandoned = false;
+
+    pthread_mutex_lock(&journal->lock);
+
+    if (journal->abandoned) {
+	pthread_mutex_unlock(&journal->lock);
+	return;
+    }
+
+    struct chunk *chunk = TAILQ_LAST(&journal->chunks, chunk_queue);
+
+    if (chunk == NULL || chunk->seq != journal->seq) {
+	chunk = ut_malloc(sizeof(struct chunk));
+	chunk->seq = journal->seq;
+	srec_buf_init(&chunk->buf);
+	TAILQ_INSERT_TAIL(&journal->chunks, chunk, entry);
+    }
+
+    size_t old_len = chunk->buf.len;
+
+    if (change_type == service_change_type_removed)
+	srec_add_removed(&chunk->buf, now, service_get_id(service));
+    else
+	srec_add_service(&chunk->buf, now, service);
+
+    journal->buffered += chunk->buf.len - old_len;
+
+    if (journal->buffered > MAX_BUFFERED) {
+	journal->abandoned = true;
+	abandoned = true;
+    }
+
+    pthread_cond_signal(&journal->cond);
+
+    pthread_mutex_unlock(&journal->lock);
+
+    if (abandoned)
+	log_warn_c(journal->log_ctx, "Journal writer is falling behind. "
+		   "Abandoning journal file until the next state save.");
+}
+
+uint64_t journal_rotate(struct journal *journal)
+{
+    pthread_mutex_lock(&journal->lock);
+
+    uint64_t seq = ++journal->seq;
+    journal->abandoned = false;
+
+    pthread_mutex_unlock(&journal->lock);
+
+    return seq;
+}
+
+void journal_compact(struct journal *journal, uint64_t seq)
+{
+    pthread_mutex_lock(&journal->lock);
+
+    if (seq > journal->compact_seq)
+	journal->compact_seq = seq;
+
+    pthread_cond_signal(&journal->cond);
+
+    pthread_mutex_unlock(&journal->lock);
+}
+
+struct seq_list
+{
+    uint64_t *seqs;
+    size_t num;
+};
+
+static void add_seq(uint64_t seq, void *cb_data)
+{
+    struct seq_list *files = cb_data;
+
+    files->seqs = ut_realloc(files->seqs, (files->num + 1) * sizeof(uint64_t));
+    files->seqs[files->num++] = seq;
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+    uint64_t seq_a = *(const uint64_t *)a;
+    uint64_t seq_b = *(const uint64_t *)b;
+
+    return seq_a < seq_b ? -1 : (seq_a > seq_b ? 1 : 0);
+}
+
+static ssize_t replay_file(const char *path, srec_cb cb, void *cb_data,
+			   const struct log_ctx *log_ctx)
+{
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+
+    if (fd < 0) {
+	log_error_c(log_ctx, "Unable to open journal file \"%s\": %s.",
+		    path, strerror(errno));
+	return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+	log_error_c(log_ctx, "Unable to stat journal file \"%s\": %s.",
+		    path, strerror(errno));
+	close(fd);
+	return -1;
+    }
+
+    size_t len = st.st_size;
+    struct journal_header header;
+
+    if (len < sizeof(header)) {
+	close(fd);
+	return 0;
+    }
+
+    const char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (data == MAP_FAILED) {
+	log_error_c(log_ctx, "Unable to map journal file \"%s\": %s.",
+		    path, strerror(errno));
+	return -1;
+    }
+
+    madvise((void *)data, len, MADV_SEQUENTIAL);
+
+    memcpy(&header, data, sizeof(header));
+
+    ssize_t num_records = 0;
+
+    if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+	header.byte_order != JOURNAL_BYTE_ORDER ||
+	header.version != JOURNAL_VERSION) {
+	log_error_c(log_ctx, "Journal file \"%s\" is malformed.", path);
+	num_records = -1;
+	goto out;
+    }
+
+    size_t offset = SREC_ALIGN(sizeof(header));
+
+    while (offset < len) {
+	struct srec rec;
+	ssize_t rec_len = srec_parse(data + offset, len - offset, &rec);
+
+	if (rec_len < 0) {
+	    /* most likely a record only partially written at a crash */
+	    log_warn_c(log_ctx, "Ignoring last %zd bytes of journal file "
+		       "\"%s\".", len - offset, path);
+	    break;
+	}
+
+	cb(&rec, cb_data);
+
+	props_destroy(rec.props);
+
+	offset += rec_len;
+	num_records++;
+    }
+
+out:
+    munmap((void *)data, len);
+
+    return num_records;
+}
+
+ssize_t journal_replay(const char *prefix, uint64_t from_seq,
+		       uint64_t *last_seq, srec_cb cb, void *cb_data,
+		       const struct log_ctx *log_ctx)
+{
+    struct seq_list files = {};
+
+    if (foreach_file(prefix, add_seq, &files) < 0) {
+	log_error_c(log_ctx, "Unable to list journal files: %s.",
+		    strerror(errno));
+	return -1;
+    }
+
+    if (files.num > 0)
+	qsort(files.seqs, files.num, sizeof(uint64_t), cmp_seq);
+
+    ssize_t total = 0;
+    size_t i;
+
+    for (i = 0; i < files.num; i++) {
+	uint64_t seq = files.seqs[i];
+
+	*last_seq = seq;
+
+	if (seq < from_seq)
+	    continue;
+
+	char *path = file_path(prefix, seq);
+
+	ssize_t num_records = replay_file(path, cb, cb_data, log_ctx);
+
+	ut_free(path);
+
+	if (num_records < 0) {
+	    total = -1;
+	    break;
+	}
+
+	total += num_records;
+    }
+
+    ut_free(files.seqs);
+
+    return total;
+}
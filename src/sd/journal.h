@@ -0,0 +1,66 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "service.h"
+#include "srec.h"
+
+/* An append-only log of service changes, complementing the state
+   file with the changes made since it was saved.
+
+   The journal is split into files with increasing sequence numbers,
+   named "<prefix>.<seq>". Records are buffered in memory and written,
+   in groups, by a dedicated writer thread. Appending never blocks on
+   disk I/O. Should the writer fall too far behind, or fail to write
+   or sync the current file, the file is abandoned until the next
+   rotation. */
+struct journal;
+
+enum journal_sync {
+    /* Leave flushing to the kernel */
+    journal_sync_none,
+    /* fsync() after every group of records written */
+    journal_sync_batch,
+    /* fsync() at most once every JOURNAL_SYNC_INTERVAL */
+    journal_sync_periodic
+};
+
+#define JOURNAL_SYNC_INTERVAL 1.0
+
+struct journal *journal_create(const char *prefix, uint64_t seq,
+			       enum journal_sync sync,
+			       const struct log_ctx *log_ctx);
+/* Writes all buffered records before returning. */
+void journal_destroy(struct journal *journal);
+
+int journal_start(struct journal *journal);
+
+/* May be called from any thread. */
+void journal_add(struct journal *journal, const struct service *service,
+		 enum service_change_type change_type);
+
+/* Directs subsequent records to a new file, and returns its sequence
+   number. */
+uint64_t journal_rotate(struct journal *journal);
+
+/* Removes, in the background, all files with a sequence number lower
+   than 'seq'. */
+void journal_compact(struct journal *journal, uint64_t seq);
+
+/* Replays, in order, the records of all files with a sequence number
+   of 'from_seq' or higher. The highest sequence number found is
+   stored in 'last_seq', which is left unchanged if there are no
+   files. Returns the number of records replayed. */
+ssize_t journal_replay(const char *prefix, uint64_t from_seq,
+		       uint64_t *last_seq, srec_cb cb, void *cb_data,
+		       const struct log_ctx *log_ctx);
+
+#endif
@@ -82,6 +82,43 @@ bool props_equal(const struct props *a, const struct props *b)
     return true;
 }
 
+static bool same_values(const struct props *a, const struct props *b,
+                        const char *prop_name)
+{
+    size_t num_a = 0;
+    size_t num_b = 0;
+    size_t i;
+
+    for (i = 0; i < a->num; i++)
+        if (strcmp(a->names[i], prop_name) == 0) {
+            if (!has_pair(b, prop_name, a->values[i]))
+                return false;
+            num_a++;
+        }
+
+    for (i = 0; i < b->num; i++)
+        if (strcmp(b->names[i], prop_name) == 0)
+            num_b++;
+
+    return num_a == num_b;
+}
+
+void props_diff(const struct props *from, const struct props *to,
+                struct props **changed, struct props **removed)
+{
+    *changed = props_create();
+    *removed = props_create();
+
+    size_t i;
+    for (i = 0; i < to->num; i++)
+        if (!same_values(from, to, to->names[i]))
+            props_add(*changed, to->names[i], to->values[i]);
+
+    for (i = 0; i < from->num; i++)
+        if (!props_has(to, from->names[i]))
+            props_add(*removed, from->names[i], from->values[i]);
+}
+
 size_t props_num_values(const struct props *props)
 {
     return props->num;
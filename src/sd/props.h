@@ -37,6 +37,12 @@ bool props_has(const struct props *props, const char *prop_name);
 
 bool props_equal(const struct props *props_a, const struct props *props_b);
 
+/* Properties in 'to' which are not in 'from', or have a different set
+   of values, are put into 'changed', with all their values in 'to'.
+   Properties only in 'from' are put into 'removed'. */
+void props_diff(const struct props *from, const struct props *to,
+		struct props **changed, struct props **removed);
+
 size_t props_num_values(const struct props *props);
 size_t props_num_names(const struct props *props);
 struct props *props_clone(const struct props *orig);
@@ -4,9 +4,13 @@
  */
 
 #include <event.h>
+#include <stdatomic.h>
 
+#include "chlog.h"
 #include "client.h"
 #include "db.h"
+#include "ebr.h"
+#include "imap.h"
 #include "pmap.h"
 #include "util.h"
 
@@ -22,11 +26,50 @@ struct orphan_timer
 PMAP_GEN_WRAPPER(orphan_map, struct orphan_map, int64_t, struct orphan_timer,
 		 static __attribute__((unused)))
 
+/* How often memory retired by snapshot updates is reclaimed, which
+   (plus the time readers spend in the snapshot) bounds the time it
+   lingers. */
+#define SNAPSHOT_RECLAIM_INTERVAL 0.1
+
+/* Snapshot records are immutable copies of the live objects */
+struct sd_snapshot
+{
+    struct imap *services;
+    struct imap *subs;
+    struct imap *clients;
+};
+
+struct sub_record
+{
+    int64_t client_id;
+    char *filter_s;
+};
+
+struct client_record
+{
+    char *remote_addr;
+    double connected_at;
+};
+
 struct sd
 {
     struct event_base *event_base;
     struct db *db;
     struct orphan_map *orphans;
+
+    /* only used if snapshots are enabled */
+    struct ebr *ebr;
+    _Atomic(struct sd_snapshot *) snapshot;
+    struct event reclaim_event;
+
+    sd_change_cb change_cbs[SD_MAX_CHANGE_CBS];
+    void *change_cb_data[SD_MAX_CHANGE_CBS];
+    size_t num_change_cbs;
+
+    /* the sequence is the instance's own, or shared */
+    struct chlog_seq *own_seq;
+    struct chlog_seq *seq;
+    struct chlog *chlog;
 };
 
 static void orphan_timeout_cb(evutil_socket_t fd, short events, void *cb_data);
@@ -82,9 +125,13 @@ struct sd *sd_create(struct event_base *event_base)
     *sd = (struct sd) {
 	.event_base = event_base,
 	.db = db_create(),
-	.orphans = orphan_map_create()
+	.orphans = orphan_map_create(),
+	.own_seq = chlog_seq_create()
     };
 
+    sd->seq = sd->own_seq;
+    sd->chlog = chlog_create(sd->seq, SD_CHANGE_LOG_SIZE);
+
     return sd;
 }
 
@@ -98,18 +145,237 @@ static bool destroy_orphan_timer_cb(int64_t service_id,
     return true;
 }
 
+static void free_service(void *ptr)
+{
+    service_dec_ref(ptr);
+}
+
+static void free_sub_record(void *ptr)
+{
+    struct sub_record *record = ptr;
+
+    ut_free(record->filter_s);
+    ut_free(record);
+}
+
+static void free_client_record(void *ptr)
+{
+    struct client_record *record = ptr;
+
+    ut_free(record->remote_addr);
+    ut_free(record);
+}
+
+static void snapshot_destroy(struct sd_snapshot *snapshot)
+{
+    imap_destroy(snapshot->services, free_service);
+    imap_destroy(snapshot->subs, free_sub_record);
+    imap_destroy(snapshot->clients, free_client_record);
+    ut_free(snapshot);
+}
+
 void sd_destroy(struct sd *sd)
 {
     if (sd != NULL) {
+	if (sd->ebr != NULL) {
+	    event_del(&sd->reclaim_event);
+	    ebr_destroy(sd->ebr);
+	    snapshot_destroy(atomic_load(&sd->snapshot));
+	}
+
 	orphan_map_foreach(sd->orphans, destroy_orphan_timer_cb, NULL);
 	orphan_map_destroy(sd->orphans);
 
 	db_destroy(sd->db);
 
+	chlog_destroy(sd->chlog);
+	chlog_seq_destroy(sd->own_seq);
+
 	ut_free(sd);
     }
 }
 
+static void reclaim_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct sd *sd = cb_data;
+
+    if (ebr_reclaim(sd->ebr) > 0) {
+	struct timeval tv;
+	ut_f_to_timeval(SNAPSHOT_RECLAIM_INTERVAL, &tv);
+	event_add(&sd->reclaim_event, &tv);
+    }
+}
+
+void sd_enable_snapshots(struct sd *sd, size_t max_readers)
+{
+    ut_assert(sd->ebr == NULL);
+
+    struct sd_snapshot *snapshot = ut_malloc(sizeof(struct sd_snapshot));
+
+    *snapshot = (struct sd_snapshot) {
+	.services = imap_create(),
+	.subs = imap_create(),
+	.clients = imap_create()
+    };
+
+    sd->ebr = ebr_create(max_readers);
+    atomic_init(&sd->snapshot, snapshot);
+
+    event_assign(&sd->reclaim_event, sd->event_base, -1, 0, reclaim_cb, sd);
+}
+
+void sd_add_change_cb(struct sd *sd, sd_change_cb cb, void *cb_data)
+{
+    ut_assert(sd->num_change_cbs < SD_MAX_CHANGE_CBS);
+
+    sd->change_cbs[sd->num_change_cbs] = cb;
+    sd->change_cb_data[sd->num_change_cbs] = cb_data;
+    sd->num_change_cbs++;
+}
+
+/* Returns a writable copy of the current snapshot root, or NULL if
+   snapshots are disabled. */
+static struct sd_snapshot *snapshot_begin(struct sd *sd)
+{
+    if (sd->ebr == NULL)
+	return NULL;
+
+    struct sd_snapshot *snapshot = ut_malloc(sizeof(struct sd_snapshot));
+
+    *snapshot = *atomic_load_explicit(&sd->snapshot, memory_order_relaxed);
+
+    return snapshot;
+}
+
+static void snapshot_commit(struct sd *sd, struct sd_snapshot *snapshot)
+{
+    struct sd_snapshot *old = atomic_exchange(&sd->snapshot, snapshot);
+
+    ebr_retire(sd->ebr, old, ut_free);
+
+    if (!event_pending(&sd->reclaim_event, EV_TIMEOUT, NULL)) {
+	struct timeval tv;
+	ut_f_to_timeval(SNAPSHOT_RECLAIM_INTERVAL, &tv);
+	event_add(&sd->reclaim_event, &tv);
+    }
+}
+
+static void snapshot_put_client(struct sd *sd, int64_t client_id)
+{
+    struct sd_snapshot *snapshot = snapshot_begin(sd);
+
+    if (snapshot == NULL)
+	return;
+
+    struct client *client = db_get_client(sd->db, client_id);
+    struct client_record *record = ut_malloc(sizeof(struct client_record));
+
+    *record = (struct client_record) {
+	.remote_addr = ut_strdup(client_get_conn_remote_addr(client)),
+	.connected_at = client_get_conn_connected_at(client)
+    };
+
+    snapshot->clients = imap_put(snapshot->clients, client_id, record,
+				 sd->ebr, free_client_record);
+
+    snapshot_commit(sd, snapshot);
+}
+
+struct snapshot_update
+{
+    struct sd *sd;
+    struct sd_snapshot *snapshot;
+};
+
+static bool snapshot_del_sub_cb(int64_t sub_id, struct sub *sub,
+				void *cb_data)
+{
+    struct snapshot_update *update = cb_data;
+    struct sd_snapshot *snapshot = update->snapshot;
+
+    snapshot->subs = imap_del(snapshot->subs, sub_id, update->sd->ebr,
+			      free_sub_record);
+
+    return true;
+}
+
+/* Must be called before the client is disconnected, since that
+   removes its subscriptions. */
+static void snapshot_del_client(struct sd *sd, int64_t client_id)
+{
+    struct sd_snapshot *snapshot = snapshot_begin(sd);
+
+    if (snapshot == NULL)
+	return;
+
+    struct snapshot_update update = {
+	.sd = sd,
+	.snapshot = snapshot
+    };
+
+    sd_foreach_client_sub(sd, client_id, snapshot_del_sub_cb, &update);
+
+    snapshot->clients = imap_del(snapshot->clients, client_id, sd->ebr,
+				 free_client_record);
+
+    snapshot_commit(sd, snapshot);
+}
+
+static void snapshot_put_sub(struct sd *sd, int64_t sub_id)
+{
+    struct sd_snapshot *snapshot = snapshot_begin(sd);
+
+    if (snapshot == NULL)
+	return;
+
+    struct sub *sub = db_get_sub(sd->db, sub_id);
+    struct sub_record *record = ut_malloc(sizeof(struct sub_record));
+
+    *record = (struct sub_record) {
+	.client_id = sub_get_client_id(sub),
+	.filter_s = sub_get_filter_str(sub)
+    };
+
+    snapshot->subs = imap_put(snapshot->subs, sub_id, record, sd->ebr,
+			      free_sub_record);
+
+    snapshot_commit(sd, snapshot);
+}
+
+static void snapshot_del_sub(struct sd *sd, int64_t sub_id)
+{
+    struct sd_snapshot *snapshot = snapshot_begin(sd);
+
+    if (snapshot == NULL)
+	return;
+
+    snapshot->subs = imap_del(snapshot->subs, sub_id, sd->ebr,
+			      free_sub_record);
+
+    snapshot_commit(sd, snapshot);
+}
+
+static void snapshot_update_service(struct sd *sd, struct service *service,
+				    enum service_change_type change_type)
+{
+    struct sd_snapshot *snapshot = snapshot_begin(sd);
+
+    if (snapshot == NULL)
+	return;
+
+    int64_t service_id = service_get_id(service);
+
+    if (change_type == service_change_type_removed)
+	snapshot->services = imap_del(snapshot->services, service_id,
+				      sd->ebr, free_service);
+    else
+	snapshot->services = imap_put(snapshot->services, service_id,
+				      service_clone(service), sd->ebr,
+				      free_service);
+
+    snapshot_commit(sd, snapshot);
+}
+
 int sd_client_connect(struct sd *sd, int64_t client_id, const char *remote_addr)
 {
     struct client *client = db_get_client(sd->db, client_id);
@@ -118,9 +384,16 @@ int sd_client_connect(struct sd *sd, int64_t client_id, const char *remote_addr)
 	client = client_create(client_id, sd->db);
 	client_connect(client, remote_addr);
 	client_dec_ref(client);
-	return 0;
-    } else
-	return client_reconnect(client, remote_addr);
+    } else {
+	int rc = client_reconnect(client, remote_addr);
+
+	if (rc < 0)
+	    return rc;
+    }
+
+    snapshot_put_client(sd, client_id);
+
+    return 0;
 }
 
 int sd_client_disconnect(struct sd *sd, int64_t client_id)
@@ -130,6 +403,8 @@ int sd_client_disconnect(struct sd *sd, int64_t client_id)
     if (client == NULL)
 	return SD_ERR_NO_SUCH_CLIENT;
 
+    snapshot_del_client(sd, client_id);
+
     return client_disconnect(client);
 }
 
@@ -234,6 +509,15 @@ static void maintain_orphans(struct sd *sd, struct service *service,
     }
 }
 
+static void log_change(struct sd *sd, struct service *service,
+		       enum service_change_type change_type)
+{
+    const struct props *prev_props = change_type != service_change_type_added ?
+	service_get_prev_props(service) : NULL;
+
+    chlog_add(sd->chlog, service_get_id(service), prev_props);
+}
+
 /* XXX: Move below to client class? It handles added-type
    notifications, and is also guaranteed to live as long as the
    service is alive. */
@@ -250,7 +534,24 @@ static void service_changed(struct service *service,
 
     db_foreach_sub(sd->db, notify_sub_service_changed, &change);
 
-    maintain_orphans(sd, service, change_type);
+    /* Mirrored services are timed out by their own server */
+    if (!service_is_mirrored(service))
+	maintain_orphans(sd, service, change_type);
+
+    snapshot_update_service(sd, service, change_type);
+
+    log_change(sd, service, change_type);
+
+    size_t i;
+    for (i = 0; i < sd->num_change_cbs; i++)
+	sd->change_cbs[i](service, change_type, sd->change_cb_data[i]);
+}
+
+static bool is_mirrored(struct sd *sd, int64_t service_id)
+{
+    struct service *service = db_get_service(sd->db, service_id);
+
+    return service != NULL && service_is_mirrored(service);
 }
 
 int sd_publish(struct sd *sd, int64_t client_id, int64_t service_id,
@@ -262,6 +563,9 @@ int sd_publish(struct sd *sd, int64_t client_id, int64_t service_id,
     if (client == NULL)
 	return SD_ERR_NO_SUCH_CLIENT;
 
+    if (is_mirrored(sd, service_id))
+	return SD_ERR_PERM_DENIED;
+
     return client_publish(client, service_id, generation, props, ttl,
 			  service_changed, sd);
 }
@@ -274,9 +578,78 @@ int sd_unpublish(struct sd *sd, int64_t client_id, int64_t service_id)
     if (client == NULL)
 	return SD_ERR_NO_SUCH_CLIENT;
 
+    if (is_mirrored(sd, service_id))
+	return SD_ERR_PERM_DENIED;
+
     return client_unpublish(client, service_id);
 }
 
+void sd_restore(struct sd *sd, int64_t client_id, int64_t service_id,
+		int64_t generation, const struct props *props,
+		int64_t ttl, double orphan_since)
+{
+    if (db_has_service(sd->db, service_id))
+	return;
+
+    struct client *client = db_get_client(sd->db, client_id);
+
+    if (client == NULL) {
+	client = client_create(client_id, sd->db);
+	client_restore(client, service_id, generation, props, ttl,
+		       orphan_since, service_changed, sd);
+	client_dec_ref(client);
+    } else if (!client_is_connected(client))
+	client_restore(client, service_id, generation, props, ttl,
+		       orphan_since, service_changed, sd);
+}
+
+void sd_mirror(struct sd *sd, int64_t client_id, int64_t service_id,
+	       int64_t generation, const struct props *props, int64_t ttl,
+	       double orphan_since)
+{
+    struct service *service = db_get_service(sd->db, service_id);
+    bool added = service == NULL;
+
+    /* Services of local clients take precedence */
+    if (!added && !service_is_mirrored(service))
+	return;
+
+    if (added) {
+	service = service_create(service_id, service_changed, sd);
+	service_set_mirrored(service);
+	service_add_begin(service);
+    } else
+	service_modify_begin(service);
+
+    service_set_generation(service, generation);
+    service_set_props(service, props);
+    service_set_ttl(service, ttl);
+    service_set_orphan_since(service, orphan_since);
+    service_set_client_id(service, client_id);
+    service_commit(service);
+
+    if (added) {
+	db_add_service(sd->db, service_id, service);
+	service_dec_ref(service);
+    }
+}
+
+void sd_mirror_remove(struct sd *sd, int64_t service_id)
+{
+    struct service *service = db_get_service(sd->db, service_id);
+
+    if (service == NULL || !service_is_mirrored(service))
+	return;
+
+    service_inc_ref(service);
+
+    db_del_service(sd->db, service_id);
+
+    service_remove(service);
+
+    service_dec_ref(service);
+}
+
 int sd_create_sub(struct sd *sd, int64_t client_id, int64_t sub_id,
 		  const char *filter_s, sub_match_cb match_cb,
 		  void *match_cb_data)
@@ -299,6 +672,9 @@ int sd_create_sub(struct sd *sd, int64_t client_id, int64_t sub_id,
 
     filter_destroy(filter);
 
+    if (rc == 0)
+	snapshot_put_sub(sd, sub_id);
+
     return rc;
 }
 
@@ -309,6 +685,66 @@ void sd_activate_sub(struct sd *sd, int64_t client_id, int64_t sub_id)
     client_activate_sub(client, sub_id);
 }
 
+static bool sub_matches(struct sub *sub, const struct props *props)
+{
+    const struct filter *filter = sub_get_filter(sub);
+
+    return filter == NULL || filter_matches(filter, props);
+}
+
+struct resume_param
+{
+    struct sd *sd;
+    struct sub *sub;
+};
+
+static void resume_service(int64_t service_id, const struct props *props,
+			   void *cb_data)
+{
+    struct resume_param *param = cb_data;
+    struct service *service = db_get_service(param->sd->db, service_id);
+
+    bool matched = props != NULL && sub_matches(param->sub, props);
+    bool matches = service != NULL &&
+	sub_matches(param->sub, service_get_props(service));
+
+    if (matches && matched) {
+	/* The subscriber's copy may predate the most recent change, so
+	   the service is passed without its delta */
+	struct service *copy = service_clone(service);
+
+	sub_match(param->sub, copy, sub_match_type_modified);
+
+	service_dec_ref(copy);
+    } else if (matches)
+	sub_match(param->sub, service, sub_match_type_appeared);
+    else if (matched && service != NULL)
+	sub_match(param->sub, service, sub_match_type_disappeared);
+    else if (matched) {
+	struct service *removed = service_create(service_id, NULL, NULL);
+
+	sub_match(param->sub, removed, sub_match_type_disappeared);
+
+	service_dec_ref(removed);
+    }
+}
+
+int sd_resume_sub(struct sd *sd, int64_t client_id, int64_t sub_id,
+		  int64_t seq)
+{
+    if (!chlog_covers(sd->chlog, seq))
+	return SD_ERR_CHANGES_TRIMMED;
+
+    struct resume_param param = {
+	.sd = sd,
+	.sub = db_get_sub(sd->db, sub_id)
+    };
+
+    chlog_foreach_since(sd->chlog, seq, resume_service, &param);
+
+    return 0;
+}
+
 int sd_unsubscribe(struct sd *sd, int64_t client_id, int64_t sub_id)
 {
     struct client *client = db_get_client(sd->db, client_id);
@@ -316,7 +752,42 @@ int sd_unsubscribe(struct sd *sd, int64_t client_id, int64_t sub_id)
     if (client == NULL)
 	return SD_ERR_NO_SUCH_CLIENT;
 
-    return client_unsubscribe(client, sub_id);
+    int rc = client_unsubscribe(client, sub_id);
+
+    if (rc == 0)
+	snapshot_del_sub(sd, sub_id);
+
+    return rc;
+}
+
+void sd_share_change_seq(struct sd *sd, struct sd *origin)
+{
+    ut_assert(chlog_len(sd->chlog) == 0);
+
+    chlog_destroy(sd->chlog);
+
+    sd->seq = origin->seq;
+    sd->chlog = chlog_create(sd->seq, SD_CHANGE_LOG_SIZE);
+}
+
+int64_t sd_get_change_seq(struct sd *sd)
+{
+    return chlog_seq_last(sd->seq);
+}
+
+bool sd_has_changes_since(struct sd *sd, int64_t seq)
+{
+    return chlog_covers(sd->chlog, seq);
+}
+
+void sd_pin_changes(struct sd *sd, int64_t seq)
+{
+    chlog_seq_pin(sd->seq, seq);
+}
+
+void sd_unpin_changes(struct sd *sd, int64_t seq)
+{
+    chlog_seq_unpin(sd->seq, seq);
 }
 
 void sd_foreach_client(struct sd *sd, sd_foreach_client_cb foreach_cb,
@@ -371,3 +842,151 @@ void sd_foreach_sub(struct sd *sd, sd_foreach_sub_cb foreach_cb,
 {
     db_foreach_sub(sd->db, foreach_cb, foreach_cb_data);
 }
+
+void sd_foreach_client_sub(struct sd *sd, int64_t client_id,
+			   sd_foreach_sub_cb foreach_cb,
+			   void *foreach_cb_data)
+{
+    struct client *client = db_get_client(sd->db, client_id);
+
+    if (client != NULL)
+	client_foreach_sub(client, foreach_cb, foreach_cb_data);
+}
+
+struct sub *sd_get_sub(struct sd *sd, int64_t sub_id)
+{
+    return db_get_sub(sd->db, sub_id);
+}
+
+const struct sd_snapshot *sd_snapshot_enter(struct sd *sd, size_t reader_idx)
+{
+    ebr_enter(sd->ebr, reader_idx);
+
+    return atomic_load(&sd->snapshot);
+}
+
+void sd_snapshot_leave(struct sd *sd, size_t reader_idx)
+{
+    ebr_leave(sd->ebr, reader_idx);
+}
+
+struct snapshot_service_param
+{
+    const struct filter *filter;
+    sd_snapshot_service_cb user_cb;
+    void *user_cb_data;
+};
+
+static bool snapshot_service_cb(int64_t service_id, void *value,
+				void *cb_data)
+{
+    struct snapshot_service_param *param = cb_data;
+    const struct service *service = value;
+
+    if (param->filter != NULL &&
+	!filter_matches(param->filter, service_get_props(service)))
+	return true;
+
+    return param->user_cb(service, param->user_cb_data);
+}
+
+void sd_snapshot_foreach_service(const struct sd_snapshot *snapshot,
+				 const struct filter *filter,
+				 sd_snapshot_service_cb foreach_cb,
+				 void *foreach_cb_data)
+{
+    struct snapshot_service_param param = {
+	.filter = filter,
+	.user_cb = foreach_cb,
+	.user_cb_data = foreach_cb_data
+    };
+
+    imap_foreach(snapshot->services, snapshot_service_cb, &param);
+}
+
+size_t sd_snapshot_num_services(const struct sd_snapshot *snapshot)
+{
+    return imap_size(snapshot->services);
+}
+
+void sd_snapshot_foreach_service_part(const struct sd_snapshot *snapshot,
+				      const struct filter *filter,
+				      size_t part, size_t num_parts,
+				      sd_snapshot_service_cb foreach_cb,
+				      void *foreach_cb_data)
+{
+    struct snapshot_service_param param = {
+	.filter = filter,
+	.user_cb = foreach_cb,
+	.user_cb_data = foreach_cb_data
+    };
+
+    ut_assert(num_parts <= SD_SNAPSHOT_MAX_PARTS);
+
+    imap_foreach_part(snapshot->services, part, num_parts,
+		      snapshot_service_cb, &param);
+}
+
+struct snapshot_sub_param
+{
+    sd_snapshot_sub_cb user_cb;
+    void *user_cb_data;
+};
+
+static bool snapshot_sub_cb(int64_t sub_id, void *value, void *cb_data)
+{
+    struct snapshot_sub_param *param = cb_data;
+    const struct sub_record *record = value;
+
+    return param->user_cb(sub_id, record->client_id, record->filter_s,
+			  param->user_cb_data);
+}
+
+void sd_snapshot_foreach_sub(const struct sd_snapshot *snapshot,
+			     sd_snapshot_sub_cb foreach_cb,
+			     void *foreach_cb_data)
+{
+    struct snapshot_sub_param param = {
+	.user_cb = foreach_cb,
+	.user_cb_data = foreach_cb_data
+    };
+
+    imap_foreach(snapshot->subs, snapshot_sub_cb, &param);
+}
+
+struct snapshot_client_param
+{
+    sd_snapshot_client_cb user_cb;
+    void *user_cb_data;
+};
+
+static bool snapshot_client_cb(int64_t client_id, void *value, void *cb_data)
+{
+    struct snapshot_client_param *param = cb_data;
+    const struct client_record *record = value;
+
+    return param->user_cb(client_id, record->remote_addr,
+			  record->connected_at, param->user_cb_data);
+}
+
+void sd_snapshot_foreach_client(const struct sd_snapshot *snapshot,
+				sd_snapshot_client_cb foreach_cb,
+				void *foreach_cb_data)
+{
+    struct snapshot_client_param param = {
+	.user_cb = foreach_cb,
+	.user_cb_data = foreach_cb_data
+    };
+
+    imap_foreach(snapshot->clients, snapshot_client_cb, &param);
+}
+
+size_t sd_snapshot_pending(struct sd *sd)
+{
+    return ebr_pending(sd->ebr);
+}
+
+double sd_snapshot_max_delay(struct sd *sd)
+{
+    return ebr_max_delay(sd->ebr);
+}
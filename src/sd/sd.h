@@ -31,10 +31,36 @@ int sd_publish(struct sd *sd, int64_t client_id, int64_t service_id,
 
 int sd_unpublish(struct sd *sd, int64_t client_id, int64_t service_id);
 
+/* Re-adds a service known from before a restart, as an orphan.
+   Ignored if the service already exists, or if its client is
+   connected. */
+void sd_restore(struct sd *sd, int64_t client_id, int64_t service_id,
+		int64_t generation, const struct props *props,
+		int64_t ttl, double orphan_since);
+
+/* Adds or replaces a mirrored service, a copy of a service kept by
+   another server. Mirrored services belong to no local client, may
+   not be published or unpublished by one, and are not timed out as
+   orphans; that is left to the other server. A service of a local
+   client is left as is. A negative 'orphan_since' means the service
+   is not an orphan. */
+void sd_mirror(struct sd *sd, int64_t client_id, int64_t service_id,
+	       int64_t generation, const struct props *props, int64_t ttl,
+	       double orphan_since);
+/* Only mirrored services are removed. */
+void sd_mirror_remove(struct sd *sd, int64_t service_id);
+
 int sd_create_sub(struct sd *sd, int64_t client_id, int64_t sub_id,
 		  const char *filter_s, sub_match_cb match_cb,
 		  void *match_cb_data);
 void sd_activate_sub(struct sd *sd, int64_t client_id, int64_t sub_id);
+/* Like sd_activate_sub(), but for a subscriber up to date as of
+   change 'seq'. Only services changed since are notified: those now
+   matching as appeared or modified, and those no longer matching (or
+   removed) as disappeared. Returns SD_ERR_CHANGES_TRIMMED, and
+   notifies nothing, if the changes are no longer in the log. */
+int sd_resume_sub(struct sd *sd, int64_t client_id, int64_t sub_id,
+		  int64_t seq);
 int sd_unsubscribe(struct sd *sd, int64_t client_id, int64_t sub_id);
 
 typedef bool (*sd_foreach_client_cb)(int64_t client_id,
@@ -54,5 +80,98 @@ typedef bool (*sd_foreach_sub_cb)(int64_t sub_id, struct sub *sub,
 				  void *foreach_cb_data);
 void sd_foreach_sub(struct sd *sd, sd_foreach_sub_cb foreach_cb,
 		    void *foreach_cb_data);
+void sd_foreach_client_sub(struct sd *sd, int64_t client_id,
+			   sd_foreach_sub_cb foreach_cb,
+			   void *foreach_cb_data);
+
+struct sub *sd_get_sub(struct sd *sd, int64_t sub_id);
+
+/* Maintain read-only snapshots of the sd instance's services,
+   subscriptions and connected clients, which may be accessed by up
+   to 'max_readers' other threads. Snapshots are updated, by copying,
+   as part of every change, and old snapshot data is reclaimed from
+   the sd instance's event loop. Must be called before any client
+   connects. */
+void sd_enable_snapshots(struct sd *sd, size_t max_readers);
+
+/* Called for every committed service change, by the thread running
+   the sd instance. */
+typedef void (*sd_change_cb)(const struct service *service,
+			     enum service_change_type change_type,
+			     void *cb_data);
+
+#define SD_MAX_CHANGE_CBS 4
+
+void sd_add_change_cb(struct sd *sd, sd_change_cb cb, void *cb_data);
+
+/* Every committed service change is assigned a sequence number, and
+   the most recent changes are kept in a log (see chlog.h). */
+#define SD_CHANGE_LOG_SIZE 65536
+
+/* Numbers the sd instance's changes from the sequence of 'origin',
+   subject to the pins of 'origin'. Must be called before any
+   change. */
+void sd_share_change_seq(struct sd *sd, struct sd *origin);
+
+/* The number of the most recent change. May be called from any
+   thread. */
+int64_t sd_get_change_seq(struct sd *sd);
+
+/* True if all changes after 'seq' are in the log. May be called from
+   any thread. */
+bool sd_has_changes_since(struct sd *sd, int64_t seq);
+
+/* Keeps the changes after 'seq' in the logs of all sd instances
+   sharing the sequence, until unpinned. A sd_has_changes_since()
+   check made after pinning remains valid. */
+void sd_pin_changes(struct sd *sd, int64_t seq);
+void sd_unpin_changes(struct sd *sd, int64_t seq);
+
+struct sd_snapshot;
+
+/* The snapshot remains valid until sd_snapshot_leave() is called,
+   which should be done promptly. */
+const struct sd_snapshot *sd_snapshot_enter(struct sd *sd, size_t reader_idx);
+void sd_snapshot_leave(struct sd *sd, size_t reader_idx);
+
+typedef bool (*sd_snapshot_service_cb)(const struct service *service,
+				       void *foreach_cb_data);
+void sd_snapshot_foreach_service(const struct sd_snapshot *snapshot,
+				 const struct filter *filter,
+				 sd_snapshot_service_cb foreach_cb,
+				 void *foreach_cb_data);
+
+size_t sd_snapshot_num_services(const struct sd_snapshot *snapshot);
+
+/* The services may be iterated over in up to SD_SNAPSHOT_MAX_PARTS
+   disjoint parts, concurrently, by threads sharing a snapshot
+   entered by one of them. */
+#define SD_SNAPSHOT_MAX_PARTS 32
+
+void sd_snapshot_foreach_service_part(const struct sd_snapshot *snapshot,
+				      const struct filter *filter,
+				      size_t part, size_t num_parts,
+				      sd_snapshot_service_cb foreach_cb,
+				      void *foreach_cb_data);
+
+typedef bool (*sd_snapshot_sub_cb)(int64_t sub_id, int64_t client_id,
+				   const char *filter_s,
+				   void *foreach_cb_data);
+void sd_snapshot_foreach_sub(const struct sd_snapshot *snapshot,
+			     sd_snapshot_sub_cb foreach_cb,
+			     void *foreach_cb_data);
+
+typedef bool (*sd_snapshot_client_cb)(int64_t client_id,
+				      const char *remote_addr,
+				      double connected_at,
+				      void *foreach_cb_data);
+void sd_snapshot_foreach_client(const struct sd_snapshot *snapshot,
+				sd_snapshot_client_cb foreach_cb,
+				void *foreach_cb_data);
+
+/* Retired snapshot data not yet reclaimed, and how long the oldest
+   such item has been waiting, in seconds. */
+size_t sd_snapshot_pending(struct sd *sd);
+double sd_snapshot_max_delay(struct sd *sd);
 
 #endif
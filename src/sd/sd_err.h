@@ -19,6 +19,8 @@
 #define SD_ERR_INVALID_FILTER (-8)
 #define SD_ERR_NO_SUCH_SUB (-9)
 
+#define SD_ERR_CHANGES_TRIMMED (-10)
+
 const char *sd_str_error(int err);
 
 #endif
@@ -24,6 +24,12 @@ struct service
     struct generation *prev;
     struct generation *next;
 
+    bool mirrored;
+
+    /* the properties delta of the most recent change, if computed */
+    struct props *changed_props;
+    struct props *removed_props;
+
     int ref_cnt;
 };
 
@@ -43,6 +49,51 @@ struct service *service_create(int64_t service_id, service_change_cb change_cb,
     return service;
 }
 
+struct service *service_clone(const struct service *service)
+{
+    struct service *clone = service_create(service->service_id, NULL, NULL);
+
+    clone->mirrored = service->mirrored;
+
+    if (service->current != NULL)
+	clone->current = generation_clone(service->current);
+
+    return clone;
+}
+
+struct service *service_clone_with_delta(const struct service *service)
+{
+    struct service *clone = service_clone(service);
+    const struct props *changed;
+    const struct props *removed;
+
+    if (service_get_props_delta(service, &changed, &removed)) {
+	clone->changed_props = props_clone(changed);
+	clone->removed_props = props_clone(removed);
+    }
+
+    return clone;
+}
+
+static bool generation_equal(struct generation *a, struct generation *b)
+{
+    if (a == NULL || b == NULL)
+	return a == b;
+
+    return generation_get_generation(a) == generation_get_generation(b) &&
+	generation_get_ttl(a) == generation_get_ttl(b) &&
+	generation_get_orphan_since(a) == generation_get_orphan_since(b) &&
+	generation_get_client_id(a) == generation_get_client_id(b) &&
+	props_equal(generation_get_props(a), generation_get_props(b));
+}
+
+bool service_equal(const struct service *service_a,
+		   const struct service *service_b)
+{
+    return service_a->service_id == service_b->service_id &&
+	generation_equal(service_a->current, service_b->current);
+}
+
 void service_inc_ref(struct service *service)
 {
     ut_assert(service->ref_cnt > 0);
@@ -50,8 +101,19 @@ void service_inc_ref(struct service *service)
     service->ref_cnt++;
 }
 
+static void clear_delta(struct service *service)
+{
+    props_destroy(service->changed_props);
+    props_destroy(service->removed_props);
+
+    service->changed_props = NULL;
+    service->removed_props = NULL;
+}
+
 static void destroy(struct service *service)
 {
+    clear_delta(service);
+
     generation_destroy(service->current);
     generation_destroy(service->prev);
     generation_destroy(service->next);
@@ -111,6 +173,8 @@ void service_commit(struct service *service)
     service->prev = service->current;
     service->current = service->next;
 
+    clear_delta(service);
+
     enum service_change_type change_type = service->change_in_progress;
 
     service->change_in_progress = service_change_type_none;
@@ -128,6 +192,8 @@ void service_remove(struct service *service)
     service->prev = service->current;
     service->current = NULL;
 
+    clear_delta(service);
+
     service->change_cb(service, service_change_type_removed,
 		       service->change_cb_data);
 }
@@ -146,6 +212,16 @@ int64_t service_get_id(const struct service *service)
     return service->service_id;
 }
 
+void service_set_mirrored(struct service *service)
+{
+    service->mirrored = true;
+}
+
+bool service_is_mirrored(const struct service *service)
+{
+    return service->mirrored;
+}
+
 #define GEN_SET_RELAY(attr_name, attr_type)				\
     void service_set_ ## attr_name(struct service *service,		\
 				   attr_type attr_name)			\
@@ -199,3 +275,28 @@ bool service_was_orphan(const struct service *service)
 
     return service_get_prev_orphan_since(service) >= 0;
 }
+
+bool service_get_props_delta(const struct service *service,
+			     const struct props **changed,
+			     const struct props **removed)
+{
+    if (service->changed_props == NULL) {
+	/* Copies, lacking the previous generation, only have a delta
+	   if created with it */
+	if (service->prev == NULL || service->current == NULL)
+	    return false;
+
+	/* The delta is a cache, and not part of the service's state */
+	struct service *mutable_service = (struct service *)service;
+
+	props_diff(generation_get_props(service->prev),
+		   generation_get_props(service->current),
+		   &mutable_service->changed_props,
+		   &mutable_service->removed_props);
+    }
+
+    *changed = service->changed_props;
+    *removed = service->removed_props;
+
+    return true;
+}
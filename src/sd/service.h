@@ -27,6 +27,18 @@ typedef void (*service_change_cb)(struct service *service,
 struct service *service_create(int64_t service_id, service_change_cb change_cb,
 			       void *change_cb_data);
 
+/* Creates a copy of the service's current state (only the id, for a
+   removed service), not tied to any sd instance. */
+struct service *service_clone(const struct service *service);
+
+/* Like service_clone(), but the copy also holds the properties delta
+   of the service's most recent change (see below). */
+struct service *service_clone_with_delta(const struct service *service);
+
+/* True if the services have the same id and current state. */
+bool service_equal(const struct service *service_a,
+		   const struct service *service_b);
+
 void service_inc_ref(struct service *service);
 void service_dec_ref(struct service *service);
 
@@ -46,6 +58,12 @@ void service_set_non_orphan(struct service *service);
 void service_set_client_id(struct service *service, int64_t client_id);
 
 int64_t service_get_id(const struct service *service);
+
+/* A mirrored service is a copy of a service kept by another server,
+   and belongs to no local client. */
+void service_set_mirrored(struct service *service);
+bool service_is_mirrored(const struct service *service);
+
 int64_t service_get_generation(const struct service *service);
 const struct props *service_get_props(const struct service *service);
 int64_t service_get_ttl(const struct service *service);
@@ -61,4 +79,13 @@ double service_get_prev_orphan_since(const struct service *service);
 bool service_was_orphan(const struct service *service);
 int64_t service_get_prev_client_id(const struct service *service);
 
+/* The properties added or changed, and removed, by the service's
+   most recent change, as per props_diff(). The delta is computed on
+   first use, and kept until the next change. Returns false if the
+   change was not a modification, or the service is a copy without
+   the delta. */
+bool service_get_props_delta(const struct service *service,
+			     const struct props **changed,
+			     const struct props **removed);
+
 #endif
@@ -0,0 +1,1271 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <event.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pfifo.h"
+#include "pmap.h"
+#include "util.h"
+
+#include "shards.h"
+
+/* Reports processed per shard, per core event loop callback */
+#define MAX_REPORT_BATCH 64
+
+enum cmd_type {
+    cmd_type_connect,
+    cmd_type_disconnect,
+    cmd_type_publish,
+    cmd_type_unpublish,
+    cmd_type_restore,
+    cmd_type_mirror,
+    cmd_type_mirror_remove,
+    cmd_type_subscribe,
+    cmd_type_unsubscribe,
+    cmd_type_list,
+    cmd_type_sync,
+    cmd_type_stop
+};
+
+/* Sent from the core to a shard */
+struct cmd
+{
+    enum cmd_type type;
+    int64_t client_id;
+    int64_t op_id;
+
+    char *remote_addr;
+
+    int64_t service_id;
+    int64_t generation;
+    struct props *props;
+    int64_t ttl;
+    double orphan_since;
+
+    int64_t sub_id;
+    int64_t sub_seq;
+    char *filter_s;
+    /* the change to resume the subscription from, or zero */
+    int64_t resume_seq;
+
+    /* the subscriptions of a disconnecting client */
+    int64_t *sub_ids;
+    size_t num_sub_ids;
+
+    struct filter *filter;
+};
+
+enum report_type {
+    report_type_result,
+    report_type_matches,
+    report_type_listing
+};
+
+struct match
+{
+    int64_t sub_id;
+    int64_t sub_seq;
+    enum sub_match_type match_type;
+};
+
+/* Sent from a shard to the core */
+struct report
+{
+    enum report_type type;
+    int64_t op_id;
+    int rc;
+
+    /* a copy of the state of the service matched */
+    struct service *service;
+    struct match *matches;
+    size_t num_matches;
+
+    struct service **services;
+    size_t num_services;
+};
+
+/* A one-way channel between two threads. The receiving thread's event
+   loop is woken up, over a pipe, only when it may have run out of
+   work. */
+struct channel
+{
+    struct pfifo *fifo;
+    atomic_bool idle;
+    int fds[2];
+    struct event event;
+};
+
+/* A shard's copy of a subscription */
+struct replica
+{
+    struct shard *shard;
+    int64_t sub_seq;
+};
+
+PMAP_GEN_WRAPPER(replica_map, struct replica_map, int64_t, struct replica,
+		 static __attribute__((unused)))
+
+struct shard
+{
+    struct shards *shards;
+    struct event_base *event_base;
+    struct sd *sd;
+    struct replica_map *replicas;
+
+    /* core to shard */
+    struct channel cmds;
+    /* shard to core */
+    struct channel reports;
+
+    /* matches for the service change currently being processed */
+    struct report *matches;
+    struct event flush_event;
+
+    pthread_t thread;
+};
+
+/* The core's view of a subscription. 'seq' tells apart different
+   subscriptions using the same id, over time. */
+struct core_sub
+{
+    int64_t seq;
+    struct sub *sub;
+};
+
+PMAP_GEN_WRAPPER(core_sub_map, struct core_sub_map, int64_t, struct core_sub,
+		 static __attribute__((unused)))
+
+/* An operation awaiting reports from one or more shards, keyed by a
+   core-assigned key, since the caller's operation ids need not be
+   unique across callers. */
+struct op
+{
+    int64_t op_id;
+    shards_result_cb result_cb;
+    shards_listing_cb listing_cb;
+    void *cb_data;
+    /* shards yet to report */
+    size_t num_pending;
+    /* the first error reported */
+    int rc;
+};
+
+PMAP_GEN_WRAPPER(op_map, struct op_map, int64_t, struct op,
+		 static __attribute__((unused)))
+
+struct shards
+{
+    struct event_base *event_base;
+    struct sd *sd;
+
+    struct shard *shards;
+    size_t num_shards;
+    bool running;
+
+    struct core_sub_map *subs;
+    int64_t next_sub_seq;
+
+    struct op_map *ops;
+    int64_t next_op_key;
+
+    struct log_ctx *log_ctx;
+};
+
+static int channel_init(struct channel *channel,
+			struct event_base *event_base,
+			event_callback_fn cb, void *cb_data)
+{
+    if (pipe2(channel->fds, O_CLOEXEC|O_NONBLOCK) < 0)
+	return -1;
+
+    channel->fifo = pfifo_create();
+    atomic_init(&channel->idle, true);
+
+    event_assign(&channel->event, event_base, channel->fds[0],
+		 EV_READ|EV_PERSIST, cb, cb_data);
+    event_add(&channel->event, NULL);
+
+    return 0;
+}
+
+static void channel_deinit(struct channel *channel)
+{
+    event_del(&channel->event);
+    close(channel->fds[0]);
+    close(channel->fds[1]);
+    pfifo_destroy(channel->fifo);
+}
+
+static void channel_wakeup(struct channel *channel)
+{
+    char c = 0;
+    ssize_t rc;
+
+    /* A full pipe already is a pending wakeup */
+    do {
+	rc = write(channel->fds[1], &c, 1);
+    } while (rc < 0 && errno == EINTR);
+}
+
+static void channel_send(struct channel *channel, void *item)
+{
+    pfifo_push(channel->fifo, item);
+
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (atomic_exchange(&channel->idle, false))
+	channel_wakeup(channel);
+}
+
+static void channel_drain_wakeups(struct channel *channel)
+{
+    char buf[64];
+
+    while (read(channel->fds[0], buf, sizeof(buf)) > 0)
+	;
+}
+
+/* Returns NULL, and marks the receiver idle, if the channel is
+   empty. */
+static void *channel_receive(struct channel *channel)
+{
+    void *item = pfifo_pop(channel->fifo);
+
+    if (item != NULL)
+	return item;
+
+    atomic_store(&channel->idle, true);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    item = pfifo_pop(channel->fifo);
+
+    if (item != NULL)
+	atomic_store(&channel->idle, false);
+
+    return item;
+}
+
+static size_t shard_idx(struct shards *shards, int64_t service_id)
+{
+    /* Fibonacci hashing, to spread out any patterns in the ids */
+    uint64_t hash = (uint64_t)service_id * UINT64_C(0x9e3779b97f4a7c15);
+
+    return (hash >> 32) % shards->num_shards;
+}
+
+static struct cmd *cmd_create(enum cmd_type type, int64_t client_id)
+{
+    struct cmd *cmd = ut_calloc(sizeof(struct cmd));
+
+    cmd->type = type;
+    cmd->client_id = client_id;
+
+    return cmd;
+}
+
+static void cmd_destroy(struct cmd *cmd)
+{
+    if (cmd != NULL) {
+	ut_free(cmd->remote_addr);
+	props_destroy(cmd->props);
+	ut_free(cmd->filter_s);
+	ut_free(cmd->sub_ids);
+	filter_destroy(cmd->filter);
+	ut_free(cmd);
+    }
+}
+
+static struct cmd *cmd_clone(const struct cmd *orig)
+{
+    struct cmd *cmd = ut_malloc(sizeof(struct cmd));
+
+    *cmd = *orig;
+
+    cmd->remote_addr = ut_strdup_non_null(orig->remote_addr);
+    cmd->props = orig->props != NULL ? props_clone(orig->props) : NULL;
+    cmd->filter_s = ut_strdup_non_null(orig->filter_s);
+    if (orig->num_sub_ids > 0)
+	cmd->sub_ids = ut_memdup(orig->sub_ids,
+				 sizeof(int64_t) * orig->num_sub_ids);
+    cmd->filter = filter_clone_non_null(orig->filter);
+
+    return cmd;
+}
+
+static struct report *report_create(enum report_type type)
+{
+    struct report *report = ut_calloc(sizeof(struct report));
+
+    report->type = type;
+
+    return report;
+}
+
+static void report_destroy(struct report *report)
+{
+    if (report != NULL) {
+	service_dec_ref(report->service);
+	ut_free(report->matches);
+
+	size_t i;
+	for (i = 0; i < report->num_services; i++)
+	    service_dec_ref(report->services[i]);
+	ut_free(report->services);
+
+	ut_free(report);
+    }
+}
+
+static void flush_matches(struct shard *shard)
+{
+    if (shard->matches != NULL) {
+	channel_send(&shard->reports, shard->matches);
+	shard->matches = NULL;
+    }
+}
+
+static void send_report(struct shard *shard, struct report *report)
+{
+    /* Keep the order in which things happened */
+    flush_matches(shard);
+
+    channel_send(&shard->reports, report);
+}
+
+static bool has_delta(const struct service *service)
+{
+    const struct props *changed;
+    const struct props *removed;
+
+    return service_get_props_delta(service, &changed, &removed);
+}
+
+/* Runs in the shard thread. Consecutive matches for the same service
+   state (and the same change, or no change, as per the properties
+   delta) are sent together, with a single copy of the service. */
+static void collect_match(struct sub *sub, const struct service *service,
+			  enum sub_match_type match_type, void *cb_data)
+{
+    struct replica *replica = cb_data;
+    struct shard *shard = replica->shard;
+    struct report *report = shard->matches;
+
+    if (report != NULL && (!service_equal(report->service, service) ||
+			   has_delta(report->service) != has_delta(service))) {
+	flush_matches(shard);
+	report = NULL;
+    }
+
+    if (report == NULL) {
+	report = report_create(report_type_matches);
+	report->service = service_clone_with_delta(service);
+	shard->matches = report;
+
+	/* Changes may also be caused by orphan timeouts */
+	event_active(&shard->flush_event, 0, 0);
+    }
+
+    report->matches = ut_realloc(report->matches, sizeof(struct match) *
+				 (report->num_matches + 1));
+    report->matches[report->num_matches] = (struct match) {
+	.sub_id = sub_get_sub_id(sub),
+	.sub_seq = replica->sub_seq,
+	.match_type = match_type
+    };
+    report->num_matches++;
+}
+
+static void flush_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct shard *shard = cb_data;
+
+    flush_matches(shard);
+}
+
+static void send_result(struct shard *shard, int64_t op_id, int rc)
+{
+    struct report *report = report_create(report_type_result);
+
+    report->op_id = op_id;
+    report->rc = rc;
+
+    send_report(shard, report);
+}
+
+static void del_replica(struct shard *shard, int64_t sub_id)
+{
+    struct replica *replica = replica_map_get(shard->replicas, sub_id);
+
+    replica_map_del(shard->replicas, sub_id);
+
+    ut_free(replica);
+}
+
+static bool add_to_listing(int64_t service_id, struct service *service,
+			   void *cb_data)
+{
+    struct report *report = cb_data;
+
+    report->services = ut_realloc(report->services, sizeof(struct service *) *
+				  (report->num_services + 1));
+    report->services[report->num_services] = service_clone(service);
+    report->num_services++;
+
+    return true;
+}
+
+static void shard_process(struct shard *shard, struct cmd *cmd)
+{
+    int rc;
+
+    switch (cmd->type) {
+    case cmd_type_connect:
+	rc = sd_client_connect(shard->sd, cmd->client_id, cmd->remote_addr);
+	ut_assert(rc == 0);
+	break;
+    case cmd_type_disconnect: {
+	rc = sd_client_disconnect(shard->sd, cmd->client_id);
+	ut_assert(rc == 0);
+
+	size_t i;
+	for (i = 0; i < cmd->num_sub_ids; i++)
+	    del_replica(shard, cmd->sub_ids[i]);
+	break;
+    }
+    case cmd_type_publish:
+	rc = sd_publish(shard->sd, cmd->client_id, cmd->service_id,
+			cmd->generation, cmd->props, cmd->ttl);
+	send_result(shard, cmd->op_id, rc);
+	break;
+    case cmd_type_unpublish:
+	rc = sd_unpublish(shard->sd, cmd->client_id, cmd->service_id);
+	send_result(shard, cmd->op_id, rc);
+	break;
+    case cmd_type_restore:
+	sd_restore(shard->sd, cmd->client_id, cmd->service_id,
+		   cmd->generation, cmd->props, cmd->ttl, cmd->orphan_since);
+	break;
+    case cmd_type_mirror:
+	sd_mirror(shard->sd, cmd->client_id, cmd->service_id,
+		  cmd->generation, cmd->props, cmd->ttl, cmd->orphan_since);
+	break;
+    case cmd_type_mirror_remove:
+	sd_mirror_remove(shard->sd, cmd->service_id);
+	break;
+    case cmd_type_subscribe: {
+	struct replica *replica = ut_malloc(sizeof(struct replica));
+
+	*replica = (struct replica) {
+	    .shard = shard,
+	    .sub_seq = cmd->sub_seq
+	};
+
+	replica_map_add(shard->replicas, cmd->sub_id, replica);
+
+	rc = sd_create_sub(shard->sd, cmd->client_id, cmd->sub_id,
+			   cmd->filter_s, collect_match, replica);
+	ut_assert(rc == 0);
+
+	if (cmd->resume_seq != 0) {
+	    rc = sd_resume_sub(shard->sd, cmd->client_id, cmd->sub_id,
+			       cmd->resume_seq);
+	    ut_assert(rc == 0);
+	    send_result(shard, cmd->op_id, rc);
+	} else
+	    sd_activate_sub(shard->sd, cmd->client_id, cmd->sub_id);
+	break;
+    }
+    case cmd_type_unsubscribe:
+	rc = sd_unsubscribe(shard->sd, cmd->client_id, cmd->sub_id);
+	ut_assert(rc == 0);
+
+	del_replica(shard, cmd->sub_id);
+	break;
+    case cmd_type_list: {
+	struct report *report = report_create(report_type_listing);
+
+	report->op_id = cmd->op_id;
+
+	sd_foreach_service(shard->sd, cmd->filter, add_to_listing, report);
+
+	send_report(shard, report);
+	break;
+    }
+    case cmd_type_sync:
+	send_result(shard, cmd->op_id, 0);
+	break;
+    case cmd_type_stop:
+	event_base_loopbreak(shard->event_base);
+	break;
+    }
+}
+
+static void cmds_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct shard *shard = cb_data;
+    struct cmd *cmd;
+
+    channel_drain_wakeups(&shard->cmds);
+
+    while ((cmd = channel_receive(&shard->cmds)) != NULL) {
+	shard_process(shard, cmd);
+	cmd_destroy(cmd);
+    }
+
+    flush_matches(shard);
+}
+
+static void *shard_run(void *arg)
+{
+    struct shard *shard = arg;
+
+    event_base_dispatch(shard->event_base);
+
+    return NULL;
+}
+
+static void op_complete(struct shards *shards, int64_t op_key,
+			struct op *op)
+{
+    op_map_del(shards->ops, op_key);
+    ut_free(op);
+}
+
+static void deliver_matches(struct shards *shards, struct report *report)
+{
+    size_t i;
+    for (i = 0; i < report->num_matches; i++) {
+	struct match *match = &report->matches[i];
+	struct core_sub *core_sub =
+	    core_sub_map_get(shards->subs, match->sub_id);
+
+	/* The subscription may have been removed, or replaced, with
+	   the match in flight */
+	if (core_sub != NULL && core_sub->seq == match->sub_seq)
+	    sub_match(core_sub->sub, report->service, match->match_type);
+    }
+}
+
+static void deliver_result(struct shards *shards, struct report *report)
+{
+    struct op *op = op_map_get(shards->ops, report->op_id);
+
+    if (op == NULL)
+	return;
+
+    if (op->rc == 0)
+	op->rc = report->rc;
+
+    op->num_pending--;
+
+    if (op->num_pending == 0) {
+	op->result_cb(op->op_id, op->rc, op->cb_data);
+	op_complete(shards, report->op_id, op);
+    }
+}
+
+static void deliver_listing(struct shards *shards, struct report *report)
+{
+    struct op *op = op_map_get(shards->ops, report->op_id);
+
+    if (op == NULL)
+	return;
+
+    size_t i;
+    for (i = 0; i < report->num_services; i++)
+	op->listing_cb(op->op_id, report->services[i], op->cb_data);
+
+    op->num_pending--;
+
+    if (op->num_pending == 0) {
+	op->listing_cb(op->op_id, NULL, op->cb_data);
+	op_complete(shards, report->op_id, op);
+    }
+}
+
+static void reports_cb(evutil_socket_t fd, short events, void *cb_data)
+{
+    struct shard *shard = cb_data;
+    struct shards *shards = shard->shards;
+
+    channel_drain_wakeups(&shard->reports);
+
+    size_t i;
+    for (i = 0; i < MAX_REPORT_BATCH; i++) {
+	struct report *report = channel_receive(&shard->reports);
+
+	if (report == NULL)
+	    return;
+
+	switch (report->type) {
+	case report_type_matches:
+	    deliver_matches(shards, report);
+	    break;
+	case report_type_result:
+	    deliver_result(shards, report);
+	    break;
+	case report_type_listing:
+	    deliver_listing(shards, report);
+	    break;
+	}
+
+	report_destroy(report);
+    }
+
+    /* Let other work in on the core thread, and continue later */
+    event_active(&shard->reports.event, EV_READ, 0);
+}
+
+static int shard_init(struct shard *shard, struct shards *shards)
+{
+    shard->shards = shards;
+    shard->event_base = event_base_new();
+
+    if (shard->event_base == NULL)
+	return -1;
+
+    if (channel_init(&shard->cmds, shard->event_base, cmds_cb, shard) < 0)
+	goto err_event_base;
+
+    if (channel_init(&shard->reports, shards->event_base, reports_cb,
+		     shard) < 0)
+	goto err_cmds;
+
+    event_assign(&shard->flush_event, shard->event_base, -1, 0,
+		 flush_cb, shard);
+
+    shard->sd = sd_create(shard->event_base);
+    sd_share_change_seq(shard->sd, shards->sd);
+    shard->replicas = replica_map_create();
+
+    return 0;
+
+err_cmds:
+    channel_deinit(&shard->cmds);
+err_event_base:
+    event_base_free(shard->event_base);
+    return -1;
+}
+
+static bool destroy_replica(int64_t sub_id, struct replica *replica,
+			    void *cb_data)
+{
+    ut_free(replica);
+    return true;
+}
+
+static void shard_deinit(struct shard *shard)
+{
+    struct cmd *cmd;
+    while ((cmd = pfifo_pop(shard->cmds.fifo)) != NULL)
+	cmd_destroy(cmd);
+
+    struct report *report;
+    while ((report = pfifo_pop(shard->reports.fifo)) != NULL)
+	report_destroy(report);
+
+    report_destroy(shard->matches);
+    event_del(&shard->flush_event);
+
+    sd_destroy(shard->sd);
+
+    replica_map_foreach(shard->replicas, destroy_replica, NULL);
+    replica_map_destroy(shard->replicas);
+
+    channel_deinit(&shard->reports);
+    channel_deinit(&shard->cmds);
+
+    event_base_free(shard->event_base);
+}
+
+struct shards *shards_create(struct event_base *event_base,
+			     size_t num_shards,
+			     const struct log_ctx *log_ctx)
+{
+    struct shards *shards = ut_calloc(sizeof(struct shards));
+
+    shards->event_base = event_base;
+    shards->sd = sd_create(event_base);
+    shards->subs = core_sub_map_create();
+    shards->ops = op_map_create();
+    shards->log_ctx = log_ctx_create(log_ctx);
+
+    shards->shards = ut_calloc(sizeof(struct shard) * num_shards);
+
+    for (; shards->num_shards < num_shards; shards->num_shards++)
+	if (shard_init(&shards->shards[shards->num_shards], shards) < 0) {
+	    log_error_c(shards->log_ctx, "Error creating shard: %s.",
+			strerror(errno));
+	    goto err;
+	}
+
+    return shards;
+
+err:
+    shards_destroy(shards);
+    return NULL;
+}
+
+static void stop_shards(struct shards *shards, size_t num)
+{
+    size_t i;
+
+    for (i = 0; i < num; i++) {
+	struct shard *shard = &shards->shards[i];
+
+	channel_send(&shard->cmds, cmd_create(cmd_type_stop, -1));
+
+	pthread_join(shard->thread, NULL);
+    }
+}
+
+static bool destroy_core_sub(int64_t sub_id, struct core_sub *core_sub,
+			     void *cb_data)
+{
+    sub_dec_ref(core_sub->sub);
+    ut_free(core_sub);
+    return true;
+}
+
+static bool destroy_op(int64_t op_key, struct op *op, void *cb_data)
+{
+    ut_free(op);
+    return true;
+}
+
+void shards_destroy(struct shards *shards)
+{
+    if (shards != NULL) {
+	if (shards->running)
+	    stop_shards(shards, shards->num_shards);
+
+	size_t i;
+	for (i = 0; i < shards->num_shards; i++)
+	    shard_deinit(&shards->shards[i]);
+	ut_free(shards->shards);
+
+	op_map_foreach(shards->ops, destroy_op, NULL);
+	op_map_destroy(shards->ops);
+
+	core_sub_map_foreach(shards->subs, destroy_core_sub, NULL);
+	core_sub_map_destroy(shards->subs);
+
+	sd_destroy(shards->sd);
+
+	log_ctx_destroy(shards->log_ctx);
+
+	ut_free(shards);
+    }
+}
+
+int shards_start(struct shards *shards)
+{
+    ut_assert(!shards->running);
+
+    /* Signals are left to the main thread */
+    sigset_t all;
+    sigset_t orig;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &orig);
+
+    size_t i;
+    int rc = 0;
+
+    for (i = 0; i < shards->num_shards; i++) {
+	rc = pthread_create(&shards->shards[i].thread, NULL, shard_run,
+			    &shards->shards[i]);
+	if (rc != 0)
+	    break;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    if (rc != 0) {
+	log_error_c(shards->log_ctx, "Unable to create shard thread: %s.",
+		    strerror(rc));
+	stop_shards(shards, i);
+	return -1;
+    }
+
+    shards->running = true;
+
+    log_debug_c(shards->log_ctx, "Started %zd shard threads.",
+		shards->num_shards);
+
+    return 0;
+}
+
+static bool is_sharded(struct shards *shards)
+{
+    return shards->num_shards > 0;
+}
+
+/* Takes ownership of 'cmd'. */
+static void broadcast(struct shards *shards, struct cmd *cmd)
+{
+    size_t i;
+    for (i = 0; i < shards->num_shards; i++) {
+	struct cmd *copy = i + 1 < shards->num_shards ? cmd_clone(cmd) : cmd;
+	channel_send(&shards->shards[i].cmds, copy);
+    }
+}
+
+static int64_t add_op(struct shards *shards, int64_t op_id,
+		      shards_result_cb result_cb,
+		      shards_listing_cb listing_cb, void *cb_data,
+		      size_t num_pending)
+{
+    struct op *op = ut_malloc(sizeof(struct op));
+
+    *op = (struct op) {
+	.op_id = op_id,
+	.result_cb = result_cb,
+	.listing_cb = listing_cb,
+	.cb_data = cb_data,
+	.num_pending = num_pending
+    };
+
+    int64_t op_key = shards->next_op_key++;
+
+    op_map_add(shards->ops, op_key, op);
+
+    return op_key;
+}
+
+int shards_client_connect(struct shards *shards, int64_t client_id,
+			  const char *remote_addr)
+{
+    int rc = sd_client_connect(shards->sd, client_id, remote_addr);
+
+    if (rc == 0 && is_sharded(shards)) {
+	struct cmd *cmd = cmd_create(cmd_type_connect, client_id);
+
+	cmd->remote_addr = ut_strdup(remote_addr);
+
+	broadcast(shards, cmd);
+    }
+
+    return rc;
+}
+
+struct collect_subs_param
+{
+    struct shards *shards;
+    struct cmd *cmd;
+};
+
+static bool remove_core_sub(int64_t sub_id, struct sub *sub, void *cb_data)
+{
+    struct collect_subs_param *param = cb_data;
+    struct shards *shards = param->shards;
+    struct cmd *cmd = param->cmd;
+
+    struct core_sub *core_sub = core_sub_map_get(shards->subs, sub_id);
+
+    core_sub_map_del(shards->subs, sub_id);
+    destroy_core_sub(sub_id, core_sub, NULL);
+
+    cmd->sub_ids = ut_realloc(cmd->sub_ids,
+			      sizeof(int64_t) * (cmd->num_sub_ids + 1));
+    cmd->sub_ids[cmd->num_sub_ids] = sub_id;
+    cmd->num_sub_ids++;
+
+    return true;
+}
+
+int shards_client_disconnect(struct shards *shards, int64_t client_id)
+{
+    if (!is_sharded(shards))
+	return sd_client_disconnect(shards->sd, client_id);
+
+    struct cmd *cmd = cmd_create(cmd_type_disconnect, client_id);
+
+    struct collect_subs_param param = {
+	.shards = shards,
+	.cmd = cmd
+    };
+
+    sd_foreach_client_sub(shards->sd, client_id, remove_core_sub, &param);
+
+    int rc = sd_client_disconnect(shards->sd, client_id);
+
+    if (rc == 0)
+	broadcast(shards, cmd);
+    else
+	cmd_destroy(cmd);
+
+    return rc;
+}
+
+void shards_publish(struct shards *shards, int64_t client_id,
+		    int64_t service_id, int64_t generation,
+		    const struct props *props, int64_t ttl,
+		    int64_t op_id, shards_result_cb result_cb, void *cb_data)
+{
+    if (!is_sharded(shards)) {
+	int rc = sd_publish(shards->sd, client_id, service_id, generation,
+			    props, ttl);
+	result_cb(op_id, rc, cb_data);
+	return;
+    }
+
+    struct cmd *cmd = cmd_create(cmd_type_publish, client_id);
+
+    cmd->op_id = add_op(shards, op_id, result_cb, NULL, cb_data, 1);
+    cmd->service_id = service_id;
+    cmd->generation = generation;
+    cmd->props = props_clone(props);
+    cmd->ttl = ttl;
+
+    channel_send(&shards->shards[shard_idx(shards, service_id)].cmds, cmd);
+}
+
+void shards_restore(struct shards *shards, int64_t client_id,
+		    int64_t service_id, int64_t generation,
+		    const struct props *props, int64_t ttl,
+		    double orphan_since)
+{
+    if (!is_sharded(shards)) {
+	sd_restore(shards->sd, client_id, service_id, generation, props, ttl,
+		   orphan_since);
+	return;
+    }
+
+    struct shard *shard = &shards->shards[shard_idx(shards, service_id)];
+
+    if (!shards->running) {
+	sd_restore(shard->sd, client_id, service_id, generation, props, ttl,
+		   orphan_since);
+	return;
+    }
+
+    struct cmd *cmd = cmd_create(cmd_type_restore, client_id);
+
+    cmd->service_id = service_id;
+    cmd->generation = generation;
+    cmd->props = props_clone(props);
+    cmd->ttl = ttl;
+    cmd->orphan_since = orphan_since;
+
+    channel_send(&shard->cmds, cmd);
+}
+
+void shards_mirror(struct shards *shards, int64_t client_id,
+		   int64_t service_id, int64_t generation,
+		   const struct props *props, int64_t ttl,
+		   double orphan_since)
+{
+    if (!is_sharded(shards)) {
+	sd_mirror(shards->sd, client_id, service_id, generation, props, ttl,
+		  orphan_since);
+	return;
+    }
+
+    struct shard *shard = &shards->shards[shard_idx(shards, service_id)];
+    struct cmd *cmd = cmd_create(cmd_type_mirror, client_id);
+
+    cmd->service_id = service_id;
+    cmd->generation = generation;
+    cmd->props = props_clone(props);
+    cmd->ttl = ttl;
+    cmd->orphan_since = orphan_since;
+
+    channel_send(&shard->cmds, cmd);
+}
+
+void shards_mirror_remove(struct shards *shards, int64_t service_id)
+{
+    if (!is_sharded(shards)) {
+	sd_mirror_remove(shards->sd, service_id);
+	return;
+    }
+
+    struct shard *shard = &shards->shards[shard_idx(shards, service_id)];
+    struct cmd *cmd = cmd_create(cmd_type_mirror_remove, -1);
+
+    cmd->service_id = service_id;
+
+    channel_send(&shard->cmds, cmd);
+}
+
+void shards_add_change_cb(struct shards *shards, sd_change_cb cb,
+			  void *cb_data)
+{
+    ut_assert(!shards->running);
+
+    if (!is_sharded(shards)) {
+	sd_add_change_cb(shards->sd, cb, cb_data);
+	return;
+    }
+
+    size_t i;
+    for (i = 0; i < shards->num_shards; i++)
+	sd_add_change_cb(shards->shards[i].sd, cb, cb_data);
+}
+
+void shards_unpublish(struct shards *shards, int64_t client_id,
+		      int64_t service_id, int64_t op_id,
+		      shards_result_cb result_cb, void *cb_data)
+{
+    if (!is_sharded(shards)) {
+	int rc = sd_unpublish(shards->sd, client_id, service_id);
+	result_cb(op_id, rc, cb_data);
+	return;
+    }
+
+    struct cmd *cmd = cmd_create(cmd_type_unpublish, client_id);
+
+    cmd->op_id = add_op(shards, op_id, result_cb, NULL, cb_data, 1);
+    cmd->service_id = service_id;
+
+    channel_send(&shards->shards[shard_idx(shards, service_id)].cmds, cmd);
+}
+
+int shards_create_sub(struct shards *shards, int64_t client_id,
+		      int64_t sub_id, const char *filter_s,
+		      sub_match_cb match_cb, void *match_cb_data)
+{
+    int rc = sd_create_sub(shards->sd, client_id, sub_id, filter_s,
+			   match_cb, match_cb_data);
+
+    if (rc == 0 && is_sharded(shards)) {
+	struct core_sub *core_sub = ut_malloc(sizeof(struct core_sub));
+
+	*core_sub = (struct core_sub) {
+	    .seq = shards->next_sub_seq++,
+	    .sub = sd_get_sub(shards->sd, sub_id)
+	};
+
+	sub_inc_ref(core_sub->sub);
+
+	core_sub_map_add(shards->subs, sub_id, core_sub);
+    }
+
+    return rc;
+}
+
+void shards_activate_sub(struct shards *shards, int64_t client_id,
+			 int64_t sub_id)
+{
+    if (!is_sharded(shards)) {
+	sd_activate_sub(shards->sd, client_id, sub_id);
+	return;
+    }
+
+    struct core_sub *core_sub = core_sub_map_get(shards->subs, sub_id);
+
+    struct cmd *cmd = cmd_create(cmd_type_subscribe, client_id);
+
+    cmd->sub_id = sub_id;
+    cmd->sub_seq = core_sub->seq;
+    cmd->filter_s = sub_get_filter_str(core_sub->sub);
+
+    broadcast(shards, cmd);
+}
+
+int shards_pin_changes(struct shards *shards, int64_t seq)
+{
+    sd_pin_changes(shards->sd, seq);
+
+    bool covered = sd_has_changes_since(shards->sd, seq);
+    size_t i;
+
+    for (i = 0; covered && i < shards->num_shards; i++)
+	covered = sd_has_changes_since(shards->shards[i].sd, seq);
+
+    if (!covered) {
+	sd_unpin_changes(shards->sd, seq);
+	return SD_ERR_CHANGES_TRIMMED;
+    }
+
+    return 0;
+}
+
+static void unpin_cb(int64_t seq, int rc, void *cb_data)
+{
+    struct shards *shards = cb_data;
+
+    sd_unpin_changes(shards->sd, seq);
+}
+
+void shards_resume_sub(struct shards *shards, int64_t client_id,
+		       int64_t sub_id, int64_t seq)
+{
+    if (!is_sharded(shards)) {
+	int rc = sd_resume_sub(shards->sd, client_id, sub_id, seq);
+	ut_assert(rc == 0);
+
+	sd_unpin_changes(shards->sd, seq);
+	return;
+    }
+
+    struct core_sub *core_sub = core_sub_map_get(shards->subs, sub_id);
+
+    struct cmd *cmd = cmd_create(cmd_type_subscribe, client_id);
+
+    /* The pin is kept until all shards are done */
+    cmd->op_id = add_op(shards, seq, unpin_cb, NULL, shards,
+			shards->num_shards);
+    cmd->sub_id = sub_id;
+    cmd->sub_seq = core_sub->seq;
+    cmd->filter_s = sub_get_filter_str(core_sub->sub);
+    cmd->resume_seq = seq;
+
+    broadcast(shards, cmd);
+}
+
+int shards_unsubscribe(struct shards *shards, int64_t client_id,
+		       int64_t sub_id)
+{
+    int rc = sd_unsubscribe(shards->sd, client_id, sub_id);
+
+    if (rc == 0 && is_sharded(shards)) {
+	struct core_sub *core_sub = core_sub_map_get(shards->subs, sub_id);
+
+	core_sub_map_del(shards->subs, sub_id);
+	destroy_core_sub(sub_id, core_sub, NULL);
+
+	struct cmd *cmd = cmd_create(cmd_type_unsubscribe, client_id);
+
+	cmd->sub_id = sub_id;
+
+	broadcast(shards, cmd);
+    }
+
+    return rc;
+}
+
+struct relay_listing_param
+{
+    int64_t op_id;
+    shards_listing_cb listing_cb;
+    void *cb_data;
+};
+
+static bool relay_listing(int64_t service_id, struct service *service,
+			  void *cb_data)
+{
+    struct relay_listing_param *param = cb_data;
+
+    param->listing_cb(param->op_id, service, param->cb_data);
+
+    return true;
+}
+
+void shards_foreach_service(struct shards *shards,
+			    const struct filter *filter, int64_t op_id,
+			    shards_listing_cb listing_cb, void *cb_data)
+{
+    if (!is_sharded(shards)) {
+	struct relay_listing_param param = {
+	    .op_id = op_id,
+	    .listing_cb = listing_cb,
+	    .cb_data = cb_data
+	};
+
+	sd_foreach_service(shards->sd, filter, relay_listing, &param);
+
+	listing_cb(op_id, NULL, cb_data);
+	return;
+    }
+
+    struct cmd *cmd = cmd_create(cmd_type_list, -1);
+
+    cmd->op_id = add_op(shards, op_id, NULL, listing_cb, cb_data,
+			shards->num_shards);
+    cmd->filter = filter_clone_non_null(filter);
+
+    broadcast(shards, cmd);
+}
+
+void shards_foreach_client(struct shards *shards,
+			   sd_foreach_client_cb foreach_cb,
+			   void *foreach_cb_data)
+{
+    sd_foreach_client(shards->sd, foreach_cb, foreach_cb_data);
+}
+
+void shards_foreach_sub(struct shards *shards, sd_foreach_sub_cb foreach_cb,
+			void *foreach_cb_data)
+{
+    sd_foreach_sub(shards->sd, foreach_cb, foreach_cb_data);
+}
+
+void shards_sync(struct shards *shards, int64_t op_id,
+		 shards_result_cb result_cb, void *cb_data)
+{
+    if (!is_sharded(shards)) {
+	result_cb(op_id, 0, cb_data);
+	return;
+    }
+
+    struct cmd *cmd = cmd_create(cmd_type_sync, -1);
+
+    /* Shards report results after any matches already collected */
+    cmd->op_id = add_op(shards, op_id, result_cb, NULL, cb_data,
+			shards->num_shards);
+
+    broadcast(shards, cmd);
+}
+
+int64_t shards_get_change_seq(struct shards *shards)
+{
+    return sd_get_change_seq(shards->sd);
+}
+
+struct cancel_param
+{
+    void *cb_data;
+    int64_t *op_keys;
+    size_t num_op_keys;
+};
+
+static bool find_cancelled(int64_t op_key, struct op *op, void *cb_data)
+{
+    struct cancel_param *param = cb_data;
+
+    if (op->cb_data == param->cb_data) {
+	param->op_keys = ut_realloc(param->op_keys, sizeof(int64_t) *
+				    (param->num_op_keys + 1));
+	param->op_keys[param->num_op_keys] = op_key;
+	param->num_op_keys++;
+    }
+
+    return true;
+}
+
+void shards_cancel(struct shards *shards, void *cb_data)
+{
+    struct cancel_param param = {
+	.cb_data = cb_data
+    };
+
+    op_map_foreach(shards->ops, find_cancelled, &param);
+
+    size_t i;
+    for (i = 0; i < param.num_op_keys; i++) {
+	int64_t op_key = param.op_keys[i];
+
+	op_complete(shards, op_key, op_map_get(shards->ops, op_key));
+    }
+
+    ut_free(param.op_keys);
+}
+
+struct sd *shards_get_core(struct shards *shards)
+{
+    return shards->sd;
+}
+
+size_t shards_get_num_shards(struct shards *shards)
+{
+    return shards->num_shards;
+}
@@ -0,0 +1,125 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef SHARDS_H
+#define SHARDS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <event2/event.h>
+
+#include "log.h"
+#include "sd.h"
+
+/* Service discovery with the services partitioned, by service id,
+   across a number of shards. Each shard is an sd instance of its
+   own, with its own orphan timers, run by a dedicated thread.
+
+   Clients and subscriptions are kept by a core sd instance, owned by
+   the calling thread, and are replicated to every shard. Matches
+   produced by the shards are delivered, in the calling thread, to
+   the core subscription's match callback. The matches for any
+   particular service are delivered in order.
+
+   Publish, unpublish and service listing results are delivered
+   asynchronously. With zero shards, the core sd instance also holds
+   the services, and all results are delivered before the call
+   returns. */
+struct shards;
+
+struct shards *shards_create(struct event_base *event_base,
+			     size_t num_shards,
+			     const struct log_ctx *log_ctx);
+void shards_destroy(struct shards *shards);
+
+int shards_start(struct shards *shards);
+
+int shards_client_connect(struct shards *shards, int64_t client_id,
+			  const char *remote_addr);
+int shards_client_disconnect(struct shards *shards, int64_t client_id);
+
+/* 'op_id' is chosen by the caller, and is handed back with the
+   result. */
+typedef void (*shards_result_cb)(int64_t op_id, int rc, void *cb_data);
+
+void shards_publish(struct shards *shards, int64_t client_id,
+		    int64_t service_id, int64_t generation,
+		    const struct props *props, int64_t ttl,
+		    int64_t op_id, shards_result_cb result_cb, void *cb_data);
+/* As per sd_restore(). Once the shards are started, the service is
+   restored asynchronously. */
+void shards_restore(struct shards *shards, int64_t client_id,
+		    int64_t service_id, int64_t generation,
+		    const struct props *props, int64_t ttl,
+		    double orphan_since);
+
+/* As per sd_mirror() and sd_mirror_remove(). The changes to any
+   particular service are applied in order. */
+void shards_mirror(struct shards *shards, int64_t client_id,
+		   int64_t service_id, int64_t generation,
+		   const struct props *props, int64_t ttl,
+		   double orphan_since);
+void shards_mirror_remove(struct shards *shards, int64_t service_id);
+
+/* 'cb' is called by whatever thread holds the service changed. May
+   only be called before the shards are started. */
+void shards_add_change_cb(struct shards *shards, sd_change_cb cb,
+			  void *cb_data);
+
+void shards_unpublish(struct shards *shards, int64_t client_id,
+		      int64_t service_id, int64_t op_id,
+		      shards_result_cb result_cb, void *cb_data);
+
+int shards_create_sub(struct shards *shards, int64_t client_id,
+		      int64_t sub_id, const char *filter_s,
+		      sub_match_cb match_cb, void *match_cb_data);
+void shards_activate_sub(struct shards *shards, int64_t client_id,
+			 int64_t sub_id);
+
+/* Keeps the changes made after 'seq', or returns
+   SD_ERR_CHANGES_TRIMMED if some are already gone. A successful call
+   must be followed by shards_resume_sub(), which releases the
+   changes. */
+int shards_pin_changes(struct shards *shards, int64_t seq);
+/* As per sd_resume_sub(), but in place of shards_activate_sub(). */
+void shards_resume_sub(struct shards *shards, int64_t client_id,
+		       int64_t sub_id, int64_t seq);
+int shards_unsubscribe(struct shards *shards, int64_t client_id,
+		       int64_t sub_id);
+
+/* Called once for every matching service, and then once with a NULL
+   service, to signal the end of the listing. */
+typedef void (*shards_listing_cb)(int64_t op_id,
+				  const struct service *service,
+				  void *cb_data);
+
+void shards_foreach_service(struct shards *shards,
+			    const struct filter *filter, int64_t op_id,
+			    shards_listing_cb listing_cb, void *cb_data);
+
+void shards_foreach_client(struct shards *shards,
+			   sd_foreach_client_cb foreach_cb,
+			   void *foreach_cb_data);
+void shards_foreach_sub(struct shards *shards, sd_foreach_sub_cb foreach_cb,
+			void *foreach_cb_data);
+
+/* Calls 'result_cb' once all service changes made so far, across
+   all shards, have had their matches delivered. */
+void shards_sync(struct shards *shards, int64_t op_id,
+		 shards_result_cb result_cb, void *cb_data);
+
+/* The number of the most recent service change, across all shards.
+   See chlog.h. */
+int64_t shards_get_change_seq(struct shards *shards);
+
+/* Drops all not-yet-delivered results destined for 'cb_data'. */
+void shards_cancel(struct shards *shards, void *cb_data);
+
+/* The sd instance keeping the clients and subscriptions (and, with
+   zero shards, the services). */
+struct sd *shards_get_core(struct shards *shards);
+size_t shards_get_num_shards(struct shards *shards);
+
+#endif
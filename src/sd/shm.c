@@ -0,0 +1,839 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "pmap.h"
+#include "util.h"
+
+#include "shm.h"
+
+#define SHM_MAGIC UINT32_C(0x74706166)
+#define SHM_VERSION 1
+
+/* Services' properties are readable by the group only */
+#define SHM_MODE 0640
+
+/* Attempts at a point-in-time snapshot made by shm_reader_foreach(),
+   before falling back to reading one service at a time. */
+#define SNAPSHOT_ATTEMPTS 8
+
+/* Slots in use, or previously in use, at which tombstones are
+   cleared out. */
+#define MAX_LOAD(num_slots) ((num_slots) - (num_slots) / 4)
+
+/* Yields made waiting for a change to complete, before a reader gives
+   up on the writer, which may have died in the middle of it. */
+#define MAX_SPINS 100000
+
+/* Reads overlapping with a change, before a reader gives up */
+#define MAX_READ_ATTEMPTS 1000
+
+/* Services not in the table, by service id */
+PMAP_GEN_WRAPPER_DEF(omitted_map, struct omitted_map, int64_t, void,
+		     static __attribute__((unused)))
+
+struct shm_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_slots;
+    /* odd while any slot is being changed */
+    _Atomic uint64_t seq;
+    _Atomic uint32_t closed;
+    _Atomic uint32_t num_services;
+    /* services left out, for being too large or the table being full */
+    _Atomic uint32_t num_omitted;
+    char pad[28];
+};
+
+enum slot_state {
+    slot_state_empty = 0,
+    slot_state_used,
+    /* a removed service, which may have been probed past */
+    slot_state_tombstone
+};
+
+struct shm_slot
+{
+    /* odd while the slot is being changed */
+    _Atomic uint64_t seq;
+    _Atomic uint32_t state;
+    _Atomic uint32_t rec_len;
+    _Atomic int64_t service_id;
+    char rec[SHM_MAX_RECORD] __attribute__((aligned(SREC_ALIGNMENT)));
+};
+
+static size_t segment_size(size_t num_slots)
+{
+    return sizeof(struct shm_header) + num_slots * sizeof(struct shm_slot);
+}
+
+static struct shm_slot *get_slot(struct shm_header *header, size_t idx)
+{
+    struct shm_slot *slots = (struct shm_slot *)(header + 1);
+
+    return &slots[idx];
+}
+
+static size_t home_idx(size_t num_slots, int64_t service_id)
+{
+    uint64_t hash = (uint64_t)service_id * UINT64_C(0x9e3779b97f4a7c15);
+
+    return (hash >> 32) % num_slots;
+}
+
+static void seq_write_begin(_Atomic uint64_t *seq)
+{
+    uint64_t value = atomic_load_explicit(seq, memory_order_relaxed);
+
+    atomic_store_explicit(seq, value + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void seq_write_end(_Atomic uint64_t *seq)
+{
+    uint64_t value = atomic_load_explicit(seq, memory_order_relaxed);
+
+    atomic_store_explicit(seq, value + 1, memory_order_release);
+}
+
+/* Fails with EAGAIN if the segment is closed, or the change doesn't
+   complete in time. */
+static int seq_read_begin(struct shm_header *header, _Atomic uint64_t *seq,
+			  uint64_t *begin)
+{
+    int i;
+
+    for (i = 0; i < MAX_SPINS; i++) {
+	if (atomic_load_explicit(&header->closed, memory_order_relaxed))
+	    break;
+
+	uint64_t value = atomic_load_explicit(seq, memory_order_acquire);
+
+	if ((value & 1) == 0) {
+	    *begin = value;
+	    return 0;
+	}
+
+	sched_yield();
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static bool seq_read_retry(_Atomic uint64_t *seq, uint64_t begin)
+{
+    atomic_thread_fence(memory_order_acquire);
+
+    return atomic_load_explicit(seq, memory_order_relaxed) != begin;
+}
+
+struct shm_writer
+{
+    char *name;
+    /* holds the segment's lock */
+    int fd;
+    struct shm_header *header;
+    size_t size;
+    ino_t ino;
+
+    /* serializes the shard threads' changes */
+    pthread_mutex_t lock;
+    size_t num_used;
+    size_t num_tombstones;
+    struct omitted_map *omitted;
+    bool full;
+    struct srec_buf rec_buf;
+
+    const struct log_ctx *log_ctx;
+};
+
+/* The writer holds a write lock on the whole segment for as long as
+   it has it open, which is until it's destroyed, or dies. Open file
+   description locks are used, since they, unlike POSIX record locks,
+   are unaffected by other descriptors of the segment being closed,
+   and can be tested for without being taken. */
+static int lock_segment(int fd)
+{
+    struct flock lock = {
+	.l_type = F_WRLCK,
+	.l_whence = SEEK_SET
+    };
+
+    return fcntl(fd, F_OFD_SETLK, &lock);
+}
+
+static bool has_writer(int fd)
+{
+    struct flock lock = {
+	.l_type = F_RDLCK,
+	.l_whence = SEEK_SET
+    };
+
+    /* Rather assume the writer is there, than report it gone */
+    if (fcntl(fd, F_OFD_GETLK, &lock) < 0)
+	return true;
+
+    return lock.l_type != F_UNLCK;
+}
+
+static bool is_current(const char *name, ino_t ino)
+{
+    int fd = shm_open(name, O_RDONLY|O_CLOEXEC, 0);
+
+    if (fd < 0)
+	return false;
+
+    struct stat st;
+    int rc = fstat(fd, &st);
+
+    close(fd);
+
+    return rc == 0 && st.st_ino == ino;
+}
+
+/* Takes the lock of the segment if its writer is gone, and it's one
+   of ours, and still goes by that name. A writer that died before
+   sizing the segment leaves it empty. */
+static bool take_abandoned(int fd, const char *name)
+{
+    struct stat st;
+
+    if (lock_segment(fd) < 0 || fstat(fd, &st) < 0)
+	return false;
+
+    if (!is_current(name, st.st_ino))
+	return false;
+
+    if (st.st_size == 0)
+	return true;
+
+    if ((size_t)st.st_size < sizeof(struct shm_header))
+	return false;
+
+    struct shm_header *header =
+	mmap(NULL, sizeof(struct shm_header), PROT_READ, MAP_SHARED, fd, 0);
+
+    if (header == MAP_FAILED)
+	return false;
+
+    bool ours = header->magic == SHM_MAGIC;
+
+    munmap(header, sizeof(struct shm_header));
+
+    return ours;
+}
+
+/* Returns the file descriptor of a new segment, locked. A segment
+   left behind by a writer which has since gone away, whether it
+   closed the segment or died, is replaced, but not one still in
+   use. */
+static int create_segment(const char *name)
+{
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, SHM_MODE);
+
+    if (fd < 0 && errno == EEXIST) {
+	int old_fd = shm_open(name, O_RDWR|O_CLOEXEC, 0);
+
+	if (old_fd < 0)
+	    return -1;
+
+	/* The old segment's lock is held until the new segment has
+	   been created, so that no other writer may replace it at the
+	   same time */
+	if (take_abandoned(old_fd, name)) {
+	    if (shm_unlink(name) == 0 || errno == ENOENT)
+		fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC,
+			      SHM_MODE);
+	} else
+	    errno = EEXIST;
+
+	UT_PROTECT_ERRNO(close(old_fd));
+    }
+
+    if (fd < 0)
+	return -1;
+
+    struct stat st;
+
+    /* Another writer may have replaced the segment before it was
+       locked */
+    if (lock_segment(fd) < 0 || fstat(fd, &st) < 0 ||
+	!is_current(name, st.st_ino)) {
+	close(fd);
+	errno = EEXIST;
+	return -1;
+    }
+
+    return fd;
+}
+
+struct shm_writer *shm_writer_create(const char *name, size_t num_slots,
+				     const struct log_ctx *log_ctx)
+{
+    size_t size = segment_size(num_slots);
+
+    int fd = create_segment(name);
+
+    if (fd < 0)
+	goto err;
+
+    struct stat st;
+
+    if (ftruncate(fd, size) < 0 || fstat(fd, &st) < 0)
+	goto err_unlink;
+
+    struct shm_header *header =
+	mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (header == MAP_FAILED)
+	goto err_unlink;
+
+    /* The slots are zeroed, and thus empty */
+    header->version = SHM_VERSION;
+    header->num_slots = num_slots;
+    atomic_thread_fence(memory_order_release);
+    header->magic = SHM_MAGIC;
+
+    struct shm_writer *writer = ut_malloc(sizeof(struct shm_writer));
+
+    *writer = (struct shm_writer) {
+	.name = ut_strdup(name),
+	.fd = fd,
+	.header = header,
+	.size = size,
+	.ino = st.st_ino,
+	.omitted = omitted_map_create(),
+	.log_ctx = log_ctx
+    };
+
+    pthread_mutex_init(&writer->lock, NULL);
+    srec_buf_init(&writer->rec_buf);
+
+    log_info_c(log_ctx, "Publishing services in shared memory segment "
+	       "\"%s\", with room for %zd services.", name, num_slots);
+
+    return writer;
+
+err_unlink:
+    UT_PROTECT_ERRNO(close(fd));
+    UT_PROTECT_ERRNO(shm_unlink(name));
+err:
+    if (errno == EEXIST)
+	log_error_c(log_ctx, "Shared memory segment \"%s\" is in use by "
+		    "another writer.", name);
+    else
+	log_error_c(log_ctx, "Unable to create shared memory segment "
+		    "\"%s\": %s.", name, strerror(errno));
+    return NULL;
+}
+
+void shm_writer_destroy(struct shm_writer *writer)
+{
+    if (writer != NULL) {
+	atomic_store(&writer->header->closed, 1);
+
+	munmap(writer->header, writer->size);
+
+	/* The name may have been taken over by another writer */
+	if (is_current(writer->name, writer->ino))
+	    shm_unlink(writer->name);
+
+	close(writer->fd);
+
+	srec_buf_deinit(&writer->rec_buf);
+	pthread_mutex_destroy(&writer->lock);
+	omitted_map_destroy(writer->omitted);
+
+	ut_free(writer->name);
+	ut_free(writer);
+    }
+}
+
+/* Returns the index of the service's slot, or -1. The index of the
+   first slot available for the service is stored in 'free_idx', or
+   -1 if there is none. */
+static ssize_t find_slot(struct shm_writer *writer, int64_t service_id,
+			 ssize_t *free_idx)
+{
+    size_t num_slots = writer->header->num_slots;
+    size_t idx = home_idx(num_slots, service_id);
+    size_t i;
+
+    *free_idx = -1;
+
+    for (i = 0; i < num_slots; i++) {
+	struct shm_slot *slot = get_slot(writer->header, idx);
+	uint32_t state = atomic_load_explicit(&slot->state,
+					      memory_order_relaxed);
+
+	if (state == slot_state_empty) {
+	    if (*free_idx < 0)
+		*free_idx = idx;
+	    return -1;
+	}
+
+	if (state == slot_state_tombstone) {
+	    if (*free_idx < 0)
+		*free_idx = idx;
+	} else if (atomic_load_explicit(&slot->service_id,
+					memory_order_relaxed) == service_id)
+	    return idx;
+
+	idx = (idx + 1) % num_slots;
+    }
+
+    return -1;
+}
+
+static void fill_slot(struct shm_slot *slot, int64_t service_id,
+		      const char *rec, size_t rec_len)
+{
+    seq_write_begin(&slot->seq);
+
+    memcpy(slot->rec, rec, rec_len);
+    atomic_store_explicit(&slot->rec_len, rec_len, memory_order_relaxed);
+    atomic_store_explicit(&slot->service_id, service_id,
+			  memory_order_relaxed);
+    atomic_store_explicit(&slot->state, slot_state_used,
+			  memory_order_relaxed);
+
+    seq_write_end(&slot->seq);
+}
+
+static void set_slot_state(struct shm_slot *slot, enum slot_state state)
+{
+    seq_write_begin(&slot->seq);
+    atomic_store_explicit(&slot->state, state, memory_order_relaxed);
+    seq_write_end(&slot->seq);
+}
+
+/* Reinserts all services, to get rid of the tombstones. Must be
+   called with the table-wide sequence lock held. */
+static void rehash(struct shm_writer *writer)
+{
+    struct shm_header *header = writer->header;
+    struct srec_buf recs;
+    size_t i;
+
+    srec_buf_init(&recs);
+
+    for (i = 0; i < header->num_slots; i++) {
+	struct shm_slot *slot = get_slot(header, i);
+	uint32_t state = atomic_load_explicit(&slot->state,
+					      memory_order_relaxed);
+
+	if (state == slot_state_used) {
+	    size_t rec_len = atomic_load_explicit(&slot->rec_len,
+						  memory_order_relaxed);
+	    memcpy(srec_buf_reserve(&recs, rec_len), slot->rec, rec_len);
+	}
+
+	if (state != slot_state_empty)
+	    set_slot_state(slot, slot_state_empty);
+    }
+
+    size_t offset = 0;
+
+    while (offset < recs.len) {
+	struct srec rec;
+	ssize_t rec_len = srec_parse(recs.data + offset, recs.len - offset,
+				     &rec);
+
+	ut_assert(rec_len > 0);
+
+	ssize_t free_idx;
+	find_slot(writer, rec.service_id, &free_idx);
+
+	fill_slot(get_slot(header, free_idx), rec.service_id,
+		  recs.data + offset, rec_len);
+
+	props_destroy(rec.props);
+
+	offset += rec_len;
+    }
+
+    writer->num_tombstones = 0;
+
+    srec_buf_deinit(&recs);
+}
+
+static void set_omitted(struct shm_writer *writer, int64_t service_id,
+			bool omitted)
+{
+    bool was_omitted = omitted_map_has_key(writer->omitted, service_id);
+
+    if (omitted && !was_omitted)
+	omitted_map_add(writer->omitted, service_id, writer);
+    else if (!omitted && was_omitted)
+	omitted_map_del(writer->omitted, service_id);
+}
+
+static void put_service(struct shm_writer *writer,
+			const struct service *service)
+{
+    int64_t service_id = service_get_id(service);
+
+    writer->rec_buf.len = 0;
+    srec_add_service(&writer->rec_buf, ut_ftime(), service);
+
+    ssize_t free_idx;
+    ssize_t idx = find_slot(writer, service_id, &free_idx);
+
+    if (writer->rec_buf.len > SHM_MAX_RECORD) {
+	log_warn_c(writer->log_ctx, "Service %"PRIx64" is too large for "
+		   "the shared memory segment.", service_id);
+	if (idx >= 0) {
+	    set_slot_state(get_slot(writer->header, idx),
+			   slot_state_tombstone);
+	    writer->num_used--;
+	    writer->num_tombstones++;
+	}
+	set_omitted(writer, service_id, true);
+	return;
+    }
+
+    if (idx < 0) {
+	size_t num_slots = writer->header->num_slots;
+
+	if (writer->num_used + writer->num_tombstones >= MAX_LOAD(num_slots) &&
+	    writer->num_tombstones > 0) {
+	    rehash(writer);
+	    find_slot(writer, service_id, &free_idx);
+	}
+
+	if (free_idx < 0 || writer->num_used + 1 >= num_slots) {
+	    if (!writer->full)
+		log_warn_c(writer->log_ctx, "Shared memory segment is "
+			   "full. Leaving services out.");
+	    writer->full = true;
+	    set_omitted(writer, service_id, true);
+	    return;
+	}
+
+	struct shm_slot *slot = get_slot(writer->header, free_idx);
+
+	if (atomic_load_explicit(&slot->state, memory_order_relaxed) ==
+	    slot_state_tombstone)
+	    writer->num_tombstones--;
+
+	writer->num_used++;
+	idx = free_idx;
+    }
+
+    fill_slot(get_slot(writer->header, idx), service_id,
+	      writer->rec_buf.data, writer->rec_buf.len);
+
+    set_omitted(writer, service_id, false);
+}
+
+static void remove_service(struct shm_writer *writer, int64_t service_id)
+{
+    ssize_t free_idx;
+    ssize_t idx = find_slot(writer, service_id, &free_idx);
+
+    set_omitted(writer, service_id, false);
+
+    if (idx < 0)
+	return;
+
+    set_slot_state(get_slot(writer->header, idx), slot_state_tombstone);
+
+    writer->num_used--;
+    writer->num_tombstones++;
+    writer->full = false;
+}
+
+void shm_writer_change_cb(const struct service *service,
+			  enum service_change_type change_type,
+			  void *cb_data)
+{
+    struct shm_writer *writer = cb_data;
+    struct shm_header *header = writer->header;
+
+    pthread_mutex_lock(&writer->lock);
+
+    seq_write_begin(&header->seq);
+
+    if (change_type == service_change_type_removed)
+	remove_service(writer, service_get_id(service));
+    else
+	put_service(writer, service);
+
+    atomic_store_explicit(&header->num_services, writer->num_used,
+			  memory_order_relaxed);
+    atomic_store_explicit(&header->num_omitted,
+			  omitted_map_size(writer->omitted),
+			  memory_order_relaxed);
+
+    seq_write_end(&header->seq);
+
+    pthread_mutex_unlock(&writer->lock);
+}
+
+struct shm_reader
+{
+    char *name;
+    /* for testing for the writer's lock */
+    int fd;
+    struct shm_header *header;
+    size_t size;
+    ino_t ino;
+    struct srec_buf buf;
+};
+
+struct shm_reader *shm_reader_open(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY|O_CLOEXEC, 0);
+
+    if (fd < 0)
+	return NULL;
+
+    struct stat st;
+
+    if (fstat(fd, &st) < 0)
+	goto err_close;
+
+    if ((size_t)st.st_size < sizeof(struct shm_header)) {
+	errno = EINVAL;
+	goto err_close;
+    }
+
+    struct shm_header *header =
+	mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (header == MAP_FAILED)
+	goto err_close;
+
+    if (header->magic != SHM_MAGIC || header->version != SHM_VERSION ||
+	segment_size(header->num_slots) != (size_t)st.st_size) {
+	munmap(header, st.st_size);
+	errno = EINVAL;
+	goto err_close;
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+
+    struct shm_reader *reader = ut_malloc(sizeof(struct shm_reader));
+
+    *reader = (struct shm_reader) {
+	.name = ut_strdup(name),
+	.fd = fd,
+	.header = header,
+	.size = st.st_size,
+	.ino = st.st_ino
+    };
+
+    srec_buf_init(&reader->buf);
+
+    return reader;
+
+err_close:
+    UT_PROTECT_ERRNO(close(fd));
+    return NULL;
+}
+
+void shm_reader_close(struct shm_reader *reader)
+{
+    if (reader != NULL) {
+	munmap(reader->header, reader->size);
+	close(reader->fd);
+	srec_buf_deinit(&reader->buf);
+	ut_free(reader->name);
+	ut_free(reader);
+    }
+}
+
+bool shm_reader_is_stale(struct shm_reader *reader)
+{
+    return atomic_load(&reader->header->closed) ||
+	!has_writer(reader->fd) || !is_current(reader->name, reader->ino);
+}
+
+size_t shm_reader_num_omitted(struct shm_reader *reader)
+{
+    return atomic_load(&reader->header->num_omitted);
+}
+
+/* Appends the slot's record, if any, to the buffer. The caller
+   checks for concurrent changes. */
+static bool copy_slot(struct shm_slot *slot, struct srec_buf *buf)
+{
+    if (atomic_load_explicit(&slot->state, memory_order_relaxed) !=
+	slot_state_used)
+	return false;
+
+    size_t rec_len = atomic_load_explicit(&slot->rec_len,
+					  memory_order_relaxed);
+
+    /* may be garbage, if the slot is being changed */
+    if (rec_len > SHM_MAX_RECORD)
+	rec_len = SHM_MAX_RECORD;
+
+    memcpy(srec_buf_reserve(buf, rec_len), slot->rec, rec_len);
+
+    return true;
+}
+
+/* Only services in the table at the time are found. */
+static bool copy_service(struct shm_header *header, int64_t service_id,
+			 struct srec_buf *buf)
+{
+    size_t num_slots = header->num_slots;
+    size_t idx = home_idx(num_slots, service_id);
+    size_t i;
+
+    for (i = 0; i < num_slots; i++) {
+	struct shm_slot *slot = get_slot(header, idx);
+	uint32_t state = atomic_load_explicit(&slot->state,
+					      memory_order_relaxed);
+
+	if (state == slot_state_empty)
+	    return false;
+
+	if (state == slot_state_used &&
+	    atomic_load_explicit(&slot->service_id,
+				 memory_order_relaxed) == service_id)
+	    return copy_slot(slot, buf);
+
+	idx = (idx + 1) % num_slots;
+    }
+
+    return false;
+}
+
+int shm_reader_get(struct shm_reader *reader, int64_t service_id,
+		   struct srec *rec)
+{
+    struct shm_header *header = reader->header;
+    int attempt;
+
+    for (attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++) {
+	uint64_t seq;
+
+	if (seq_read_begin(header, &header->seq, &seq) < 0)
+	    return -1;
+
+	reader->buf.len = 0;
+	bool found = copy_service(header, service_id, &reader->buf);
+
+	if (seq_read_retry(&header->seq, seq))
+	    continue;
+
+	if (!found ||
+	    srec_parse(reader->buf.data, reader->buf.len, rec) < 0) {
+	    errno = ENOENT;
+	    return -1;
+	}
+
+	return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static int copy_consistent_slot(struct shm_header *header,
+				struct shm_slot *slot, struct srec_buf *buf)
+{
+    size_t start = buf->len;
+    int attempt;
+
+    for (attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++) {
+	uint64_t seq;
+
+	if (seq_read_begin(header, &slot->seq, &seq) < 0)
+	    return -1;
+
+	buf->len = start;
+	copy_slot(slot, buf);
+
+	if (!seq_read_retry(&slot->seq, seq))
+	    return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+static int copy_all(struct shm_header *header, bool slot_consistent,
+		    struct srec_buf *buf)
+{
+    size_t i;
+
+    for (i = 0; i < header->num_slots; i++) {
+	struct shm_slot *slot = get_slot(header, i);
+
+	if (!slot_consistent)
+	    copy_slot(slot, buf);
+	else if (copy_consistent_slot(header, slot, buf) < 0)
+	    return -1;
+    }
+
+    return 0;
+}
+
+static void deliver(const struct srec_buf *buf, const struct filter *filter,
+		    srec_cb cb, void *cb_data)
+{
+    size_t offset = 0;
+
+    while (offset < buf->len) {
+	struct srec rec;
+	ssize_t rec_len = srec_parse(buf->data + offset, buf->len - offset,
+				     &rec);
+
+	if (rec_len < 0)
+	    return;
+
+	if (filter == NULL || filter_matches(filter, rec.props))
+	    cb(&rec, cb_data);
+
+	props_destroy(rec.props);
+
+	offset += rec_len;
+    }
+}
+
+int shm_reader_foreach(struct shm_reader *reader, const struct filter *filter,
+		       srec_cb cb, void *cb_data)
+{
+    struct shm_header *header = reader->header;
+    int i;
+
+    for (i = 0; i < SNAPSHOT_ATTEMPTS; i++) {
+	uint64_t seq;
+
+	if (seq_read_begin(header, &header->seq, &seq) < 0)
+	    return -1;
+
+	reader->buf.len = 0;
+	copy_all(header, false, &reader->buf);
+
+	if (!seq_read_retry(&header->seq, seq)) {
+	    deliver(&reader->buf, filter, cb, cb_data);
+	    return 0;
+	}
+    }
+
+    reader->buf.len = 0;
+
+    if (copy_all(header, true, &reader->buf) < 0)
+	return -1;
+
+    deliver(&reader->buf, filter, cb, cb_data);
+
+    return 1;
+}
@@ -0,0 +1,82 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "filter.h"
+#include "log.h"
+#include "service.h"
+#include "srec.h"
+
+/* A read-only copy of a domain's services in a POSIX shared memory
+   segment, for co-located processes to look services up in without
+   any protocol round-trip.
+
+   The segment is a fixed-size open-addressing hash table, with one
+   service record per slot. Every slot, and the table as a whole, is
+   guarded by a sequence lock. The writer updates only the slot of the
+   service changed, and never waits for readers, which instead retry
+   their reads should they overlap with a change. A reader retries
+   only so many times, since the writer may have died in the middle
+   of a change, after which the reader functions below fail with
+   EAGAIN, and the reader is to be reopened. The same goes for a
+   closed segment. */
+
+#define SHM_DEFAULT_SLOTS 65536
+
+/* Service records, including properties, larger than this are left
+   out of the table. */
+#define SHM_MAX_RECORD 1008
+
+struct shm_writer;
+
+/* Fails with EEXIST if there is a segment of the same name, unless
+   its writer has gone away, by closing it or by dying, in which case
+   it is replaced. The segment is readable by the owner's group. */
+struct shm_writer *shm_writer_create(const char *name, size_t num_slots,
+				     const struct log_ctx *log_ctx);
+/* Marks the segment closed, for readers to notice, and removes its
+   name. */
+void shm_writer_destroy(struct shm_writer *writer);
+
+/* For use with shards_add_change_cb(). May be called from any
+   thread. */
+void shm_writer_change_cb(const struct service *service,
+			  enum service_change_type change_type,
+			  void *cb_data);
+
+struct shm_reader;
+
+struct shm_reader *shm_reader_open(const char *name);
+void shm_reader_close(struct shm_reader *reader);
+
+/* True if the writer has closed the segment, has died, or has been
+   replaced, in which case the reader should be reopened. */
+bool shm_reader_is_stale(struct shm_reader *reader);
+
+/* The number of services left out of the table, for being too large,
+   or for the table being full. If non-zero, the table is incomplete,
+   and the protocol is to be used for anything not found in it. */
+size_t shm_reader_num_omitted(struct shm_reader *reader);
+
+/* Returns -1, with errno set to ENOENT, if there is no such service
+   in the table. Otherwise, 'rec' holds a copy of the service's
+   current state, the properties of which are owned by the caller. */
+int shm_reader_get(struct shm_reader *reader, int64_t service_id,
+		   struct srec *rec);
+
+/* Calls 'cb' for every service matching the filter (or every
+   service, if 'filter' is NULL), as of a single point in time. Should
+   the table be too busy for such a snapshot, the services are instead
+   read one at a time, and 1 is returned, rather than 0. Returns -1 on
+   failure. */
+int shm_reader_foreach(struct shm_reader *reader, const struct filter *filter,
+		       srec_cb cb, void *cb_data);
+
+#endif
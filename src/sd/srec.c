@@ -0,0 +1,259 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <string.h>
+
+#include "util.h"
+
+#include "srec.h"
+
+#define INITIAL_CAPACITY 4096
+
+struct srec_header
+{
+    /* including the properties */
+    uint32_t len;
+    uint32_t type;
+    double time;
+    int64_t service_id;
+    int64_t generation;
+    int64_t ttl;
+    int64_t client_id;
+    double orphan_since;
+    uint32_t num_props;
+    uint32_t reserved;
+};
+
+enum { prop_type_int64, prop_type_str };
+
+/* Followed by the NUL-terminated name, and for strings, the
+   NUL-terminated value. */
+struct srec_prop
+{
+    uint32_t name_size;
+    uint32_t type;
+    /* the value, or for strings, the size of the value */
+    int64_t value;
+};
+
+void srec_buf_init(struct srec_buf *buf)
+{
+    *buf = (struct srec_buf) {};
+}
+
+void srec_buf_deinit(struct srec_buf *buf)
+{
+    ut_free(buf->data);
+}
+
+void *srec_buf_reserve(struct srec_buf *buf, size_t len)
+{
+    size_t offset = SREC_ALIGN(buf->len);
+    size_t end = offset + len;
+
+    if (end > buf->capacity) {
+	size_t old_capacity = buf->capacity;
+
+	if (buf->capacity == 0)
+	    buf->capacity = INITIAL_CAPACITY;
+
+	while (end > buf->capacity)
+	    buf->capacity *= 2;
+
+	buf->data = ut_realloc(buf->data, buf->capacity);
+	memset(buf->data + old_capacity, 0, buf->capacity - old_capacity);
+    }
+
+    buf->len = end;
+
+    return buf->data + offset;
+}
+
+struct add_prop_param
+{
+    struct srec_buf *buf;
+    uint32_t num_props;
+};
+
+static bool add_prop(const char *name, const struct pvalue *value,
+		     void *cb_data)
+{
+    struct add_prop_param *param = cb_data;
+
+    size_t name_size = strlen(name) + 1;
+    bool is_str = pvalue_is_str(value);
+    size_t str_size = is_str ? strlen(pvalue_str(value)) + 1 : 0;
+
+    char *data = srec_buf_reserve(param->buf, sizeof(struct srec_prop) +
+				  name_size + str_size);
+
+    struct srec_prop prop = {
+	.name_size = name_size,
+	.type = is_str ? prop_type_str : prop_type_int64,
+	.value = is_str ? (int64_t)str_size : pvalue_int64(value)
+    };
+
+    memcpy(data, &prop, sizeof(prop));
+    memcpy(data + sizeof(prop), name, name_size);
+
+    if (is_str)
+	memcpy(data + sizeof(prop) + name_size, pvalue_str(value), str_size);
+
+    param->num_props++;
+
+    return true;
+}
+
+void srec_add_service(struct srec_buf *buf, double time,
+		      const struct service *service)
+{
+    size_t offset = (char *)srec_buf_reserve(buf, sizeof(struct srec_header))
+	- buf->data;
+
+    struct add_prop_param param = {
+	.buf = buf
+    };
+
+    props_foreach(service_get_props(service), add_prop, &param);
+
+    buf->len = SREC_ALIGN(buf->len);
+
+    struct srec_header header = {
+	.len = buf->len - offset,
+	.type = srec_type_service,
+	.time = time,
+	.service_id = service_get_id(service),
+	.generation = service_get_generation(service),
+	.ttl = service_get_ttl(service),
+	.client_id = service_get_client_id(service),
+	.orphan_since = service_is_orphan(service) ?
+	    service_get_orphan_since(service) : -1,
+	.num_props = param.num_props
+    };
+
+    /* the buffer may have been moved */
+    memcpy(buf->data + offset, &header, sizeof(header));
+}
+
+void srec_add_removed(struct srec_buf *buf, double time, int64_t service_id)
+{
+    struct srec_header header = {
+	.len = sizeof(struct srec_header),
+	.type = srec_type_removed,
+	.time = time,
+	.service_id = service_id
+    };
+
+    memcpy(srec_buf_reserve(buf, sizeof(header)), &header, sizeof(header));
+}
+
+size_t srec_len(const char *data)
+{
+    uint32_t len;
+
+    memcpy(&len, data, sizeof(len));
+
+    return len;
+}
+
+static bool is_terminated(const char *s, size_t size)
+{
+    return size > 0 && s[size - 1] == '\0' && strlen(s) == size - 1;
+}
+
+/* Returns NULL if the properties are malformed. */
+static struct props *parse_props(const char *data, size_t len,
+				 uint32_t num_props)
+{
+    struct props *props = props_create();
+    size_t offset = 0;
+    uint32_t i;
+
+    for (i = 0; i < num_props; i++) {
+	struct srec_prop prop;
+
+	if (len - offset < sizeof(prop))
+	    goto err;
+
+	memcpy(&prop, data + offset, sizeof(prop));
+	offset += sizeof(prop);
+
+	const char *name = data + offset;
+
+	if (len - offset < prop.name_size ||
+	    !is_terminated(name, prop.name_size))
+	    goto err;
+
+	offset += prop.name_size;
+
+	if (prop.type == prop_type_int64)
+	    props_add_int64(props, name, prop.value);
+	else if (prop.type == prop_type_str) {
+	    const char *value = data + offset;
+
+	    if (prop.value < 0 || len - offset < (uint64_t)prop.value ||
+		!is_terminated(value, prop.value))
+		goto err;
+
+	    props_add_str(props, name, value);
+
+	    offset += prop.value;
+	} else
+	    goto err;
+
+	offset = SREC_ALIGN(offset);
+
+	if (offset > len)
+	    goto err;
+    }
+
+    return props;
+
+err:
+    props_destroy(props);
+    return NULL;
+}
+
+ssize_t srec_parse(const char *data, size_t len, struct srec *rec)
+{
+    struct srec_header header;
+
+    if (len < sizeof(header))
+	return -1;
+
+    memcpy(&header, data, sizeof(header));
+
+    if (header.len < sizeof(header) || header.len > len ||
+	header.len != SREC_ALIGN(header.len))
+	return -1;
+
+    *rec = (struct srec) {
+	.type = header.type,
+	.time = header.time,
+	.service_id = header.service_id
+    };
+
+    switch (header.type) {
+    case srec_type_service:
+	rec->props = parse_props(data + sizeof(header),
+				 header.len - sizeof(header),
+				 header.num_props);
+
+	if (rec->props == NULL)
+	    return -1;
+
+	rec->generation = header.generation;
+	rec->ttl = header.ttl;
+	rec->client_id = header.client_id;
+	rec->orphan_since = header.orphan_since;
+	break;
+    case srec_type_removed:
+	break;
+    default:
+	return -1;
+    }
+
+    return header.len;
+}
@@ -0,0 +1,71 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef SREC_H
+#define SREC_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "props.h"
+#include "service.h"
+
+/* Binary service records, as stored in the state file and the
+   journal. Records are in native byte order, and 8-byte aligned. */
+
+enum srec_type {
+    srec_type_service = 1,
+    srec_type_removed = 2
+};
+
+struct srec
+{
+    enum srec_type type;
+    double time;
+    int64_t service_id;
+    /* the below are only set for srec_type_service */
+    int64_t generation;
+    struct props *props;
+    int64_t ttl;
+    int64_t client_id;
+    /* negative for services which are not orphans */
+    double orphan_since;
+};
+
+struct srec_buf
+{
+    char *data;
+    size_t len;
+    size_t capacity;
+};
+
+#define SREC_ALIGNMENT 8
+#define SREC_ALIGN(len) \
+    (((len) + SREC_ALIGNMENT - 1) & ~((size_t)SREC_ALIGNMENT - 1))
+
+void srec_buf_init(struct srec_buf *buf);
+void srec_buf_deinit(struct srec_buf *buf);
+
+/* Returns a zeroed, aligned, region of 'len' bytes at the end of the
+   buffer. */
+void *srec_buf_reserve(struct srec_buf *buf, size_t len);
+
+void srec_add_service(struct srec_buf *buf, double time,
+		      const struct service *service);
+void srec_add_removed(struct srec_buf *buf, double time,
+		      int64_t service_id);
+
+/* The length of the record starting at 'data', which must have been
+   produced by this module. */
+size_t srec_len(const char *data);
+
+typedef void (*srec_cb)(const struct srec *rec, void *cb_data);
+
+/* Returns the length of the record at 'data', or -1 if it's
+   malformed or truncated. The caller owns the record's properties. */
+ssize_t srec_parse(const char *data, size_t len, struct srec *rec);
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "pmap.h"
+#include "util.h"
+
+#include "srec_table.h"
+
+struct table_service
+{
+    int64_t generation;
+    struct props *props;
+    int64_t ttl;
+    int64_t client_id;
+    double orphan_since;
+};
+
+PMAP_GEN_WRAPPER(table_service_map, struct table_service_map, int64_t,
+		 struct table_service, static __attribute__((unused)))
+
+struct srec_table
+{
+    struct table_service_map *services;
+    double last_known;
+};
+
+static void table_service_destroy(struct table_service *service)
+{
+    if (service != NULL) {
+	props_destroy(service->props);
+	ut_free(service);
+    }
+}
+
+static bool destroy_service_cb(int64_t service_id,
+			       struct table_service *service, void *cb_data)
+{
+    table_service_destroy(service);
+
+    return true;
+}
+
+struct srec_table *srec_table_create(void)
+{
+    struct srec_table *table = ut_malloc(sizeof(struct srec_table));
+
+    *table = (struct srec_table) {
+	.services = table_service_map_create()
+    };
+
+    return table;
+}
+
+void srec_table_destroy(struct srec_table *table)
+{
+    if (table != NULL) {
+	srec_table_clear(table);
+	table_service_map_destroy(table->services);
+	ut_free(table);
+    }
+}
+
+void srec_table_apply(struct srec_table *table, const struct srec *rec)
+{
+    if (rec->time > table->last_known)
+	table->last_known = rec->time;
+
+    struct table_service *prev =
+	table_service_map_get(table->services, rec->service_id);
+
+    if (prev != NULL) {
+	table_service_map_del(table->services, rec->service_id);
+	table_service_destroy(prev);
+    }
+
+    if (rec->type != srec_type_service)
+	return;
+
+    struct table_service *service = ut_malloc(sizeof(struct table_service));
+
+    *service = (struct table_service) {
+	.generation = rec->generation,
+	.props = props_clone(rec->props),
+	.ttl = rec->ttl,
+	.client_id = rec->client_id,
+	.orphan_since = rec->orphan_since
+    };
+
+    table_service_map_add(table->services, rec->service_id, service);
+}
+
+void srec_table_clear(struct srec_table *table)
+{
+    table_service_map_foreach(table->services, destroy_service_cb, NULL);
+    table_service_map_clear(table->services);
+}
+
+size_t srec_table_size(const struct srec_table *table)
+{
+    return table_service_map_size(table->services);
+}
+
+double srec_table_last_known(const struct srec_table *table)
+{
+    return table->last_known;
+}
+
+struct restore_param
+{
+    struct shards *shards;
+    double orphan_since;
+    double now;
+    size_t num_restored;
+    size_t num_expired;
+};
+
+static bool restore_cb(int64_t service_id, struct table_service *service,
+		       void *cb_data)
+{
+    struct restore_param *param = cb_data;
+
+    double orphan_since = service->orphan_since >= 0 ?
+	service->orphan_since : param->orphan_since;
+
+    if (orphan_since + service->ttl <= param->now)
+	param->num_expired++;
+    else {
+	shards_restore(param->shards, service->client_id, service_id,
+		       service->generation, service->props, service->ttl,
+		       orphan_since);
+	param->num_restored++;
+    }
+
+    return true;
+}
+
+size_t srec_table_restore(struct srec_table *table, struct shards *shards,
+			  double orphan_since, size_t *num_expired)
+{
+    struct restore_param param = {
+	.shards = shards,
+	.orphan_since = orphan_since,
+	.now = ut_ftime()
+    };
+
+    table_service_map_foreach(table->services, restore_cb, &param);
+
+    srec_table_clear(table);
+
+    *num_expired = param.num_expired;
+
+    return param.num_restored;
+}
@@ -0,0 +1,38 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef SREC_TABLE_H
+#define SREC_TABLE_H
+
+#include <stddef.h>
+
+#include "shards.h"
+#include "srec.h"
+
+/* The latest known state of a set of services, built from a stream
+   of service records (e.g., from a state file and a journal, or a
+   replication connection). */
+struct srec_table;
+
+struct srec_table *srec_table_create(void);
+void srec_table_destroy(struct srec_table *table);
+
+void srec_table_apply(struct srec_table *table, const struct srec *rec);
+void srec_table_clear(struct srec_table *table);
+
+size_t srec_table_size(const struct srec_table *table);
+
+/* The time of the most recent record applied. */
+double srec_table_last_known(const struct srec_table *table);
+
+/* Restores all services into 'shards' as orphans, and empties the
+   table. Services not orphaned in the table are considered orphans
+   since 'orphan_since'. Services whose time has already run out are
+   skipped, and counted in 'num_expired'. Returns the number of
+   services restored. */
+size_t srec_table_restore(struct srec_table *table, struct shards *shards,
+			  double orphan_since, size_t *num_expired);
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#include "state_file.h"
+
+#define STATE_MAGIC "TPAFSTAT"
+#define STATE_VERSION 1
+/* Written in native byte order, which the loader verifies */
+#define STATE_BYTE_ORDER UINT32_C(0x01020304)
+
+struct state_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    double saved_at;
+    uint64_t num_services;
+    uint64_t journal_seq;
+};
+
+struct state_writer
+{
+    struct srec_buf buf;
+    uint64_t num_services;
+    uint64_t journal_seq;
+};
+
+struct state_writer *state_writer_create(uint64_t journal_seq)
+{
+    struct state_writer *writer = ut_malloc(sizeof(struct state_writer));
+
+    *writer = (struct state_writer) {
+	.journal_seq = journal_seq
+    };
+
+    srec_buf_init(&writer->buf);
+    srec_buf_reserve(&writer->buf, sizeof(struct state_header));
+
+    return writer;
+}
+
+void state_writer_destroy(struct state_writer *writer)
+{
+    if (writer != NULL) {
+	srec_buf_deinit(&writer->buf);
+	ut_free(writer);
+    }
+}
+
+void state_writer_add(struct state_writer *writer,
+		      const struct service *service)
+{
+    srec_add_service(&writer->buf, 0, service);
+
+    writer->num_services++;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+	ssize_t rc = write(fd, buf, len);
+
+	if (rc < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+
+	buf += rc;
+	len -= rc;
+    }
+
+    return 0;
+}
+
+int state_writer_save(struct state_writer *writer, const char *path,
+		      const struct log_ctx *log_ctx)
+{
+    struct state_header header = {
+	.magic = STATE_MAGIC,
+	.version = STATE_VERSION,
+	.byte_order = STATE_BYTE_ORDER,
+	.saved_at = ut_ftime(),
+	.num_services = writer->num_services,
+	.journal_seq = writer->journal_seq
+    };
+
+    memcpy(writer->buf.data, &header, sizeof(header));
+
+    char *tmp_path = ut_asprintf("%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+
+    if (fd < 0) {
+	log_error_c(log_ctx, "Unable to open state file \"%s\": %s.",
+		    tmp_path, strerror(errno));
+	goto err_free;
+    }
+
+    if (write_all(fd, writer->buf.data, writer->buf.len) < 0 ||
+	fsync(fd) < 0) {
+	log_error_c(log_ctx, "Error writing state file \"%s\": %s.",
+		    tmp_path, strerror(errno));
+	goto err_close;
+    }
+
+    close(fd);
+
+    if (rename(tmp_path, path) < 0) {
+	log_error_c(log_ctx, "Unable to rename state file \"%s\" to "
+		    "\"%s\": %s.", tmp_path, path, strerror(errno));
+	goto err_unlink;
+    }
+
+    log_debug_c(log_ctx, "Saved %"PRIu64" services to \"%s\".",
+		writer->num_services, path);
+
+    ut_free(tmp_path);
+
+    return 0;
+
+err_close:
+    close(fd);
+err_unlink:
+    unlink(tmp_path);
+err_free:
+    ut_free(tmp_path);
+    return -1;
+}
+
+static ssize_t load_records(const char *data, size_t len,
+			    struct state_info *info, srec_cb cb,
+			    void *cb_data, const struct log_ctx *log_ctx)
+{
+    struct state_header header;
+
+    if (len < sizeof(header))
+	goto err_format;
+
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0 ||
+	header.byte_order != STATE_BYTE_ORDER)
+	goto err_format;
+
+    if (header.version != STATE_VERSION) {
+	log_error_c(log_ctx, "Unsupported state file version %"PRIu32".",
+		    header.version);
+	return -1;
+    }
+
+    size_t offset = SREC_ALIGN(sizeof(header));
+    uint64_t i;
+
+    for (i = 0; i < header.num_services; i++) {
+	struct srec rec;
+
+	ssize_t rec_len = srec_parse(data + offset, len - offset, &rec);
+
+	if (rec_len < 0)
+	    goto err_format;
+
+	if (rec.type != srec_type_service) {
+	    props_destroy(rec.props);
+	    goto err_format;
+	}
+
+	rec.time = header.saved_at;
+
+	cb(&rec, cb_data);
+
+	props_destroy(rec.props);
+
+	offset += rec_len;
+    }
+
+    *info = (struct state_info) {
+	.saved_at = header.saved_at,
+	.journal_seq = header.journal_seq
+    };
+
+    return header.num_services;
+
+err_format:
+    log_error_c(log_ctx, "State file is malformed.");
+    return -1;
+}
+
+ssize_t state_load(const char *path, struct state_info *info, srec_cb cb,
+		   void *cb_data, const struct log_ctx *log_ctx)
+{
+    *info = (struct state_info) {};
+
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+
+    if (fd < 0) {
+	if (errno == ENOENT)
+	    return 0;
+
+	log_error_c(log_ctx, "Unable to open state file \"%s\": %s.",
+		    path, strerror(errno));
+	return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) < 0) {
+	log_error_c(log_ctx, "Unable to stat state file \"%s\": %s.",
+		    path, strerror(errno));
+	close(fd);
+	return -1;
+    }
+
+    if (st.st_size == 0) {
+	close(fd);
+	return 0;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (data == MAP_FAILED) {
+	log_error_c(log_ctx, "Unable to map state file \"%s\": %s.",
+		    path, strerror(errno));
+	return -1;
+    }
+
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    ssize_t rc = load_records(data, st.st_size, info, cb, cb_data, log_ctx);
+
+    munmap(data, st.st_size);
+
+    return rc;
+}
@@ -0,0 +1,49 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef STATE_FILE_H
+#define STATE_FILE_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "service.h"
+#include "srec.h"
+
+/* A compact binary file holding a domain's services, allowing them
+   to survive a server restart. The file is memory mapped when
+   loaded, and consists of a header followed by one service record
+   per service. */
+struct state_writer;
+
+/* Marks a state file saved without a journal */
+#define STATE_NO_JOURNAL UINT64_MAX
+
+/* 'journal_seq' is the first journal file holding changes not
+   (necessarily) included in the state file. */
+struct state_writer *state_writer_create(uint64_t journal_seq);
+void state_writer_destroy(struct state_writer *writer);
+
+void state_writer_add(struct state_writer *writer,
+		      const struct service *service);
+
+/* Atomically replaces the file at 'path' with the services added so
+   far. */
+int state_writer_save(struct state_writer *writer, const char *path,
+		      const struct log_ctx *log_ctx);
+
+struct state_info
+{
+    double saved_at;
+    uint64_t journal_seq;
+};
+
+/* Returns the number of services loaded. A missing file is treated
+   as an empty one, with a zero 'journal_seq'. */
+ssize_t state_load(const char *path, struct state_info *info, srec_cb cb,
+		   void *cb_data, const struct log_ctx *log_ctx);
+
+#endif
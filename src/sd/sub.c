@@ -111,6 +111,12 @@ void sub_notify(struct sub *sub, enum service_change_type change_type,
     }
 }
 
+void sub_match(struct sub *sub, const struct service *service,
+	       enum sub_match_type match_type)
+{
+    sub->match_cb(sub, service, match_type, sub->match_cb_data);
+}
+
 int64_t sub_get_sub_id(const struct sub *sub)
 {
     return sub->sub_id;
@@ -29,6 +29,11 @@ void sub_dec_ref(struct sub *sub);
 void sub_notify(struct sub *sub, enum service_change_type change_type,
 		const struct service *service);
 
+/* Reports a match found elsewhere, e.g. by a replica of the
+   subscription. */
+void sub_match(struct sub *sub, const struct service *service,
+	       enum sub_match_type match_type);
+
 int64_t sub_get_sub_id(const struct sub *sub);
 
 const struct filter *sub_get_filter(const struct sub *sub);
@@ -0,0 +1,162 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "util.h"
+
+#include "ebr.h"
+
+#define CACHE_LINE_SIZE 64
+
+#define IDLE UINT64_MAX
+
+/* Padded, to keep readers from sharing cache lines */
+struct reader
+{
+    /* the epoch observed when entering, or IDLE */
+    atomic_uint_fast64_t epoch;
+    char pad[CACHE_LINE_SIZE - sizeof(atomic_uint_fast64_t)];
+};
+
+struct retired
+{
+    void *ptr;
+    ebr_free_fn free_fn;
+    uint64_t epoch;
+    double retired_at;
+};
+
+struct ebr
+{
+    atomic_uint_fast64_t epoch;
+
+    struct reader *readers;
+    size_t num_readers;
+
+    /* in order of retirement, and thus epoch */
+    struct retired *retired;
+    size_t num_retired;
+    size_t retired_capacity;
+};
+
+struct ebr *ebr_create(size_t max_readers)
+{
+    struct ebr *ebr = ut_calloc(sizeof(struct ebr));
+
+    atomic_init(&ebr->epoch, 0);
+
+    ebr->readers = ut_calloc(sizeof(struct reader) *
+			     (max_readers > 0 ? max_readers : 1));
+    ebr->num_readers = max_readers;
+
+    size_t i;
+    for (i = 0; i < max_readers; i++)
+	atomic_init(&ebr->readers[i].epoch, IDLE);
+
+    return ebr;
+}
+
+static void free_retired(struct ebr *ebr, size_t num)
+{
+    size_t i;
+    for (i = 0; i < num; i++)
+	ebr->retired[i].free_fn(ebr->retired[i].ptr);
+
+    ebr->num_retired -= num;
+    memmove(ebr->retired, ebr->retired + num,
+	    sizeof(struct retired) * ebr->num_retired);
+}
+
+void ebr_destroy(struct ebr *ebr)
+{
+    if (ebr != NULL) {
+	free_retired(ebr, ebr->num_retired);
+	ut_free(ebr->retired);
+	ut_free(ebr->readers);
+	ut_free(ebr);
+    }
+}
+
+void ebr_enter(struct ebr *ebr, size_t reader_idx)
+{
+    ut_assert(reader_idx < ebr->num_readers);
+
+    struct reader *reader = &ebr->readers[reader_idx];
+
+    /* Sequentially consistent, so the writer either sees the reader
+       as active, or the reader sees everything unlinked up to the
+       point the writer moved the epoch forward. */
+    atomic_store(&reader->epoch, atomic_load(&ebr->epoch));
+}
+
+void ebr_leave(struct ebr *ebr, size_t reader_idx)
+{
+    atomic_store_explicit(&ebr->readers[reader_idx].epoch, IDLE,
+			  memory_order_release);
+}
+
+void ebr_retire(struct ebr *ebr, void *ptr, ebr_free_fn free_fn)
+{
+    if (ebr->num_retired == ebr->retired_capacity) {
+	ebr->retired_capacity =
+	    ebr->retired_capacity > 0 ? 2 * ebr->retired_capacity : 64;
+	ebr->retired = ut_realloc(ebr->retired, sizeof(struct retired) *
+				  ebr->retired_capacity);
+    }
+
+    ebr->retired[ebr->num_retired] = (struct retired) {
+	.ptr = ptr,
+	.free_fn = free_fn,
+	.epoch = atomic_load_explicit(&ebr->epoch, memory_order_relaxed),
+	.retired_at = ut_ftime()
+    };
+    ebr->num_retired++;
+}
+
+size_t ebr_reclaim(struct ebr *ebr)
+{
+    if (ebr->num_retired == 0)
+	return 0;
+
+    /* Readers entering from now on can't see anything retired so
+       far. */
+    atomic_fetch_add(&ebr->epoch, 1);
+
+    uint64_t min_epoch = IDLE;
+
+    size_t i;
+    for (i = 0; i < ebr->num_readers; i++) {
+	uint64_t epoch = atomic_load(&ebr->readers[i].epoch);
+
+	if (epoch < min_epoch)
+	    min_epoch = epoch;
+    }
+
+    size_t num_reclaimable = 0;
+
+    while (num_reclaimable < ebr->num_retired &&
+	   ebr->retired[num_reclaimable].epoch < min_epoch)
+	num_reclaimable++;
+
+    free_retired(ebr, num_reclaimable);
+
+    return ebr->num_retired;
+}
+
+size_t ebr_pending(const struct ebr *ebr)
+{
+    return ebr->num_retired;
+}
+
+double ebr_max_delay(const struct ebr *ebr)
+{
+    if (ebr->num_retired == 0)
+	return 0;
+
+    return ut_ftime() - ebr->retired[0].retired_at;
+}
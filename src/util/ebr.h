@@ -0,0 +1,44 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef EBR_H
+#define EBR_H
+
+#include <stddef.h>
+
+/* Epoch-based reclamation, allowing reader threads to access data
+   structures which a single writer thread updates by copying. Memory
+   unlinked by the writer is retired, and freed only once no reader
+   may still hold a reference to it.
+
+   Readers must not block while between ebr_enter() and ebr_leave(),
+   since doing so delays reclamation. */
+struct ebr;
+
+struct ebr *ebr_create(size_t max_readers);
+/* Frees all retired memory. No reader may be active. */
+void ebr_destroy(struct ebr *ebr);
+
+/* 'reader_idx' identifies the reader, and must be less than
+   'max_readers'. A particular index may only be used by one thread
+   at a time. */
+void ebr_enter(struct ebr *ebr, size_t reader_idx);
+void ebr_leave(struct ebr *ebr, size_t reader_idx);
+
+typedef void (*ebr_free_fn)(void *ptr);
+
+/* Writer-side functions */
+void ebr_retire(struct ebr *ebr, void *ptr, ebr_free_fn free_fn);
+
+/* Frees retired memory no reader may still be referencing. Returns
+   the number of items still awaiting reclamation. */
+size_t ebr_reclaim(struct ebr *ebr);
+
+size_t ebr_pending(const struct ebr *ebr);
+/* The time, in seconds, the oldest not-yet-reclaimed item has been
+   retired, or zero if there is no such item. */
+double ebr_max_delay(const struct ebr *ebr);
+
+#endif
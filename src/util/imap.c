@@ -0,0 +1,403 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <string.h>
+
+#include "util.h"
+
+#include "imap.h"
+
+#define BITS_PER_LEVEL 5
+#define WIDTH (1 << BITS_PER_LEVEL)
+#define LEVEL_MASK (WIDTH - 1)
+
+struct leaf
+{
+    int64_t key;
+    void *value;
+};
+
+/* A node holds leaves and children, in that order, directly after
+   the header. Which slots are in use is given by the bitmaps. */
+struct node
+{
+    uint32_t leafmap;
+    uint32_t nodemap;
+};
+
+struct imap
+{
+    struct node *root;
+    size_t size;
+};
+
+/* An expanded, mutable, form of a node */
+struct slots
+{
+    uint32_t leafmap;
+    uint32_t nodemap;
+    struct leaf leaves[WIDTH];
+    struct node *children[WIDTH];
+};
+
+/* A bijection, so distinct keys never collide */
+static uint64_t hash_key(int64_t key)
+{
+    uint64_t x = (uint64_t)key;
+
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    x = x ^ (x >> 31);
+
+    return x;
+}
+
+static unsigned slot_idx(uint64_t hash, unsigned depth)
+{
+    return (hash >> (depth * BITS_PER_LEVEL)) & LEVEL_MASK;
+}
+
+static unsigned num_leaves(const struct node *node)
+{
+    return __builtin_popcount(node->leafmap);
+}
+
+static unsigned num_children(const struct node *node)
+{
+    return __builtin_popcount(node->nodemap);
+}
+
+static struct leaf *node_leaves(const struct node *node)
+{
+    return (struct leaf *)(node + 1);
+}
+
+static struct node **node_children(const struct node *node)
+{
+    return (struct node **)(node_leaves(node) + num_leaves(node));
+}
+
+static unsigned pos(uint32_t map, unsigned idx)
+{
+    return __builtin_popcount(map & ((UINT32_C(1) << idx) - 1));
+}
+
+static void decode(const struct node *node, struct slots *slots)
+{
+    slots->leafmap = node->leafmap;
+    slots->nodemap = node->nodemap;
+
+    unsigned idx;
+    for (idx = 0; idx < WIDTH; idx++) {
+	uint32_t bit = UINT32_C(1) << idx;
+
+	if (node->leafmap & bit)
+	    slots->leaves[idx] = node_leaves(node)[pos(node->leafmap, idx)];
+	else if (node->nodemap & bit)
+	    slots->children[idx] =
+		node_children(node)[pos(node->nodemap, idx)];
+    }
+}
+
+/* Returns NULL for an empty node. */
+static struct node *encode(const struct slots *slots)
+{
+    if (slots->leafmap == 0 && slots->nodemap == 0)
+	return NULL;
+
+    unsigned leaves_len = __builtin_popcount(slots->leafmap);
+    unsigned children_len = __builtin_popcount(slots->nodemap);
+
+    struct node *node =
+	ut_malloc(sizeof(struct node) + sizeof(struct leaf) * leaves_len +
+		  sizeof(struct node *) * children_len);
+
+    node->leafmap = slots->leafmap;
+    node->nodemap = slots->nodemap;
+
+    struct leaf *leaves = node_leaves(node);
+    struct node **children = node_children(node);
+
+    unsigned idx;
+    for (idx = 0; idx < WIDTH; idx++) {
+	uint32_t bit = UINT32_C(1) << idx;
+
+	if (slots->leafmap & bit)
+	    *leaves++ = slots->leaves[idx];
+	else if (slots->nodemap & bit)
+	    *children++ = slots->children[idx];
+    }
+
+    return node;
+}
+
+static struct node *create_pair(unsigned depth, const struct leaf *leaf_a,
+				const struct leaf *leaf_b)
+{
+    unsigned idx_a = slot_idx(hash_key(leaf_a->key), depth);
+    unsigned idx_b = slot_idx(hash_key(leaf_b->key), depth);
+
+    struct slots slots = {};
+
+    if (idx_a == idx_b) {
+	slots.nodemap = UINT32_C(1) << idx_a;
+	slots.children[idx_a] = create_pair(depth + 1, leaf_a, leaf_b);
+    } else {
+	slots.leafmap = (UINT32_C(1) << idx_a) | (UINT32_C(1) << idx_b);
+	slots.leaves[idx_a] = *leaf_a;
+	slots.leaves[idx_b] = *leaf_b;
+    }
+
+    return encode(&slots);
+}
+
+static struct node *node_put(struct node *node, unsigned depth,
+			     uint64_t hash, const struct leaf *leaf,
+			     void **old_value, struct ebr *ebr)
+{
+    struct slots slots = {};
+
+    if (node != NULL)
+	decode(node, &slots);
+
+    unsigned idx = slot_idx(hash, depth);
+    uint32_t bit = UINT32_C(1) << idx;
+
+    if (slots.leafmap & bit) {
+	if (slots.leaves[idx].key == leaf->key) {
+	    *old_value = slots.leaves[idx].value;
+	    slots.leaves[idx].value = leaf->value;
+	} else {
+	    slots.leafmap &= ~bit;
+	    slots.nodemap |= bit;
+	    slots.children[idx] =
+		create_pair(depth + 1, &slots.leaves[idx], leaf);
+	}
+    } else if (slots.nodemap & bit)
+	slots.children[idx] = node_put(slots.children[idx], depth + 1, hash,
+				       leaf, old_value, ebr);
+    else {
+	slots.leafmap |= bit;
+	slots.leaves[idx] = *leaf;
+    }
+
+    if (node != NULL)
+	ebr_retire(ebr, node, ut_free);
+
+    return encode(&slots);
+}
+
+/* Returns 'node' if the key was not found. */
+static struct node *node_del(struct node *node, unsigned depth,
+			     uint64_t hash, int64_t key, void **old_value,
+			     struct ebr *ebr)
+{
+    unsigned idx = slot_idx(hash, depth);
+    uint32_t bit = UINT32_C(1) << idx;
+
+    struct slots slots;
+    decode(node, &slots);
+
+    if (slots.leafmap & bit) {
+	if (slots.leaves[idx].key != key)
+	    return node;
+
+	*old_value = slots.leaves[idx].value;
+	slots.leafmap &= ~bit;
+    } else if (slots.nodemap & bit) {
+	struct node *child = slots.children[idx];
+	struct node *new_child =
+	    node_del(child, depth + 1, hash, key, old_value, ebr);
+
+	if (new_child == child)
+	    return node;
+
+	if (new_child == NULL)
+	    slots.nodemap &= ~bit;
+	else if (num_leaves(new_child) == 1 && num_children(new_child) == 0) {
+	    /* Pull up the lone leaf. The new child has never been
+	       visible to any reader. */
+	    slots.nodemap &= ~bit;
+	    slots.leafmap |= bit;
+	    slots.leaves[idx] = node_leaves(new_child)[0];
+	    ut_free(new_child);
+	} else
+	    slots.children[idx] = new_child;
+    } else
+	return node;
+
+    ebr_retire(ebr, node, ut_free);
+
+    return encode(&slots);
+}
+
+struct imap *imap_create(void)
+{
+    return ut_calloc(sizeof(struct imap));
+}
+
+static void node_destroy(struct node *node, ebr_free_fn value_free)
+{
+    unsigned i;
+
+    for (i = 0; i < num_leaves(node); i++)
+	value_free(node_leaves(node)[i].value);
+
+    for (i = 0; i < num_children(node); i++)
+	node_destroy(node_children(node)[i], value_free);
+
+    ut_free(node);
+}
+
+void imap_destroy(struct imap *map, ebr_free_fn value_free)
+{
+    if (map != NULL) {
+	if (map->root != NULL)
+	    node_destroy(map->root, value_free);
+	ut_free(map);
+    }
+}
+
+size_t imap_size(const struct imap *map)
+{
+    return map->size;
+}
+
+void *imap_get(const struct imap *map, int64_t key)
+{
+    uint64_t hash = hash_key(key);
+    const struct node *node = map->root;
+    unsigned depth;
+
+    for (depth = 0; node != NULL; depth++) {
+	unsigned idx = slot_idx(hash, depth);
+	uint32_t bit = UINT32_C(1) << idx;
+
+	if (node->leafmap & bit) {
+	    const struct leaf *leaf =
+		&node_leaves(node)[pos(node->leafmap, idx)];
+
+	    return leaf->key == key ? leaf->value : NULL;
+	} else if (node->nodemap & bit)
+	    node = node_children(node)[pos(node->nodemap, idx)];
+	else
+	    return NULL;
+    }
+
+    return NULL;
+}
+
+static struct imap *new_version(struct imap *map, struct node *root,
+				size_t size, struct ebr *ebr)
+{
+    struct imap *version = ut_malloc(sizeof(struct imap));
+
+    *version = (struct imap) {
+	.root = root,
+	.size = size
+    };
+
+    ebr_retire(ebr, map, ut_free);
+
+    return version;
+}
+
+struct imap *imap_put(struct imap *map, int64_t key, void *value,
+		      struct ebr *ebr, ebr_free_fn value_free)
+{
+    const struct leaf leaf = {
+	.key = key,
+	.value = value
+    };
+    void *old_value = NULL;
+
+    struct node *root =
+	node_put(map->root, 0, hash_key(key), &leaf, &old_value, ebr);
+
+    if (old_value != NULL) {
+	ebr_retire(ebr, old_value, value_free);
+	return new_version(map, root, map->size, ebr);
+    }
+
+    return new_version(map, root, map->size + 1, ebr);
+}
+
+struct imap *imap_del(struct imap *map, int64_t key,
+		      struct ebr *ebr, ebr_free_fn value_free)
+{
+    if (map->root == NULL)
+	return map;
+
+    void *old_value = NULL;
+
+    struct node *root =
+	node_del(map->root, 0, hash_key(key), key, &old_value, ebr);
+
+    if (root == map->root)
+	return map;
+
+    ebr_retire(ebr, old_value, value_free);
+
+    return new_version(map, root, map->size - 1, ebr);
+}
+
+static bool node_foreach(const struct node *node, imap_foreach_cb cb,
+			 void *cb_data)
+{
+    unsigned i;
+
+    for (i = 0; i < num_leaves(node); i++) {
+	const struct leaf *leaf = &node_leaves(node)[i];
+
+	if (!cb(leaf->key, leaf->value, cb_data))
+	    return false;
+    }
+
+    for (i = 0; i < num_children(node); i++)
+	if (!node_foreach(node_children(node)[i], cb, cb_data))
+	    return false;
+
+    return true;
+}
+
+void imap_foreach(const struct imap *map, imap_foreach_cb cb, void *cb_data)
+{
+    if (map->root != NULL)
+	node_foreach(map->root, cb, cb_data);
+}
+
+void imap_foreach_part(const struct imap *map, size_t part,
+		       size_t num_parts, imap_foreach_cb cb, void *cb_data)
+{
+    ut_assert(part < num_parts && num_parts <= IMAP_MAX_PARTS);
+
+    const struct node *root = map->root;
+
+    if (root == NULL)
+	return;
+
+    /* The parts are ranges of the root node's slots */
+    unsigned first = part * WIDTH / num_parts;
+    unsigned last = (part + 1) * WIDTH / num_parts;
+    unsigned idx;
+
+    for (idx = first; idx < last; idx++) {
+	uint32_t bit = UINT32_C(1) << idx;
+
+	if (root->leafmap & bit) {
+	    const struct leaf *leaf =
+		&node_leaves(root)[pos(root->leafmap, idx)];
+
+	    if (!cb(leaf->key, leaf->value, cb_data))
+		return;
+	} else if (root->nodemap & bit) {
+	    const struct node *child =
+		node_children(root)[pos(root->nodemap, idx)];
+
+	    if (!node_foreach(child, cb, cb_data))
+		return;
+	}
+    }
+}
@@ -0,0 +1,49 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef IMAP_H
+#define IMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ebr.h"
+
+/* A persistent (immutable) map from int64_t keys to pointers, in the
+   form of a hash array mapped trie.
+
+   An update produces a new version of the map, sharing all but the
+   path to the updated key with the old version. The parts of the old
+   version not used by the new one, including any replaced or removed
+   value, are retired with the 'ebr' instance, so readers may keep
+   using the old version while in an ebr_enter()/ebr_leave()
+   section. */
+struct imap;
+
+struct imap *imap_create(void);
+/* Immediately frees the version, and all values in it. Only to be
+   used when there are no readers. */
+void imap_destroy(struct imap *map, ebr_free_fn value_free);
+
+size_t imap_size(const struct imap *map);
+void *imap_get(const struct imap *map, int64_t key);
+
+/* Replaces any existing value for the key. */
+struct imap *imap_put(struct imap *map, int64_t key, void *value,
+		      struct ebr *ebr, ebr_free_fn value_free);
+struct imap *imap_del(struct imap *map, int64_t key,
+		      struct ebr *ebr, ebr_free_fn value_free);
+
+typedef bool (*imap_foreach_cb)(int64_t key, void *value, void *cb_data);
+void imap_foreach(const struct imap *map, imap_foreach_cb cb, void *cb_data);
+
+/* The entries may be split into up to IMAP_MAX_PARTS disjoint parts,
+   of roughly equal size, which may be iterated over concurrently. */
+#define IMAP_MAX_PARTS 32
+
+void imap_foreach_part(const struct imap *map, size_t part,
+		       size_t num_parts, imap_foreach_cb cb, void *cb_data);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <stdatomic.h>
+
+#include "util.h"
+
+#include "pfifo.h"
+
+#define CACHE_LINE_SIZE 64
+
+#define BLOCK_CAPACITY 256
+
+/* The FIFO is a linked list of blocks. The producer fills the tail
+   block, and links in a new one when it runs full. The consumer frees
+   a block once it has been emptied, and the next one has been
+   linked in, at which point the producer is done with it. */
+struct block
+{
+    _Atomic(void *) elems[BLOCK_CAPACITY];
+    _Atomic(struct block *) next;
+};
+
+struct pfifo
+{
+    _Alignas(CACHE_LINE_SIZE) struct block *head;
+    size_t head_idx;
+
+    _Alignas(CACHE_LINE_SIZE) struct block *tail;
+    size_t tail_idx;
+};
+
+static struct block *block_create(void)
+{
+    struct block *block = ut_malloc(sizeof(struct block));
+
+    size_t i;
+    for (i = 0; i < BLOCK_CAPACITY; i++)
+	atomic_init(&block->elems[i], NULL);
+
+    atomic_init(&block->next, NULL);
+
+    return block;
+}
+
+struct pfifo *pfifo_create(void)
+{
+    struct pfifo *fifo = ut_malloc(sizeof(struct pfifo));
+
+    struct block *block = block_create();
+
+    fifo->head = block;
+    fifo->head_idx = 0;
+    fifo->tail = block;
+    fifo->tail_idx = 0;
+
+    return fifo;
+}
+
+void pfifo_destroy(struct pfifo *fifo)
+{
+    if (fifo != NULL) {
+	struct block *block = fifo->head;
+
+	while (block != NULL) {
+	    struct block *next = atomic_load(&block->next);
+	    ut_free(block);
+	    block = next;
+	}
+
+	ut_free(fifo);
+    }
+}
+
+void pfifo_push(struct pfifo *fifo, void *elem)
+{
+    ut_assert(elem != NULL);
+
+    if (fifo->tail_idx == BLOCK_CAPACITY) {
+	struct block *block = block_create();
+
+	atomic_store_explicit(&fifo->tail->next, block, memory_order_release);
+
+	fifo->tail = block;
+	fifo->tail_idx = 0;
+    }
+
+    atomic_store_explicit(&fifo->tail->elems[fifo->tail_idx], elem,
+			  memory_order_release);
+    fifo->tail_idx++;
+}
+
+void *pfifo_pop(struct pfifo *fifo)
+{
+    if (fifo->head_idx == BLOCK_CAPACITY) {
+	struct block *next =
+	    atomic_load_explicit(&fifo->head->next, memory_order_acquire);
+
+	if (next == NULL)
+	    return NULL;
+
+	ut_free(fifo->head);
+
+	fifo->head = next;
+	fifo->head_idx = 0;
+    }
+
+    void *elem = atomic_load_explicit(&fifo->head->elems[fifo->head_idx],
+				      memory_order_acquire);
+
+    if (elem != NULL)
+	fifo->head_idx++;
+
+    return elem;
+}
@@ -0,0 +1,47 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef PFIFO_H
+#define PFIFO_H
+
+#include <stdbool.h>
+
+/* An unbounded, lock-free, single-producer single-consumer FIFO of
+   pointers. pfifo_push() must only be used by the producer, and
+   pfifo_pop() only by the consumer. NULL may not be pushed. */
+struct pfifo;
+
+struct pfifo *pfifo_create(void);
+void pfifo_destroy(struct pfifo *fifo);
+
+void pfifo_push(struct pfifo *fifo, void *elem);
+/* Returns NULL if the FIFO is empty. */
+void *pfifo_pop(struct pfifo *fifo);
+
+#define PFIFO_GEN_WRAPPER_DEF(fifo_name, fifo_type, elem_type, fun_attrs) \
+    fifo_type;								\
+									\
+    fun_attrs fifo_type *fifo_name ## _create(void)			\
+    {									\
+	return (fifo_type *)pfifo_create();				\
+    }									\
+									\
+    fun_attrs void fifo_name ## _destroy(fifo_type *fifo)		\
+    {									\
+	pfifo_destroy((struct pfifo *)fifo);				\
+    }									\
+									\
+    fun_attrs void fifo_name ## _push(fifo_type *fifo, elem_type *elem) \
+    {									\
+	pfifo_push((struct pfifo *)fifo, elem);				\
+    }									\
+									\
+    fun_attrs elem_type *fifo_name ## _pop(fifo_type *fifo)		\
+    {									\
+	return pfifo_pop((struct pfifo *)fifo);				\
+    }									\
+									\
+
+#endif
@@ -3,102 +3,130 @@
  * Copyright(c) 2023 Ericsson AB
  */
 
-#include "plist.h"
 #include "util.h"
 
 #include "pmap.h"
 
 #include <string.h>
 
+/* Open addressing hash table with linear probing, and backward shift
+   deletion (i.e., no tombstones). */
+
 struct entry
 {
     uint64_t key;
     void *value;
+    bool used;
 };
 
-static void *elist_elem_clone(const void *original)
+struct pmap
 {
-    struct entry *copy = ut_malloc(sizeof(struct entry));
-
-    memcpy(copy, original, sizeof(struct entry));
+    struct entry *entries;
+    size_t capacity;
+    size_t size;
+};
 
-    return copy;
-}
+#define MIN_CAPACITY (8)
 
-static bool elist_elem_equal(const void *a, const void *b)
+static uint64_t hash(uint64_t key)
 {
-    const struct entry *entry_a = a;
-    const struct entry *entry_b = b;
+    /* splitmix64 finalizer */
+    key ^= key >> 30;
+    key *= UINT64_C(0xbf58476d1ce4e5b9);
+    key ^= key >> 27;
+    key *= UINT64_C(0x94d049bb133111eb);
+    key ^= key >> 31;
 
-    return entry_a->key == entry_b->key;
+    return key;
 }
 
-static void elist_elem_destroy(void *elem)
+static size_t home_idx(const struct pmap *map, uint64_t key)
 {
-    ut_free(elem);
+    return hash(key) & (map->capacity - 1);
 }
 
-PLIST_GEN_BY_VALUE_WRAPPER_DEF(elist, struct elist, struct entry,
-			       elist_elem_clone, elist_elem_destroy,
-			       elist_elem_equal,
-			       static __attribute__((unused)))
-
-struct pmap
+static size_t next_idx(const struct pmap *map, size_t idx)
 {
-    struct elist *entries;
-};
+    return (idx + 1) & (map->capacity - 1);
+}
 
 struct pmap *pmap_create(void)
 {
-    struct pmap *map = ut_malloc(sizeof(struct pmap));
-
-    *map = (struct pmap) {
-	.entries = elist_create()
-    };
-
-    return map;
+    return ut_calloc(sizeof(struct pmap));
 }
 
 void pmap_destroy(struct pmap *map)
 {
     if (map != NULL) {
-	elist_destroy(map->entries);
+	ut_free(map->entries);
 	ut_free(map);
     }
 }
 
-struct value_dec_ref_cb_data
+void pmap_destroy_cnted(struct pmap *map, pmap_value_dec_ref value_dec_ref)
 {
-    pmap_value_dec_ref value_dec_ref;
-};
+    if (map != NULL) {
+	pmap_clear_cnted(map, value_dec_ref);
+	pmap_destroy(map);
+    }
+}
 
-static bool value_dec_ref_cb(struct entry *entry, void *cb_data)
+static ssize_t index_of(const struct pmap *map, uint64_t key)
 {
-    struct value_dec_ref_cb_data *data = cb_data;
+    if (map->size == 0)
+	return -1;
 
-    data->value_dec_ref(entry->value);
+    size_t idx;
+    for (idx = home_idx(map, key); map->entries[idx].used;
+	 idx = next_idx(map, idx))
+	if (map->entries[idx].key == key)
+	    return idx;
 
-    return true;
+    return -1;
 }
 
-void pmap_destroy_cnted(struct pmap *map, pmap_value_dec_ref value_dec_ref)
+static void insert(struct pmap *map, uint64_t key, void *value)
 {
-    if (map != NULL) {
-	pmap_clear_cnted(map, value_dec_ref);
-	pmap_destroy(map);
-    }
+    size_t idx = home_idx(map, key);
+
+    while (map->entries[idx].used)
+	idx = next_idx(map, idx);
+
+    map->entries[idx] = (struct entry) {
+	.key = key,
+	.value = value,
+	.used = true
+    };
+
+    map->size++;
+}
+
+static void resize(struct pmap *map, size_t capacity)
+{
+    struct entry *old_entries = map->entries;
+    size_t old_capacity = map->capacity;
+
+    map->entries = ut_calloc(sizeof(struct entry) * capacity);
+    map->capacity = capacity;
+    map->size = 0;
+
+    size_t i;
+    for (i = 0; i < old_capacity; i++)
+	if (old_entries[i].used)
+	    insert(map, old_entries[i].key, old_entries[i].value);
+
+    ut_free(old_entries);
 }
 
 void pmap_add(struct pmap *map, uint64_t key, void *value)
 {
     ut_assert(!pmap_has_key(map, key));
 
-    struct entry entry = {
-	.key = key,
-	.value = value
-    };
+    /* keep the load factor at or below 1/2 */
+    if (2 * (map->size + 1) > map->capacity)
+	resize(map, map->capacity == 0 ? MIN_CAPACITY : 2 * map->capacity);
 
-    elist_append(map->entries, &entry);
+    insert(map, key, value);
 }
 
 void pmap_add_cnted(struct pmap *map, pmap_value_inc_ref value_inc_ref,
@@ -108,22 +136,9 @@ void pmap_add_cnted(struct pmap *map, pmap_value_inc_ref value_inc_ref,
     pmap_add(map, key, value);
 }
 
-static ssize_t index_of(const struct pmap *map, uint64_t key)
-{
-    struct entry entry = {
-	.key = key
-    };
-
-    return elist_index_of(map->entries, &entry);
-}
-
 bool pmap_has_key(const struct pmap *map, uint64_t key)
 {
-    struct entry entry = {
-	.key = key
-    };
-
-    return elist_has(map->entries, &entry);
+    return index_of(map, key) >= 0;
 }
 
 void *pmap_get(const struct pmap *map, uint64_t key)
@@ -133,9 +148,7 @@ void *pmap_get(const struct pmap *map, uint64_t key)
     if (idx < 0)
 	return NULL;
 
-    struct entry *entry = elist_get(map->entries, idx);
-
-    return entry->value;
+    return map->entries[idx].value;
 }
 
 void pmap_del(struct pmap *map, uint64_t key)
@@ -143,7 +156,29 @@ void pmap_del(struct pmap *map, uint64_t key)
     ssize_t idx = index_of(map, key);
     ut_assert(idx >= 0);
 
-    elist_del(map->entries, idx);
+    size_t hole = idx;
+    size_t next = next_idx(map, hole);
+
+    /* Shift entries back into the hole, unless that would move them
+       before their home position. */
+    while (map->entries[next].used) {
+	size_t home = home_idx(map, map->entries[next].key);
+	size_t dist_next = (next - home) & (map->capacity - 1);
+	size_t dist_hole = (hole - home) & (map->capacity - 1);
+
+	if (dist_hole < dist_next) {
+	    map->entries[hole] = map->entries[next];
+	    hole = next;
+	}
+
+	next = next_idx(map, next);
+    }
+
+    map->entries[hole].used = false;
+    map->size--;
+
+    if (map->capacity > MIN_CAPACITY && 8 * map->size < map->capacity)
+	resize(map, map->capacity / 2);
 }
 
 void pmap_del_cnted(struct pmap *map, pmap_value_dec_ref value_dec_ref,
@@ -158,45 +193,34 @@ void pmap_del_cnted(struct pmap *map, pmap_value_dec_ref value_dec_ref,
 
 void pmap_clear(struct pmap *map)
 {
-    elist_clear(map->entries);
+    ut_free(map->entries);
+
+    map->entries = NULL;
+    map->capacity = 0;
+    map->size = 0;
 }
 
 void pmap_clear_cnted(struct pmap *map, pmap_value_dec_ref value_dec_ref)
 {
-    struct value_dec_ref_cb_data cb_data = {
-	.value_dec_ref = value_dec_ref
-    };
+    size_t i;
+    for (i = 0; i < map->capacity; i++)
+	if (map->entries[i].used)
+	    value_dec_ref(map->entries[i].value);
 
-    elist_foreach(map->entries, value_dec_ref_cb, &cb_data);
-
-    elist_clear(map->entries);
+    pmap_clear(map);
 }
 
 size_t pmap_size(const struct pmap *map)
 {
-    return elist_len(map->entries);
-}
-
-struct forward_data
-{
-    pmap_foreach_cb user_cb;
-    void *user_cb_data;
-};
-
-static bool forward_cb(struct entry *entry, void *cb_data)
-{
-    struct forward_data *data = cb_data;
-
-    return data->user_cb(entry->key, entry->value, data->user_cb_data);
+    return map->size;
 }
 
-void pmap_foreach(const struct pmap *pmap, pmap_foreach_cb cb,
+void pmap_foreach(const struct pmap *map, pmap_foreach_cb cb,
 		   void *cb_data)
 {
-    struct forward_data data = {
-	.user_cb = cb,
-	.user_cb_data = cb_data
-    };
-
-    elist_foreach(pmap->entries, forward_cb, &data);
+    size_t i;
+    for (i = 0; i < map->capacity; i++)
+	if (map->entries[i].used &&
+	    !cb(map->entries[i].key, map->entries[i].value, cb_data))
+	    break;
 }
@@ -93,6 +93,13 @@ void *pqueue_peek(struct pqueue *queue)
     return queue->elems[queue->start_idx];
 }
 
+void *pqueue_get(const struct pqueue *queue, size_t index)
+{
+    ut_assert(index < queue->len);
+
+    return queue->elems[(queue->start_idx + index) % queue->capacity];
+}
+
 size_t pqueue_len(const struct pqueue *queue)
 {
     return queue->len;
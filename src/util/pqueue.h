@@ -17,6 +17,7 @@ void pqueue_destroy(struct pqueue *queue);
 void pqueue_push(struct pqueue *queue, void *elem);
 void *pqueue_pop(struct pqueue *queue);
 void *pqueue_peek(struct pqueue *queue);
+void *pqueue_get(const struct pqueue *queue, size_t index);
 
 size_t pqueue_len(const struct pqueue *queue);
 
@@ -48,6 +49,12 @@ size_t pqueue_len(const struct pqueue *queue);
 	return pqueue_peek((struct pqueue *)queue);			\
     }									\
 									\
+    fun_attrs elem_type *queue_name ## _get(const queue_type *queue,	\
+					    size_t index)		\
+    {									\
+	return pqueue_get((const struct pqueue *)queue, index);		\
+    }									\
+									\
     fun_attrs size_t queue_name ## _len(const queue_type *queue)	\
     {									\
 	return pqueue_len((const struct pqueue *)queue);		\
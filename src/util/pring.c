@@ -0,0 +1,110 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <stdatomic.h>
+
+#include "util.h"
+
+#include "pring.h"
+
+#define CACHE_LINE_SIZE 64
+
+struct pring
+{
+    void **elems;
+    size_t mask;
+
+    /* The indices grow without bound, and are only reduced modulo
+       the capacity when used to access an element. Each is written
+       by only one of the threads, and kept on a cache line of its
+       own. */
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+};
+
+static size_t round_up_pow2(size_t value)
+{
+    size_t pow2 = 1;
+
+    while (pow2 < value)
+	pow2 *= 2;
+
+    return pow2;
+}
+
+struct pring *pring_create(size_t capacity)
+{
+    struct pring *ring = ut_malloc(sizeof(struct pring));
+
+    capacity = round_up_pow2(capacity > 0 ? capacity : 1);
+
+    ring->elems = ut_malloc(sizeof(void *) * capacity);
+    ring->mask = capacity - 1;
+
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return ring;
+}
+
+void pring_destroy(struct pring *ring)
+{
+    if (ring != NULL) {
+	ut_free(ring->elems);
+	ut_free(ring);
+    }
+}
+
+bool pring_push(struct pring *ring, void *elem)
+{
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail - head > ring->mask)
+	return false;
+
+    ring->elems[tail & ring->mask] = elem;
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    return true;
+}
+
+void *pring_peek(struct pring *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head == tail)
+	return NULL;
+
+    return ring->elems[head & ring->mask];
+}
+
+void *pring_pop(struct pring *ring)
+{
+    void *elem = pring_peek(ring);
+
+    if (elem != NULL) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    }
+
+    return elem;
+}
+
+size_t pring_len(const struct pring *ring)
+{
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    return tail - head;
+}
+
+size_t pring_capacity(const struct pring *ring)
+{
+    return ring->mask + 1;
+}
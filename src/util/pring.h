@@ -0,0 +1,70 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#ifndef PRING_H
+#define PRING_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* A fixed-capacity, lock-free, single-producer single-consumer ring
+   buffer of pointers. One thread may push, while another pops, with
+   no other synchronization. The push side functions must only be used
+   by the producer, and the pop side functions (including peek) only
+   by the consumer. pring_len() may be used by either. NULL may not
+   be pushed. */
+struct pring;
+
+struct pring *pring_create(size_t capacity);
+void pring_destroy(struct pring *ring);
+
+/* Returns false if the ring is full. */
+bool pring_push(struct pring *ring, void *elem);
+void *pring_pop(struct pring *ring);
+void *pring_peek(struct pring *ring);
+
+size_t pring_len(const struct pring *ring);
+size_t pring_capacity(const struct pring *ring);
+
+#define PRING_GEN_WRAPPER_DEF(ring_name, ring_type, elem_type, fun_attrs) \
+    ring_type;								\
+									\
+    fun_attrs ring_type *ring_name ## _create(size_t capacity)		\
+    {									\
+	return (ring_type *)pring_create(capacity);			\
+    }									\
+									\
+    fun_attrs void ring_name ## _destroy(ring_type *ring)		\
+    {									\
+	pring_destroy((struct pring *)ring);				\
+    }									\
+									\
+    fun_attrs bool ring_name ## _push(ring_type *ring, elem_type *elem) \
+    {									\
+	return pring_push((struct pring *)ring, elem);			\
+    }									\
+									\
+    fun_attrs elem_type *ring_name ## _pop(ring_type *ring)		\
+    {									\
+	return pring_pop((struct pring *)ring);				\
+    }									\
+									\
+    fun_attrs elem_type *ring_name ## _peek(ring_type *ring)		\
+    {									\
+	return pring_peek((struct pring *)ring);			\
+    }									\
+									\
+    fun_attrs size_t ring_name ## _len(const ring_type *ring)		\
+    {									\
+	return pring_len((const struct pring *)ring);			\
+    }									\
+									\
+    fun_attrs size_t ring_name ## _capacity(const ring_type *ring)	\
+    {									\
+	return pring_capacity((const struct pring *)ring);		\
+    }									\
+									\
+
+#endif
@@ -0,0 +1,283 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+/*
+ * tpafbench -- measures the request throughput of a Pathfinder server
+ *
+ * For every domain address given, a number of client threads connects
+ * and issues "publish" requests (each republishing the client's own
+ * services with increasing generation numbers) for a fixed period of
+ * time, keeping a number of requests outstanding. The number of
+ * completed requests per second is reported per domain and in total.
+ *
+ * To see how tpafd scales with the number of domains, run tpafd with N
+ * domains, and tpafbench with the same N domain addresses, for
+ * different values of N.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <jansson.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xcm.h>
+
+#include "util.h"
+
+#define DEFAULT_CLIENTS 4
+#define DEFAULT_DURATION 5.0
+#define DEFAULT_WINDOW 32
+#define NUM_SERVICES 16
+
+struct client
+{
+    const char *addr;
+    double duration;
+    int window;
+
+    pthread_t thread;
+
+    int64_t completed;
+    bool failed;
+};
+
+static void usage(const char *name)
+{
+    printf("%s [options] <domain-addr> ...\n", name);
+    printf("Options:\n");
+    printf("  -c <clients>   Clients per domain. Default is %d.\n",
+	   DEFAULT_CLIENTS);
+    printf("  -d <duration>  Test duration in seconds. Default is %.0f s.\n",
+	   DEFAULT_DURATION);
+    printf("  -w <window>    Outstanding requests per client. Default "
+	   "is %d.\n", DEFAULT_WINDOW);
+    printf("  -h             Print this text.\n");
+}
+
+static int send_json(struct xcm_socket *conn, json_t *msg)
+{
+    char *data = json_dumps(msg, JSON_COMPACT);
+
+    int rc = xcm_send(conn, data, strlen(data));
+
+    free(data);
+    json_decref(msg);
+
+    return rc;
+}
+
+/* Returns 1 for a successful reply, 0 for other messages, and -1 on
+   failure. */
+static int receive_reply(struct xcm_socket *conn)
+{
+    char buf[65536];
+
+    int rc = xcm_receive(conn, buf, sizeof(buf));
+
+    if (rc <= 0)
+	return -1;
+
+    json_t *msg = json_loadb(buf, rc, 0, NULL);
+
+    if (msg == NULL)
+	return -1;
+
+    const char *msg_type = json_string_value(json_object_get(msg,
+							     "msg-type"));
+
+    if (msg_type == NULL)
+	rc = -1;
+    else if (strcmp(msg_type, "complete") == 0)
+	rc = 1;
+    else if (strcmp(msg_type, "fail") == 0)
+	rc = -1;
+    else
+	rc = 0;
+
+    json_decref(msg);
+
+    return rc;
+}
+
+static json_t *create_request(const char *cmd, int64_t ta_id)
+{
+    json_t *req = json_object();
+
+    json_object_set_new(req, "ta-cmd", json_string(cmd));
+    json_object_set_new(req, "ta-id", json_integer(ta_id));
+    json_object_set_new(req, "msg-type", json_string("request"));
+
+    return req;
+}
+
+static int hello(struct xcm_socket *conn)
+{
+    json_t *req = create_request("hello", 0);
+
+    json_object_set_new(req, "client-id", json_integer(ut_rand_id()));
+    json_object_set_new(req, "protocol-minimum-version", json_integer(2));
+    json_object_set_new(req, "protocol-maximum-version", json_integer(2));
+
+    if (send_json(conn, req) < 0)
+	return -1;
+
+    return receive_reply(conn) == 1 ? 0 : -1;
+}
+
+static int publish(struct xcm_socket *conn, int64_t ta_id,
+		   int64_t service_id, int64_t generation)
+{
+    json_t *req = create_request("publish", ta_id);
+
+    json_t *props = json_object();
+    json_t *name = json_array();
+
+    json_array_append_new(name, json_string("bench"));
+    json_object_set_new(props, "name", name);
+
+    json_object_set_new(req, "service-id", json_integer(service_id));
+    json_object_set_new(req, "generation", json_integer(generation));
+    json_object_set_new(req, "service-props", props);
+    json_object_set_new(req, "ttl", json_integer(60));
+
+    return send_json(conn, req);
+}
+
+static void *run_client(void *arg)
+{
+    struct client *client = arg;
+
+    struct xcm_socket *conn = xcm_connect(client->addr, 0);
+
+    if (conn == NULL) {
+	fprintf(stderr, "Unable to connect to \"%s\": %s.\n", client->addr,
+		strerror(errno));
+	client->failed = true;
+	return NULL;
+    }
+
+    if (hello(conn) < 0)
+	goto err;
+
+    int64_t base_service_id = ut_rand_id();
+    int64_t next_ta_id = 1;
+    int outstanding = 0;
+
+    double deadline = ut_ftime() + client->duration;
+
+    while (ut_ftime() < deadline) {
+	while (outstanding < client->window) {
+	    int64_t ta_id = next_ta_id++;
+	    int64_t service_id = base_service_id + ta_id % NUM_SERVICES;
+	    int64_t generation = ta_id;
+
+	    if (publish(conn, ta_id, service_id, generation) < 0)
+		goto err;
+
+	    outstanding++;
+	}
+
+	int rc = receive_reply(conn);
+
+	if (rc < 0)
+	    goto err;
+	else if (rc == 1) {
+	    outstanding--;
+	    client->completed++;
+	}
+    }
+
+    xcm_close(conn);
+
+    return NULL;
+
+err:
+    fprintf(stderr, "Error communicating with \"%s\".\n", client->addr);
+    client->failed = true;
+    xcm_close(conn);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int num_clients = DEFAULT_CLIENTS;
+    double duration = DEFAULT_DURATION;
+    int window = DEFAULT_WINDOW;
+
+    int c;
+    while ((c = getopt(argc, argv, "c:d:w:h")) != -1)
+	switch (c) {
+	case 'c':
+	    num_clients = atoi(optarg);
+	    break;
+	case 'd':
+	    duration = atof(optarg);
+	    break;
+	case 'w':
+	    window = atoi(optarg);
+	    break;
+	case 'h':
+	    usage(argv[0]);
+	    exit(EXIT_SUCCESS);
+	    break;
+	default:
+	    exit(EXIT_FAILURE);
+	}
+
+    int num_domains = argc - optind;
+
+    if (num_domains == 0 || num_clients < 1 || window < 1 || duration <= 0) {
+	usage(argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    size_t num_total = num_domains * num_clients;
+    struct client *clients = ut_calloc(sizeof(struct client) * num_total);
+
+    size_t i;
+    for (i = 0; i < num_total; i++) {
+	struct client *client = &clients[i];
+
+	client->addr = argv[optind + i / num_clients];
+	client->duration = duration;
+	client->window = window;
+
+	if (pthread_create(&client->thread, NULL, run_client, client) != 0) {
+	    fprintf(stderr, "Unable to create client thread.\n");
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    bool failed = false;
+    int64_t total = 0;
+
+    for (i = 0; i < num_total; i++) {
+	pthread_join(clients[i].thread, NULL);
+	failed |= clients[i].failed;
+    }
+
+    int d;
+    for (d = 0; d < num_domains; d++) {
+	int64_t domain_completed = 0;
+
+	int j;
+	for (j = 0; j < num_clients; j++)
+	    domain_completed += clients[d * num_clients + j].completed;
+
+	printf("%-24s %10.0f requests/s\n", argv[optind + d],
+	       domain_completed / duration);
+
+	total += domain_completed;
+    }
+
+    printf("%-24s %10.0f requests/s\n", "Total", total / duration);
+
+    ut_free(clients);
+
+    exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
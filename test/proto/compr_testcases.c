@@ -0,0 +1,142 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+
+#include "compr.h"
+
+TESTSUITE(compr, NULL, NULL)
+
+#define NUM_MSGS 8
+#define MAX_MSG_LEN 1024
+
+static void make_msg(int idx, char *buf)
+{
+    snprintf(buf, MAX_MSG_LEN,
+	     "{\"ta-cmd\": \"subscribe\", \"ta-id\": %d, \"msg-type\": "
+	     "\"notify\", \"match-type\": \"appeared\", \"service-id\": %d, "
+	     "\"generation\": 0, \"service-props\": {\"name\": "
+	     "[\"service-%d\"]}, \"ttl\": 60, \"client-id\": 4711}",
+	     idx % 3, idx * 17, idx);
+}
+
+TESTCASE(compr, stream)
+{
+    struct deflater *deflater = deflater_create();
+    struct inflater *inflater = inflater_create();
+    size_t total_plain = 0;
+    size_t total_compressed = 0;
+    size_t first_len = 0;
+    size_t last_len = 0;
+    int i;
+
+    for (i = 0; i < NUM_MSGS; i++) {
+	char plain[MAX_MSG_LEN];
+	make_msg(i, plain);
+	size_t plain_len = strlen(plain);
+
+	struct msg *compressed = deflater_compress(deflater, plain,
+						   plain_len);
+	CHK(compressed != NULL);
+
+	/* every message must be possible to inflate on arrival */
+	char buf[MAX_MSG_LEN];
+	int len = inflater_decompress(inflater, msg_data(compressed),
+				      msg_len(compressed), buf, sizeof(buf));
+	CHKINTEQ(len, plain_len);
+	CHK(memcmp(buf, plain, plain_len) == 0);
+
+	if (i == 0)
+	    first_len = msg_len(compressed);
+	last_len = msg_len(compressed);
+
+	total_plain += plain_len;
+	total_compressed += msg_len(compressed);
+
+	msg_destroy(compressed);
+    }
+
+    /* the history carries over between messages */
+    CHK(last_len < first_len);
+
+    struct compr_stats stats;
+
+    deflater_get_stats(deflater, &stats);
+    CHKINTEQ(stats.plain_bytes, total_plain);
+    CHKINTEQ(stats.compressed_bytes, total_compressed);
+
+    inflater_get_stats(inflater, &stats);
+    CHKINTEQ(stats.plain_bytes, total_plain);
+    CHKINTEQ(stats.compressed_bytes, total_compressed);
+
+    inflater_destroy(inflater);
+    deflater_destroy(deflater);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(compr, reject_corrupt)
+{
+    const char *garbage = "{\"ta-cmd\": \"hello\"}";
+    struct inflater *inflater = inflater_create();
+    char buf[MAX_MSG_LEN];
+
+    CHKINTEQ(inflater_decompress(inflater, garbage, strlen(garbage),
+				 buf, sizeof(buf)), -1);
+
+    inflater_destroy(inflater);
+
+    struct deflater *deflater = deflater_create();
+    char plain[MAX_MSG_LEN];
+
+    make_msg(0, plain);
+    struct msg *first = deflater_compress(deflater, plain, strlen(plain));
+    make_msg(1, plain);
+    struct msg *second = deflater_compress(deflater, plain, strlen(plain));
+
+    /* a message without its predecessors lacks the stream header */
+    inflater = inflater_create();
+    CHKINTEQ(inflater_decompress(inflater, msg_data(second),
+				 msg_len(second), buf, sizeof(buf)), -1);
+    inflater_destroy(inflater);
+
+    /* a damaged stream header */
+    char *damaged = ut_memdup(msg_data(first), msg_len(first));
+    damaged[1] ^= 0xff;
+
+    inflater = inflater_create();
+    CHKINTEQ(inflater_decompress(inflater, damaged, msg_len(first),
+				 buf, sizeof(buf)), -1);
+    inflater_destroy(inflater);
+
+    /* trailing data after the message */
+    char *padded = ut_malloc(msg_len(first) + 4);
+    memcpy(padded, msg_data(first), msg_len(first));
+    memset(padded + msg_len(first), 0xff, 4);
+
+    inflater = inflater_create();
+    CHKINTEQ(inflater_decompress(inflater, padded, msg_len(first) + 4,
+				 buf, sizeof(buf)), -1);
+    inflater_destroy(inflater);
+
+    /* output not fitting into the buffer */
+    inflater = inflater_create();
+    CHKINTEQ(inflater_decompress(inflater, msg_data(first),
+				 msg_len(first), buf, 16), -1);
+    inflater_destroy(inflater);
+
+    ut_free(padded);
+    ut_free(damaged);
+    msg_destroy(second);
+    msg_destroy(first);
+    deflater_destroy(deflater);
+
+    return UTEST_SUCCESS;
+}
@@ -0,0 +1,563 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#include "proto_bin.h"
+#include "proto_ta.h"
+
+/* Indices into the protocol's table of transaction types */
+#define CMD_PUBLISH 1
+#define CMD_PING 5
+
+#define MSG_TYPE_REQ 0
+#define MSG_TYPE_COMPLETE 3
+
+static const char *dict_names[] = { "color", "zone", "name" };
+
+static struct proto_dict *dict;
+
+static int setup(unsigned setup_flags)
+{
+    dict = proto_dict_create(dict_names, UT_ARRAY_LEN(dict_names));
+
+    return UTEST_SUCCESS;
+}
+
+static int teardown(unsigned setup_flags)
+{
+    proto_dict_dec_ref(dict);
+
+    return UTEST_SUCCESS;
+}
+
+TESTSUITE(proto_bin, setup, teardown)
+
+TESTCASE(proto_bin, primitives)
+{
+    struct proto_bin_writer writer;
+
+    proto_bin_writer_init(&writer);
+
+    proto_bin_write_u8(&writer, 0xfe);
+    proto_bin_write_u32(&writer, UINT32_C(0x01020304));
+    proto_bin_write_i64(&writer, -4711);
+    proto_bin_write_f64(&writer, 0.125);
+    proto_bin_write_str(&writer, "foo", 3);
+    proto_bin_write_str(&writer, "", 0);
+
+    struct msg *msg = proto_bin_writer_morph(&writer);
+
+    CHKINTEQ(msg_len(msg), 1 + 4 + 8 + 8 + 4 + 3 + 4);
+
+    /* little-endian */
+    const uint8_t *data = msg_data(msg);
+    CHKINTEQ(data[1], 0x04);
+    CHKINTEQ(data[4], 0x01);
+
+    struct proto_bin_reader reader;
+    uint8_t u8;
+    uint32_t u32;
+    int64_t i64;
+    double f64;
+    const char *str;
+    size_t len;
+
+    proto_bin_reader_init(&reader, msg_data(msg), msg_len(msg));
+
+    CHKNOERR(proto_bin_read_u8(&reader, &u8));
+    CHKINTEQ(u8, 0xfe);
+    CHKNOERR(proto_bin_read_u32(&reader, &u32));
+    CHK(u32 == UINT32_C(0x01020304));
+    CHKNOERR(proto_bin_read_i64(&reader, &i64));
+    CHK(i64 == -4711);
+    CHKNOERR(proto_bin_read_f64(&reader, &f64));
+    CHK(f64 == 0.125);
+    CHKNOERR(proto_bin_read_str(&reader, &str, &len));
+    CHKINTEQ(len, 3);
+    CHK(memcmp(str, "foo", 3) == 0);
+    CHKNOERR(proto_bin_read_str(&reader, &str, &len));
+    CHKINTEQ(len, 0);
+
+    CHK(proto_bin_reader_at_end(&reader));
+    CHKINTEQ(proto_bin_read_u8(&reader, &u8), -1);
+
+    msg_destroy(msg);
+
+    CHK(proto_bin_is_bin((uint8_t[]) { PROTO_BIN_MAGIC }, 1));
+    CHK(!proto_bin_is_bin("{}", 2));
+    CHK(!proto_bin_is_bin("", 0));
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_bin, truncated)
+{
+    const uint8_t data[8] = { 0 };
+    struct proto_bin_reader reader;
+    uint32_t u32;
+    int64_t i64;
+    double f64;
+
+    proto_bin_reader_init(&reader, data, 3);
+    CHKINTEQ(proto_bin_read_u32(&reader, &u32), -1);
+
+    proto_bin_reader_init(&reader, data, 7);
+    CHKINTEQ(proto_bin_read_i64(&reader, &i64), -1);
+    CHKINTEQ(proto_bin_read_f64(&reader, &f64), -1);
+
+    /* a failed read consumes nothing */
+    CHKNOERR(proto_bin_read_u32(&reader, &u32));
+    CHKINTEQ(reader.offset, 4);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_bin, oversized_length)
+{
+    uint32_t prefixes[] = {
+	4, UINT32_C(0x7fffffff), UINT32_MAX - 3, UINT32_MAX
+    };
+    size_t i;
+
+    for (i = 0; i < UT_ARRAY_LEN(prefixes); i++) {
+	struct proto_bin_writer writer;
+
+	proto_bin_writer_init(&writer);
+	proto_bin_write_u32(&writer, prefixes[i]);
+	proto_bin_write_u8(&writer, 'a');
+	proto_bin_write_u8(&writer, 'b');
+	proto_bin_write_u8(&writer, 'c');
+
+	struct msg *msg = proto_bin_writer_morph(&writer);
+	struct proto_bin_reader reader;
+	const char *str;
+	size_t len;
+
+	proto_bin_reader_init(&reader, msg_data(msg), msg_len(msg));
+	CHKINTEQ(proto_bin_read_str(&reader, &str, &len), -1);
+
+	/* names without the dictionary bit are plain strings */
+	if (!(prefixes[i] & PROTO_BIN_DICT_REF)) {
+	    proto_bin_reader_init(&reader, msg_data(msg), msg_len(msg));
+	    CHKINTEQ(proto_bin_read_name(&reader, NULL, &str, &len), -1);
+	}
+
+	msg_destroy(msg);
+    }
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_bin, dict)
+{
+    CHKSTREQ(proto_dict_name(dict, 0), "color");
+    CHKSTREQ(proto_dict_name(dict, 2), "name");
+    CHK(proto_dict_name(dict, 3) == NULL);
+    CHK(proto_dict_name(dict, UINT32_MAX) == NULL);
+    CHK(proto_dict_name(NULL, 0) == NULL);
+
+    struct proto_bin_writer writer;
+
+    proto_bin_writer_init(&writer);
+    proto_bin_write_u32(&writer, PROTO_BIN_DICT_REF | 1);
+    proto_bin_write_u32(&writer, PROTO_BIN_DICT_REF | 3);
+    proto_bin_write_u32(&writer, UINT32_MAX);
+
+    struct msg *refs = proto_bin_writer_morph(&writer);
+    const uint8_t *data = msg_data(refs);
+    struct proto_bin_reader reader;
+    const char *name;
+    size_t len;
+
+    proto_bin_reader_init(&reader, data, sizeof(uint32_t));
+    CHKNOERR(proto_bin_read_name(&reader, dict, &name, &len));
+    CHKINTEQ(len, 4);
+    CHK(memcmp(name, "zone", 4) == 0);
+
+    /* no dictionary */
+    proto_bin_reader_init(&reader, data, sizeof(uint32_t));
+    CHKINTEQ(proto_bin_read_name(&reader, NULL, &name, &len), -1);
+
+    /* out of range */
+    proto_bin_reader_init(&reader, data + 4, sizeof(uint32_t));
+    CHKINTEQ(proto_bin_read_name(&reader, dict, &name, &len), -1);
+
+    proto_bin_reader_init(&reader, data + 8, sizeof(uint32_t));
+    CHKINTEQ(proto_bin_read_name(&reader, dict, &name, &len), -1);
+
+    msg_destroy(refs);
+
+    proto_dict_inc_ref(dict);
+    proto_dict_dec_ref(dict);
+    CHKSTREQ(proto_dict_name(dict, 1), "zone");
+
+    return UTEST_SUCCESS;
+}
+
+static struct props *create_props(void)
+{
+    struct props *props = props_create();
+
+    props_add_str(props, "color", "red");
+    props_add_str(props, "color", "green");
+    props_add_int64(props, "zone", -17);
+    props_add_str(props, "address", "tls:10.0.0.1:4711");
+    props_add_int64(props, "port", 4711);
+
+    return props;
+}
+
+static struct msg *create_publish(int64_t ta_id, const struct props *props,
+				  const struct proto_dict *props_dict)
+{
+    struct proto_bin_writer writer;
+
+    proto_bin_writer_init(&writer);
+
+    proto_bin_write_u8(&writer, PROTO_BIN_MAGIC);
+    proto_bin_write_u8(&writer, MSG_TYPE_REQ);
+    proto_bin_write_u8(&writer, CMD_PUBLISH);
+    proto_bin_write_i64(&writer, ta_id);
+
+    proto_bin_write_u8(&writer, 0);
+    proto_bin_write_i64(&writer, 99);
+    proto_bin_write_u8(&writer, 1);
+    proto_bin_write_i64(&writer, 3);
+    proto_bin_write_u8(&writer, 2);
+    proto_bin_write_props(&writer, props_dict, props);
+    proto_bin_write_u8(&writer, 3);
+    proto_bin_write_i64(&writer, 60);
+
+    return proto_bin_writer_morph(&writer);
+}
+
+static int check_publish(const struct msg *msg,
+			 const struct proto_dict *decode_dict,
+			 const struct props *expected_props)
+{
+    json_t *req = proto_req_bin_to_json(msg_data(msg), msg_len(msg),
+					decode_dict, NULL);
+
+    CHK(req != NULL);
+
+    CHKSTREQ(json_string_value(json_object_get(req, PROTO_FIELD_TA_CMD)),
+	     PROTO_CMD_PUBLISH);
+    CHKSTREQ(json_string_value(json_object_get(req, PROTO_FIELD_MSG_TYPE)),
+	     PROTO_MSG_TYPE_REQ);
+    CHK(json_integer_value(json_object_get(req, PROTO_FIELD_TA_ID)) == 42);
+    CHK(json_integer_value(json_object_get(req, PROTO_FIELD_SERVICE_ID)) ==
+	99);
+    CHK(json_integer_value(json_object_get(req, PROTO_FIELD_GENERATION)) ==
+	3);
+    CHK(json_integer_value(json_object_get(req, PROTO_FIELD_TTL)) == 60);
+
+    struct props *props =
+	proto_json_to_props(json_object_get(req, PROTO_FIELD_SERVICE_PROPS),
+			    NULL);
+
+    CHK(props != NULL);
+    CHK(props_equal(props, expected_props));
+
+    props_destroy(props);
+    json_decref(req);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_bin, props_round_trip)
+{
+    struct props *props = create_props();
+
+    struct msg *with_dict = create_publish(42, props, dict);
+    struct msg *without_dict = create_publish(42, props, NULL);
+
+    /* dictionary references make for a shorter message */
+    CHK(msg_len(with_dict) < msg_len(without_dict));
+
+    CHKNOERR(check_publish(with_dict, dict, props));
+    CHKNOERR(check_publish(without_dict, dict, props));
+    CHKNOERR(check_publish(without_dict, NULL, props));
+
+    /* references can't be resolved without the dictionary */
+    CHK(proto_req_bin_to_json(msg_data(with_dict), msg_len(with_dict),
+			      NULL, NULL) == NULL);
+
+    struct props *empty = props_create();
+    struct msg *empty_msg = create_publish(42, empty, dict);
+
+    CHKNOERR(check_publish(empty_msg, dict, empty));
+
+    msg_destroy(empty_msg);
+    props_destroy(empty);
+    msg_destroy(without_dict);
+    msg_destroy(with_dict);
+    props_destroy(props);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_bin, reject_truncated_req)
+{
+    struct props *props = create_props();
+    struct msg *msg = create_publish(42, props, dict);
+    size_t len;
+
+    for (len = 0; len < msg_len(msg); len++) {
+	json_t *req = proto_req_bin_to_json(msg_data(msg), len, dict, NULL);
+
+	/* a message cut at a field boundary is valid, but lacks
+	   fields */
+	if (req != NULL) {
+	    CHK(json_object_get(req, PROTO_FIELD_TTL) == NULL);
+	    json_decref(req);
+	}
+    }
+
+    msg_destroy(msg);
+    props_destroy(props);
+
+    return UTEST_SUCCESS;
+}
+
+static json_t *decode_with(uint8_t msg_type, uint8_t cmd, uint8_t tag,
+			   const void *value, size_t value_len)
+{
+    struct proto_bin_writer writer;
+
+    proto_bin_writer_init(&writer);
+
+    proto_bin_write_u8(&writer, PROTO_BIN_MAGIC);
+    proto_bin_write_u8(&writer, msg_type);
+    proto_bin_write_u8(&writer, cmd);
+    proto_bin_write_i64(&writer, 1);
+    proto_bin_write_u8(&writer, tag);
+
+    const uint8_t *bytes = value;
+    size_t i;
+    for (i = 0; i < value_len; i++)
+	proto_bin_write_u8(&writer, bytes[i]);
+
+    struct msg *msg = proto_bin_writer_morph(&writer);
+    json_t *req = proto_req_bin_to_json(msg_data(msg), msg_len(msg), dict,
+					NULL);
+
+    msg_destroy(msg);
+
+    return req;
+}
+
+TESTCASE(proto_bin, reject_invalid_req)
+{
+    /* little-endian 17 */
+    uint8_t service_id[] = { 17, 0, 0, 0, 0, 0, 0, 0 };
+
+    /* a valid unpublish */
+    json_t *req = decode_with(MSG_TYPE_REQ, 2, 0, service_id,
+			      sizeof(service_id));
+    CHK(req != NULL);
+    json_decref(req);
+
+    /* not a request */
+    CHK(decode_with(MSG_TYPE_COMPLETE, 2, 0, service_id,
+		    sizeof(service_id)) == NULL);
+
+    /* unknown command */
+    CHK(decode_with(MSG_TYPE_REQ, 200, 0, service_id,
+		    sizeof(service_id)) == NULL);
+
+    /* unknown field */
+    CHK(decode_with(MSG_TYPE_REQ, 2, 1, service_id,
+		    sizeof(service_id)) == NULL);
+
+    /* duplicate field */
+    uint8_t dup[] = { 17, 0, 0, 0, 0, 0, 0, 0, 0, 18, 0, 0, 0, 0, 0, 0, 0 };
+    CHK(decode_with(MSG_TYPE_REQ, 2, 0, dup, sizeof(dup)) == NULL);
+
+    /* an out-of-range dictionary index in the properties */
+    struct proto_bin_writer writer;
+    proto_bin_writer_init(&writer);
+    proto_bin_write_u32(&writer, 1);
+    proto_bin_write_u32(&writer, PROTO_BIN_DICT_REF | 3);
+    proto_bin_write_u8(&writer, PROTO_BIN_INT64);
+    proto_bin_write_i64(&writer, 1);
+    struct msg *bad_ref = proto_bin_writer_morph(&writer);
+
+    CHK(decode_with(MSG_TYPE_REQ, CMD_PUBLISH, 2, msg_data(bad_ref),
+		    msg_len(bad_ref)) == NULL);
+
+    msg_destroy(bad_ref);
+
+    /* an unknown property value type */
+    proto_bin_writer_init(&writer);
+    proto_bin_write_u32(&writer, 1);
+    proto_bin_write_u32(&writer, PROTO_BIN_DICT_REF | 0);
+    proto_bin_write_u8(&writer, 2);
+    proto_bin_write_i64(&writer, 1);
+    struct msg *bad_type = proto_bin_writer_morph(&writer);
+
+    CHK(decode_with(MSG_TYPE_REQ, CMD_PUBLISH, 2, msg_data(bad_type),
+		    msg_len(bad_type)) == NULL);
+
+    msg_destroy(bad_type);
+
+    /* more property values than there are */
+    uint8_t num_values[] = { 0xff, 0xff, 0xff, 0xff };
+    CHK(decode_with(MSG_TYPE_REQ, CMD_PUBLISH, 2, num_values,
+		    sizeof(num_values)) == NULL);
+
+    /* not the magic byte */
+    uint8_t json_like[11] = { '{' };
+    CHK(proto_req_bin_to_json(json_like, sizeof(json_like), dict,
+			      NULL) == NULL);
+
+    return UTEST_SUCCESS;
+}
+
+static json_t *decode_publish_with_name(const char *name, size_t name_len)
+{
+    struct proto_bin_writer writer;
+
+    proto_bin_writer_init(&writer);
+    proto_bin_write_u32(&writer, 2);
+    proto_bin_write_str(&writer, name, name_len);
+    proto_bin_write_u8(&writer, PROTO_BIN_INT64);
+    proto_bin_write_i64(&writer, 1);
+    proto_bin_write_str(&writer, name, name_len);
+    proto_bin_write_u8(&writer, PROTO_BIN_STR);
+    proto_bin_write_str(&writer, "x", 1);
+
+    struct msg *props = proto_bin_writer_morph(&writer);
+    json_t *req = decode_with(MSG_TYPE_REQ, CMD_PUBLISH, 2,
+			      msg_data(props), msg_len(props));
+
+    msg_destroy(props);
+
+    return req;
+}
+
+TESTCASE(proto_bin, reject_invalid_name)
+{
+    json_t *req = decode_publish_with_name("a", 1);
+    CHK(req != NULL);
+
+    json_t *props = json_object_get(req, PROTO_FIELD_SERVICE_PROPS);
+    json_t *values = json_object_get(props, "a");
+    CHK(json_is_array(values));
+    CHKINTEQ(json_array_size(values), 2);
+    json_decref(req);
+
+    /* not valid UTF-8 */
+    CHK(decode_publish_with_name("\xff", 1) == NULL);
+    CHK(decode_publish_with_name("a\xc3", 2) == NULL);
+
+    /* an embedded NUL */
+    CHK(decode_publish_with_name("a\0b", 3) == NULL);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_bin, response)
+{
+    struct proto_bin_writer writer;
+
+    proto_bin_writer_init(&writer);
+    proto_bin_write_u8(&writer, PROTO_BIN_MAGIC);
+    proto_bin_write_u8(&writer, MSG_TYPE_REQ);
+    proto_bin_write_u8(&writer, CMD_PING);
+    proto_bin_write_i64(&writer, 4711);
+
+    struct msg *req_msg = proto_bin_writer_morph(&writer);
+    struct proto_ta *ta = proto_ta_create(NULL);
+
+    proto_ta_set_binary(ta, dict);
+
+    CHKNOERR(proto_ta_req(ta, req_msg));
+    CHKSTREQ(proto_ta_get_cmd(ta), PROTO_CMD_PING);
+
+    struct msg *response = proto_ta_complete(ta);
+    struct proto_bin_reader reader;
+    uint8_t magic;
+    uint8_t msg_type;
+    uint8_t cmd;
+    int64_t ta_id;
+
+    proto_bin_reader_init(&reader, msg_data(response), msg_len(response));
+
+    CHKNOERR(proto_bin_read_u8(&reader, &magic));
+    CHKINTEQ(magic, PROTO_BIN_MAGIC);
+    CHKNOERR(proto_bin_read_u8(&reader, &msg_type));
+    CHKINTEQ(msg_type, MSG_TYPE_COMPLETE);
+    CHKNOERR(proto_bin_read_u8(&reader, &cmd));
+    CHKINTEQ(cmd, CMD_PING);
+    CHKNOERR(proto_bin_read_i64(&reader, &ta_id));
+    CHK(ta_id == 4711);
+    CHK(proto_bin_reader_at_end(&reader));
+
+    msg_destroy(response);
+    proto_ta_destroy(ta);
+    msg_destroy(req_msg);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_bin, envelope)
+{
+    const char *msgs[] = { "first", "", "third message" };
+    struct proto_bin_writer writer;
+    size_t i;
+
+    /* as laid out by the connection's output path */
+    proto_bin_writer_init(&writer);
+    proto_bin_write_u8(&writer, PROTO_BIN_MAGIC);
+    proto_bin_write_u8(&writer, PROTO_BIN_ENVELOPE);
+
+    for (i = 0; i < UT_ARRAY_LEN(msgs); i++)
+	proto_bin_write_str(&writer, msgs[i], strlen(msgs[i]));
+
+    struct msg *envelope = proto_bin_writer_morph(&writer);
+    const uint8_t *data = msg_data(envelope);
+
+    CHKINTEQ(msg_len(envelope), 2 + 3 * 4 + 5 + 0 + 13);
+    CHKINTEQ(data[0], PROTO_BIN_MAGIC);
+    CHKINTEQ(data[1], PROTO_BIN_ENVELOPE);
+
+    struct proto_bin_reader reader;
+
+    proto_bin_reader_init(&reader, data + 2, msg_len(envelope) - 2);
+
+    for (i = 0; !proto_bin_reader_at_end(&reader); i++) {
+	const char *str;
+	size_t len;
+
+	CHK(i < UT_ARRAY_LEN(msgs));
+	CHKNOERR(proto_bin_read_str(&reader, &str, &len));
+	CHKINTEQ(len, strlen(msgs[i]));
+	CHK(memcmp(str, msgs[i], len) == 0);
+    }
+
+    CHKINTEQ(i, UT_ARRAY_LEN(msgs));
+
+    /* a cut-off envelope */
+    proto_bin_reader_init(&reader, data + 2, msg_len(envelope) - 3);
+
+    for (i = 0; i < UT_ARRAY_LEN(msgs) - 1; i++) {
+	const char *str;
+	size_t len;
+	CHKNOERR(proto_bin_read_str(&reader, &str, &len));
+    }
+
+    const char *str;
+    size_t len;
+    CHKINTEQ(proto_bin_read_str(&reader, &str, &len), -1);
+
+    msg_destroy(envelope);
+
+    return UTEST_SUCCESS;
+}
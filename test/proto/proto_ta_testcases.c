@@ -0,0 +1,186 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include <string.h>
+
+#include "util.h"
+
+#include "msg.h"
+#include "proto_ta.h"
+
+TESTSUITE(proto_ta, NULL, NULL)
+
+static bool scan(const char *req, int64_t *ta_id)
+{
+    return proto_ping_scan(req, strlen(req), ta_id);
+}
+
+/* Returns the transaction id, or -1 if the validator rejects the
+   request. */
+static int64_t validate(const char *req)
+{
+    struct proto_ta *ta = proto_ta_create(NULL);
+    struct msg *msg = msg_create(req, strlen(req));
+    int64_t ta_id = -1;
+
+    if (proto_ta_req(ta, msg) == 0 &&
+	strcmp(proto_ta_get_cmd(ta), PROTO_CMD_PING) == 0)
+	ta_id = ta->ta_id;
+
+    msg_destroy(msg);
+    proto_ta_destroy(ta);
+
+    return ta_id;
+}
+
+TESTCASE(proto_ta, ping_scan_accept)
+{
+    const char *reqs[] = {
+	"{\"ta-cmd\":\"ping\",\"ta-id\":17,\"msg-type\":\"request\"}",
+	"{\"ta-cmd\": \"ping\", \"ta-id\": 17, \"msg-type\": \"request\"}",
+	"{\"msg-type\":\"request\",\"ta-cmd\":\"ping\",\"ta-id\":17}",
+	"{\"ta-id\":17,\"msg-type\":\"request\",\"ta-cmd\":\"ping\"}",
+	" \t{\n\"ta-id\" :\r17 ,\"ta-cmd\":\"ping\" ,\n\"msg-type\":"
+	"\"request\"\t}\n "
+    };
+    size_t i;
+
+    for (i = 0; i < UT_ARRAY_LEN(reqs); i++) {
+	int64_t ta_id = -1;
+
+	CHK(scan(reqs[i], &ta_id));
+	CHK(ta_id == 17);
+	CHK(validate(reqs[i]) == 17);
+    }
+
+    int64_t ta_id = -1;
+
+    CHK(scan("{\"ta-cmd\":\"ping\",\"ta-id\":0,\"msg-type\":\"request\"}",
+	     &ta_id));
+    CHK(ta_id == 0);
+
+    CHK(scan("{\"ta-cmd\":\"ping\",\"ta-id\":999999999999999999,"
+	     "\"msg-type\":\"request\"}", &ta_id));
+    CHK(ta_id == INT64_C(999999999999999999));
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_ta, ping_scan_fall_through)
+{
+    struct {
+	const char *req;
+	/* the outcome of full validation */
+	int64_t ta_id;
+    } reqs[] = {
+	/* escapes */
+	{ "{\"ta-cmd\":\"p\\u0069ng\",\"ta-id\":1,\"msg-type\":\"request\"}", 1 },
+	{ "{\"ta\\u002dcmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\"}", 1 },
+	/* non-ASCII characters */
+	{ "{\"ta-cmd\":\"p\xc3\xafng\",\"ta-id\":1,\"msg-type\":\"request\"}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\"}\xc2\xa0",
+	  -1 },
+	/* duplicate fields */
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"ta-id\":2}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\","
+	  "\"ta-id\":2}", 2 },
+	/* extra fields */
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\","
+	  "\"foo\":1}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\","
+	  "\"session-id\":1}", -1 },
+	/* missing fields */
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1}", -1 },
+	{ "{}", -1 },
+	/* leading zeros */
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":01,\"msg-type\":\"request\"}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":00,\"msg-type\":\"request\"}", -1 },
+	/* 19 digits or more */
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1000000000000000000,"
+	  "\"msg-type\":\"request\"}", INT64_C(1000000000000000000) },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":9223372036854775807,"
+	  "\"msg-type\":\"request\"}", INT64_MAX },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":99999999999999999999,"
+	  "\"msg-type\":\"request\"}", -1 },
+	/* other number forms */
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":-1,\"msg-type\":\"request\"}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1.0,\"msg-type\":\"request\"}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1e2,\"msg-type\":\"request\"}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":\"1\",\"msg-type\":\"request\"}", -1 },
+	/* trailing data */
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\"} x", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\"}}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\",}", -1 },
+	/* truncated */
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\"", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"requ", -1 },
+	{ "", -1 },
+	/* other transactions, or message types */
+	{ "{\"ta-cmd\":\"hello\",\"ta-id\":1,\"msg-type\":\"request\"}", -1 },
+	{ "{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"complete\"}", -1 },
+	{ "[\"ta-cmd\",\"ping\",\"ta-id\",1,\"msg-type\",\"request\"]", -1 }
+    };
+    size_t i;
+
+    for (i = 0; i < UT_ARRAY_LEN(reqs); i++) {
+	int64_t ta_id = -1;
+
+	CHK(!scan(reqs[i].req, &ta_id));
+	CHK(validate(reqs[i].req) == reqs[i].ta_id);
+    }
+
+    /* embedded NUL */
+    const char nul_req[] =
+	"{\"ta-cmd\":\"ping\",\"ta-id\":1,\"msg-type\":\"request\"}\0";
+    int64_t ta_id;
+
+    CHK(!proto_ping_scan(nul_req, sizeof(nul_req), &ta_id));
+
+    return UTEST_SUCCESS;
+}
+
+static int check_complete(int64_t ta_id, const char *expected)
+{
+    struct msg *fast = proto_ping_complete(ta_id);
+
+    CHKINTEQ(msg_len(fast), strlen(expected));
+    CHK(memcmp(msg_data(fast), expected, msg_len(fast)) == 0);
+
+    /* the same as produced the ordinary way */
+    char *req = ut_asprintf("{\"ta-cmd\":\"ping\",\"ta-id\":%"PRId64","
+			    "\"msg-type\":\"request\"}", ta_id);
+    struct msg *req_msg = msg_create(req, strlen(req));
+    struct proto_ta *ta = proto_ta_create(NULL);
+
+    CHKNOERR(proto_ta_req(ta, req_msg));
+
+    struct msg *slow = proto_ta_complete(ta);
+
+    CHKINTEQ(msg_len(slow), msg_len(fast));
+    CHK(memcmp(msg_data(slow), msg_data(fast), msg_len(fast)) == 0);
+
+    msg_destroy(slow);
+    proto_ta_destroy(ta);
+    msg_destroy(req_msg);
+    ut_free(req);
+    msg_destroy(fast);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(proto_ta, ping_complete)
+{
+    CHKNOERR(check_complete(0, "{\"ta-cmd\": \"ping\", \"ta-id\": 0, "
+			    "\"msg-type\": \"complete\"}"));
+    CHKNOERR(check_complete(4711, "{\"ta-cmd\": \"ping\", \"ta-id\": 4711, "
+			    "\"msg-type\": \"complete\"}"));
+    CHKNOERR(check_complete(INT64_MAX, "{\"ta-cmd\": \"ping\", \"ta-id\": "
+			    "9223372036854775807, \"msg-type\": "
+			    "\"complete\"}"));
+
+    return UTEST_SUCCESS;
+}
@@ -0,0 +1,183 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include "chlog.h"
+
+#define CAPACITY 8
+
+static struct chlog_seq *seq;
+static struct chlog *log;
+
+static int setup(unsigned setup_flags)
+{
+    seq = chlog_seq_create();
+    log = chlog_create(seq, CAPACITY);
+
+    return UTEST_SUCCESS;
+}
+
+static int teardown(unsigned setup_flags)
+{
+    chlog_destroy(log);
+    chlog_seq_destroy(seq);
+
+    return UTEST_SUCCESS;
+}
+
+TESTSUITE(chlog, setup, teardown)
+
+static int64_t add(struct chlog *log, int64_t service_id, int64_t prev_x)
+{
+    if (prev_x < 0)
+	return chlog_add(log, service_id, NULL);
+
+    struct props *props = props_create();
+    props_add_int64(props, "x", prev_x);
+
+    int64_t change_seq = chlog_add(log, service_id, props);
+
+    props_destroy(props);
+
+    return change_seq;
+}
+
+struct since
+{
+    int num_services;
+    int64_t service_id_sum;
+    /* the sum of the services' 'x' as of the starting point */
+    int64_t x_sum;
+    int num_new;
+};
+
+static void since_cb(int64_t service_id, const struct props *props,
+		     void *cb_data)
+{
+    struct since *since = cb_data;
+
+    since->num_services++;
+    since->service_id_sum += service_id;
+
+    if (props != NULL) {
+	const struct pvalue *x = props_get_one(props, "x");
+	since->x_sum += pvalue_int64(x);
+    } else
+	since->num_new++;
+}
+
+static struct since foreach_since(int64_t from)
+{
+    struct since since = { };
+
+    chlog_foreach_since(log, from, since_cb, &since);
+
+    return since;
+}
+
+TESTCASE(chlog, foreach_since)
+{
+    int64_t start = chlog_seq_last(seq);
+
+    CHK(start != 0);
+    CHK(chlog_covers(log, start));
+    CHK(!chlog_covers(log, start - 1));
+    CHK(!chlog_covers(log, start + 1));
+
+    CHK(add(log, 1, -1) == start + 1);
+    CHK(add(log, 2, -1) == start + 2);
+    CHK(add(log, 1, 10) == start + 3);
+    CHK(add(log, 1, 11) == start + 4);
+    CHK(add(log, 2, 20) == start + 5);
+
+    CHK(chlog_seq_last(seq) == start + 5);
+
+    struct since since = foreach_since(start);
+
+    CHKINTEQ(since.num_services, 2);
+    CHK(since.service_id_sum == 3);
+    CHKINTEQ(since.num_new, 2);
+
+    since = foreach_since(start + 2);
+
+    CHKINTEQ(since.num_services, 2);
+    CHK(since.x_sum == 10 + 20);
+    CHKINTEQ(since.num_new, 0);
+
+    since = foreach_since(start + 3);
+
+    CHKINTEQ(since.num_services, 2);
+    CHK(since.x_sum == 11 + 20);
+
+    CHKINTEQ(foreach_since(start + 5).num_services, 0);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(chlog, trim)
+{
+    int64_t start = chlog_seq_last(seq);
+    int i;
+
+    for (i = 0; i < 3 * CAPACITY; i++)
+	add(log, i, i);
+
+    CHKINTEQ(chlog_len(log), CAPACITY);
+
+    int64_t last = chlog_seq_last(seq);
+
+    CHK(!chlog_covers(log, start));
+    CHK(!chlog_covers(log, last - CAPACITY - 1));
+    CHK(chlog_covers(log, last - CAPACITY));
+    CHK(chlog_covers(log, last));
+
+    struct since since = foreach_since(last - CAPACITY);
+
+    CHKINTEQ(since.num_services, CAPACITY);
+    CHK(since.x_sum == since.service_id_sum);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(chlog, pin)
+{
+    struct chlog *other_log = chlog_create(seq, CAPACITY);
+    int64_t pinned = chlog_seq_last(seq);
+    int i;
+
+    chlog_seq_pin(seq, pinned);
+    chlog_seq_pin(seq, pinned + 1);
+
+    /* both logs share the sequence, and keep the changes */
+    for (i = 0; i < 2 * CAPACITY; i++) {
+	add(log, i, -1);
+	add(other_log, i, -1);
+    }
+
+    CHKINTEQ(chlog_len(log), 2 * CAPACITY);
+    CHKINTEQ(chlog_len(other_log), 2 * CAPACITY);
+    CHK(chlog_covers(log, pinned));
+    CHK(chlog_covers(other_log, pinned));
+
+    CHKINTEQ(foreach_since(pinned).num_services, 2 * CAPACITY);
+
+    chlog_seq_unpin(seq, pinned);
+
+    add(log, 0, -1);
+
+    CHK(!chlog_covers(log, pinned));
+    CHK(chlog_covers(log, pinned + 1));
+
+    chlog_seq_unpin(seq, pinned + 1);
+
+    add(log, 0, -1);
+
+    CHKINTEQ(chlog_len(log), CAPACITY);
+
+    chlog_destroy(other_log);
+
+    return UTEST_SUCCESS;
+}
@@ -0,0 +1,270 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "testutil.h"
+#include "util.h"
+
+#include "journal.h"
+#include "service.h"
+
+static char dir_path[] = "/tmp/tpaftest-journal-XXXXXX";
+static char *prefix;
+
+static int setup(unsigned setup_flags)
+{
+    strcpy(dir_path + strlen(dir_path) - 6, "XXXXXX");
+
+    CHK(mkdtemp(dir_path) != NULL);
+
+    prefix = ut_asprintf("%s/domain.journal", dir_path);
+
+    return UTEST_SUCCESS;
+}
+
+static int teardown(unsigned setup_flags)
+{
+    DIR *dir = opendir(dir_path);
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL)
+	if (entry->d_name[0] != '.') {
+	    char *path = ut_asprintf("%s/%s", dir_path, entry->d_name);
+	    unlink(path);
+	    ut_free(path);
+	}
+
+    closedir(dir);
+
+    rmdir(dir_path);
+
+    ut_free(prefix);
+
+    return UTEST_SUCCESS;
+}
+
+TESTSUITE(journal, setup, teardown)
+
+static void ignore_change_cb(struct service *service,
+			     enum service_change_type change_type,
+			     void *cb_data)
+{
+}
+
+static struct service *create_service(int64_t service_id,
+				      int64_t generation, int64_t ttl)
+{
+    struct service *service =
+	service_create(service_id, ignore_change_cb, NULL);
+    struct props *props = props_create();
+
+    props_add_int64(props, "generation", generation);
+
+    service_add_begin(service);
+    service_set_generation(service, generation);
+    service_set_props(service, props);
+    service_set_ttl(service, ttl);
+    service_set_client_id(service, 42);
+    service_set_non_orphan(service);
+    service_commit(service);
+
+    props_destroy(props);
+
+    return service;
+}
+
+#define MAX_REPLAYED 16
+
+struct replayed
+{
+    size_t count;
+    enum srec_type types[MAX_REPLAYED];
+    int64_t service_ids[MAX_REPLAYED];
+    int64_t generations[MAX_REPLAYED];
+};
+
+static void record_replay_cb(const struct srec *rec, void *cb_data)
+{
+    struct replayed *replayed = cb_data;
+    size_t idx = replayed->count++;
+
+    replayed->types[idx] = rec->type;
+    replayed->service_ids[idx] = rec->service_id;
+    replayed->generations[idx] = rec->generation;
+}
+
+static void journal_some(struct journal *journal)
+{
+    struct service *service = create_service(17, 1, 60);
+
+    journal_add(journal, service, service_change_type_added);
+
+    service_modify_begin(service);
+    service_set_generation(service, 2);
+    service_commit(service);
+
+    journal_add(journal, service, service_change_type_modified);
+    journal_add(journal, service, service_change_type_removed);
+
+    service_dec_ref(service);
+}
+
+TESTCASE(journal, replay)
+{
+    struct journal *journal =
+	journal_create(prefix, 1, journal_sync_batch, NULL);
+
+    CHKNOERR(journal_start(journal));
+
+    journal_some(journal);
+
+    CHK(journal_rotate(journal) == 2);
+
+    struct service *service = create_service(99, 5, 1);
+    journal_add(journal, service, service_change_type_added);
+    service_dec_ref(service);
+
+    journal_destroy(journal);
+
+    struct replayed replayed = {};
+    uint64_t last_seq = 0;
+
+    CHKINTEQ(journal_replay(prefix, 1, &last_seq, record_replay_cb,
+			    &replayed, NULL), 4);
+
+    CHK(last_seq == 2);
+
+    CHKINTEQ(replayed.types[0], srec_type_service);
+    CHK(replayed.service_ids[0] == 17);
+    CHK(replayed.generations[0] == 1);
+
+    CHKINTEQ(replayed.types[1], srec_type_service);
+    CHK(replayed.generations[1] == 2);
+
+    CHKINTEQ(replayed.types[2], srec_type_removed);
+    CHK(replayed.service_ids[2] == 17);
+
+    CHK(replayed.service_ids[3] == 99);
+
+    replayed = (struct replayed) {};
+
+    CHKINTEQ(journal_replay(prefix, 2, &last_seq, record_replay_cb,
+			    &replayed, NULL), 1);
+    CHK(replayed.service_ids[0] == 99);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(journal, compact)
+{
+    struct journal *journal =
+	journal_create(prefix, 7, journal_sync_none, NULL);
+
+    CHKNOERR(journal_start(journal));
+
+    journal_some(journal);
+
+    uint64_t seq = journal_rotate(journal);
+
+    journal_some(journal);
+
+    journal_compact(journal, seq);
+
+    journal_destroy(journal);
+
+    struct replayed replayed = {};
+    uint64_t last_seq = 0;
+
+    CHKINTEQ(journal_replay(prefix, 0, &last_seq, record_replay_cb,
+			    &replayed, NULL), 3);
+    CHK(last_seq == seq);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(journal, truncated)
+{
+    struct journal *journal =
+	journal_create(prefix, 1, journal_sync_periodic, NULL);
+
+    CHKNOERR(journal_start(journal));
+
+    journal_some(journal);
+
+    journal_destroy(journal);
+
+    char *path = ut_asprintf("%s.%016x", prefix, 1);
+
+    FILE *file = fopen(path, "r");
+    CHK(file != NULL);
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fclose(file);
+
+    /* as if the process crashed in the middle of writing */
+    CHKNOERR(truncate(path, len - 4));
+
+    ut_free(path);
+
+    struct replayed replayed = {};
+    uint64_t last_seq = 0;
+
+    CHKINTEQ(journal_replay(prefix, 0, &last_seq, record_replay_cb,
+			    &replayed, NULL), 2);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(journal, failed)
+{
+    char *path = ut_asprintf("%s.%016x", prefix, 1);
+
+    /* makes the file impossible to open */
+    CHKNOERR(mkdir(path, 0700));
+
+    struct journal *journal =
+	journal_create(prefix, 1, journal_sync_batch, NULL);
+
+    CHKNOERR(journal_start(journal));
+
+    journal_some(journal);
+
+    tu_fsleep(0.25);
+
+    CHKNOERR(rmdir(path));
+
+    /* the file stays abandoned, rather than missing records */
+    journal_some(journal);
+
+    CHK(journal_rotate(journal) == 2);
+
+    struct service *service = create_service(99, 5, 1);
+    journal_add(journal, service, service_change_type_added);
+    service_dec_ref(service);
+
+    journal_destroy(journal);
+
+    CHK(access(path, F_OK) < 0);
+
+    ut_free(path);
+
+    struct replayed replayed = {};
+    uint64_t last_seq = 0;
+
+    CHKINTEQ(journal_replay(prefix, 0, &last_seq, record_replay_cb,
+			    &replayed, NULL), 1);
+    CHK(last_seq == 2);
+    CHK(replayed.service_ids[0] == 99);
+
+    return UTEST_SUCCESS;
+}
@@ -290,3 +290,63 @@ TESTCASE(props, clone)
     return UTEST_SUCCESS;
 }
 
+
+TESTCASE(props, diff)
+{
+    struct props *from = props_create();
+    props_add_str(from, "name", "foo");
+    props_add_int64(from, "load", 17);
+    props_add_int64(from, "port", 80);
+    props_add_int64(from, "port", 443);
+    props_add_str(from, "old", "bar");
+
+    struct props *to = props_create();
+    props_add_int64(to, "port", 443);
+    props_add_int64(to, "port", 80);
+    props_add_int64(to, "load", 18);
+    props_add_str(to, "name", "foo");
+    props_add_str(to, "new", "baz");
+
+    struct props *changed;
+    struct props *removed;
+
+    props_diff(from, to, &changed, &removed);
+
+    struct props *expected_changed = props_create();
+    props_add_int64(expected_changed, "load", 18);
+    props_add_str(expected_changed, "new", "baz");
+
+    struct props *expected_removed = props_create();
+    props_add_str(expected_removed, "old", "bar");
+
+    CHKNOERR(assure_equal(changed, expected_changed));
+    CHKNOERR(assure_equal(removed, expected_removed));
+
+    props_destroy(changed);
+    props_destroy(removed);
+
+    /* a multi-value property losing one value is changed */
+    props_del_one(to, "port");
+
+    props_diff(from, to, &changed, &removed);
+
+    CHK(props_has(changed, "port"));
+    CHKINTEQ(props_num_values(changed), 3);
+
+    props_destroy(changed);
+    props_destroy(removed);
+
+    props_diff(from, from, &changed, &removed);
+
+    CHKINTEQ(props_num_values(changed), 0);
+    CHKINTEQ(props_num_values(removed), 0);
+
+    props_destroy(changed);
+    props_destroy(removed);
+    props_destroy(from);
+    props_destroy(to);
+    props_destroy(expected_changed);
+    props_destroy(expected_removed);
+
+    return UTEST_SUCCESS;
+}
@@ -202,3 +202,409 @@ TESTCASE(sd, subscribe_unsubscribe)
 
     return UTEST_SUCCESS;
 }
+
+static bool count_service_cb(const struct service *service, void *cb_data)
+{
+    size_t *count = cb_data;
+
+    (*count)++;
+
+    return true;
+}
+
+static bool count_sub_cb(int64_t sub_id, int64_t client_id,
+			 const char *filter_s, void *cb_data)
+{
+    size_t *count = cb_data;
+
+    (*count)++;
+
+    return true;
+}
+
+static bool count_client_cb(int64_t client_id, const char *remote_addr,
+			    double connected_at, void *cb_data)
+{
+    size_t *count = cb_data;
+
+    (*count)++;
+
+    return true;
+}
+
+struct snapshot_counts
+{
+    size_t services;
+    size_t subs;
+    size_t clients;
+};
+
+static void count_snapshot(struct snapshot_counts *counts)
+{
+    *counts = (struct snapshot_counts) {};
+
+    const struct sd_snapshot *snapshot = sd_snapshot_enter(sd, 0);
+
+    sd_snapshot_foreach_service(snapshot, NULL, count_service_cb,
+				&counts->services);
+    sd_snapshot_foreach_sub(snapshot, count_sub_cb, &counts->subs);
+    sd_snapshot_foreach_client(snapshot, count_client_cb, &counts->clients);
+
+    sd_snapshot_leave(sd, 0);
+}
+
+TESTCASE(sd, snapshots)
+{
+    sd_enable_snapshots(sd, 1);
+
+    int64_t client_id = 99;
+
+    CHKNOSDERR(sd_client_connect(sd, client_id, "ux:foo"));
+
+    struct props *props = props_create();
+    props_add_int64(props, "x", 17);
+
+    CHKNOSDERR(sd_publish(sd, client_id, 1, 0, props, 60));
+    CHKNOSDERR(sd_publish(sd, client_id, 2, 0, props, 60));
+
+    struct record_match match = {};
+
+    CHKNOSDERR(sd_create_sub(sd, client_id, 42, "(x=17)", record_match_cb,
+			     &match));
+    sd_activate_sub(sd, client_id, 42);
+
+    struct snapshot_counts counts;
+
+    count_snapshot(&counts);
+    CHKINTEQ(counts.services, 2);
+    CHKINTEQ(counts.subs, 1);
+    CHKINTEQ(counts.clients, 1);
+
+    const struct sd_snapshot *old = sd_snapshot_enter(sd, 0);
+
+    CHKNOSDERR(sd_unpublish(sd, client_id, 1));
+    CHKNOSDERR(sd_client_disconnect(sd, client_id));
+
+    /* retired data is kept alive while the reader is active */
+    run_loop(0.3);
+    CHK(sd_snapshot_pending(sd) > 0);
+
+    size_t old_services = 0;
+    sd_snapshot_foreach_service(old, NULL, count_service_cb, &old_services);
+    CHKINTEQ(old_services, 2);
+
+    sd_snapshot_leave(sd, 0);
+
+    count_snapshot(&counts);
+    /* the orphan remains, until its ttl expires */
+    CHKINTEQ(counts.services, 1);
+    CHKINTEQ(counts.subs, 0);
+    CHKINTEQ(counts.clients, 0);
+
+    run_loop(0.3);
+    CHKINTEQ(sd_snapshot_pending(sd), 0);
+
+    props_destroy(props);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(sd, restore)
+{
+    int64_t pub_client_id = 99;
+    int64_t service_id = 4444;
+    int64_t generation = 44;
+    struct props *props = props_create();
+    props_add_int64(props, "x", 17);
+
+    sd_restore(sd, pub_client_id, service_id, generation, props, 60,
+	       ut_ftime() - 10);
+
+    /* expires shortly */
+    sd_restore(sd, pub_client_id, service_id + 1, generation, props, 1,
+	       ut_ftime() - 0.5);
+
+    int64_t sub_client_id = 100;
+
+    CHKNOSDERR(sd_client_connect(sd, sub_client_id, "ux:foo"));
+
+    struct record_match match = {};
+    int64_t sub_id = 1234;
+    CHKNOSDERR(sd_create_sub(sd, sub_client_id, sub_id, "(x=17)",
+			     record_match_cb, &match));
+
+    sd_activate_sub(sd, sub_client_id, sub_id);
+
+    CHKINTEQ(match.match_type, sub_match_type_appeared);
+    CHK(service_is_orphan(match.service));
+    CHK(service_get_client_id(match.service) == pub_client_id);
+
+    match = (struct record_match) { };
+
+    run_loop(0.75);
+
+    CHKINTEQ(match.match_type, sub_match_type_disappeared);
+
+    match = (struct record_match) { };
+
+    /* the owner reclaims the service */
+    CHKNOSDERR(sd_client_connect(sd, pub_client_id, "ux:asdf"));
+    CHKNOSDERR(sd_publish(sd, pub_client_id, service_id, generation,
+			  props, 60));
+
+    CHKINTEQ(match.match_type, sub_match_type_modified);
+    CHK(service_get_id(match.service) == service_id);
+    CHK(!service_is_orphan(match.service));
+
+    props_destroy(props);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(sd, mirror)
+{
+    int64_t pub_client_id = 99;
+    int64_t service_id = 4444;
+    struct props *props = props_create();
+    props_add_int64(props, "x", 17);
+
+    int64_t sub_client_id = 100;
+
+    CHKNOSDERR(sd_client_connect(sd, sub_client_id, "ux:foo"));
+
+    struct record_match match = {};
+    int64_t sub_id = 1234;
+    CHKNOSDERR(sd_create_sub(sd, sub_client_id, sub_id, "(x=17)",
+			     record_match_cb, &match));
+
+    sd_activate_sub(sd, sub_client_id, sub_id);
+
+    sd_mirror(sd, pub_client_id, service_id, 1, props, 60, -1);
+
+    CHKINTEQ(match.match_type, sub_match_type_appeared);
+    CHK(!service_is_orphan(match.service));
+    CHK(service_get_client_id(match.service) == pub_client_id);
+
+    match = (struct record_match) { };
+
+    /* orphans are left for the other server to time out */
+    sd_mirror(sd, pub_client_id, service_id, 1, props, 1, ut_ftime() - 2);
+
+    CHKINTEQ(match.match_type, sub_match_type_modified);
+    CHK(service_is_orphan(match.service));
+
+    match = (struct record_match) { };
+
+    run_loop(0.25);
+
+    CHK(match.service == NULL);
+
+    sd_mirror_remove(sd, service_id);
+
+    CHKINTEQ(match.match_type, sub_match_type_disappeared);
+
+    match = (struct record_match) { };
+
+    sd_mirror_remove(sd, service_id);
+
+    CHK(match.service == NULL);
+
+    /* mirrored services are off limits for local clients, and vice
+       versa */
+    sd_mirror(sd, pub_client_id, service_id, 1, props, 60, -1);
+
+    CHKINTEQ(sd_publish(sd, sub_client_id, service_id, 2, props, 60),
+	     SD_ERR_PERM_DENIED);
+    CHKINTEQ(sd_unpublish(sd, sub_client_id, service_id),
+	     SD_ERR_PERM_DENIED);
+
+    sd_mirror_remove(sd, service_id);
+
+    CHKNOSDERR(sd_publish(sd, sub_client_id, service_id, 1, props, 60));
+
+    match = (struct record_match) { };
+
+    sd_mirror(sd, pub_client_id, service_id, 2, props, 60, -1);
+    sd_mirror_remove(sd, service_id);
+
+    CHK(match.service == NULL);
+
+    CHKNOSDERR(sd_unpublish(sd, sub_client_id, service_id));
+
+    props_destroy(props);
+
+    return UTEST_SUCCESS;
+}
+
+struct count_matches
+{
+    int num[3];
+    int64_t service_id_sum[3];
+};
+
+static void count_match_cb(struct sub *sub, const struct service *service,
+			   enum sub_match_type match_type, void *cb_data)
+{
+    struct count_matches *counts = cb_data;
+
+    counts->num[match_type]++;
+    counts->service_id_sum[match_type] += service_get_id(service);
+}
+
+static int publish_x(int64_t client_id, int64_t service_id,
+		     int64_t generation, int64_t x)
+{
+    struct props *props = props_create();
+    props_add_int64(props, "x", x);
+
+    int rc = sd_publish(sd, client_id, service_id, generation, props, 60);
+
+    props_destroy(props);
+
+    return rc;
+}
+
+TESTCASE(sd, resume_sub)
+{
+    int64_t pub_client_id = 99;
+
+    CHKNOSDERR(sd_client_connect(sd, pub_client_id, "ux:asdf"));
+
+    CHKNOSDERR(publish_x(pub_client_id, 1, 1, 17));
+    CHKNOSDERR(publish_x(pub_client_id, 2, 1, 17));
+    CHKNOSDERR(publish_x(pub_client_id, 3, 1, 0));
+    CHKNOSDERR(publish_x(pub_client_id, 5, 1, 17));
+
+    int64_t seq = sd_get_change_seq(sd);
+
+    CHK(sd_has_changes_since(sd, seq));
+
+    /* modified */
+    CHKNOSDERR(publish_x(pub_client_id, 1, 2, 17));
+    CHKNOSDERR(publish_x(pub_client_id, 1, 3, 17));
+    /* out of sight, into sight */
+    CHKNOSDERR(publish_x(pub_client_id, 2, 2, 0));
+    CHKNOSDERR(publish_x(pub_client_id, 3, 2, 17));
+    /* came and went */
+    CHKNOSDERR(publish_x(pub_client_id, 4, 1, 17));
+    CHKNOSDERR(sd_unpublish(sd, pub_client_id, 4));
+    /* removed */
+    CHKNOSDERR(sd_unpublish(sd, pub_client_id, 5));
+
+    CHK(sd_get_change_seq(sd) == seq + 7);
+
+    int64_t sub_client_id = 100;
+
+    CHKNOSDERR(sd_client_connect(sd, sub_client_id, "ux:foo"));
+
+    struct count_matches counts = {};
+    int64_t sub_id = 1234;
+    CHKNOSDERR(sd_create_sub(sd, sub_client_id, sub_id, "(x=17)",
+			     count_match_cb, &counts));
+
+    CHKNOSDERR(sd_resume_sub(sd, sub_client_id, sub_id, seq));
+
+    CHKINTEQ(counts.num[sub_match_type_appeared], 1);
+    CHK(counts.service_id_sum[sub_match_type_appeared] == 3);
+    CHKINTEQ(counts.num[sub_match_type_modified], 1);
+    CHK(counts.service_id_sum[sub_match_type_modified] == 1);
+    CHKINTEQ(counts.num[sub_match_type_disappeared], 2);
+    CHK(counts.service_id_sum[sub_match_type_disappeared] == 2 + 5);
+
+    counts = (struct count_matches) { };
+
+    /* nothing happened since */
+    CHKNOSDERR(sd_resume_sub(sd, sub_client_id, sub_id,
+			     sd_get_change_seq(sd)));
+
+    CHKINTEQ(counts.num[sub_match_type_appeared] +
+	     counts.num[sub_match_type_modified] +
+	     counts.num[sub_match_type_disappeared], 0);
+
+    /* from before the sd instance existed, or from the future */
+    CHK(!sd_has_changes_since(sd, seq - 1000));
+    CHKINTEQ(sd_resume_sub(sd, sub_client_id, sub_id, seq - 1000),
+	     SD_ERR_CHANGES_TRIMMED);
+    CHKINTEQ(sd_resume_sub(sd, sub_client_id, sub_id,
+			   sd_get_change_seq(sd) + 1),
+	     SD_ERR_CHANGES_TRIMMED);
+
+    return UTEST_SUCCESS;
+}
+
+struct record_delta
+{
+    enum sub_match_type match_type;
+    bool has_delta;
+    size_t num_changed;
+    size_t num_removed;
+};
+
+static void record_delta_cb(struct sub *sub, const struct service *service,
+			    enum sub_match_type match_type, void *cb_data)
+{
+    struct record_delta *d = cb_data;
+    const struct props *changed;
+    const struct props *removed;
+
+    d->match_type = match_type;
+    d->has_delta = service_get_props_delta(service, &changed, &removed);
+
+    if (d->has_delta) {
+	d->num_changed = props_num_values(changed);
+	d->num_removed = props_num_values(removed);
+    }
+}
+
+TESTCASE(sd, props_delta)
+{
+    int64_t pub_client_id = 99;
+
+    CHKNOSDERR(sd_client_connect(sd, pub_client_id, "ux:asdf"));
+
+    struct props *props = props_create();
+    props_add_int64(props, "x", 17);
+    props_add_str(props, "name", "foo");
+    props_add_int64(props, "load", 1);
+
+    CHKNOSDERR(sd_publish(sd, pub_client_id, 1, 1, props, 60));
+
+    int64_t seq = sd_get_change_seq(sd);
+
+    int64_t sub_client_id = 100;
+
+    CHKNOSDERR(sd_client_connect(sd, sub_client_id, "ux:foo"));
+
+    struct record_delta delta = {};
+    int64_t sub_id = 1234;
+    CHKNOSDERR(sd_create_sub(sd, sub_client_id, sub_id, "(x=17)",
+			     record_delta_cb, &delta));
+
+    sd_activate_sub(sd, sub_client_id, sub_id);
+
+    CHKINTEQ(delta.match_type, sub_match_type_appeared);
+    CHK(!delta.has_delta);
+
+    props_del_one(props, "load");
+    props_add_int64(props, "load", 2);
+    props_del_one(props, "name");
+
+    CHKNOSDERR(sd_publish(sd, pub_client_id, 1, 2, props, 60));
+
+    CHKINTEQ(delta.match_type, sub_match_type_modified);
+    CHK(delta.has_delta);
+    CHKINTEQ(delta.num_changed, 1);
+    CHKINTEQ(delta.num_removed, 1);
+
+    delta = (struct record_delta) { };
+
+    /* the subscriber may not have seen the previous generation */
+    CHKNOSDERR(sd_resume_sub(sd, sub_client_id, sub_id, seq));
+
+    CHKINTEQ(delta.match_type, sub_match_type_modified);
+    CHK(!delta.has_delta);
+
+    props_destroy(props);
+
+    return UTEST_SUCCESS;
+}
@@ -0,0 +1,287 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include <event2/event.h>
+#include <inttypes.h>
+
+#include "testutil.h"
+#include "util.h"
+
+#include "shards.h"
+
+#define NUM_SHARDS 3
+
+static struct event_base *event_base;
+static struct shards *shards;
+
+static int setup(unsigned setup_flags)
+{
+    event_base = event_base_new();
+
+    CHK(event_base != NULL);
+
+    shards = shards_create(event_base, NUM_SHARDS, NULL);
+
+    CHK(shards != NULL);
+
+    CHK(shards_start(shards) == 0);
+
+    return UTEST_SUCCESS;
+}
+
+static int teardown(unsigned setup_flags)
+{
+    shards_destroy(shards);
+
+    event_base_free(event_base);
+
+    return UTEST_SUCCESS;
+}
+
+TESTSUITE(shards, setup, teardown)
+
+/* Runs the event loop until '*count' reaches 'target', or the
+   timeout expires. */
+static bool run_until(const int *count, int target, double timeout)
+{
+    double deadline = ut_ftime() + timeout;
+
+    while (*count < target && ut_ftime() < deadline) {
+	struct timeval tmo;
+	tu_f_to_timeval(0.01, &tmo);
+
+	event_base_loopexit(event_base, &tmo);
+	event_base_dispatch(event_base);
+    }
+
+    return *count >= target;
+}
+
+struct results
+{
+    int count;
+    int last_rc;
+};
+
+static void record_result_cb(int64_t op_id, int rc, void *cb_data)
+{
+    struct results *results = cb_data;
+
+    results->count++;
+    results->last_rc = rc;
+}
+
+struct matches
+{
+    int appeared;
+    int modified;
+    int disappeared;
+    int64_t last_generation;
+};
+
+static void record_match_cb(struct sub *sub, const struct service *service,
+			    enum sub_match_type match_type, void *cb_data)
+{
+    struct matches *matches = cb_data;
+
+    switch (match_type) {
+    case sub_match_type_appeared:
+	matches->appeared++;
+	break;
+    case sub_match_type_modified:
+	matches->modified++;
+	matches->last_generation = service_get_generation(service);
+	break;
+    case sub_match_type_disappeared:
+	matches->disappeared++;
+	break;
+    }
+}
+
+#define NUM_SERVICES 32
+
+static void publish_all(int64_t client_id, int64_t generation,
+			struct results *results)
+{
+    struct props *props = props_create();
+    props_add_int64(props, "x", 17);
+
+    int i;
+    for (i = 0; i < NUM_SERVICES; i++)
+	shards_publish(shards, client_id, 1000 + i, generation, props, 1,
+		       i, record_result_cb, results);
+
+    props_destroy(props);
+}
+
+TESTCASE(shards, publish_subscribe)
+{
+    int64_t pub_client_id = 99;
+    int64_t sub_client_id = 100;
+
+    CHKINTEQ(shards_client_connect(shards, pub_client_id, "ux:foo"), 0);
+    CHKINTEQ(shards_client_connect(shards, pub_client_id, "ux:foo"),
+	     SD_ERR_CLIENT_ALREADY_EXISTS);
+    CHKINTEQ(shards_client_connect(shards, sub_client_id, "ux:bar"), 0);
+
+    struct results results = {};
+
+    publish_all(pub_client_id, 1, &results);
+
+    CHK(run_until(&results.count, NUM_SERVICES, 5.0));
+    CHKINTEQ(results.last_rc, 0);
+
+    struct matches matches = {};
+    int64_t sub_id = 1234;
+
+    CHKINTEQ(shards_create_sub(shards, sub_client_id, sub_id, "(x=17)",
+			       record_match_cb, &matches), 0);
+    CHKINTEQ(shards_create_sub(shards, sub_client_id, sub_id, NULL,
+			       record_match_cb, &matches),
+	     SD_ERR_SUB_ALREADY_EXISTS);
+
+    shards_activate_sub(shards, sub_client_id, sub_id);
+
+    CHK(run_until(&matches.appeared, NUM_SERVICES, 5.0));
+
+    /* Notifications for a service are delivered in order */
+    int64_t generation;
+    for (generation = 2; generation <= 10; generation++)
+	publish_all(pub_client_id, generation, &results);
+
+    CHK(run_until(&matches.modified, NUM_SERVICES * 9, 5.0));
+    CHKINTEQ(matches.last_generation, 10);
+
+    results = (struct results) {};
+
+    struct props *props = props_create();
+
+    shards_publish(shards, pub_client_id, 1000, 5, props, 1, 0,
+		   record_result_cb, &results);
+
+    props_destroy(props);
+
+    CHK(run_until(&results.count, 1, 5.0));
+    CHKINTEQ(results.last_rc, SD_ERR_NEWER_SERVICE_GENERATION_EXISTS);
+
+    matches = (struct matches) {};
+
+    CHKINTEQ(shards_client_disconnect(shards, pub_client_id), 0);
+
+    CHK(run_until(&matches.modified, NUM_SERVICES, 5.0));
+    CHK(run_until(&matches.disappeared, NUM_SERVICES, 5.0));
+
+    CHKINTEQ(shards_unsubscribe(shards, sub_client_id, sub_id), 0);
+    CHKINTEQ(shards_unsubscribe(shards, sub_client_id, sub_id),
+	     SD_ERR_NO_SUCH_SUB);
+
+    CHKINTEQ(shards_client_disconnect(shards, sub_client_id), 0);
+
+    return UTEST_SUCCESS;
+}
+
+struct listing
+{
+    int num_services;
+    int done;
+};
+
+static void record_listing_cb(int64_t op_id, const struct service *service,
+			      void *cb_data)
+{
+    struct listing *listing = cb_data;
+
+    if (service != NULL)
+	listing->num_services++;
+    else
+	listing->done++;
+}
+
+TESTCASE(shards, list_and_cancel)
+{
+    int64_t client_id = 4711;
+
+    CHKINTEQ(shards_client_connect(shards, client_id, "ux:foo"), 0);
+
+    struct results results = {};
+
+    publish_all(client_id, 1, &results);
+
+    struct listing listing = {};
+
+    shards_foreach_service(shards, NULL, 0, record_listing_cb, &listing);
+
+    CHK(run_until(&listing.done, 1, 5.0));
+    CHKINTEQ(listing.num_services, NUM_SERVICES);
+    CHKINTEQ(results.count, NUM_SERVICES);
+
+    struct results cancelled = {};
+
+    shards_unpublish(shards, client_id, 1000, 0, record_result_cb,
+		     &cancelled);
+    shards_cancel(shards, &cancelled);
+
+    results = (struct results) {};
+
+    shards_unpublish(shards, client_id, 1000, 0, record_result_cb,
+		     &results);
+
+    CHK(run_until(&results.count, 1, 5.0));
+    CHKINTEQ(results.last_rc, SD_ERR_NO_SUCH_SERVICE);
+    CHKINTEQ(cancelled.count, 0);
+
+    CHKINTEQ(shards_client_disconnect(shards, client_id), 0);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(shards, resume_and_sync)
+{
+    int64_t pub_client_id = 99;
+    int64_t sub_client_id = 100;
+
+    CHKINTEQ(shards_client_connect(shards, pub_client_id, "ux:foo"), 0);
+    CHKINTEQ(shards_client_connect(shards, sub_client_id, "ux:bar"), 0);
+
+    struct results results = {};
+
+    publish_all(pub_client_id, 1, &results);
+
+    CHK(run_until(&results.count, NUM_SERVICES, 5.0));
+
+    int64_t seq = shards_get_change_seq(shards);
+
+    /* the sequence is shared among the shards */
+    publish_all(pub_client_id, 2, &results);
+
+    CHK(run_until(&results.count, 2 * NUM_SERVICES, 5.0));
+    CHK(shards_get_change_seq(shards) == seq + NUM_SERVICES);
+
+    struct matches matches = {};
+    int64_t sub_id = 1234;
+
+    CHKINTEQ(shards_create_sub(shards, sub_client_id, sub_id, "(x=17)",
+			       record_match_cb, &matches), 0);
+
+    CHKINTEQ(shards_pin_changes(shards, seq - 1000),
+	     SD_ERR_CHANGES_TRIMMED);
+    CHKINTEQ(shards_pin_changes(shards, seq), 0);
+
+    shards_resume_sub(shards, sub_client_id, sub_id, seq);
+
+    struct results sync_results = {};
+
+    shards_sync(shards, 0, record_result_cb, &sync_results);
+
+    CHK(run_until(&sync_results.count, 1, 5.0));
+
+    CHKINTEQ(matches.appeared, 0);
+    CHKINTEQ(matches.modified, NUM_SERVICES);
+    CHK(matches.last_generation == 2);
+
+    return UTEST_SUCCESS;
+}
@@ -0,0 +1,351 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include <errno.h>
+#include <event2/event.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#include "sd.h"
+#include "shm.h"
+
+#define CLIENT_ID 42
+#define NUM_SLOTS 16
+
+static struct event_base *event_base;
+static struct sd *sd;
+static char shm_name[64];
+static struct shm_writer *writer;
+static struct shm_reader *reader;
+
+static int setup(unsigned setup_flags)
+{
+    event_base = event_base_new();
+
+    CHK(event_base != NULL);
+
+    sd = sd_create(event_base);
+
+    CHK(sd != NULL);
+
+    snprintf(shm_name, sizeof(shm_name), "/tpaftest-shm-%d", getpid());
+
+    writer = shm_writer_create(shm_name, NUM_SLOTS, NULL);
+
+    CHK(writer != NULL);
+
+    sd_add_change_cb(sd, shm_writer_change_cb, writer);
+
+    reader = shm_reader_open(shm_name);
+
+    CHK(reader != NULL);
+
+    CHKINTEQ(sd_client_connect(sd, CLIENT_ID, "ux:foo"), 0);
+
+    return UTEST_SUCCESS;
+}
+
+static int teardown(unsigned setup_flags)
+{
+    shm_reader_close(reader);
+
+    sd_destroy(sd);
+
+    shm_writer_destroy(writer);
+
+    event_base_free(event_base);
+
+    return UTEST_SUCCESS;
+}
+
+TESTSUITE(shm, setup, teardown)
+
+static int publish(int64_t service_id, int64_t generation, const char *color)
+{
+    struct props *props = props_create();
+
+    props_add_str(props, "color", color);
+
+    int rc = sd_publish(sd, CLIENT_ID, service_id, generation, props, 60);
+
+    props_destroy(props);
+
+    return rc;
+}
+
+struct listing
+{
+    int num_services;
+    int64_t service_id_sum;
+};
+
+static void count_cb(const struct srec *rec, void *cb_data)
+{
+    struct listing *listing = cb_data;
+
+    listing->num_services++;
+    listing->service_id_sum += rec->service_id;
+}
+
+static struct listing list(const char *filter_s)
+{
+    struct filter *filter = filter_s != NULL ? filter_parse(filter_s) : NULL;
+    struct listing listing = { };
+
+    shm_reader_foreach(reader, filter, count_cb, &listing);
+
+    filter_destroy(filter);
+
+    return listing;
+}
+
+TESTCASE(shm, get_and_foreach)
+{
+    CHKINTEQ(publish(1, 1, "red"), 0);
+    CHKINTEQ(publish(2, 1, "green"), 0);
+    CHKINTEQ(publish(3, 1, "red"), 0);
+    CHKINTEQ(publish(1, 5, "red"), 0);
+
+    struct srec rec;
+
+    CHKINTEQ(shm_reader_get(reader, 1, &rec), 0);
+    CHKINTEQ(rec.type, srec_type_service);
+    CHK(rec.service_id == 1);
+    CHK(rec.generation == 5);
+    CHK(rec.client_id == CLIENT_ID);
+    CHK(rec.ttl == 60);
+    CHK(rec.orphan_since < 0);
+    CHK(props_has(rec.props, "color"));
+    props_destroy(rec.props);
+
+    CHKINTEQ(shm_reader_get(reader, 99, &rec), -1);
+    CHKERRNOEQ(ENOENT);
+
+    struct listing listing = list("(color=red)");
+
+    CHKINTEQ(listing.num_services, 2);
+    CHK(listing.service_id_sum == 4);
+
+    CHKINTEQ(list(NULL).num_services, 3);
+
+    CHKINTEQ(sd_unpublish(sd, CLIENT_ID, 1), 0);
+
+    CHKINTEQ(shm_reader_get(reader, 1, &rec), -1);
+    CHKINTEQ(list("(color=red)").num_services, 1);
+
+    /* orphans are kept, and marked as such */
+    CHKINTEQ(sd_client_disconnect(sd, CLIENT_ID), 0);
+
+    CHKINTEQ(shm_reader_get(reader, 2, &rec), 0);
+    CHK(rec.orphan_since > 0);
+    props_destroy(rec.props);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(shm, churn)
+{
+    int64_t service_id;
+
+    /* leaves a trail of removed services, which must not get in the
+       way of lookups */
+    for (service_id = 1; service_id < 10 * NUM_SLOTS; service_id++) {
+	CHKINTEQ(publish(service_id, 1, "red"), 0);
+
+	if (service_id % 4 != 0)
+	    CHKINTEQ(sd_unpublish(sd, CLIENT_ID, service_id), 0);
+	else if (service_id > 2 * NUM_SLOTS)
+	    CHKINTEQ(sd_unpublish(sd, CLIENT_ID, service_id - 2 * NUM_SLOTS),
+		     0);
+    }
+
+    struct listing listing = list(NULL);
+    int64_t expected_sum = 0;
+    int expected_num = 0;
+
+    for (service_id = 1; service_id < 10 * NUM_SLOTS; service_id++) {
+	struct srec rec;
+	bool live = service_id % 4 == 0 &&
+	    service_id + 2 * NUM_SLOTS >= 10 * NUM_SLOTS;
+
+	if (live) {
+	    CHKINTEQ(shm_reader_get(reader, service_id, &rec), 0);
+	    props_destroy(rec.props);
+	    expected_sum += service_id;
+	    expected_num++;
+	} else
+	    CHKINTEQ(shm_reader_get(reader, service_id, &rec), -1);
+    }
+
+    CHKINTEQ(listing.num_services, expected_num);
+    CHK(listing.service_id_sum == expected_sum);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(shm, full)
+{
+    int64_t service_id;
+
+    for (service_id = 0; service_id < 2 * NUM_SLOTS; service_id++)
+	CHKINTEQ(publish(service_id, 1, "red"), 0);
+
+    CHKINTEQ(list(NULL).num_services, NUM_SLOTS - 1);
+    CHKINTEQ(shm_reader_num_omitted(reader), NUM_SLOTS + 1);
+
+    CHKINTEQ(sd_unpublish(sd, CLIENT_ID, 2 * NUM_SLOTS - 1), 0);
+    CHKINTEQ(shm_reader_num_omitted(reader), NUM_SLOTS);
+
+    CHKINTEQ(sd_unpublish(sd, CLIENT_ID, 0), 0);
+    CHKINTEQ(publish(2 * NUM_SLOTS - 2, 2, "red"), 0);
+    CHKINTEQ(shm_reader_num_omitted(reader), NUM_SLOTS - 1);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(shm, too_large)
+{
+    char color[2 * SHM_MAX_RECORD];
+
+    memset(color, 'r', sizeof(color) - 1);
+    color[sizeof(color) - 1] = '\0';
+
+    CHKINTEQ(publish(1, 1, "red"), 0);
+    CHKINTEQ(shm_reader_num_omitted(reader), 0);
+
+    CHKINTEQ(publish(1, 2, color), 0);
+    CHKINTEQ(shm_reader_num_omitted(reader), 1);
+
+    struct srec rec;
+    CHKINTEQ(shm_reader_get(reader, 1, &rec), -1);
+
+    CHKINTEQ(publish(1, 3, "red"), 0);
+    CHKINTEQ(shm_reader_num_omitted(reader), 0);
+
+    CHKINTEQ(shm_reader_get(reader, 1, &rec), 0);
+    props_destroy(rec.props);
+
+    CHKINTEQ(publish(1, 4, color), 0);
+    CHKINTEQ(sd_unpublish(sd, CLIENT_ID, 1), 0);
+    CHKINTEQ(shm_reader_num_omitted(reader), 0);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(shm, stale)
+{
+    CHK(!shm_reader_is_stale(reader));
+
+    CHKINTEQ(publish(1, 1, "red"), 0);
+
+    /* a segment in use is not taken over */
+    CHK(shm_writer_create(shm_name, NUM_SLOTS, NULL) == NULL);
+    CHKERRNOEQ(EEXIST);
+
+    CHK(!shm_reader_is_stale(reader));
+
+    sd_destroy(sd);
+    sd = NULL;
+
+    shm_writer_destroy(writer);
+    writer = NULL;
+
+    CHK(shm_reader_is_stale(reader));
+
+    struct srec rec;
+    CHKINTEQ(shm_reader_get(reader, 1, &rec), -1);
+    CHKERRNOEQ(EAGAIN);
+
+    struct listing listing = { };
+    CHKINTEQ(shm_reader_foreach(reader, NULL, count_cb, &listing), -1);
+    CHKERRNOEQ(EAGAIN);
+
+    struct shm_writer *new_writer =
+	shm_writer_create(shm_name, NUM_SLOTS, NULL);
+
+    CHK(new_writer != NULL);
+
+    struct shm_reader *new_reader = shm_reader_open(shm_name);
+
+    CHK(new_reader != NULL);
+    CHK(!shm_reader_is_stale(new_reader));
+
+    CHKINTEQ(shm_reader_get(new_reader, 1, &rec), -1);
+    CHKERRNOEQ(ENOENT);
+
+    shm_writer_destroy(new_writer);
+
+    CHK(shm_reader_is_stale(new_reader));
+    CHK(shm_reader_open(shm_name) == NULL);
+
+    shm_reader_close(new_reader);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(shm, crashed_writer)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/tpaftest-shm-crash-%d", getpid());
+
+    int pipefd[2];
+    CHKNOERR(pipe(pipefd));
+
+    pid_t pid = fork();
+    CHK(pid >= 0);
+
+    if (pid == 0) {
+	/* dies without destroying the writer */
+	struct shm_writer *abandoned = shm_writer_create(name, NUM_SLOTS,
+							 NULL);
+	char ready = abandoned != NULL;
+
+	if (write(pipefd[1], &ready, 1) != 1)
+	    _exit(EXIT_FAILURE);
+
+	for (;;)
+	    pause();
+    }
+
+    close(pipefd[1]);
+
+    char ready = 0;
+    CHKINTEQ(read(pipefd[0], &ready, 1), 1);
+    CHK(ready);
+
+    close(pipefd[0]);
+
+    struct shm_reader *old_reader = shm_reader_open(name);
+    CHK(old_reader != NULL);
+    CHK(!shm_reader_is_stale(old_reader));
+
+    CHK(shm_writer_create(name, NUM_SLOTS, NULL) == NULL);
+    CHKERRNOEQ(EEXIST);
+
+    CHKNOERR(kill(pid, SIGKILL));
+    CHKINTEQ(waitpid(pid, NULL, 0), pid);
+
+    CHK(shm_reader_is_stale(old_reader));
+
+    struct shm_writer *new_writer = shm_writer_create(name, NUM_SLOTS, NULL);
+    CHK(new_writer != NULL);
+
+    struct shm_reader *new_reader = shm_reader_open(name);
+    CHK(new_reader != NULL);
+    CHK(!shm_reader_is_stale(new_reader));
+
+    shm_reader_close(new_reader);
+    shm_reader_close(old_reader);
+    shm_writer_destroy(new_writer);
+
+    return UTEST_SUCCESS;
+}
@@ -0,0 +1,157 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include <event2/event.h>
+
+#include "util.h"
+
+#include "srec_table.h"
+
+static struct event_base *event_base;
+static struct shards *shards;
+static struct srec_table *table;
+
+static int setup(unsigned setup_flags)
+{
+    event_base = event_base_new();
+
+    CHK(event_base != NULL);
+
+    /* With zero shards, restored services are in place at once */
+    shards = shards_create(event_base, 0, NULL);
+
+    CHK(shards != NULL);
+
+    table = srec_table_create();
+
+    return UTEST_SUCCESS;
+}
+
+static int teardown(unsigned setup_flags)
+{
+    srec_table_destroy(table);
+
+    shards_destroy(shards);
+
+    event_base_free(event_base);
+
+    return UTEST_SUCCESS;
+}
+
+TESTSUITE(srec_table, setup, teardown)
+
+static void apply_service(int64_t service_id, int64_t generation,
+			  int64_t ttl, double orphan_since, double time)
+{
+    struct props *props = props_create();
+
+    props_add_int64(props, "generation", generation);
+
+    struct srec rec = {
+	.type = srec_type_service,
+	.time = time,
+	.service_id = service_id,
+	.generation = generation,
+	.props = props,
+	.ttl = ttl,
+	.client_id = 42,
+	.orphan_since = orphan_since
+    };
+
+    srec_table_apply(table, &rec);
+
+    props_destroy(props);
+}
+
+static void apply_removed(int64_t service_id, double time)
+{
+    struct srec rec = {
+	.type = srec_type_removed,
+	.time = time,
+	.service_id = service_id
+    };
+
+    srec_table_apply(table, &rec);
+}
+
+struct listing
+{
+    int num_services;
+    int64_t generation_sum;
+    bool all_orphans;
+};
+
+static void count_cb(int64_t op_id, const struct service *service,
+		     void *cb_data)
+{
+    struct listing *listing = cb_data;
+
+    if (service == NULL)
+	return;
+
+    listing->num_services++;
+    listing->generation_sum += service_get_generation(service);
+
+    if (!service_is_orphan(service))
+	listing->all_orphans = false;
+}
+
+TESTCASE(srec_table, apply_and_restore)
+{
+    double now = ut_ftime();
+
+    apply_service(1, 1, 60, -1, now - 2);
+    apply_service(2, 1, 60, -1, now - 2);
+    apply_service(3, 1, 60, -1, now - 2);
+    apply_service(4, 1, 1, now - 10, now - 2);
+
+    CHKINTEQ(srec_table_size(table), 4);
+
+    apply_service(1, 7, 60, -1, now - 1);
+    apply_removed(2, now - 1);
+    apply_removed(99, now - 1);
+
+    CHKINTEQ(srec_table_size(table), 3);
+    CHK(srec_table_last_known(table) == now - 1);
+
+    size_t num_expired;
+    size_t num_restored = srec_table_restore(table, shards, now - 1,
+					     &num_expired);
+
+    CHKINTEQ(num_restored, 2);
+    CHKINTEQ(num_expired, 1);
+    CHKINTEQ(srec_table_size(table), 0);
+
+    struct listing listing = {
+	.all_orphans = true
+    };
+
+    shards_foreach_service(shards, NULL, 0, count_cb, &listing);
+
+    CHKINTEQ(listing.num_services, 2);
+    CHKINTEQ(listing.generation_sum, 8);
+    CHK(listing.all_orphans);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(srec_table, clear)
+{
+    apply_service(1, 1, 60, -1, 1);
+    apply_service(2, 1, 60, -1, 1);
+
+    srec_table_clear(table);
+
+    CHKINTEQ(srec_table_size(table), 0);
+
+    size_t num_expired;
+
+    CHKINTEQ(srec_table_restore(table, shards, ut_ftime(), &num_expired), 0);
+    CHKINTEQ(num_expired, 0);
+
+    return UTEST_SUCCESS;
+}
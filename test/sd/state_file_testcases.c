@@ -0,0 +1,199 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include "utest.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#include "service.h"
+#include "state_file.h"
+
+static char *path;
+
+static int setup(unsigned setup_flags)
+{
+    path = ut_asprintf("/tmp/tpaftest-%d.state", (int)getpid());
+
+    unlink(path);
+
+    return UTEST_SUCCESS;
+}
+
+static int teardown(unsigned setup_flags)
+{
+    unlink(path);
+
+    ut_free(path);
+
+    return UTEST_SUCCESS;
+}
+
+TESTSUITE(state_file, setup, teardown)
+
+#define MAX_LOADED 16
+
+struct loaded
+{
+    size_t count;
+    int64_t service_ids[MAX_LOADED];
+    int64_t generations[MAX_LOADED];
+    struct props *props[MAX_LOADED];
+    int64_t ttls[MAX_LOADED];
+    int64_t client_ids[MAX_LOADED];
+    double orphan_since[MAX_LOADED];
+};
+
+static void record_load_cb(const struct srec *rec, void *cb_data)
+{
+    struct loaded *loaded = cb_data;
+    size_t idx = loaded->count++;
+
+    loaded->service_ids[idx] = rec->service_id;
+    loaded->generations[idx] = rec->generation;
+    loaded->props[idx] = props_clone(rec->props);
+    loaded->ttls[idx] = rec->ttl;
+    loaded->client_ids[idx] = rec->client_id;
+    loaded->orphan_since[idx] = rec->orphan_since;
+}
+
+static void loaded_clear(struct loaded *loaded)
+{
+    size_t i;
+
+    for (i = 0; i < loaded->count; i++)
+	props_destroy(loaded->props[i]);
+}
+
+static void ignore_change_cb(struct service *service,
+			     enum service_change_type change_type,
+			     void *cb_data)
+{
+}
+
+static struct service *create_service(int64_t service_id,
+				      int64_t generation,
+				      const struct props *props,
+				      int64_t ttl, int64_t client_id)
+{
+    struct service *service = service_create(service_id, ignore_change_cb, NULL);
+
+    service_add_begin(service);
+    service_set_generation(service, generation);
+    service_set_props(service, props);
+    service_set_ttl(service, ttl);
+    service_set_client_id(service, client_id);
+    service_set_non_orphan(service);
+    service_commit(service);
+
+    return service;
+}
+
+TESTCASE(state_file, save_load)
+{
+    struct props *props_a = props_create();
+    props_add_int64(props_a, "name", -4711);
+    props_add_str(props_a, "name", "value");
+    props_add_str(props_a, "address", "tls:10.0.0.1:4711");
+
+    struct props *props_b = props_create();
+
+    struct service *service_a = create_service(17, 3, props_a, 60, 99);
+    struct service *service_b = create_service(-1, 0, props_b, 0, 42);
+
+    service_modify_begin(service_b);
+    service_set_orphan_since(service_b, 1234.5);
+    service_commit(service_b);
+
+    struct state_writer *writer = state_writer_create(4711);
+
+    state_writer_add(writer, service_a);
+    state_writer_add(writer, service_b);
+
+    double before = ut_ftime();
+
+    CHKNOERR(state_writer_save(writer, path, NULL));
+
+    state_writer_destroy(writer);
+
+    struct loaded loaded = {};
+    struct state_info info;
+
+    CHKINTEQ(state_load(path, &info, record_load_cb, &loaded, NULL), 2);
+
+    CHK(info.saved_at >= before && info.saved_at <= ut_ftime());
+    CHK(info.journal_seq == 4711);
+
+    CHKINTEQ(loaded.count, 2);
+
+    CHK(loaded.service_ids[0] == 17);
+    CHK(loaded.generations[0] == 3);
+    CHK(props_equal(loaded.props[0], props_a));
+    CHK(loaded.ttls[0] == 60);
+    CHK(loaded.client_ids[0] == 99);
+    CHK(loaded.orphan_since[0] < 0);
+
+    CHK(loaded.service_ids[1] == -1);
+    CHK(props_equal(loaded.props[1], props_b));
+    CHK(loaded.client_ids[1] == 42);
+    CHK(loaded.orphan_since[1] == 1234.5);
+
+    loaded_clear(&loaded);
+    service_dec_ref(service_a);
+    service_dec_ref(service_b);
+    props_destroy(props_a);
+    props_destroy(props_b);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(state_file, missing)
+{
+    struct loaded loaded = {};
+    struct state_info info;
+
+    CHKINTEQ(state_load(path, &info, record_load_cb, &loaded, NULL), 0);
+    CHKINTEQ(loaded.count, 0);
+    CHK(info.journal_seq == 0);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(state_file, malformed)
+{
+    struct props *props = props_create();
+    props_add_str(props, "name", "value");
+
+    struct service *service = create_service(17, 3, props, 60, 99);
+
+    struct state_writer *writer = state_writer_create(4711);
+    state_writer_add(writer, service);
+    CHKNOERR(state_writer_save(writer, path, NULL));
+    state_writer_destroy(writer);
+
+    /* a truncated file must not be loaded */
+    CHKNOERR(truncate(path, 60));
+
+    struct loaded loaded = {};
+    struct state_info info;
+
+    CHKINTEQ(state_load(path, &info, record_load_cb, &loaded, NULL), -1);
+    CHKINTEQ(loaded.count, 0);
+
+    int fd = open(path, O_WRONLY|O_TRUNC);
+    CHK(fd >= 0);
+    CHKINTEQ(write(fd, "garbage", 7), 7);
+    close(fd);
+
+    CHKINTEQ(state_load(path, &info, record_load_cb, &loaded, NULL), -1);
+
+    service_dec_ref(service);
+    props_destroy(props);
+
+    return UTEST_SUCCESS;
+}
@@ -0,0 +1,228 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "utest.h"
+#include "testutil.h"
+#include "util.h"
+
+#include "imap.h"
+
+TESTSUITE(imap, NULL, NULL)
+
+#define NUM_KEYS (2000)
+
+static int64_t key_of(int i)
+{
+    /* exercise negative keys, and keys differing only in high bits */
+    return (i % 2 == 0) ? i : -((int64_t)i << 40);
+}
+
+static bool count_cb(int64_t key, void *value, void *cb_data)
+{
+    size_t *count = cb_data;
+
+    (*count)++;
+
+    return true;
+}
+
+TESTCASE(imap, put_get_del)
+{
+    struct ebr *ebr = ebr_create(1);
+    struct imap *map = imap_create();
+
+    int64_t *values[NUM_KEYS] = {};
+
+    int i;
+    for (i = 0; i < 20 * NUM_KEYS; i++) {
+	int idx = tu_rand_max(NUM_KEYS);
+	int64_t key = key_of(idx);
+
+	if (tu_rand_max(3) == 0) {
+	    map = imap_del(map, key, ebr, ut_free);
+	    values[idx] = NULL;
+	} else {
+	    int64_t *value = ut_malloc(sizeof(int64_t));
+	    *value = key;
+	    map = imap_put(map, key, value, ebr, ut_free);
+	    values[idx] = value;
+	}
+
+	if (i % 1000 == 0)
+	    ebr_reclaim(ebr);
+    }
+
+    size_t expected_size = 0;
+    for (i = 0; i < NUM_KEYS; i++) {
+	CHK(imap_get(map, key_of(i)) == values[i]);
+	if (values[i] != NULL)
+	    expected_size++;
+    }
+
+    CHKINTEQ(imap_size(map), expected_size);
+
+    size_t count = 0;
+    imap_foreach(map, count_cb, &count);
+    CHKINTEQ(count, expected_size);
+
+    CHK(ebr_pending(ebr) > 0);
+    CHKINTEQ(ebr_reclaim(ebr), 0);
+    CHK(ebr_max_delay(ebr) == 0);
+
+    imap_destroy(map, ut_free);
+    ebr_destroy(ebr);
+
+    return UTEST_SUCCESS;
+}
+
+static void no_free(void *ptr)
+{
+}
+
+TESTCASE(imap, old_versions_intact)
+{
+    struct ebr *ebr = ebr_create(1);
+    struct imap *v0 = imap_create();
+
+    int64_t one = 1;
+    int64_t two = 2;
+
+    struct imap *v1 = imap_put(v0, 17, &one, ebr, no_free);
+
+    CHKINTEQ(imap_size(v0), 0);
+    CHK(imap_get(v0, 17) == NULL);
+
+    struct imap *v2 = imap_put(v1, 17, &two, ebr, no_free);
+    struct imap *v3 = imap_del(v2, 17, ebr, no_free);
+
+    CHK(imap_get(v1, 17) == &one);
+    CHK(imap_get(v2, 17) == &two);
+    CHKINTEQ(imap_size(v2), 1);
+    CHK(imap_get(v3, 17) == NULL);
+    CHKINTEQ(imap_size(v3), 0);
+
+    CHK(imap_del(v3, 17, ebr, no_free) == v3);
+
+    imap_destroy(v3, no_free);
+    ebr_destroy(ebr);
+
+    return UTEST_SUCCESS;
+}
+
+#define NUM_UPDATES (20000)
+
+struct reader_param
+{
+    struct ebr *ebr;
+    _Atomic(struct imap *) *current;
+    atomic_bool *stop;
+};
+
+static bool check_cb(int64_t key, void *value, void *cb_data)
+{
+    bool *ok = cb_data;
+
+    if (*(int64_t *)value != key)
+	*ok = false;
+
+    return true;
+}
+
+static void *read_map(void *arg)
+{
+    struct reader_param *param = arg;
+    bool ok = true;
+
+    while (!atomic_load(param->stop)) {
+	ebr_enter(param->ebr, 0);
+
+	struct imap *map = atomic_load(param->current);
+	imap_foreach(map, check_cb, &ok);
+
+	ebr_leave(param->ebr, 0);
+    }
+
+    return ok ? param : NULL;
+}
+
+TESTCASE(imap, concurrent_reader)
+{
+    struct ebr *ebr = ebr_create(1);
+    _Atomic(struct imap *) current = imap_create();
+    atomic_bool stop = false;
+
+    struct reader_param param = {
+	.ebr = ebr,
+	.current = &current,
+	.stop = &stop
+    };
+
+    pthread_t reader;
+    CHK(pthread_create(&reader, NULL, read_map, &param) == 0);
+
+    int i;
+    for (i = 0; i < NUM_UPDATES; i++) {
+	int64_t key = tu_rand_max(100);
+	struct imap *map = atomic_load(&current);
+
+	if (tu_rand_max(2) == 0)
+	    map = imap_del(map, key, ebr, ut_free);
+	else {
+	    int64_t *value = ut_malloc(sizeof(int64_t));
+	    *value = key;
+	    map = imap_put(map, key, value, ebr, ut_free);
+	}
+
+	atomic_store(&current, map);
+
+	if (i % 100 == 0)
+	    ebr_reclaim(ebr);
+    }
+
+    atomic_store(&stop, true);
+
+    void *result;
+    CHK(pthread_join(reader, &result) == 0);
+    CHK(result == &param);
+
+    CHKINTEQ(ebr_reclaim(ebr), 0);
+
+    imap_destroy(atomic_load(&current), ut_free);
+    ebr_destroy(ebr);
+
+    return UTEST_SUCCESS;
+}
+
+TESTCASE(imap, parts)
+{
+    struct ebr *ebr = ebr_create(1);
+    struct imap *map = imap_create();
+
+    int i;
+    for (i = 0; i < NUM_KEYS; i++) {
+	int64_t *value = ut_malloc(sizeof(int64_t));
+	*value = key_of(i);
+	map = imap_put(map, key_of(i), value, ebr, ut_free);
+    }
+
+    size_t num_parts;
+    for (num_parts = 1; num_parts <= IMAP_MAX_PARTS; num_parts++) {
+	size_t count = 0;
+	size_t part;
+
+	for (part = 0; part < num_parts; part++)
+	    imap_foreach_part(map, part, num_parts, count_cb, &count);
+
+	CHKINTEQ(count, NUM_KEYS);
+    }
+
+    imap_destroy(map, ut_free);
+    ebr_destroy(ebr);
+
+    return UTEST_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <pthread.h>
+
+#include "utest.h"
+#include "testutil.h"
+
+#include "pfifo.h"
+
+TESTSUITE(pfifo, NULL, NULL)
+
+TESTCASE(pfifo, basic)
+{
+    struct pfifo *fifo = pfifo_create();
+
+    CHK(pfifo_pop(fifo) == NULL);
+
+    uintptr_t next_push = 1;
+    uintptr_t next_pop = 1;
+
+    int i;
+    for (i = 0; i < 100; i++) {
+	uintptr_t num_push = tu_rand_max(1000);
+	uintptr_t j;
+
+	for (j = 0; j < num_push; j++)
+	    pfifo_push(fifo, (void *)next_push++);
+
+	uintptr_t num_pop = tu_rand_max(next_push - next_pop);
+
+	for (j = 0; j < num_pop; j++)
+	    CHK(pfifo_pop(fifo) == (void *)next_pop++);
+    }
+
+    while (next_pop < next_push)
+	CHK(pfifo_pop(fifo) == (void *)next_pop++);
+
+    CHK(pfifo_pop(fifo) == NULL);
+
+    /* leave elements behind, for pfifo_destroy() to clean up */
+    for (i = 0; i < 1000; i++)
+	pfifo_push(fifo, (void *)next_push++);
+
+    pfifo_destroy(fifo);
+
+    return UTEST_SUCCESS;
+}
+
+#define NUM_TRANSFERS (100000)
+
+static void *produce(void *arg)
+{
+    struct pfifo *fifo = arg;
+
+    uintptr_t i;
+    for (i = 1; i <= NUM_TRANSFERS; i++)
+	pfifo_push(fifo, (void *)i);
+
+    return NULL;
+}
+
+TESTCASE(pfifo, threaded)
+{
+    struct pfifo *fifo = pfifo_create();
+
+    pthread_t producer;
+
+    CHK(pthread_create(&producer, NULL, produce, fifo) == 0);
+
+    uintptr_t expected = 1;
+
+    while (expected <= NUM_TRANSFERS) {
+	void *elem = pfifo_pop(fifo);
+
+	if (elem != NULL) {
+	    CHK(elem == (void *)expected);
+	    expected++;
+	}
+    }
+
+    CHK(pthread_join(producer, NULL) == 0);
+
+    CHK(pfifo_pop(fifo) == NULL);
+
+    pfifo_destroy(fifo);
+
+    return UTEST_SUCCESS;
+}
@@ -168,3 +168,46 @@ TESTCASE(pmap, foreach)
 
     return UTEST_SUCCESS;
 }
+
+#define CHURN_KEY_SPACE (64)
+#define CHURN_ITERATIONS (100000)
+
+TESTCASE(pmap, churn)
+{
+    struct pmap *map = pmap_create();
+
+    /* a small key space makes for many probe sequence collisions */
+    bool present[CHURN_KEY_SPACE] = {};
+    size_t num_present = 0;
+
+    size_t i;
+    for (i = 0; i < CHURN_ITERATIONS; i++) {
+	uint64_t key = tu_rand_max(CHURN_KEY_SPACE);
+
+	if (present[key]) {
+	    CHK(pmap_get(map, key) == (void *)(uintptr_t)(key + 1));
+	    pmap_del(map, key);
+	    present[key] = false;
+	    num_present--;
+	} else {
+	    CHK(!pmap_has_key(map, key));
+	    pmap_add(map, key, (void *)(uintptr_t)(key + 1));
+	    present[key] = true;
+	    num_present++;
+	}
+
+	CHKINTEQ(pmap_size(map), num_present);
+    }
+
+    for (i = 0; i < CHURN_KEY_SPACE; i++)
+	CHK(pmap_has_key(map, i) == present[i]);
+
+    pmap_clear(map);
+
+    CHKINTEQ(pmap_size(map), 0);
+    CHK(!pmap_has_key(map, 0));
+
+    pmap_destroy(map);
+
+    return UTEST_SUCCESS;
+}
@@ -68,3 +68,27 @@ TESTCASE(pqueue, basic)
 
     return UTEST_SUCCESS;
 }
+
+TESTCASE(pqueue, get)
+{
+    struct pqueue *queue = pqueue_create();
+
+    uintptr_t i;
+    for (i = 0; i < 100; i++)
+	pqueue_push(queue, (void *)i);
+
+    /* move the start index to exercise wrap-around */
+    for (i = 0; i < 50; i++) {
+	pqueue_pop(queue);
+	pqueue_push(queue, (void *)(100 + i));
+    }
+
+    CHKINTEQ(100, pqueue_len(queue));
+
+    for (i = 0; i < pqueue_len(queue); i++)
+	CHKINTEQ((uintptr_t)pqueue_get(queue, i), 50 + i);
+
+    pqueue_destroy(queue);
+
+    return UTEST_SUCCESS;
+}
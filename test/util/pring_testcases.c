@@ -0,0 +1,101 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ * Copyright(c) 2023 Ericsson AB
+ */
+
+#include <pthread.h>
+
+#include "utest.h"
+#include "testutil.h"
+
+#include "pring.h"
+
+TESTSUITE(pring, NULL, NULL)
+
+TESTCASE(pring, basic)
+{
+    struct pring *ring = pring_create(100);
+
+    CHKINTEQ(128, pring_capacity(ring));
+    CHKINTEQ(0, pring_len(ring));
+    CHK(pring_pop(ring) == NULL);
+    CHK(pring_peek(ring) == NULL);
+
+    uintptr_t i;
+    for (i = 0; i < 128; i++)
+	CHK(pring_push(ring, (void *)(i + 1)));
+
+    CHK(!pring_push(ring, (void *)42));
+    CHKINTEQ(128, pring_len(ring));
+
+    /* exercise wrap-around */
+    uintptr_t next_push = 129;
+    uintptr_t next_pop = 1;
+
+    for (i = 0; i < 1000; i++) {
+	uintptr_t num_pop = 1 + tu_rand_max(pring_len(ring) - 1);
+	uintptr_t j;
+
+	for (j = 0; j < num_pop; j++) {
+	    CHK(pring_peek(ring) == (void *)next_pop);
+	    CHK(pring_pop(ring) == (void *)next_pop);
+	    next_pop++;
+	}
+
+	while (pring_push(ring, (void *)next_push))
+	    next_push++;
+
+	CHKINTEQ(128, pring_len(ring));
+    }
+
+    while (pring_len(ring) > 0)
+	CHK(pring_pop(ring) == (void *)next_pop++);
+
+    CHKINTEQ(next_push, next_pop);
+
+    pring_destroy(ring);
+
+    return UTEST_SUCCESS;
+}
+
+#define NUM_TRANSFERS (100000)
+
+static void *produce(void *arg)
+{
+    struct pring *ring = arg;
+
+    uintptr_t i;
+    for (i = 1; i <= NUM_TRANSFERS; i++)
+	while (!pring_push(ring, (void *)i))
+	    ;
+
+    return NULL;
+}
+
+TESTCASE(pring, threaded)
+{
+    struct pring *ring = pring_create(64);
+
+    pthread_t producer;
+
+    CHK(pthread_create(&producer, NULL, produce, ring) == 0);
+
+    uintptr_t expected = 1;
+
+    while (expected <= NUM_TRANSFERS) {
+	void *elem = pring_pop(ring);
+
+	if (elem != NULL) {
+	    CHK(elem == (void *)expected);
+	    expected++;
+	}
+    }
+
+    CHK(pthread_join(producer, NULL) == 0);
+
+    CHKINTEQ(0, pring_len(ring));
+
+    pring_destroy(ring);
+
+    return UTEST_SUCCESS;
+}